@@ -0,0 +1,25 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "protocol.h"
+
+#define ADMISSION_DEFAULT_USER_RATE 20      // tokens per second each user earns
+#define ADMISSION_DEFAULT_GLOBAL_RATE 20000 // tokens per second shared by all users
+#define ADMISSION_BURST_SECONDS 2           // a full bucket holds this many seconds of tokens
+#define ADMISSION_DEFAULT_SHED_DEPTH 4096   // queued tasks on a shard before costly requests are shed
+#define ADMISSION_RETRY_AFTER_SHED_MS 250
+
+// What to do with a request
+typedef enum
+{
+    ADMISSION_ACCEPTED,
+    ADMISSION_THROTTLED, // its user or the server ran out of tokens
+    ADMISSION_SHED       // the shard it would run on is overloaded
+} AdmissionResult;
+
+int admissionInit(int maxUsers, int userRate, int globalRate, long shedDepth);
+AdmissionResult admissionCheck(const Message *message, int userId, long queueDepth, int *retryAfterMs);
+long admissionThrottledRequests(void);
+long admissionShedRequests(void);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef BLOB_H
+#define BLOB_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+#define BLOB_DIRECTORY "TerChatApp/blobs"
+#define BLOB_MAX_UPLOADS 64     // unfinished uploads tracked at once, over all users
+#define BLOB_UPLOAD_TIMEOUT 60  // seconds an idle unfinished upload keeps its slot
+#define BLOB_WINDOW_CHUNKS 16   // chunks a download sends before yielding its shard
+
+int blobInit(void);
+int blobReceive(int userId, int peerId, const BlobChunk *chunk, const char *data,
+                long long *blobId, char name[BLOB_NAME_SIZE], size_t *size);
+int blobRefuse(int userId, int peerId, const BlobChunk *chunk);
+void blobDiscard(long long blobId, int userId, int peerId);
+int blobOpen(long long blobId, int userId, int peerId, size_t *size);
+long blobUploadsInProgress(void);
+
+#endif
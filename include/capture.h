@@ -0,0 +1,45 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+#define CAPTURE_MAGIC "TCAP1\n"
+#define CAPTURE_BUFFER_SIZE (1 << 20) // bytes buffered before a write to the capture file
+
+// Kinds of capture records
+typedef enum
+{
+    CAPTURE_OPEN = 1, // a client connected
+    CAPTURE_FRAME,    // a frame arrived; a CaptureFrame and the body follow
+    CAPTURE_REPLY,    // a reply to a request was sent; its request ID follows as an int32_t
+    CAPTURE_CLOSE     // the client disconnected
+} CaptureKind;
+
+// Header of every record
+typedef struct __attribute__((packed))
+{
+    uint8_t kind;
+    uint32_t connection;  // socket descriptor on the recording server; reused after CAPTURE_CLOSE
+    uint64_t timestampUs; // since the capture started
+} CaptureRecord;
+
+// A received frame; the body is stored without its trailing zeros
+typedef struct __attribute__((packed))
+{
+    int32_t type;
+    int32_t to;
+    int32_t from;
+    int32_t requestId;
+    uint16_t bodyLength;
+} CaptureFrame;
+
+int captureOpen(const char *path);
+void captureConnectionOpened(int sock);
+void captureFrameReceived(int sock, const Message *message);
+void captureReplySent(int sock, const Message *message);
+void captureConnectionClosed(int sock);
+void captureClose(void);
+
+#endif
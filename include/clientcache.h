@@ -0,0 +1,20 @@
+#ifndef CLIENTCACHE_H
+#define CLIENTCACHE_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+#define CLIENT_CACHE_DIRECTORY "TerChatClient"
+#define CLIENT_CACHE_MESSAGES_PER_PEER 200 // most recent messages of each conversation kept on compaction
+#define CLIENT_CACHE_SYNC_INTERVAL 15      // seconds between background syncs
+
+int clientCacheOpen(int userId, int port);
+long long clientCacheVersion(void);
+int clientCacheApply(long long version, const char *entries, size_t length);
+
+int clientCacheContacts(User *contacts, int maxContacts);
+int clientCacheConversation(int peer, char *lines, size_t size, int *unread);
+int clientCacheUnreadCounts(int *peers, int *counts, int maxPeers);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "protocol.h"
+
+#define CLUSTER_MAX_NODES 16
+#define CLUSTER_ANNOUNCE_INTERVAL_MS 20
+#define CLUSTER_RECONNECT_INTERVAL_MS 1000
+
+// Kinds of frames exchanged between nodes
+typedef enum
+{
+    CLUSTER_HELLO,      // first frame on a link, "node" names the sender
+    CLUSTER_ROUTES,     // body holds PresenceChange records for users of the sender, "to" their count
+    CLUSTER_DELIVER,    // a type 7 message for a user logged in on the receiver
+    CLUSTER_REGISTERED, // body holds the User just registered on the sender
+    CLUSTER_ACK,        // "sequence" is the last DELIVER or REGISTERED frame the sender has handled from the receiver
+} ClusterFrameKind;
+
+typedef struct
+{
+    int kind;
+    int node;
+    long long sequence; // DELIVER and REGISTERED: numbered per link direction, resent until acknowledged
+    Message message;
+} ClusterFrame;
+
+// Called on a link's reader thread for every DELIVER and REGISTERED frame
+typedef void (*ClusterReceiveFn)(int node, int kind, const Message *message, void *context);
+
+int clusterStart(int nodeId, const char *nodes, int userCapacity, ClusterReceiveFn receive, void *context);
+int clusterEnabled(void);
+int clusterRouteOf(int userId);
+void clusterUserChanged(int userId);
+int clusterForward(int node, int kind, const Message *message);
+void clusterBroadcast(int kind, const Message *message);
+
+long clusterLinksUp(void);
+long clusterRemoteUsers(void);
+
+#endif
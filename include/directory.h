@@ -0,0 +1,14 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include "protocol.h"
+
+#define DIRECTORY_MAX_RESULTS 32
+#define DIRECTORY_DEFAULT_RESULTS 8
+
+int directoryInit(int userCapacity);
+void directoryUserRegistered(const User *user);
+int directoryLookup(int userId, const char *query, User *matches, int maxMatches);
+long directoryEntryCount(void);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "protocol.h"
+
+// Priority classes of shard work, scheduled by weighted round robin
+typedef enum
+{
+    DISPATCH_INTERACTIVE, // chat delivery, reading a conversation and other changes the user waits on
+    DISPATCH_BACKGROUND,  // reads: contact lists, unread counts, search, sync
+    DISPATCH_BULK,        // blob transfers and other long jobs
+    DISPATCH_CLASS_COUNT
+} DispatchClass;
+
+// Runs one request on the shard that owns its user; generation is the one given to dispatchSubmit()
+typedef void (*DispatchHandlerFn)(int sock, unsigned generation, Message *message, void *context);
+// Runs a cross-shard operation on the shard that owns a user
+typedef void (*DispatchTaskFn)(void *argument);
+
+int dispatchStart(int count, DispatchHandlerFn handler, void *context);
+int dispatchShardOf(int userId);
+int dispatchSubmit(int userId, int sock, unsigned generation, const Message *message, DispatchClass priority);
+int dispatchPost(int userId, DispatchTaskFn function, void *argument);
+int dispatchYield(int userId, DispatchTaskFn function, void *argument);
+long dispatchQueueDepth(void);
+long dispatchShardQueueDepth(int userId);
+long dispatchClassQueueDepth(DispatchClass priority);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+
+int heartbeatInit(int idleTimeoutSeconds, int maxSockets);
+void heartbeatTrack(int sock);
+void heartbeatTouch(int sock);
+void heartbeatUntrack(int sock);
+long heartbeatTrackedConnections(void);
+
+#endif
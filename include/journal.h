@@ -0,0 +1,19 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+
+// Kinds of entries in a user's change journal; each entry is one line, the kind and a comma first
+typedef enum
+{
+    JOURNAL_CONTACT_ADDED = 'C',   // followed by the contact list line
+    JOURNAL_CONTACT_REMOVED = 'D', // followed by the contact's user ID
+    JOURNAL_MESSAGE = 'M',         // followed by the mailbox line
+    JOURNAL_READ = 'R',            // followed by the peer whose messages were read
+    JOURNAL_RESET = 'X',           // only in sync replies: drop everything, a full copy follows
+} JournalEntryKind;
+
+int journalAppend(int userId, JournalEntryKind kind, const char *filePath, const char *lines, size_t length);
+int journalChangesSince(int userId, long long since, char **changes, size_t *length, long long *version);
+
+#endif
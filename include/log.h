@@ -0,0 +1,112 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+typedef enum
+{
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF
+} LogLevel;
+
+typedef enum
+{
+    LOG_ARG_INT,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER
+} LogArgType;
+
+// One captured printf argument; formatting happens later on the flusher thread
+typedef struct
+{
+    LogArgType type;
+    union
+    {
+        int64_t i;
+        double d;
+        const char *s;
+        const void *p;
+    } value;
+} LogArg;
+
+extern volatile int logMinLevel;
+
+void logInit(void);
+void logShutdown(void);
+void logSetLevel(LogLevel level);
+void logEmit(LogLevel level, const char *format, const LogArg *args, int argCount);
+
+static inline LogArg logArgInt(int64_t value)
+{
+    LogArg arg = {LOG_ARG_INT, {.i = value}};
+    return arg;
+}
+
+static inline LogArg logArgDouble(double value)
+{
+    LogArg arg = {LOG_ARG_DOUBLE, {.d = value}};
+    return arg;
+}
+
+static inline LogArg logArgString(const char *value)
+{
+    LogArg arg = {LOG_ARG_STRING, {.s = value}};
+    return arg;
+}
+
+static inline LogArg logArgPointer(const void *value)
+{
+    LogArg arg = {LOG_ARG_POINTER, {.p = value}};
+    return arg;
+}
+
+#define LOG_ARG(x) _Generic((x),                      \
+    char *: logArgString,                             \
+    const char *: logArgString,                       \
+    void *: logArgPointer,                            \
+    const void *: logArgPointer,                      \
+    float: logArgDouble,                              \
+    double: logArgDouble,                             \
+    default: logArgInt)(x)
+
+// Argument counting for up to LOG_MAX_ARGS printf arguments after the format string;
+// LOG_COUNT includes the format, so it goes up to LOG_MAX_ARGS + 1
+#define LOG_MAX_ARGS 8
+#define LOG_NTH(_1, _2, _3, _4, _5, _6, _7, _8, _9, N, ...) N
+#define LOG_COUNT(...) LOG_NTH(__VA_ARGS__, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+_Static_assert(LOG_COUNT("", 1, 2, 3, 4, 5, 6, 7, 8) == LOG_MAX_ARGS + 1, "LOG_COUNT and LOG_MAX_ARGS disagree");
+#define LOG_CAT_(a, b) a##b
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_FORMAT(format, ...) format
+#define LOG_ARGS_1(f)
+#define LOG_ARGS_2(f, a) LOG_ARG(a)
+#define LOG_ARGS_3(f, a, b) LOG_ARG(a), LOG_ARG(b)
+#define LOG_ARGS_4(f, a, b, c) LOG_ARG(a), LOG_ARG(b), LOG_ARG(c)
+#define LOG_ARGS_5(f, a, b, c, d) LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d)
+#define LOG_ARGS_6(f, a, b, c, d, e) LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d), LOG_ARG(e)
+#define LOG_ARGS_7(f, a, b, c, d, e, g) LOG_ARGS_6(f, a, b, c, d, e), LOG_ARG(g)
+#define LOG_ARGS_8(f, a, b, c, d, e, g, h) LOG_ARGS_7(f, a, b, c, d, e, g), LOG_ARG(h)
+#define LOG_ARGS_9(f, a, b, c, d, e, g, h, k) LOG_ARGS_8(f, a, b, c, d, e, g, h), LOG_ARG(k)
+
+// The level is checked before any argument is captured; the format string must be a literal
+#define LOG_AT(level, ...)                                                                  \
+    do                                                                                      \
+    {                                                                                       \
+        _Static_assert(LOG_COUNT(__VA_ARGS__) <= LOG_MAX_ARGS + 1, "too many log arguments"); \
+        if ((level) >= logMinLevel)                                                         \
+        {                                                                                   \
+            LogArg logArgs_[] = {{LOG_ARG_INT, {0}}, LOG_CAT(LOG_ARGS_, LOG_COUNT(__VA_ARGS__))(__VA_ARGS__)}; \
+            logEmit((level), LOG_FORMAT(__VA_ARGS__, 0), logArgs_ + 1, LOG_COUNT(__VA_ARGS__) - 1); \
+        }                                                                                   \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif
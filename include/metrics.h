@@ -0,0 +1,47 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Request classes tracked by the metrics surface, one per handled message type
+typedef enum
+{
+    METRIC_LOGIN,
+    METRIC_REGISTER,
+    METRIC_LIST_CONTACTS,
+    METRIC_ADD_USER,
+    METRIC_DELETE_USER,
+    METRIC_SEND,
+    METRIC_CHECK,
+    METRIC_READ,
+    METRIC_BATCH_SEND,
+    METRIC_SEARCH,
+    METRIC_FIND_USERS,
+    METRIC_PRESENCE,
+    METRIC_SYNC,
+    METRIC_BLOB_UPLOAD,
+    METRIC_BLOB_DOWNLOAD,
+    METRIC_OTHER,
+    METRIC_TYPE_COUNT
+} MetricType;
+
+// Callback used to sample a gauge (queue depth, table size...) at scrape time
+typedef long (*MetricsGaugeFn)(void);
+
+MetricType metricsTypeFromMessage(int messageType);
+const char *metricsTypeName(MetricType type);
+uint64_t metricsNow(void);
+
+void metricsRecordRequest(MetricType type, uint64_t elapsedNs);
+void metricsConnectionOpened(void);
+void metricsConnectionClosed(void);
+void metricsBytesIn(size_t bytes);
+void metricsBytesOut(size_t bytes);
+void metricsInFlight(int delta);
+int metricsRegisterGauge(const char *name, const char *help, MetricsGaugeFn fn);
+
+size_t metricsRender(char *buffer, size_t size);
+int metricsStartEndpoint(const char *socketPath);
+
+#endif
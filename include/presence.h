@@ -0,0 +1,27 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+#define PRESENCE_FLUSH_INTERVAL_MS 250
+
+// Sends an unsolicited frame to a connection, unless it has closed since it subscribed
+typedef void (*PresenceSendFn)(int sock, unsigned generation, const Message *message);
+
+int presenceStart(int userCapacity, int maxSockets, PresenceSendFn send);
+void presenceConnected(int sock, int userId);
+int presenceDisconnected(int sock);
+int presenceIsOnline(int userId);
+int presenceSocketOf(int userId);
+int presenceUserOf(int sock);
+
+void presenceSubscribe(int sock, unsigned generation, int userId, const int32_t *contacts, int contactCount);
+void presenceContactAdded(int userId, int contactId);
+void presenceContactRemoved(int userId, int contactId);
+
+long presenceOnlineUsers(void);
+long presenceSubscribers(void);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#define PORT 8081
+#define REGISTRATION_BUFFER_SIZE 16
+#define MESSAGE_BODY_SIZE 1024
+#define MAX_USER_ID 1000 // user IDs run from 0 to MAX_USER_ID - 1; clients accept ids in [0, 999]
+#define HEARTBEAT_INTERVAL 30 // seconds between client pings; must stay well below the server idle timeout
+
+typedef struct // Struct to represent a message
+{
+    /*
+    message type / explanation
+        -1       /  disconnect
+        0        /  login request
+        1        /  server message
+        2        /  registration request
+        3        /  confirmation message
+        4        /  list contacts
+        5        /  add user
+        6        /  delete user
+        7        /  send message
+        8        /  check message
+        9        /  read messages
+        10       /  batch send (body holds BatchEntry records, "to" holds their count)
+        11       /  heartbeat (client ping, echoed back by the server)
+        12       /  search messages (body holds the query, "to" the maximum number of results;
+                    one reply per hit with the stored line, "from" the peer and "to" the hit count)
+        13       /  find users (body holds the start of a username, name, surname or phone number,
+                    "to" the maximum number of results; one reply per match with a User in the body
+                    and "to" the match count)
+        14       /  presence (request: subscribe to the presence of the sender's contacts; replies and
+                    later pushes hold PresenceChange records in the body, "to" holds their count)
+        15       /  sync changes (body holds the last version the client has as decimal text, empty for
+                    none; replies hold "<new version>\n" and then journal lines, "to" the frame count)
+        16       /  blob chunk (body holds a BlobChunk and its bytes; uploads go to "to" and only the
+                    last chunk is answered, with a confirmation; a first chunk refused because the
+                    recipient is offline is answered instead, and the rest of that upload is dropped
+                    unanswered; downloads answer a type 17 request)
+        17       /  fetch blob (body holds the blob ID as decimal text, "to" the other user of the
+                    conversation it was sent in; answered with type 16 chunks)
+        18       /  retry later (reply to a request the server refused under load; "to" holds the
+                    milliseconds to wait before sending it again)
+    */
+    int type;
+    char body[MESSAGE_BODY_SIZE];
+    int to;        // -1 for server, user_id for specific user
+    int from;      // -1 for server, user_id for specific user
+    int requestId; // chosen by the client, echoed on every reply; 0 for unsolicited messages
+} Message;
+
+// One entry of a batch send; followed in the body by `length` bytes of text
+typedef struct __attribute__((packed))
+{
+    int to;
+    unsigned short length;
+} BatchEntry;
+
+// Header of a blob chunk; followed in the body by `length` bytes of the blob.
+// The first chunk of an upload starts with the blob's name and a NUL (an
+// empty name marks a long text message); downloads carry the bytes only.
+typedef struct __attribute__((packed))
+{
+    int uploadId;        // chosen by the uploader, unique among its unfinished uploads; 0 in downloads
+    unsigned int offset; // of these bytes in the upload
+    unsigned short length;
+    unsigned char last; // 1 on the final chunk
+} BlobChunk;
+
+#define BLOB_CHUNK_DATA_SIZE (MESSAGE_BODY_SIZE - (int)sizeof(BlobChunk))
+#define BLOB_NAME_SIZE 64
+#define BLOB_MAX_SIZE (64 << 20)
+// Text of the message that stands for a finished upload: blob ID, size in bytes, name
+#define BLOB_REFERENCE_FORMAT "[blob %lld %zu %s]"
+#define BLOB_REFERENCE_PREFIX "[blob "
+
+// Online state of one user, as carried by presence frames
+typedef struct
+{
+    int userId;
+    int online; // 1 when the user has at least one logged-in connection
+} PresenceChange;
+
+#define PRESENCE_CHANGES_PER_FRAME (MESSAGE_BODY_SIZE / (int)sizeof(PresenceChange))
+
+typedef struct
+{
+    /* data */
+    int userId;
+    char username[REGISTRATION_BUFFER_SIZE];
+    char phoneNumber[REGISTRATION_BUFFER_SIZE];
+    char name[REGISTRATION_BUFFER_SIZE];
+    char surname[REGISTRATION_BUFFER_SIZE];
+} User;
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stddef.h>
+
+// Called with every complete fixed-size frame; return -1 to close the connection
+typedef int (*ReactorFrameFn)(int sock, void *frame, void *context);
+typedef void (*ReactorConnectionFn)(int sock, void *context);
+
+typedef struct
+{
+    int port;
+    int backlog;
+    int reactorCount;
+    size_t frameSize;
+    ReactorFrameFn onFrame;
+    ReactorConnectionFn onAccept; // optional
+    ReactorConnectionFn onClose;  // optional
+    void *context;
+} ReactorConfig;
+
+int reactorOpenListener(int port, int backlog, int reusePort);
+long reactorRaiseFileLimit(void);
+int reactorRun(const ReactorConfig *config);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stddef.h>
+
+#include "storage.h"
+
+#define REPLICATION_MAX_FOLLOWERS 8
+#define REPLICATION_LOG_SIZE (64 << 20) // bytes of recent mutations kept for followers that fall behind
+#define REPLICATION_RECONNECT_INTERVAL_MS 1000
+
+// Called on a follower for every applied record: before an append reaches the file, after a replacement has
+typedef void (*ReplicationApplyFn)(StorageMutation mutation, const char *path, const char *data, size_t length);
+
+int replicationStartPrimary(int port);
+int replicationStartFollower(const char *primary, ReplicationApplyFn applied);
+
+long replicationFollowers(void);
+long replicationBacklogBytes(void);
+long replicationLinkUp(void);
+
+#endif
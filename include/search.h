@@ -0,0 +1,25 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEARCH_MAX_RESULTS 32
+#define SEARCH_DEFAULT_RESULTS 10
+
+// A message of a user's mailbox matching a query
+typedef struct
+{
+    uint32_t ordinal; // line number in the mailbox
+    int32_t peer;
+    uint64_t offset; // of the line in the mailbox file
+    uint32_t length;
+    float score;
+} SearchHit;
+
+int searchInit(int userCapacity);
+void searchMailboxAppended(int userId, const char *data, size_t length);
+void searchMailboxRewritten(int userId);
+int searchMessages(int userId, const char *query, SearchHit *hits, int maxHits, int *totalHits);
+
+#endif
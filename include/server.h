@@ -0,0 +1,27 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <sys/types.h>
+
+#include "protocol.h"
+
+// Request handlers of the server; src/bench.c drives them directly
+
+void initSendLocks(void);
+ssize_t sendFrame(int sock, const Message *msg);
+ssize_t sendReply(int sock, Message *msg);
+void sendConfirmationMessage(int newSocket, const char *message);
+void handleLoginRequest(int newSocket, Message receivedMessage);
+void handleRegistrationRequest(int newSocket, Message receivedMessage);
+void sendContactList(int sock, int userId);
+void addUserToContactList(int sock, int userId, User user);
+void deleteUserFromFile(int sock, int userId, int userIdToDelete);
+void processMessage(int sock, int fromUserId, int toUserId, int recipientSocket, char *messageText);
+void processBatchMessage(int sock, const Message *receivedMessage);
+void countUnreadMessagesAndSend(int sock, int userId);
+void readUserMessagesAndSetReadStatus(int sock, int userId, int targetUserId);
+void searchMessagesAndSend(int sock, int userId, const char *query, int maxResults);
+void findUsersAndSend(int sock, int userId, const char *query, int maxResults);
+void syncChangesAndSend(int sock, int userId, const char *since);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdint.h>
+
+#define STATE_SNAPSHOT_PATH "TerChatApp/state.snapshot"
+
+// Unread messages of one mailbox, grouped by the other party of the conversation
+typedef struct
+{
+    int32_t peer;
+    uint32_t count;
+} StateUnread;
+
+int stateInit(int userCapacity, const char *snapshotPath);
+int stateSave(void);
+int stateStartSnapshots(int intervalSeconds);
+
+int stateIsRegistered(int userId);
+void stateUserRegistered(int userId);
+void stateReloadUser(int userId);
+void stateImportUser(int userId, const int32_t *contactIds, int contactCount, const int32_t *unreadPeers, int unreadCount, uint32_t messageCount);
+
+int stateHasContact(int userId, int contactId);
+int stateContactCount(int userId);
+int stateContacts(int userId, int32_t *contacts, int maxContacts);
+void stateContactAdded(int userId, int contactId);
+void stateContactRemoved(int userId, int contactId);
+
+void stateMessageStored(int userId, int peerId);
+void stateMessagesRead(int userId, int peerId);
+int stateUnreadCounts(int userId, StateUnread *counts, int maxCounts);
+
+long stateUnverifiedUsers(void);
+
+#endif
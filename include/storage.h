@@ -0,0 +1,61 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stddef.h>
+
+#define STORAGE_USERS_DIRECTORY "TerChatApp/users"
+#define STORAGE_USER_LIST_PATH STORAGE_USERS_DIRECTORY "/user_list.txt"
+#define STORAGE_SHARDS_DIRECTORY STORAGE_USERS_DIRECTORY "/shards"
+#define STORAGE_PATH_SIZE 64 // fits any per-user path
+#define STORAGE_TEMPORARY_SUFFIX ".tmp" // storageReplace() writes here first
+
+typedef enum
+{
+    STORAGE_BACKEND_SYNC,    // append in the calling thread (the original path)
+    STORAGE_BACKEND_IO_URING // batch appends on a writer thread through io_uring
+} StorageBackend;
+
+// Per-user files, stored under STORAGE_SHARDS_DIRECTORY/<hh>/<hh>/<id>/
+typedef enum
+{
+    STORAGE_USER_DIRECTORY,
+    STORAGE_USER_CONTACTS,
+    STORAGE_USER_MESSAGES,
+    STORAGE_USER_CHANGES
+} StorageUserFile;
+
+// One append of a batch committed with storageAppendBatch()
+typedef struct
+{
+    const char *path;
+    const char *data;
+    size_t length;
+} StorageWrite;
+
+// Kinds of changes reported to the storage observer
+typedef enum
+{
+    STORAGE_MUTATION_APPEND, // data was appended to the file
+    STORAGE_MUTATION_REPLACE // data is the new content of the file
+} StorageMutation;
+
+typedef void (*StorageObserverFn)(StorageMutation mutation, const char *path, const char *data, size_t length);
+
+StorageBackend storageInit(StorageBackend requested);
+int storageAppend(const char *path, const char *data, size_t length);
+int storageAppendBatch(const StorageWrite *writes, int count);
+int storageAppendf(const char *path, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void storageSync(void);
+void storageSyncUser(int userId);
+long storagePendingAppends(void);
+int storageReplace(const char *path, const char *data, size_t length);
+void storageSetObserver(StorageObserverFn function);
+void storageFreeze(void);
+void storageThaw(void);
+
+const char *storageUserPath(int userId, StorageUserFile file, char path[STORAGE_PATH_SIZE]);
+int storageUserOfPath(const char *path);
+int storageCreateUserDirectory(int userId);
+int storageMigrateLegacyLayout(void);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef TERCHAT_H
+#define TERCHAT_H
+
+#include <stdio.h>
+
+#include "protocol.h"
+
+#define TERCHAT_MAX_PENDING_REQUESTS 64 // requests in flight per session; a newer one reusing a slot forgets the older
+
+// An epoll instance driving any number of sessions; see terchatLoopRun()
+typedef struct TerchatLoop TerchatLoop;
+// One connection to the server, logged in as one user
+typedef struct TerchatSession TerchatSession;
+
+// Called on the thread running the loop with every frame the server sends.
+// requestType is the type of the request the frame answers, or -1 for
+// pushes such as messages from other users; complete is set on the frame
+// that finishes the request. The frame is only valid during the call.
+// frame is NULL exactly once, when the connection has closed; the session
+// is freed when that call returns.
+typedef void (*TerchatFrameFn)(TerchatSession *session, const Message *frame, int requestType, int complete, void *context);
+
+TerchatLoop *terchatLoopCreate(void);
+int terchatLoopFd(const TerchatLoop *loop);
+int terchatLoopRun(TerchatLoop *loop, int timeoutMs);
+void terchatLoopDestroy(TerchatLoop *loop);
+
+TerchatSession *terchatConnect(TerchatLoop *loop, const char *host, int port, int userId, TerchatFrameFn onFrame, void *context);
+void terchatClose(TerchatSession *session);
+int terchatUserId(const TerchatSession *session);
+int terchatError(const TerchatSession *session);
+
+// Requests return the request ID the replies will carry, or -1 with errno set.
+// They may be called from any thread until the session's closing callback.
+int terchatRequest(TerchatSession *session, Message *msg);
+int terchatLogin(TerchatSession *session);
+int terchatRegister(TerchatSession *session, const char *username, const char *phoneNumber, const char *name, const char *surname);
+int terchatDisconnect(TerchatSession *session);
+int terchatListContacts(TerchatSession *session);
+int terchatAddContact(TerchatSession *session, const User *user);
+int terchatDeleteContact(TerchatSession *session, int contactId);
+int terchatSendMessage(TerchatSession *session, int recipientId, const char *text);
+int terchatSendBatch(TerchatSession *session, const int *recipientIds, int *recipientCount, const char *text);
+// Takes ownership of file: it is read on the loop's thread as the socket drains and closed when the upload ends
+int terchatSendFile(TerchatSession *session, int recipientId, const char *name, FILE *file);
+int terchatCheckMessages(TerchatSession *session);
+int terchatReadMessages(TerchatSession *session, int peerId);
+int terchatSearchMessages(TerchatSession *session, const char *query, int maxResults);
+int terchatFindUsers(TerchatSession *session, const char *query, int maxResults);
+int terchatSubscribePresence(TerchatSession *session);
+int terchatSync(TerchatSession *session, long long sinceVersion);
+int terchatFetchBlob(TerchatSession *session, int peerId, long long blobId);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+// Intrusive timer; embed it in the object being timed
+typedef struct TimerEntry
+{
+    struct TimerEntry *next;
+    struct TimerEntry *prev;
+    uint64_t expiresAt; // in ticks
+} TimerEntry;
+
+typedef void (*TimerExpireFn)(TimerEntry *entry, void *context);
+
+typedef struct
+{
+    TimerEntry slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // list heads
+    uint64_t now;
+    long count;
+} TimerWheel;
+
+void timerWheelInit(TimerWheel *wheel, uint64_t now);
+void timerWheelSchedule(TimerWheel *wheel, TimerEntry *entry, uint64_t expiresAt);
+void timerWheelCancel(TimerWheel *wheel, TimerEntry *entry);
+void timerWheelAdvance(TimerWheel *wheel, uint64_t now, TimerExpireFn expire, void *context);
+
+#endif
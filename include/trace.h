@@ -0,0 +1,95 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "protocol.h"
+
+#define TRACE_DEFAULT_SAMPLE_EVERY 100 // one request in this many is traced
+
+// The sampled request a thread is working on; id is 0 when it is not traced
+typedef struct
+{
+    uint64_t id;
+    uint64_t handedOffAt; // when the request was queued for another thread, ns
+    int32_t type;
+    int32_t requestId;
+    int32_t user;
+} TraceContext;
+
+extern volatile int traceSampleEvery; // 0 while tracing is off
+extern _Thread_local TraceContext traceContext;
+extern _Thread_local uint64_t traceReadAt;
+
+int traceStart(const char *path, int sampleEvery);
+void traceShutdown(void);
+void traceSample(const Message *message);
+void traceRecord(const char *name, uint64_t startedAt, uint64_t endedAt);
+void traceResumeSampled(const TraceContext *context);
+long traceDroppedSpans(void);
+
+static inline uint64_t traceNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Marks the start of the read that may complete the next frame
+static inline void traceReadStarted(void)
+{
+    if (traceSampleEvery > 0)
+    {
+        traceReadAt = traceNow();
+    }
+}
+
+// Decides whether a request that was just read is traced
+static inline void traceRequestReceived(const Message *message)
+{
+    if (traceSampleEvery > 0)
+    {
+        traceSample(message);
+    }
+}
+
+// Spans cost a thread-local load and a branch unless the current request is sampled
+static inline uint64_t traceSpanBegin(void)
+{
+    return traceContext.id != 0 ? traceNow() : 0;
+}
+
+static inline void traceSpanEnd(const char *name, uint64_t startedAt)
+{
+    if (startedAt != 0)
+    {
+        traceRecord(name, startedAt, traceNow());
+    }
+}
+
+// Carries the current request to work queued for another thread
+static inline void traceHandOff(TraceContext *context)
+{
+    *context = traceContext;
+    if (context->id != 0)
+    {
+        context->handedOffAt = traceNow();
+    }
+}
+
+// Continues a handed-off request on this thread
+static inline void traceResume(const TraceContext *context)
+{
+    if (context->id != 0)
+    {
+        traceResumeSampled(context);
+    }
+}
+
+static inline void traceFinish(void)
+{
+    traceContext.id = 0;
+}
+
+#endif
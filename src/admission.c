@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "admission.h"
+#include "log.h"
+
+#define ADMISSION_MILLI 1000 // buckets count thousandths of a token
+#define ADMISSION_LOCK_STRIPES 64
+#define ADMISSION_SHEDDABLE_COST (4 * ADMISSION_MILLI) // requests at least this costly go first under load
+#define ADMISSION_HARD_SHED_FACTOR 4                   // past this many times the shed depth everything charged is shed
+
+typedef struct
+{
+    int64_t tokens;      // in thousandths; negative while paying off continued uploads
+    uint64_t refilledAt; // ns
+} AdmissionBucket;
+
+static AdmissionBucket *userBuckets = NULL;
+static int userBucketCount = 0;
+static AdmissionBucket globalBucket;
+static pthread_mutex_t userLocks[ADMISSION_LOCK_STRIPES];
+static pthread_mutex_t globalLock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t userRate = 0; // thousandths per second, 0 when unlimited
+static int64_t globalRate = 0;
+static long shedDepth = 0;
+static atomic_long throttledRequests;
+static atomic_long shedRequests;
+
+static uint64_t admissionNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sets up the buckets.
+ *
+ * @param maxUsers User IDs below this get their own bucket; connections
+ * nobody is logged in on share one more.
+ * @param perUserRate Tokens per second each user earns; 0 for no per-user limit.
+ * @param serverRate Tokens per second for all users together; 0 for no global limit.
+ * @param depth Shard queue depth at which shedding starts; 0 to never shed.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int admissionInit(int maxUsers, int perUserRate, int serverRate, long depth)
+{
+    userRate = (int64_t)perUserRate * ADMISSION_MILLI;
+    globalRate = (int64_t)serverRate * ADMISSION_MILLI;
+    shedDepth = depth;
+    uint64_t now = admissionNow();
+    userBuckets = malloc(((size_t)maxUsers + 1) * sizeof(AdmissionBucket));
+    if (userBuckets == NULL)
+    {
+        LOG_ERROR("Error allocating %d admission buckets", maxUsers + 1);
+        return -1;
+    }
+    userBucketCount = maxUsers + 1;
+    int i;
+    for (i = 0; i < userBucketCount; i++)
+    {
+        userBuckets[i] = (AdmissionBucket){userRate * ADMISSION_BURST_SECONDS, now};
+    }
+    for (i = 0; i < ADMISSION_LOCK_STRIPES; i++)
+    {
+        pthread_mutex_init(&userLocks[i], NULL);
+    }
+    globalBucket = (AdmissionBucket){globalRate * ADMISSION_BURST_SECONDS, now};
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns what a request costs, in thousandths of a token.
+ *
+ * Costs follow the work a request does: reading and rewriting a whole
+ * mailbox weighs far more than appending one line. Connection-level
+ * messages are free.
+ */
+// <----------------------------------------------------------------> //
+static int64_t admissionCostOf(const Message *message)
+{
+    switch (message->type)
+    {
+    case 2: // registration appends to the user list and creates files
+        return 5 * ADMISSION_MILLI;
+    case 4:
+    case 5:
+    case 13:
+    case 14:
+    case 15:
+        return 2 * ADMISSION_MILLI;
+    case 6: // rewrites the contact list
+    case 8: // counts unread messages, a mailbox scan when not cached
+    case 12:
+        return 4 * ADMISSION_MILLI;
+    case 7:
+        return ADMISSION_MILLI;
+    case 9:  // reads and rewrites the whole mailbox
+    case 17: // streams a whole blob
+        return 8 * ADMISSION_MILLI;
+    case 10: // one delivery per entry
+        return (int64_t)(1 + (message->to > 0 ? message->to : 0)) * ADMISSION_MILLI;
+    case 16: // one chunk of an upload
+        return ADMISSION_MILLI / 8;
+    default:
+        return 0;
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Limits a cost to what a full bucket of the given rate holds.
+ *
+ * A batch, or any request under a low rate, may cost more than the bucket
+ * can ever hold; it is charged a full bucket instead of being refused for
+ * good with a retry hint the client could never meet.
+ */
+// <----------------------------------------------------------------> //
+static int64_t admissionCapped(int64_t cost, int64_t rate)
+{
+    int64_t capacity = rate * ADMISSION_BURST_SECONDS;
+    return cost < capacity ? cost : capacity;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Refills a bucket and takes a cost from it; called with the bucket's lock held.
+ *
+ * @param force Take the cost even if the bucket goes negative.
+ * @return int64_t 0 if the cost was taken, otherwise the milliseconds until it could be.
+ */
+// <----------------------------------------------------------------> //
+static int64_t admissionTake(AdmissionBucket *bucket, int64_t rate, int64_t cost, uint64_t now, int force)
+{
+    int64_t capacity = rate * ADMISSION_BURST_SECONDS;
+    int64_t earned = (int64_t)((now - bucket->refilledAt) / 1000ull) * rate / 1000000;
+    if (earned > 0 && bucket->tokens + earned >= capacity)
+    {
+        bucket->tokens = capacity;
+        bucket->refilledAt = now;
+    }
+    else if (earned > 0)
+    {
+        bucket->tokens += earned;
+        bucket->refilledAt += (uint64_t)earned * 1000000000ull / (uint64_t)rate; // keeps the fraction not yet earned
+    }
+    if (bucket->tokens >= cost || force)
+    {
+        bucket->tokens -= cost;
+        return 0;
+    }
+    return (cost - bucket->tokens) * 1000 / rate + 1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Decides whether a request runs, before it is queued on a shard.
+ *
+ * A request must be paid for by both its user's bucket and the global one,
+ * so one client flooding the server runs out of tokens long before the
+ * server does. The user is the one logged in on the connection, never the
+ * sender the request names, which the client is free to vary. Independently of tokens, a shard whose queue is past the
+ * shed depth refuses costly requests, and past four times that depth
+ * everything but continued uploads. A chunk that continues an upload is
+ * never refused, since the upload could not resume; its cost is still
+ * taken and may leave the user in debt.
+ *
+ * @param message The request.
+ * @param userId The user logged in on the request's connection, -1 if none.
+ * @param queueDepth Tasks waiting on the shard that would run the request.
+ * @param retryAfterMs Receives a hint for when to retry a refused request.
+ * @return AdmissionResult Whether the request runs.
+ */
+// <----------------------------------------------------------------> //
+AdmissionResult admissionCheck(const Message *message, int userId, long queueDepth, int *retryAfterMs)
+{
+    int64_t cost = admissionCostOf(message);
+    if (cost == 0)
+    {
+        return ADMISSION_ACCEPTED;
+    }
+    BlobChunk chunk;
+    memcpy(&chunk, message->body, sizeof(chunk));
+    int continuation = message->type == 16 && chunk.offset > 0;
+
+    if (shedDepth > 0 && !continuation &&
+        (queueDepth >= shedDepth * ADMISSION_HARD_SHED_FACTOR || (queueDepth >= shedDepth && cost >= ADMISSION_SHEDDABLE_COST)))
+    {
+        atomic_fetch_add_explicit(&shedRequests, 1, memory_order_relaxed);
+        *retryAfterMs = ADMISSION_RETRY_AFTER_SHED_MS;
+        return ADMISSION_SHED;
+    }
+
+    uint64_t now = admissionNow();
+    int64_t wait = 0;
+    int index = userId >= 0 && userId < userBucketCount - 1 ? userId : userBucketCount - 1;
+    AdmissionBucket *bucket = userRate > 0 ? &userBuckets[index] : NULL;
+    pthread_mutex_t *lock = &userLocks[(unsigned)index % ADMISSION_LOCK_STRIPES];
+    int64_t userCost = admissionCapped(cost, userRate);
+    if (bucket != NULL)
+    {
+        pthread_mutex_lock(lock);
+        wait = admissionTake(bucket, userRate, userCost, now, continuation);
+        pthread_mutex_unlock(lock);
+    }
+    if (wait == 0 && globalRate > 0)
+    {
+        pthread_mutex_lock(&globalLock);
+        wait = admissionTake(&globalBucket, globalRate, admissionCapped(cost, globalRate), now, continuation);
+        pthread_mutex_unlock(&globalLock);
+        if (wait > 0 && bucket != NULL)
+        {
+            pthread_mutex_lock(lock);
+            bucket->tokens += userCost; // not run, so not paid for
+            pthread_mutex_unlock(lock);
+        }
+    }
+    if (wait > 0)
+    {
+        atomic_fetch_add_explicit(&throttledRequests, 1, memory_order_relaxed);
+        *retryAfterMs = wait < 0x7fffffff ? (int)wait : 0x7fffffff;
+        return ADMISSION_THROTTLED;
+    }
+    return ADMISSION_ACCEPTED;
+}
+
+long admissionThrottledRequests(void)
+{
+    return atomic_load_explicit(&throttledRequests, memory_order_relaxed);
+}
+
+long admissionShedRequests(void)
+{
+    return atomic_load_explicit(&shedRequests, memory_order_relaxed);
+}
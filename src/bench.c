@@ -0,0 +1,505 @@
+#define _GNU_SOURCE // nftw
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ftw.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "presence.h"
+#include "protocol.h"
+#include "search.h"
+#include "server.h"
+#include "state.h"
+#include "storage.h"
+
+#define BENCH_DEFAULT_USERS "1000"
+#define BENCH_DEFAULT_CONTACTS "10,100"
+#define BENCH_DEFAULT_MESSAGES "10,100,1000"
+#define BENCH_DEFAULT_MIN_MS 200    // each calibrated operation runs at least this long
+#define BENCH_DEFAULT_MAX_OPS 1000  // operations that change data run on this many distinct users at most
+#define BENCH_MAX_POINTS 16         // values in one size list
+#define BENCH_UNREAD_EVERY 4        // every n-th generated message is unread
+
+// glibc's allocator; the wrappers below count what the handlers allocate and pass the calls on
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void __libc_free(void *pointer);
+
+// Sizes of one generated dataset
+typedef struct
+{
+    int users;
+    int contacts; // per user
+    int messages; // per mailbox
+} BenchDataset;
+
+// One call of the operation under test; iteration picks the user
+typedef void (*BenchOpFn)(const BenchDataset *dataset, long iteration);
+
+static atomic_ulong allocations;
+static atomic_ulong allocatedBytes;
+static int replySocket = -1; // the handlers reply here; a thread discards what arrives on the other end
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Counting allocator.
+ *
+ * Defining these in the executable interposes them for the whole process,
+ * including allocations glibc makes on the handlers' behalf (getline,
+ * strdup, open_memstream). Frees are not counted: bytes/op is what an
+ * operation asked for, not what it kept.
+ */
+// <----------------------------------------------------------------> //
+void *malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocatedBytes, size, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocatedBytes, count * size, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocatedBytes, size, memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+}
+
+void free(void *pointer)
+{
+    __libc_free(pointer);
+}
+
+static uint64_t benchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void *benchDiscardReplies(void *arg)
+{
+    int fd = (int)(long)arg;
+    char buffer[64 * 1024];
+    while (read(fd, buffer, sizeof(buffer)) > 0)
+    {
+    }
+    return NULL;
+}
+
+static void benchDiscardPresence(int sock, unsigned generation, const Message *message)
+{
+    (void)sock;
+    (void)generation;
+    (void)message;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Parses a comma separated list of positive sizes.
+ *
+ * @return int The number of values, or -1 if the list is malformed.
+ */
+// <----------------------------------------------------------------> //
+static int benchParseList(const char *text, int *values)
+{
+    int count = 0;
+    const char *cursor = text;
+    while (*cursor != '\0')
+    {
+        char *end;
+        long value = strtol(cursor, &end, 10);
+        if (end == cursor || value <= 0 || value > 10000000 || count == BENCH_MAX_POINTS || (*end != ',' && *end != '\0'))
+        {
+            return -1;
+        }
+        values[count++] = (int)value;
+        cursor = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+static int benchContactOf(const BenchDataset *dataset, int userId, int index)
+{
+    return (userId + 1 + index) % dataset->users;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Writes a dataset in the server's file layout under the current directory.
+ *
+ * User u has the contacts u+1 .. u+contacts (wrapping around) and a mailbox
+ * of messages exchanged with them in turn; every BENCH_UNREAD_EVERY-th one
+ * is unread.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+static int benchGenerate(const BenchDataset *dataset)
+{
+    if (mkdir("TerChatApp", 0777) == -1 || mkdir(STORAGE_USERS_DIRECTORY, 0777) == -1 || mkdir(STORAGE_SHARDS_DIRECTORY, 0777) == -1)
+    {
+        perror("Error creating the dataset directories");
+        return -1;
+    }
+    FILE *userList = fopen(STORAGE_USER_LIST_PATH, "w");
+    if (userList == NULL)
+    {
+        perror("Error creating the user list");
+        return -1;
+    }
+    int userId;
+    for (userId = 0; userId < dataset->users; userId++)
+    {
+        fprintf(userList, "%d,user%d,555%07d,Name%d,Surname%d\n", userId, userId, userId, userId, userId);
+        if (storageCreateUserDirectory(userId) < 0)
+        {
+            fclose(userList);
+            return -1;
+        }
+
+        char filePath[STORAGE_PATH_SIZE];
+        FILE *file = fopen(storageUserPath(userId, STORAGE_USER_CONTACTS, filePath), "w");
+        if (file == NULL)
+        {
+            perror("Error creating a contact list");
+            fclose(userList);
+            return -1;
+        }
+        int i;
+        for (i = 0; i < dataset->contacts; i++)
+        {
+            int contactId = benchContactOf(dataset, userId, i);
+            fprintf(file, "%d,Name%d,Surname%d,555%07d\n", contactId, contactId, contactId, contactId);
+        }
+        fclose(file);
+
+        file = fopen(storageUserPath(userId, STORAGE_USER_MESSAGES, filePath), "w");
+        if (file == NULL)
+        {
+            perror("Error creating a mailbox");
+            fclose(userList);
+            return -1;
+        }
+        for (i = 0; i < dataset->messages; i++)
+        {
+            fprintf(file, "2024-01-01 12:%02d:%02d, %d, benchmark message number %d, %d\n", (i / 60) % 60, i % 60,
+                    benchContactOf(dataset, userId, i % dataset->contacts), i, i % BENCH_UNREAD_EVERY != 0);
+        }
+        fclose(file);
+    }
+    fclose(userList);
+    return 0;
+}
+
+static void benchReport(const char *name, const BenchDataset *dataset, long ops, uint64_t elapsedNs, unsigned long allocs, unsigned long bytes)
+{
+    printf("%-16s %7d %8d %8d %8ld %12.0f %10.1f %12.0f\n", name, dataset->users, dataset->contacts, dataset->messages, ops,
+           (double)elapsedNs / (double)ops, (double)allocs / (double)ops, (double)bytes / (double)ops);
+    fflush(stdout);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Runs an operation a fixed number of times, starting at iteration first.
+ */
+// <----------------------------------------------------------------> //
+static void benchFixed(const char *name, const BenchDataset *dataset, BenchOpFn operation, long first, long ops)
+{
+    unsigned long allocsBefore = atomic_load(&allocations);
+    unsigned long bytesBefore = atomic_load(&allocatedBytes);
+    uint64_t startedAt = benchNow();
+    long i;
+    for (i = first; i < first + ops; i++)
+    {
+        operation(dataset, i);
+    }
+    uint64_t elapsed = benchNow() - startedAt;
+    benchReport(name, dataset, ops, elapsed, atomic_load(&allocations) - allocsBefore, atomic_load(&allocatedBytes) - bytesBefore);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Runs an operation in doubling batches until one lasts minNs, and reports that batch.
+ *
+ * For operations that leave the data as they found it, so the batch size
+ * can follow the speed of the operation.
+ */
+// <----------------------------------------------------------------> //
+static void benchCalibrated(const char *name, const BenchDataset *dataset, BenchOpFn operation, uint64_t minNs)
+{
+    long iteration = 0;
+    long batch = 1;
+    while (1)
+    {
+        unsigned long allocsBefore = atomic_load(&allocations);
+        unsigned long bytesBefore = atomic_load(&allocatedBytes);
+        uint64_t startedAt = benchNow();
+        long i;
+        for (i = 0; i < batch; i++)
+        {
+            operation(dataset, iteration++);
+        }
+        uint64_t elapsed = benchNow() - startedAt;
+        if (elapsed >= minNs || batch >= (1L << 30))
+        {
+            benchReport(name, dataset, batch, elapsed, atomic_load(&allocations) - allocsBefore, atomic_load(&allocatedBytes) - bytesBefore);
+            return;
+        }
+        batch *= 2;
+    }
+}
+
+static void benchIsRegistered(const BenchDataset *dataset, long iteration)
+{
+    stateIsRegistered((int)(iteration % dataset->users));
+}
+
+// A cold user: contacts and mailbox are parsed again, as after a restart without a snapshot
+static void benchLoadUser(const BenchDataset *dataset, long iteration)
+{
+    int userId = (int)(iteration % dataset->users);
+    stateReloadUser(userId);
+    stateContactCount(userId);
+}
+
+// The added contact is an ID past the generated users, in nobody's list
+static void benchAddContact(const BenchDataset *dataset, long iteration)
+{
+    User user;
+    memset(&user, 0, sizeof(user));
+    user.userId = dataset->users;
+    snprintf(user.name, sizeof(user.name), "Name%d", user.userId);
+    snprintf(user.surname, sizeof(user.surname), "Surname%d", user.userId);
+    snprintf(user.phoneNumber, sizeof(user.phoneNumber), "555%07d", user.userId);
+    addUserToContactList(replySocket, (int)(iteration % dataset->users), user);
+}
+
+static void benchDeleteContact(const BenchDataset *dataset, long iteration)
+{
+    deleteUserFromFile(replySocket, (int)(iteration % dataset->users), dataset->users);
+}
+
+static void benchCountUnread(const BenchDataset *dataset, long iteration)
+{
+    countUnreadMessagesAndSend(replySocket, (int)(iteration % dataset->users));
+}
+
+static void benchReadMessages(const BenchDataset *dataset, long iteration)
+{
+    int userId = (int)(iteration % dataset->users);
+    readUserMessagesAndSetReadStatus(replySocket, userId, benchContactOf(dataset, userId, (int)(iteration / dataset->users % dataset->contacts)));
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Generates one dataset in a fresh directory and measures every operation on it.
+ *
+ * Runs in a child process: the server modules keep their state in globals
+ * that are set up once per process.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+static int benchRunDataset(const char *directory, const BenchDataset *dataset, uint64_t minNs, long maxOps)
+{
+    if (mkdir(directory, 0777) == -1 || chdir(directory) == -1)
+    {
+        perror("Error creating the dataset directory");
+        return -1;
+    }
+    if (benchGenerate(dataset) < 0)
+    {
+        return -1;
+    }
+
+    logInit();
+    if (getenv("TERCHAT_LOG_LEVEL") == NULL)
+    {
+        logSetLevel(LOG_LEVEL_WARN);
+    }
+    int capacity = dataset->users + 1; // one more for the contact the benchmark adds
+    int sockets[2];
+    pthread_t drainer;
+    storageInit(STORAGE_BACKEND_SYNC);
+    initSendLocks();
+    if (stateInit(capacity, STATE_SNAPSHOT_PATH) < 0 || searchInit(capacity) < 0 || presenceStart(capacity, 64, benchDiscardPresence) < 0 ||
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0 || pthread_create(&drainer, NULL, benchDiscardReplies, (void *)(long)sockets[1]) != 0)
+    {
+        fprintf(stderr, "Error setting up the server modules\n");
+        return -1;
+    }
+    pthread_detach(drainer);
+    replySocket = sockets[0];
+
+    long distinctOps = dataset->users < maxOps ? dataset->users : maxOps;
+    benchCalibrated("is_registered", dataset, benchIsRegistered, minNs);
+    benchCalibrated("load_user_state", dataset, benchLoadUser, minNs);
+    int userId;
+    for (userId = 0; userId < dataset->users; userId++)
+    {
+        stateContactCount(userId); // the rest run warm, as on a server that has been up for a while
+    }
+    benchFixed("add_contact", dataset, benchAddContact, 0, distinctOps);
+    benchFixed("delete_contact", dataset, benchDeleteContact, 0, distinctOps);
+    benchCalibrated("count_unread", dataset, benchCountUnread, minNs);
+    benchFixed("read_messages", dataset, benchReadMessages, 0, distinctOps); // marks what it reads, so each run must be a first read
+    logShutdown();
+    return 0;
+}
+
+static int benchRemoveEntry(const char *path, const struct stat *status, int flag, struct FTW *ftw)
+{
+    (void)status;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Prints the command line usage.
+ */
+// <----------------------------------------------------------------> //
+static void printUsage(const char *program)
+{
+    printf("Usage: %s [-u users] [-c contacts] [-m messages] [-t ms] [-n ops] [-d directory] [-k]\n", program);
+    printf("  -u users     Registered users, comma separated sizes to sweep (default: %s)\n", BENCH_DEFAULT_USERS);
+    printf("  -c contacts  Contacts per user, comma separated (default: %s)\n", BENCH_DEFAULT_CONTACTS);
+    printf("  -m messages  Messages per mailbox, comma separated (default: %s)\n", BENCH_DEFAULT_MESSAGES);
+    printf("  -t ms        Minimum run time of each read-only operation (default: %d)\n", BENCH_DEFAULT_MIN_MS);
+    printf("  -n ops       Most users a changing operation runs on (default: %d)\n", BENCH_DEFAULT_MAX_OPS);
+    printf("  -d directory Where datasets are generated (default: a new directory in /tmp)\n");
+    printf("  -k           Keep the generated datasets\n");
+    printf("Every combination of the sizes is generated and measured in a process of its own.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *userSizes = BENCH_DEFAULT_USERS;
+    const char *contactSizes = BENCH_DEFAULT_CONTACTS;
+    const char *messageSizes = BENCH_DEFAULT_MESSAGES;
+    int minMs = BENCH_DEFAULT_MIN_MS;
+    long maxOps = BENCH_DEFAULT_MAX_OPS;
+    const char *root = NULL;
+    int keep = 0;
+    int option;
+    while ((option = getopt(argc, argv, "u:c:m:t:n:d:kh")) != -1)
+    {
+        switch (option)
+        {
+        case 'u':
+            userSizes = optarg;
+            break;
+        case 'c':
+            contactSizes = optarg;
+            break;
+        case 'm':
+            messageSizes = optarg;
+            break;
+        case 't':
+            minMs = atoi(optarg);
+            break;
+        case 'n':
+            maxOps = atol(optarg);
+            break;
+        case 'd':
+            root = optarg;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            printUsage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+
+    int users[BENCH_MAX_POINTS], contacts[BENCH_MAX_POINTS], messages[BENCH_MAX_POINTS];
+    int userCount = benchParseList(userSizes, users);
+    int contactCount = benchParseList(contactSizes, contacts);
+    int messageCount = benchParseList(messageSizes, messages);
+    if (userCount <= 0 || contactCount <= 0 || messageCount <= 0 || minMs <= 0 || maxOps <= 0)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    char temporary[] = "/tmp/terchat-bench-XXXXXX";
+    int ownRoot = root == NULL;
+    if (ownRoot)
+    {
+        root = mkdtemp(temporary);
+    }
+    else if (mkdir(root, 0777) == -1 && errno != EEXIST)
+    {
+        root = NULL;
+    }
+    if (root == NULL)
+    {
+        perror("Error creating the dataset directory");
+        return 1;
+    }
+
+    printf("%-16s %7s %8s %8s %8s %12s %10s %12s\n", "operation", "users", "contacts", "messages", "ops", "ns/op", "allocs/op", "bytes/op");
+    fflush(stdout);
+    int failures = 0;
+    int u, c, m;
+    for (u = 0; u < userCount; u++)
+    {
+        for (c = 0; c < contactCount; c++)
+        {
+            for (m = 0; m < messageCount; m++)
+            {
+                BenchDataset dataset = {users[u], contacts[c], messages[m]};
+                if (dataset.contacts >= dataset.users)
+                {
+                    fprintf(stderr, "Skipping %d contacts for %d users: contacts must be fewer than users\n", dataset.contacts, dataset.users);
+                    continue;
+                }
+                char directory[4096];
+                snprintf(directory, sizeof(directory), "%s/u%d-c%d-m%d", root, dataset.users, dataset.contacts, dataset.messages);
+                pid_t child = fork();
+                if (child == 0)
+                {
+                    exit(benchRunDataset(directory, &dataset, (uint64_t)minMs * 1000000ull, maxOps) < 0 ? 1 : 0);
+                }
+                int status;
+                if (child < 0 || waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                {
+                    fprintf(stderr, "Benchmark of %d users, %d contacts, %d messages failed\n", dataset.users, dataset.contacts, dataset.messages);
+                    failures++;
+                }
+                if (!keep)
+                {
+                    nftw(directory, benchRemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+                }
+            }
+        }
+    }
+
+    if (keep)
+    {
+        printf("Datasets kept in %s\n", root);
+    }
+    else if (ownRoot)
+    {
+        rmdir(root);
+    }
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "blob.h"
+#include "log.h"
+
+#define BLOB_PATH_SIZE 96
+#define BLOB_UPLOAD_SUFFIX ".part"
+
+// An upload whose last chunk has not arrived yet
+typedef struct
+{
+    int fd; // of the partial file, -1 for a free slot or a refused upload
+    int refused; // the upload was refused as it started; its other chunks are dropped unanswered
+    int userId;
+    int uploadId;
+    int peerId;
+    size_t received;   // bytes of the upload so far, name included
+    size_t nameLength; // of the name and its NUL at the start of the upload, 0 until the first chunk
+    time_t lastActivity;
+    char name[BLOB_NAME_SIZE];
+} BlobUpload;
+
+static BlobUpload uploads[BLOB_MAX_UPLOADS];
+static pthread_mutex_t uploadsLock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_llong nextBlobId;
+static atomic_long uploadsInProgress;
+
+static int blobInUse(const BlobUpload *upload)
+{
+    return upload->fd >= 0 || upload->refused;
+}
+
+static const char *blobUploadPath(int userId, int uploadId, char path[BLOB_PATH_SIZE])
+{
+    snprintf(path, BLOB_PATH_SIZE, BLOB_DIRECTORY "/upload-%d-%d" BLOB_UPLOAD_SUFFIX, userId, uploadId);
+    return path;
+}
+
+static const char *blobPath(long long blobId, int fromUserId, int toUserId, char path[BLOB_PATH_SIZE])
+{
+    snprintf(path, BLOB_PATH_SIZE, BLOB_DIRECTORY "/%lld-%d-%d", blobId, fromUserId, toUserId);
+    return path;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Creates the blob directory, drops unfinished uploads of a previous run and picks the next blob ID.
+ *
+ * Blobs are stored one file per blob, named "<blob ID>-<sender>-<recipient>",
+ * so a download can check who may read a blob without an index.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int blobInit(void)
+{
+    int i;
+    for (i = 0; i < BLOB_MAX_UPLOADS; i++)
+    {
+        uploads[i].fd = -1;
+    }
+    if ((mkdir("TerChatApp", 0755) != 0 && errno != EEXIST) || (mkdir(BLOB_DIRECTORY, 0755) != 0 && errno != EEXIST))
+    {
+        LOG_ERROR("Error creating %s: %s", BLOB_DIRECTORY, strerror(errno));
+        return -1;
+    }
+    DIR *directory = opendir(BLOB_DIRECTORY);
+    if (directory == NULL)
+    {
+        LOG_ERROR("Error opening %s: %s", BLOB_DIRECTORY, strerror(errno));
+        return -1;
+    }
+    long long highest = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        size_t nameLength = strlen(entry->d_name);
+        size_t suffixLength = strlen(BLOB_UPLOAD_SUFFIX);
+        if (nameLength > suffixLength && strcmp(entry->d_name + nameLength - suffixLength, BLOB_UPLOAD_SUFFIX) == 0)
+        {
+            char path[BLOB_PATH_SIZE + 256];
+            snprintf(path, sizeof(path), BLOB_DIRECTORY "/%s", entry->d_name);
+            unlink(path);
+            continue;
+        }
+        long long blobId = strtoll(entry->d_name, NULL, 10);
+        if (blobId > highest)
+        {
+            highest = blobId;
+        }
+    }
+    closedir(directory);
+    atomic_store(&nextBlobId, highest + 1);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Closes an unfinished upload and removes its partial file; called with uploadsLock held.
+ */
+// <----------------------------------------------------------------> //
+static void blobDropUploadLocked(BlobUpload *upload)
+{
+    if (upload->refused)
+    {
+        upload->refused = 0; // no file was created for it
+        return;
+    }
+    char path[BLOB_PATH_SIZE];
+    close(upload->fd);
+    unlink(blobUploadPath(upload->userId, upload->uploadId, path));
+    upload->fd = -1;
+    atomic_fetch_sub(&uploadsInProgress, 1);
+}
+
+static void blobDropUpload(BlobUpload *upload)
+{
+    pthread_mutex_lock(&uploadsLock);
+    blobDropUploadLocked(upload);
+    pthread_mutex_unlock(&uploadsLock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Finds the slot of an unfinished upload, or claims one when a chunk starts an upload.
+ *
+ * A chunk at offset 0 always starts over, dropping an upload with the same
+ * ID. When every slot is taken, uploads idle for BLOB_UPLOAD_TIMEOUT make
+ * room.
+ *
+ * @param refused Claim the slot for a refused upload, without a partial file.
+ * @return BlobUpload* The slot, or NULL if there is none.
+ */
+// <----------------------------------------------------------------> //
+static BlobUpload *blobFindUpload(int userId, int uploadId, int peerId, int starts, int refused)
+{
+    time_t now = time(NULL);
+    BlobUpload *found = NULL;
+    BlobUpload *vacant = NULL;
+    int i;
+    pthread_mutex_lock(&uploadsLock);
+    for (i = 0; i < BLOB_MAX_UPLOADS; i++)
+    {
+        BlobUpload *upload = &uploads[i];
+        if (blobInUse(upload) && upload->userId == userId && upload->uploadId == uploadId)
+        {
+            found = upload;
+        }
+        else if (blobInUse(upload) && now - upload->lastActivity > BLOB_UPLOAD_TIMEOUT)
+        {
+            LOG_WARN("Dropping upload %d of %d, idle for %ld seconds", upload->uploadId, upload->userId, (long)(now - upload->lastActivity));
+            blobDropUploadLocked(upload);
+        }
+        if (!blobInUse(upload) && vacant == NULL)
+        {
+            vacant = upload;
+        }
+    }
+    if (found != NULL && starts)
+    {
+        blobDropUploadLocked(found);
+        vacant = found;
+        found = NULL;
+    }
+    if (found == NULL && starts && vacant != NULL && refused)
+    {
+        vacant->userId = userId;
+        vacant->uploadId = uploadId;
+        vacant->peerId = peerId;
+        vacant->refused = 1;
+        found = vacant;
+    }
+    else if (found == NULL && starts && vacant != NULL)
+    {
+        char path[BLOB_PATH_SIZE];
+        vacant->fd = open(blobUploadPath(userId, uploadId, path), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (vacant->fd < 0)
+        {
+            LOG_ERROR("Error creating %s: %s", path, strerror(errno));
+        }
+        else
+        {
+            vacant->userId = userId;
+            vacant->uploadId = uploadId;
+            vacant->peerId = peerId;
+            vacant->received = 0;
+            vacant->nameLength = 0;
+            found = vacant;
+            atomic_fetch_add(&uploadsInProgress, 1);
+        }
+    }
+    if (found != NULL)
+    {
+        found->lastActivity = now;
+    }
+    pthread_mutex_unlock(&uploadsLock);
+    return found;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Takes the name off the first chunk of an upload.
+ *
+ * Characters that would break a mailbox line or a file name become '_'.
+ *
+ * @return size_t Length of the name and its NUL, 0 if the chunk holds no complete name.
+ */
+// <----------------------------------------------------------------> //
+static size_t blobTakeName(BlobUpload *upload, const char *data, size_t length)
+{
+    const char *end = memchr(data, '\0', length < BLOB_NAME_SIZE ? length : BLOB_NAME_SIZE);
+    if (end == NULL)
+    {
+        return 0;
+    }
+    size_t i;
+    for (i = 0; data + i < end; i++)
+    {
+        char c = data[i];
+        upload->name[i] = (c < 0x20 && c >= 0) || c == ',' || c == ']' || c == '/' || c == '\\' ? '_' : c;
+    }
+    upload->name[i] = '\0';
+    return (size_t)(end - data) + 1;
+}
+
+static int blobWriteAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Writes one chunk of an upload straight to its partial file.
+ *
+ * Chunks of one upload must arrive in order; one that does not fit drops the
+ * upload. The last chunk turns the partial file into a blob.
+ *
+ * @param userId The uploader.
+ * @param peerId The recipient; must not change during the upload.
+ * @param chunk The chunk header.
+ * @param data The chunk's bytes.
+ * @param blobId Receives the ID of the finished blob.
+ * @param name Receives the name of the finished blob.
+ * @param size Receives the size of the finished blob.
+ * @return int 1 if the blob is finished, 0 if more chunks are expected, -1 if the chunk was refused,
+ *             -2 for the last chunk of an upload refused as it started (see blobRefuse()).
+ */
+// <----------------------------------------------------------------> //
+int blobReceive(int userId, int peerId, const BlobChunk *chunk, const char *data,
+                long long *blobId, char name[BLOB_NAME_SIZE], size_t *size)
+{
+    if (chunk->length > BLOB_CHUNK_DATA_SIZE)
+    {
+        return -1;
+    }
+    BlobUpload *upload = blobFindUpload(userId, chunk->uploadId, peerId, chunk->offset == 0, 0);
+    if (upload == NULL)
+    {
+        return -1;
+    }
+    if (upload->refused)
+    {
+        if (!chunk->last)
+        {
+            return 0;
+        }
+        blobDropUpload(upload);
+        return -2;
+    }
+    if (upload->peerId != peerId || chunk->offset != upload->received ||
+        upload->received + chunk->length > (size_t)BLOB_MAX_SIZE + BLOB_NAME_SIZE)
+    {
+        LOG_WARN("Refusing chunk at %u of upload %d of %d", chunk->offset, chunk->uploadId, userId);
+        blobDropUpload(upload);
+        return -1;
+    }
+
+    const char *bytes = data;
+    size_t length = chunk->length;
+    if (upload->nameLength == 0)
+    {
+        upload->nameLength = blobTakeName(upload, data, length);
+        if (upload->nameLength == 0)
+        {
+            blobDropUpload(upload);
+            return -1;
+        }
+        bytes += upload->nameLength;
+        length -= upload->nameLength;
+    }
+    if (blobWriteAll(upload->fd, bytes, length) < 0)
+    {
+        LOG_ERROR("Error writing upload %d of %d: %s", chunk->uploadId, userId, strerror(errno));
+        blobDropUpload(upload);
+        return -1;
+    }
+    upload->received += chunk->length;
+    if (!chunk->last)
+    {
+        return 0;
+    }
+
+    char uploadPath[BLOB_PATH_SIZE];
+    char path[BLOB_PATH_SIZE];
+    *blobId = atomic_fetch_add(&nextBlobId, 1);
+    if (rename(blobUploadPath(userId, chunk->uploadId, uploadPath), blobPath(*blobId, userId, peerId, path)) != 0)
+    {
+        LOG_ERROR("Error storing blob %lld: %s", *blobId, strerror(errno));
+        blobDropUpload(upload);
+        return -1;
+    }
+    memcpy(name, upload->name, BLOB_NAME_SIZE);
+    *size = upload->received - upload->nameLength;
+    pthread_mutex_lock(&uploadsLock);
+    close(upload->fd);
+    upload->fd = -1;
+    atomic_fetch_sub(&uploadsInProgress, 1);
+    pthread_mutex_unlock(&uploadsLock);
+    return 1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Refuses an upload at its first chunk.
+ *
+ * The caller answers the first chunk; the chunks still on their way are
+ * then dropped by blobReceive() without a file or another answer, up to
+ * the last one.
+ *
+ * @return int 0 on success, -1 if no slot is free (the later chunks are refused as unknown).
+ */
+// <----------------------------------------------------------------> //
+int blobRefuse(int userId, int peerId, const BlobChunk *chunk)
+{
+    if (chunk->last)
+    {
+        return 0; // nothing follows
+    }
+    return blobFindUpload(userId, chunk->uploadId, peerId, 1, 1) != NULL ? 0 : -1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Removes a finished blob that will not be referenced, e.g. because its recipient went offline.
+ */
+// <----------------------------------------------------------------> //
+void blobDiscard(long long blobId, int userId, int peerId)
+{
+    char path[BLOB_PATH_SIZE];
+    unlink(blobPath(blobId, userId, peerId, path));
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Opens a blob for reading by one of the two users it was exchanged between.
+ *
+ * @param blobId The blob.
+ * @param userId The user asking for it.
+ * @param peerId The other user of the conversation.
+ * @param size Receives the blob's size.
+ * @return int A file descriptor to close(), or -1 if there is no such blob between the two users.
+ */
+// <----------------------------------------------------------------> //
+int blobOpen(long long blobId, int userId, int peerId, size_t *size)
+{
+    char path[BLOB_PATH_SIZE];
+    int fd = open(blobPath(blobId, peerId, userId, path), O_RDONLY);
+    if (fd < 0)
+    {
+        fd = open(blobPath(blobId, userId, peerId, path), O_RDONLY);
+    }
+    struct stat status;
+    if (fd >= 0 && fstat(fd, &status) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0)
+    {
+        *size = (size_t)status.st_size;
+    }
+    return fd;
+}
+
+long blobUploadsInProgress(void)
+{
+    return atomic_load(&uploadsInProgress);
+}
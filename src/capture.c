@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "capture.h"
+#include "log.h"
+
+static FILE *captureFile = NULL; // set once at startup, NULL when not capturing
+static pthread_mutex_t captureLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t startedAtUs;
+
+static uint64_t captureNowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000ull;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Starts recording incoming traffic to a capture file.
+ *
+ * The file starts with CAPTURE_MAGIC and holds one record per connection
+ * opened or closed, frame received and reply sent, in the order they
+ * happened. The replay tool reads it back.
+ *
+ * @param path The capture file; truncated.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int captureOpen(const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        LOG_ERROR("Error opening capture file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+    fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), file);
+    startedAtUs = captureNowUs();
+    captureFile = file;
+    LOG_INFO("Capturing traffic to %s", path);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Appends one record; the payload may be NULL.
+ */
+// <----------------------------------------------------------------> //
+static void captureWrite(CaptureKind kind, int sock, const void *payload, size_t payloadLength, const void *body, size_t bodyLength)
+{
+    CaptureRecord record = {(uint8_t)kind, (uint32_t)sock, 0};
+    pthread_mutex_lock(&captureLock);
+    if (captureFile != NULL)
+    {
+        record.timestampUs = captureNowUs() - startedAtUs; // taken under the lock, so records are in time order
+        fwrite(&record, sizeof(record), 1, captureFile);
+        if (payloadLength > 0)
+        {
+            fwrite(payload, 1, payloadLength, captureFile);
+        }
+        if (bodyLength > 0)
+        {
+            fwrite(body, 1, bodyLength, captureFile);
+        }
+    }
+    pthread_mutex_unlock(&captureLock);
+}
+
+void captureConnectionOpened(int sock)
+{
+    if (captureFile != NULL)
+    {
+        captureWrite(CAPTURE_OPEN, sock, NULL, 0, NULL, 0);
+    }
+}
+
+void captureConnectionClosed(int sock)
+{
+    if (captureFile != NULL)
+    {
+        captureWrite(CAPTURE_CLOSE, sock, NULL, 0, NULL, 0);
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Records a frame received from a client.
+ *
+ * Bodies are mostly zero padding, so only the part up to the last non-zero
+ * byte is stored; a typical chat frame takes a few dozen bytes.
+ */
+// <----------------------------------------------------------------> //
+void captureFrameReceived(int sock, const Message *message)
+{
+    if (captureFile == NULL)
+    {
+        return;
+    }
+    size_t bodyLength = sizeof(message->body);
+    while (bodyLength > 0 && message->body[bodyLength - 1] == '\0')
+    {
+        bodyLength--;
+    }
+    CaptureFrame frame = {message->type, message->to, message->from, message->requestId, (uint16_t)bodyLength};
+    captureWrite(CAPTURE_FRAME, sock, &frame, sizeof(frame), message->body, bodyLength);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Records that a reply to a request went out, for the replay tool's latency baseline.
+ */
+// <----------------------------------------------------------------> //
+void captureReplySent(int sock, const Message *message)
+{
+    if (captureFile == NULL || message->requestId == 0)
+    {
+        return;
+    }
+    int32_t requestId = message->requestId;
+    captureWrite(CAPTURE_REPLY, sock, &requestId, sizeof(requestId), NULL, 0);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Flushes and closes the capture file; registered with atexit().
+ */
+// <----------------------------------------------------------------> //
+void captureClose(void)
+{
+    pthread_mutex_lock(&captureLock);
+    if (captureFile != NULL)
+    {
+        fclose(captureFile);
+        captureFile = NULL;
+    }
+    pthread_mutex_unlock(&captureLock);
+}
@@ -2,52 +2,47 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/inet.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "clientcache.h"
+#include "protocol.h"
+#include "terchat.h"
 
-#define PORT 8081
 #define BUFFER_SIZE 1024
-#define REGISTRATION_BUFFER_SIZE 16
 #define MAX_USER_ID_LENGTH 3
 #define MAX_USERS 10
+#define MAX_DOWNLOADS 8
+#define DOWNLOAD_DIRECTORY CLIENT_CACHE_DIRECTORY "/blobs"
 
-typedef struct
-{
-    /*
-    message type / explanation
-        -1       /  disconnect
-        0        /  login request
-        1        /  server message
-        2        /  registration request
-        3        /  confirmation message
-        4        /  list contacts
-        5        /  add user
-        6        /  delete user
-        7        /  send message
-        8        /  check message
-        9        /  read messages
-    */
-    int type; // -1 for disconnect, 0 for login request, 1 for regular message
-    char body[1024];
-    int to;   // -1 for server, user_id for specific user
-    int from; // for the client, this is the user_id
-} Message;
+// Frames of the sync in flight, joined; applied to the cache once the last one arrives
+static atomic_int syncInFlight;
+static int syncAnnounced = 0; // the user asked for the sync in flight
+static char *syncEntries = NULL;
+static size_t syncLength = 0;
+static size_t syncCapacity = 0;
 
+// A blob being fetched; only touched by the receiving thread, which starts and finishes downloads
 typedef struct
 {
-    /* data */
-    int userId;
-    char username[REGISTRATION_BUFFER_SIZE];
-    char phoneNumber[REGISTRATION_BUFFER_SIZE];
-    char name[REGISTRATION_BUFFER_SIZE];
-    char surname[REGISTRATION_BUFFER_SIZE];
-} User;
+    int requestId; // 0 for a free slot
+    int fromUserId;
+    int text; // a long text message, printed once complete
+    FILE *file;
+    char path[128];
+} Download;
+
+static Download downloads[MAX_DOWNLOADS];
+
+// Peer whose cached messages a read request only marks read; its history lines are not printed again
+static int quietReadPeer = -1;
 
 // struct to pass arguments to the new thread
 struct args
 {
-    int sock;
-    int userId;
+    TerchatSession *session;
     int *showMenu;
 };
 
@@ -82,16 +77,12 @@ int validateUserId(char *userIdStr)
 // Send a disconnect message to the server
 /**
  * @brief Disconnects the client from the server.
- * @param sock The socket descriptor of the client.
- * @param user_id The ID of the client.
+ * @param session The session of the client.
  */
 // <----------------------------------------------------------------> //
-void disconnect(int sock, int user_id)
+void disconnect(TerchatSession *session)
 {
-    Message disconnectMessage;
-    disconnectMessage.type = -1; // -1 indicates a disconnect message
-    disconnectMessage.from = user_id;
-    send(sock, &disconnectMessage, sizeof(disconnectMessage), 0);
+    terchatDisconnect(session);
     printf("Disconnect request sent to server\n");
 }
 
@@ -114,11 +105,10 @@ void removeNewline(char *string)
 /**
  * @brief Registers a user by collecting their information and sending it to the server.
  *
- * @param sock The socket file descriptor for the client-server connection.
- * @param userId The ID of the user.
+ * @param session The session of the client.
  */
 // <----------------------------------------------------------------> //
-void registerUser(int sock, int userId)
+void registerUser(TerchatSession *session)
 {
     // Prompt the user to register
     printf("Please register for using this app\n");
@@ -146,14 +136,8 @@ void registerUser(int sock, int userId)
     fgets(surname, REGISTRATION_BUFFER_SIZE, stdin);
     removeNewline(surname);
 
-    // Create a Message for the user's information
-    Message userInfo;
-    userInfo.type = 2;
-    userInfo.from = userId;
-    sprintf(userInfo.body, "%s,%s,%s,%s", username, phoneNumber, name, surname);
-
     // Send user info to server
-    send(sock, &userInfo, sizeof(userInfo), 0);
+    terchatRegister(session, username, phoneNumber, name, surname);
     printf("User info sent to server\n");
 
     // Free the allocated memory
@@ -165,24 +149,32 @@ void registerUser(int sock, int userId)
 
 // <----------------------------------------------------------------> //
 /**
- * @brief Lists the contacts of the user.
+ * @brief Lists the contacts of the user, from the cache once it has been synced.
  *
- * @param sock The socket file descriptor for the client-server connection.
- * @param userId The ID of the user.
+ * @param session The session of the client.
+ * @return int 1 if the cache answered, 0 if a reply from the server will.
  */
 // <----------------------------------------------------------------> //
-void listContacts(int sock, int userId)
+int listContacts(TerchatSession *session)
 {
-    Message msg;
-    msg.type = 4; // Assuming 1 is the type for "list contacts" request
-    msg.from = userId;
-    msg.to = -1;
-    strcpy(msg.body, "List contacts request");
+    if (clientCacheVersion() > 0)
+    {
+        User contacts[MESSAGE_BODY_SIZE / sizeof(User)];
+        int contactCount = clientCacheContacts(contacts, (int)(sizeof(contacts) / sizeof(contacts[0])));
+        printf("User ID, Name, Surname, Phone Number\n");
+        int i;
+        for (i = 0; i < contactCount; i++)
+        {
+            printf("%d, %s, %s, %s\n", contacts[i].userId, contacts[i].name, contacts[i].surname, contacts[i].phoneNumber);
+        }
+        return 1;
+    }
 
-    if (send(sock, &msg, sizeof(msg), 0) == -1)
+    if (terchatListContacts(session) == -1)
     {
         perror("Error sending list contacts request");
     }
+    return 0;
 }
 
 // <----------------------------------------------------------------> //
@@ -217,19 +209,13 @@ User CreateUser()
 /**
  * @brief Adds a user to the user list.
  *
- * @param sock The socket file descriptor for the client-server connection.
- * @param userId The ID of the user.
+ * @param session The session of the client.
  * @param user The user to be added.
  */
 // <----------------------------------------------------------------> //
-void addUser(int sock, int userId, User user)
+void addUser(TerchatSession *session, User user)
 {
-    Message msg;
-    msg.type = 5;
-    msg.from = userId;                      // Set the message type to 5 (add user)
-    memcpy(&msg.body, &user, sizeof(User)); // Copy the user struct into the message body
-
-    if (send(sock, &msg, sizeof(msg), 0) == -1)
+    if (terchatAddContact(session, &user) == -1)
     {
         perror("Error sending user");
     }
@@ -240,11 +226,9 @@ void addUser(int sock, int userId, User user)
  * @brief Processes the list of users received from the server.
  *
  * @param receivedMessage The message received from the server.
- * @param sock The socket file descriptor for the client-server connection.
- * @param userId The ID of the user.
  */
 // <----------------------------------------------------------------> //
-void processUserList(Message receivedMessage, int sock, int userId)
+void processUserList(const Message *receivedMessage)
 {
     User *users = malloc(MAX_USERS * sizeof(User));
     if (users == NULL)
@@ -253,8 +237,8 @@ void processUserList(Message receivedMessage, int sock, int userId)
         return;
     }
 
-    int userCount = receivedMessage.to;
-    memcpy(users, &receivedMessage.body, userCount * sizeof(User));
+    int userCount = receivedMessage->to;
+    memcpy(users, receivedMessage->body, userCount * sizeof(User));
     printf("User ID, Name, Surname, Phone Number\n");
     int i;
     for (i = 0; i < userCount; i++)
@@ -269,22 +253,16 @@ void processUserList(Message receivedMessage, int sock, int userId)
 /**
  * @brief Deletes a user from the user list.
  *
- * @param sock The socket file descriptor for the client-server connection.
- * @param userId The ID of the user.
+ * @param session The session of the client.
  */
 // <----------------------------------------------------------------> //
-void deleteUser(int sock, int userId)
+void deleteUser(TerchatSession *session)
 {
     int deleteUserId;
     printf("Enter the ID of the user to be deleted: ");
     scanf("%d", &deleteUserId);
 
-    Message msg;
-    msg.type = 6;          // Set the message type to 6 (delete user)
-    msg.from = userId;     // Set the from field to the current userId
-    msg.to = deleteUserId; // Set the to field to the userId of the user to be deleted
-
-    if (send(sock, &msg, sizeof(msg), 0) == -1)
+    if (terchatDeleteContact(session, deleteUserId) == -1)
     {
         perror("Error sending delete user request");
     }
@@ -294,11 +272,12 @@ void deleteUser(int sock, int userId)
 /**
  * @brief Sends a message to another user.
  *
- * @param sock The socket file descriptor for the client-server connection.
- * @param userId The ID of the user.
+ * A message too long for one frame is streamed as a blob without a name.
+ *
+ * @param session The session of the client.
  */
 // <----------------------------------------------------------------> //
-void sendMessage(int sock, int userId)
+void sendMessage(TerchatSession *session)
 {
     int recipientUserId;
     printf("Enter the ID of the user to send the message to: ");
@@ -310,80 +289,436 @@ void sendMessage(int sock, int userId)
     {
     }
 
-    char messageText[256];
+    char *messageText = NULL;
+    size_t size = 0;
     printf("Enter your message: ");
-    fgets(messageText, sizeof(messageText), stdin);
+    ssize_t length = getline(&messageText, &size, stdin);
+    if (length < 0)
+    {
+        free(messageText);
+        return;
+    }
 
     // Remove trailing newline
     messageText[strcspn(messageText, "\n")] = 0;
 
-    Message msg;
-    msg.type = 7;                                         // Set the message type to 7 (send message)
-    msg.from = userId;                                    // Set the from field to the current userId
-    msg.to = recipientUserId;                             // Set the to field to the userId of the recipient
-    strncpy(msg.body, messageText, sizeof(msg.body) - 1); // Copy the message text into the body field
-
-    if (send(sock, &msg, sizeof(msg), 0) == -1)
+    if (terchatSendMessage(session, recipientUserId, messageText) == -1)
     {
         perror("Error sending message");
     }
+    free(messageText);
 }
 
 // <----------------------------------------------------------------> //
 /**
- * @brief Checks if the user has any new messages.
+ * @brief Sends a file to another user as an attachment.
  *
- * @param sock The socket file descriptor for the client-server connection.
- * @param userId The ID of the user.
+ * @param session The session of the client.
  */
 // <----------------------------------------------------------------> //
-void checkMessage(int sock, int userId)
+void sendFile(TerchatSession *session)
 {
-    Message msg;
-    msg.type = 8;      // Set the message type to 8 (check message)
-    msg.from = userId; // Set the from field to the current userId
+    int recipientUserId;
+    printf("Enter the ID of the user to send the file to: ");
+    scanf("%d", &recipientUserId);
 
-    if (send(sock, &msg, sizeof(msg), 0) == -1)
+    // Clear the input buffer
+    int c;
+    while ((c = getchar()) != '\n' && c != EOF)
     {
-        perror("Error sending check message");
+    }
+
+    char path[256];
+    printf("Enter the path of the file: ");
+    fgets(path, sizeof(path), stdin);
+    path[strcspn(path, "\n")] = 0;
+
+    FILE *file = fopen(path, "rb");
+    struct stat status;
+    if (file == NULL || fstat(fileno(file), &status) != 0)
+    {
+        perror("Error opening the file");
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+        return;
+    }
+    if (status.st_size > BLOB_MAX_SIZE)
+    {
+        printf("The file is larger than %d bytes\n", BLOB_MAX_SIZE);
+        fclose(file);
+        return;
+    }
+    const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+    if (terchatSendFile(session, recipientUserId, name, file) == -1) // the session closes the file
+    {
+        perror("Error sending the file");
     }
 }
 
 // <----------------------------------------------------------------> //
 /**
- * @brief Requests the server to send the messages from a specific user.
+ * @brief Searches the user's message history on the server.
  *
- * @param sock The socket file descriptor for the client-server connection.
- * @param userId The ID of the user.
+ * @param session The session of the client.
  */
 // <----------------------------------------------------------------> //
-void requestReadMessages(int sock, int userId)
+void searchMessages(TerchatSession *session)
+{
+    char query[256];
+    printf("Enter the words to search for: ");
+    fgets(query, sizeof(query), stdin);
+    query[strcspn(query, "\n")] = 0;
+
+    if (terchatSearchMessages(session, query, 0) == -1) // default number of results
+    {
+        perror("Error sending search request");
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Looks up registered users by the start of their name, surname, username or phone number.
+ *
+ * @param session The session of the client.
+ */
+// <----------------------------------------------------------------> //
+void findUsers(TerchatSession *session)
+{
+    char query[REGISTRATION_BUFFER_SIZE * 2];
+    printf("Enter the start of a name, surname, username or phone number: ");
+    fgets(query, sizeof(query), stdin);
+    query[strcspn(query, "\n")] = 0;
+
+    if (terchatFindUsers(session, query, 0) == -1) // default number of results
+    {
+        perror("Error sending find users request");
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Asks the server for the changes to contacts and messages since the cached version.
+ *
+ * At most one sync is in flight; a request while one is pending is dropped,
+ * since the pending one brings the changes too.
+ *
+ * @param session The session of the client.
+ * @param announce Whether to tell the user when the sync completes.
+ */
+// <----------------------------------------------------------------> //
+void syncChanges(TerchatSession *session, int announce)
+{
+    if (atomic_exchange(&syncInFlight, 1))
+    {
+        return;
+    }
+    syncAnnounced = announce;
+    if (terchatSync(session, clientCacheVersion()) == -1)
+    {
+        perror("Error sending sync request");
+        atomic_store(&syncInFlight, 0);
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Collects the frames of a sync reply and applies them to the cache with the last one.
+ *
+ * @param receivedMessage A type 15 frame.
+ * @param completed Whether the frame completes the sync.
+ */
+// <----------------------------------------------------------------> //
+void processSyncFrame(const Message *receivedMessage, int completed)
+{
+    const char *entries = memchr(receivedMessage->body, '\n', MESSAGE_BODY_SIZE);
+    size_t length = entries != NULL ? strnlen(entries + 1, MESSAGE_BODY_SIZE - (size_t)(entries + 1 - receivedMessage->body)) : 0;
+    if (syncLength + length > syncCapacity)
+    {
+        size_t capacity = syncCapacity > 0 ? syncCapacity * 2 : 4096;
+        while (capacity < syncLength + length)
+        {
+            capacity *= 2;
+        }
+        char *grown = realloc(syncEntries, capacity);
+        if (grown == NULL)
+        {
+            perror("Error allocating sync buffer");
+            return;
+        }
+        syncEntries = grown;
+        syncCapacity = capacity;
+    }
+    if (length > 0)
+    {
+        memcpy(syncEntries + syncLength, entries + 1, length);
+        syncLength += length;
+    }
+    if (!completed)
+    {
+        return;
+    }
+
+    long long version = strtoll(receivedMessage->body, NULL, 10);
+    if (clientCacheApply(version, syncEntries, syncLength) < 0)
+    {
+        perror("Error writing the cache");
+    }
+    if (syncAnnounced)
+    {
+        printf("Synced up to version %lld\n", version);
+    }
+    syncLength = 0;
+    atomic_store(&syncInFlight, 0);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Fetches the blob a received message references.
+ *
+ * Attachments are saved under DOWNLOAD_DIRECTORY; a long text message is
+ * saved there too and printed once complete.
+ *
+ * @param session The session of the client.
+ * @param receivedMessage The type 7 message holding the reference.
+ * @return int 1 if the message referenced a blob, 0 otherwise.
+ */
+// <----------------------------------------------------------------> //
+int fetchBlob(TerchatSession *session, const Message *receivedMessage)
+{
+    long long blobId;
+    size_t size;
+    char name[BLOB_NAME_SIZE] = "";
+    if (strncmp(receivedMessage->body, BLOB_REFERENCE_PREFIX, strlen(BLOB_REFERENCE_PREFIX)) != 0 ||
+        sscanf(receivedMessage->body + strlen(BLOB_REFERENCE_PREFIX), "%lld %zu %63[^]]", &blobId, &size, name) < 2)
+    {
+        return 0;
+    }
+
+    Download *download = NULL;
+    int i;
+    for (i = 0; i < MAX_DOWNLOADS && download == NULL; i++)
+    {
+        if (downloads[i].requestId == 0)
+        {
+            download = &downloads[i];
+        }
+    }
+    mkdir(CLIENT_CACHE_DIRECTORY, 0755);
+    mkdir(DOWNLOAD_DIRECTORY, 0755);
+    char path[sizeof(download->path)];
+    snprintf(path, sizeof(path), DOWNLOAD_DIRECTORY "/%lld-%s", blobId, name[0] != '\0' ? name : "message.txt");
+    FILE *file = download != NULL ? fopen(path, "wb") : NULL;
+    if (file == NULL)
+    {
+        printf("Could not fetch blob %lld from %d: %s\n", blobId, receivedMessage->from, download != NULL ? strerror(errno) : "too many downloads");
+        return 1;
+    }
+
+    int requestId = terchatFetchBlob(session, receivedMessage->from, blobId);
+    if (requestId == -1)
+    {
+        perror("Error requesting the blob");
+        fclose(file);
+        return 1;
+    }
+    download->requestId = requestId;
+    download->fromUserId = receivedMessage->from;
+    download->text = name[0] == '\0';
+    download->file = file;
+    strcpy(download->path, path);
+    if (!download->text)
+    {
+        printf("Receiving %s (%zu bytes) from %d\n", name, size, receivedMessage->from);
+    }
+    return 1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Writes a chunk of a download to its file and finishes the download with the last one.
+ *
+ * @param receivedMessage A type 16 frame, or the confirmation that ends a failed download.
+ * @param completed Whether the frame completes the download.
+ */
+// <----------------------------------------------------------------> //
+void processBlobFrame(const Message *receivedMessage, int completed)
+{
+    Download *download = NULL;
+    int i;
+    for (i = 0; i < MAX_DOWNLOADS && download == NULL; i++)
+    {
+        if (downloads[i].requestId != 0 && downloads[i].requestId == receivedMessage->requestId)
+        {
+            download = &downloads[i];
+        }
+    }
+    if (download == NULL)
+    {
+        return;
+    }
+    if (receivedMessage->type == 16)
+    {
+        BlobChunk chunk;
+        memcpy(&chunk, receivedMessage->body, sizeof(chunk));
+        size_t length = chunk.length <= BLOB_CHUNK_DATA_SIZE ? chunk.length : BLOB_CHUNK_DATA_SIZE;
+        fwrite(receivedMessage->body + sizeof(chunk), 1, length, download->file);
+    }
+    if (!completed)
+    {
+        return;
+    }
+
+    fclose(download->file);
+    download->requestId = 0;
+    if (receivedMessage->type != 16)
+    {
+        unlink(download->path);
+        return;
+    }
+    if (!download->text)
+    {
+        printf("Saved the attachment from %d to %s\n", download->fromUserId, download->path);
+        return;
+    }
+    FILE *file = fopen(download->path, "r");
+    if (file != NULL)
+    {
+        printf("Message received from %d: ", download->fromUserId);
+        char buffer[BUFFER_SIZE];
+        size_t length;
+        while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        {
+            fwrite(buffer, 1, length, stdout);
+        }
+        printf("\n");
+        fclose(file);
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sends one message to several users in a single batch request.
+ *
+ * @param session The session of the client.
+ */
+// <----------------------------------------------------------------> //
+void sendBatchMessage(TerchatSession *session)
+{
+    char recipients[256];
+    printf("Enter the IDs of the users to send the message to (separated by spaces): ");
+    fgets(recipients, sizeof(recipients), stdin);
+
+    char messageText[256];
+    printf("Enter your message: ");
+    fgets(messageText, sizeof(messageText), stdin);
+    messageText[strcspn(messageText, "\n")] = 0;
+
+    int recipientIds[sizeof(recipients) / 2];
+    int recipientCount = 0;
+    char *cursor = recipients;
+    char *end;
+    long recipientUserId;
+    while ((recipientUserId = strtol(cursor, &end, 10)), end != cursor)
+    {
+        recipientIds[recipientCount++] = (int)recipientUserId;
+        cursor = end;
+    }
+
+    int requested = recipientCount;
+    int requestId = terchatSendBatch(session, recipientIds, &recipientCount, messageText);
+    if (recipientCount < requested)
+    {
+        printf("Too many recipients, the rest are skipped\n");
+    }
+    if (requestId == -1)
+    {
+        perror("Error sending batch message");
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Shows the messages from a specific user and has the server mark them read.
+ *
+ * With a synced cache the history is shown from it, and the server is only
+ * asked when there are unread messages to mark.
+ *
+ * @param session The session of the client.
+ * @return int 1 if the cache answered, 0 if a reply from the server will.
+ */
+// <----------------------------------------------------------------> //
+int requestReadMessages(TerchatSession *session)
 {
     int targetUserId;
     printf("Enter the user ID of the user whose messages you want to read: ");
     scanf("%d", &targetUserId);
 
-    // Now you can send a request to the server to get the messages from targetUserId
-    Message request;
-    request.type = 9;          // type 9 for read messages request
-    request.to = targetUserId; // to server
-    request.from = userId;
+    int unread = 0;
+    if (clientCacheVersion() > 0)
+    {
+        char lines[8 * MESSAGE_BODY_SIZE];
+        clientCacheConversation(targetUserId, lines, sizeof(lines), &unread);
+        printf("Messages from %d:\n%s", targetUserId, lines);
+        if (unread == 0)
+        {
+            return 1; // nothing to mark read on the server
+        }
+    }
 
-    if (send(sock, &request, sizeof(request), 0) == -1)
+    // Now you can send a request to the server to get the messages from targetUserId
+    quietReadPeer = unread > 0 ? targetUserId : -1;
+    if (terchatReadMessages(session, targetUserId) == -1)
     {
         perror("Error sending message");
     }
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Checks if the user has any new messages, from the cache once it has been synced.
+ *
+ * @param session The session of the client.
+ * @return int 1 if the cache answered, 0 if a reply from the server will.
+ */
+// <----------------------------------------------------------------> //
+int checkMessage(TerchatSession *session)
+{
+    if (clientCacheVersion() > 0)
+    {
+        int peers[MESSAGE_BODY_SIZE / 32];
+        int counts[MESSAGE_BODY_SIZE / 32];
+        int peerCount = clientCacheUnreadCounts(peers, counts, (int)(sizeof(peers) / sizeof(peers[0])));
+        if (peerCount == 0)
+        {
+            printf("No unread message\n");
+            return 1;
+        }
+        int i;
+        for (i = 0; i < peerCount; i++)
+        {
+            printf("%d Unread message from user %d\n", counts[i], peers[i]);
+        }
+        return requestReadMessages(session);
+    }
+
+    if (terchatCheckMessages(session) == -1)
+    {
+        perror("Error sending check message");
+    }
+    return 0;
 }
 
 // <----------------------------------------------------------------> //
 /**
  * @brief Handles the menu for the user.
  *
- * @param sock The socket file descriptor for the client-server connection.
- * @param userId The ID of the user.
+ * @param session The session of the client.
  */
 // <----------------------------------------------------------------> //
-void HandleMenu(int sock, int userId, int *showMenu)
+void HandleMenu(TerchatSession *session, int *showMenu)
 {
     printf("<--------------------------->\n");
     printf("Please type your choice:\n");
@@ -393,6 +728,11 @@ void HandleMenu(int sock, int userId, int *showMenu)
     printf("4 - Send message\n");
     printf("5 - Check message\n");
     printf("6 - Disconnect\n");
+    printf("7 - Send message to several users\n");
+    printf("8 - Search messages\n");
+    printf("9 - Find users\n");
+    printf("10 - Sync changes\n");
+    printf("11 - Send file\n");
 
     int choice;
     scanf("%d", &choice);
@@ -403,26 +743,46 @@ void HandleMenu(int sock, int userId, int *showMenu)
     {
     case 1:
         // Call function to list contacts
-        listContacts(sock, userId);
+        *showMenu = listContacts(session);
         break;
     case 2:
         // Call function to add user
-        addUser(sock, userId, CreateUser());
+        addUser(session, CreateUser());
         break;
     case 3:
         // Call function to delete user
-        deleteUser(sock, userId);
+        deleteUser(session);
         break;
     case 4:
         // Call function to send message
-        sendMessage(sock, userId);
+        sendMessage(session);
         break;
     case 5:
         // Call function to check message
-        checkMessage(sock, userId);
+        *showMenu = checkMessage(session);
         break;
     case 6:
-        disconnect(sock, userId);
+        disconnect(session);
+        break;
+    case 7:
+        // Call function to send one message to several users
+        sendBatchMessage(session);
+        break;
+    case 8:
+        // Call function to search the message history
+        searchMessages(session);
+        break;
+    case 9:
+        // Call function to look up users by name, surname, username or phone
+        findUsers(session);
+        break;
+    case 10:
+        // Call function to fetch what changed since the last sync
+        syncChanges(session, 1);
+        break;
+    case 11:
+        // Call function to send a file as an attachment
+        sendFile(session);
         break;
     default:
         printf("Invalid choice. Please try again.\n");
@@ -440,8 +800,7 @@ void HandleMenu(int sock, int userId, int *showMenu)
 // <----------------------------------------------------------------> //
 void *handleUserInput(void *arg)
 {
-    int sock = ((struct args *)arg)->sock;
-    int userId = ((struct args *)arg)->userId;
+    TerchatSession *session = ((struct args *)arg)->session;
     int *showMenu = ((struct args *)arg)->showMenu;
 
     while (1)
@@ -450,119 +809,220 @@ void *handleUserInput(void *arg)
         {
             continue;
         }
-        HandleMenu(sock, userId, showMenu);
+        HandleMenu(session, showMenu);
     }
 
     return NULL;
 }
 
-int main(int argc, char *argv[])
+// <----------------------------------------------------------------> //
+/**
+ * @brief Reconciles the cache with the server periodically.
+ *
+ * @param arg The arguments passed to the thread.
+ */
+// <----------------------------------------------------------------> //
+void *syncCacheInBackground(void *arg)
 {
-    int userId = validateUserId(argv[1]);
-    int showMenu = 0;
-    int sock = 0;
-    struct sockaddr_in serverAddr;
-    char buffer[BUFFER_SIZE] = {0};
+    TerchatSession *session = ((struct args *)arg)->session;
 
-    // socket file descriptor
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0)
+    while (1)
     {
-        perror("Error! when socket is creating");
-        exit(EXIT_FAILURE);
+        syncChanges(session, 0);
+        sleep(CLIENT_CACHE_SYNC_INTERVAL);
     }
 
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(PORT);
+    return NULL;
+}
 
-    // Convert IPv4 and IPv6 addresses from text to binary form
-    if (inet_pton(AF_INET, "127.0.0.1", &serverAddr.sin_addr) <= 0)
+// <----------------------------------------------------------------> //
+/**
+ * @brief Shows a frame received from the server; runs on the main thread, inside the session loop.
+ *
+ * @param session The session of the client.
+ * @param receivedMessage The frame, or NULL once the connection has closed.
+ * @param requestType The type of the request the frame answers, -1 for pushes.
+ * @param requestCompleted Whether the frame completes that request.
+ * @param arg The arguments shared with the other threads.
+ */
+// <----------------------------------------------------------------> //
+void handleServerFrame(TerchatSession *session, const Message *receivedMessage, int requestType, int requestCompleted, void *arg)
+{
+    int *showMenu = ((struct args *)arg)->showMenu;
+    if (receivedMessage == NULL || receivedMessage->type == -1) // disconnect request or connection closed
+    {
+        if (receivedMessage == NULL && terchatError(session) != 0)
+        {
+            printf("Error! Connection failed: %s\n", strerror(terchatError(session)));
+            exit(EXIT_FAILURE);
+        }
+        printf("Disconnect request received from server or connection closed\n");
+        exit(0);
+    }
+    else if (receivedMessage->type == 2) // registration request
     {
-        printf("\nInvalid address/ Address not supported \n");
-        return -1;
+        registerUser(session);
+        *showMenu = 0;
     }
-
-    int connection = connect(sock, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
-    if (connection < 0)
+    else if (receivedMessage->type == 3) // confirmation message
     {
-        perror("Error! Connection failed");
-        exit(EXIT_FAILURE);
+        // confirmation message
+        printf("<!!!!!!!!!!!!!!!!!!!!!!!!!!!>\n");
+        if (requestCompleted)
+        {
+            printf("Server notification (request %d, type %d)! %s\n", receivedMessage->requestId, requestType, receivedMessage->body);
+        }
+        else
+        {
+            printf("Server notification! %s\n", receivedMessage->body);
+        }
+        printf("<!!!!!!!!!!!!!!!!!!!!!!!!!!!>\n");
+        if (requestCompleted && requestType == 17)
+        {
+            processBlobFrame(receivedMessage, requestCompleted); // the blob could not be fetched
+        }
+        if (requestCompleted && (requestType == 5 || requestType == 6 || requestType == 7 || requestType == 9 || requestType == 10 || requestType == 16))
+        {
+            syncChanges(session, 0); // bring the cache up to date with our own change
+        }
+        *showMenu = 1;
     }
-
-    printf("Connected to server\n");
-
-    // Send user_id to server
-    Message loginMessage;
-    loginMessage.type = 0;
-    loginMessage.from = userId;
-    loginMessage.to = -1; // this message will processed by server
-    send(sock, &loginMessage, sizeof(loginMessage), 0);
-    printf("Login request sent to server\n");
-
-    // Create a new thread to handle user input
-    pthread_t thread_id;
-    struct args arguments = {sock, userId, &showMenu};
-    pthread_create(&thread_id, NULL, handleUserInput, &arguments);
-
-    while (1)
+    else if (receivedMessage->type == 4) // list contacts
     {
-
-        // Receive message from server
-        Message receivedMessage;
-        int valrec = recv(sock, &receivedMessage, sizeof(Message), 0);
-        if (valrec <= 0 || receivedMessage.type == -1) // disconnect request or connection closed
+        processUserList(receivedMessage);
+        *showMenu = 1;
+    }
+    else if (receivedMessage->type == 7) // send message
+    {
+        if (!fetchBlob(session, receivedMessage))
         {
-            printf("Disconnect request received from server or connection closed\n");
-            close(sock);
-            exit(0);
+            printf("Message received from %d: %s\n", receivedMessage->from, receivedMessage->body);
         }
-        else if (receivedMessage.type == 2) // registration request
+        syncChanges(session, 0);
+        *showMenu = 1;
+    }
+    else if (receivedMessage->type == 8) // check message
+    {
+        printf("%s", receivedMessage->body);
+        requestReadMessages(session);
+    }
+    else if (receivedMessage->type == 9) // read messages
+    {
+        if (receivedMessage->from != quietReadPeer)
         {
-            registerUser(sock, userId);
-            showMenu = 0;
+            printf("Messages from %d:\n", receivedMessage->from);
+            printf("%s", receivedMessage->body);
         }
-        else if (receivedMessage.type == 3) // confirmation message
+        *showMenu = 1;
+    }
+    else if (receivedMessage->type == 12) // search hit
+    {
+        printf("Found (with %d): %s", receivedMessage->from, receivedMessage->body);
+        if (requestCompleted)
         {
-            // confirmation message
-            printf("<!!!!!!!!!!!!!!!!!!!!!!!!!!!>\n");
-            printf("Server notification! %s\n", receivedMessage.body);
-            printf("<!!!!!!!!!!!!!!!!!!!!!!!!!!!>\n");
-            // HandleMenu(sock, userId);
-            showMenu = 1;
+            *showMenu = 1;
         }
-        else if (receivedMessage.type == 4) // list contacts
+    }
+    else if (receivedMessage->type == 13) // found user
+    {
+        User found;
+        memcpy(&found, receivedMessage->body, sizeof(User));
+        printf("Found user %d: %s (%s %s, %s)\n", found.userId, found.username, found.name, found.surname, found.phoneNumber);
+        if (requestCompleted)
+        {
+            *showMenu = 1;
+        }
+    }
+    else if (receivedMessage->type == 14) // presence of contacts
+    {
+        int i;
+        for (i = 0; i < receivedMessage->to && i < PRESENCE_CHANGES_PER_FRAME; i++)
         {
-            // list contacts
-            processUserList(receivedMessage, sock, userId);
-            showMenu = 1;
-            // HandleMenu(sock, userId);
+            PresenceChange change;
+            memcpy(&change, receivedMessage->body + i * sizeof(change), sizeof(change));
+            printf("Contact %d is %s\n", change.userId, change.online ? "online" : "offline");
         }
-        else if (receivedMessage.type == 7) // send message
+    }
+    else if (receivedMessage->type == 15) // changes since the last sync
+    {
+        processSyncFrame(receivedMessage, requestCompleted);
+        if (requestCompleted && syncAnnounced)
         {
-            printf("Message received from %d: %s\n", receivedMessage.from, receivedMessage.body);
-            showMenu = 1;
-            // HandleMenu(sock, userId);
+            *showMenu = 1;
         }
-        else if (receivedMessage.type == 8) // check message
+    }
+    else if (receivedMessage->type == 16) // chunk of a fetched blob
+    {
+        processBlobFrame(receivedMessage, requestCompleted);
+    }
+    else if (receivedMessage->type == 18) // request refused under load
+    {
+        if (requestCompleted && requestType == 15)
         {
-            printf("%s", receivedMessage.body);
-            requestReadMessages(sock, userId);
+            atomic_store(&syncInFlight, 0); // the next background sync tries again
         }
-        else if (receivedMessage.type == 9) // read messages
+        if (requestCompleted && requestType == 17)
         {
-            printf("Messages from %d:\n", receivedMessage.from);
-            printf("%s", receivedMessage.body);
-            showMenu = 1;
-            // HandleMenu(sock, userId);
+            processBlobFrame(receivedMessage, requestCompleted);
         }
-        else
+        if (requestType != 15)
         {
-            printf("Server %d: %s, message type %d\n", sock, receivedMessage.body, receivedMessage.type);
+            printf("Server busy, request %d (type %d) not handled; retry in %d ms\n", receivedMessage->requestId, requestType, receivedMessage->to);
+            *showMenu = 1;
         }
+    }
+    else if (receivedMessage->type == 11) // heartbeat reply
+    {
+        // nothing to show; the server only confirms the session is alive
+    }
+    else
+    {
+        printf("Server %d: %s, message type %d\n", terchatUserId(session), receivedMessage->body, receivedMessage->type);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int userId = validateUserId(argv[1]);
+    int port = argc > 2 ? atoi(argv[2]) : PORT; // any node of a cluster
+    int showMenu = 0;
+    struct args arguments = {NULL, &showMenu};
+
+    // The session loop runs on this thread; heartbeats are sent from it too
+    TerchatLoop *loop = terchatLoopCreate();
+    if (loop == NULL)
+    {
+        perror("Error! when the event loop is creating");
+        exit(EXIT_FAILURE);
+    }
+    arguments.session = terchatConnect(loop, "127.0.0.1", port, userId, handleServerFrame, &arguments);
+    if (arguments.session == NULL)
+    {
+        perror("Error! Connection failed");
+        exit(EXIT_FAILURE);
+    }
 
-        // Clear the buffer
-        memset(buffer, 0, sizeof(buffer));
+    if (clientCacheOpen(userId, port) < 0)
+    {
+        perror("Error opening the cache, continuing without it");
     }
 
-    return 0;
-}
\ No newline at end of file
+    // Send user_id to server; sent as soon as the connection is up
+    terchatLogin(arguments.session);
+    printf("Login request sent to server\n");
+
+    // Ask for the presence of the contacts; changes are pushed from then on
+    terchatSubscribePresence(arguments.session);
+
+    // Create a new thread to handle user input
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, handleUserInput, &arguments);
+    pthread_t syncThread;
+    pthread_create(&syncThread, NULL, syncCacheInBackground, &arguments);
+
+    while (terchatLoopRun(loop, -1) >= 0)
+    {
+    }
+    perror("Error in the event loop");
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,506 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "clientcache.h"
+
+#define CLIENT_CACHE_COMPACT_SLACK (64 * 1024) // bytes of superseded entries tolerated before a rewrite
+
+// A message of the mailbox as the server stores it: "date, peer, text, read status"
+typedef struct
+{
+    int peer;
+    int read;
+    char *line;
+} CachedMessage;
+
+// Peers seen while compacting, with the number of their messages
+typedef struct
+{
+    int peer;
+    int total;
+    int seen;
+} CachedPeer;
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static char cachePath[64];
+static long long cacheVersion = 0;
+static User *contacts = NULL;
+static int contactCount = 0;
+static int contactCapacity = 0;
+static CachedMessage *messages = NULL;
+static int messageCount = 0;
+static int messageCapacity = 0;
+static size_t fileSize = 0;
+
+static void clientCacheReset(void)
+{
+    int i;
+    for (i = 0; i < messageCount; i++)
+    {
+        free(messages[i].line);
+    }
+    messageCount = 0;
+    contactCount = 0;
+}
+
+static void clientCacheRemoveContact(int contactId)
+{
+    int i;
+    for (i = 0; i < contactCount; i++)
+    {
+        if (contacts[i].userId == contactId)
+        {
+            memmove(&contacts[i], &contacts[i + 1], (size_t)(contactCount - i - 1) * sizeof(User));
+            contactCount--;
+            return;
+        }
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Applies one journal entry to the cached contacts and messages.
+ *
+ * @param entry The entry without its newline, NUL-terminated.
+ */
+// <----------------------------------------------------------------> //
+static void clientCacheApplyEntry(char *entry)
+{
+    if (entry[0] == '\0' || entry[1] != ',')
+    {
+        return;
+    }
+    char *data = entry + 2;
+    int i;
+    switch (entry[0])
+    {
+    case 'X': // reset
+        clientCacheReset();
+        break;
+    case 'C': // contact added
+    {
+        User contact;
+        memset(&contact, 0, sizeof(contact));
+        if (sscanf(data, "%d,%15[^,],%15[^,],%15[^\n]", &contact.userId, contact.name, contact.surname, contact.phoneNumber) < 1)
+        {
+            break;
+        }
+        clientCacheRemoveContact(contact.userId);
+        if (contactCount == contactCapacity)
+        {
+            int capacity = contactCapacity > 0 ? contactCapacity * 2 : 16;
+            User *grown = realloc(contacts, (size_t)capacity * sizeof(User));
+            if (grown == NULL)
+            {
+                break;
+            }
+            contacts = grown;
+            contactCapacity = capacity;
+        }
+        contacts[contactCount++] = contact;
+        break;
+    }
+    case 'D': // contact removed
+        clientCacheRemoveContact(atoi(data));
+        break;
+    case 'M': // message stored
+    {
+        int peer;
+        const char *status = strrchr(data, ',');
+        if (sscanf(data, "%*[^,], %d", &peer) != 1 || status == NULL)
+        {
+            break;
+        }
+        if (messageCount == messageCapacity)
+        {
+            int capacity = messageCapacity > 0 ? messageCapacity * 2 : 64;
+            CachedMessage *grown = realloc(messages, (size_t)capacity * sizeof(CachedMessage));
+            if (grown == NULL)
+            {
+                break;
+            }
+            messages = grown;
+            messageCapacity = capacity;
+        }
+        char *line = strdup(data);
+        if (line != NULL)
+        {
+            messages[messageCount].peer = peer;
+            messages[messageCount].read = atoi(status + 1);
+            messages[messageCount].line = line;
+            messageCount++;
+        }
+        break;
+    }
+    case 'R': // messages from a peer read
+    {
+        int peer = atoi(data);
+        for (i = 0; i < messageCount; i++)
+        {
+            if (messages[i].peer == peer && !messages[i].read)
+            {
+                char *status = messages[i].line + strlen(messages[i].line) - 1;
+                if (*status == '0')
+                {
+                    *status = '1';
+                }
+                messages[i].read = 1;
+            }
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Applies newline-separated entries; V entries set the version.
+ */
+// <----------------------------------------------------------------> //
+static void clientCacheApplyEntries(char *entries, size_t length)
+{
+    char *cursor = entries;
+    char *end = entries + length;
+    while (cursor < end)
+    {
+        char *newline = memchr(cursor, '\n', (size_t)(end - cursor));
+        if (newline == NULL)
+        {
+            break;
+        }
+        *newline = '\0';
+        if (cursor[0] == 'V' && cursor[1] == ',')
+        {
+            cacheVersion = strtoll(cursor + 2, NULL, 10);
+        }
+        else
+        {
+            clientCacheApplyEntry(cursor);
+        }
+        *newline = '\n';
+        cursor = newline + 1;
+    }
+}
+
+static size_t clientCacheLiveSize(void)
+{
+    size_t size = (size_t)contactCount * sizeof(User);
+    int i;
+    for (i = 0; i < messageCount; i++)
+    {
+        size += strlen(messages[i].line) + 3;
+    }
+    return size;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Rewrites the cache file from memory, keeping recent messages of each conversation.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+static int clientCacheRewrite(void)
+{
+    CachedPeer *peers = malloc(((size_t)messageCount + 1) * sizeof(CachedPeer));
+    if (peers == NULL)
+    {
+        return -1;
+    }
+    int peerCount = 0;
+    int i, j;
+    for (i = 0; i < messageCount; i++)
+    {
+        for (j = 0; j < peerCount && peers[j].peer != messages[i].peer; j++)
+        {
+            continue;
+        }
+        if (j == peerCount)
+        {
+            peers[peerCount++] = (CachedPeer){messages[i].peer, 0, 0};
+        }
+        peers[j].total++;
+    }
+
+    char temporaryPath[sizeof(cachePath) + 4];
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", cachePath);
+    FILE *file = fopen(temporaryPath, "w");
+    if (file == NULL)
+    {
+        free(peers);
+        return -1;
+    }
+    fprintf(file, "X,\n");
+    for (i = 0; i < contactCount; i++)
+    {
+        fprintf(file, "C,%d,%s,%s,%s\n", contacts[i].userId, contacts[i].name, contacts[i].surname, contacts[i].phoneNumber);
+    }
+    int kept = 0;
+    for (i = 0; i < messageCount; i++)
+    {
+        for (j = 0; peers[j].peer != messages[i].peer; j++)
+        {
+            continue;
+        }
+        if (peers[j].total - peers[j].seen++ > CLIENT_CACHE_MESSAGES_PER_PEER)
+        {
+            free(messages[i].line);
+            continue;
+        }
+        fprintf(file, "M,%s\n", messages[i].line);
+        messages[kept++] = messages[i];
+    }
+    messageCount = kept;
+    fprintf(file, "V,%lld\n", cacheVersion);
+    free(peers);
+    long size = ftell(file);
+    if (fclose(file) != 0 || rename(temporaryPath, cachePath) != 0)
+    {
+        unlink(temporaryPath);
+        return -1;
+    }
+    fileSize = (size_t)size;
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Loads the cache of a user, so contacts and conversations are available before any sync.
+ *
+ * The file is a copy of the user's server journal: entry lines as the
+ * server sends them, each synced batch closed by a "V,<version>" line.
+ * A batch cut short by a crash has no V line and is dropped.
+ *
+ * @param userId The user.
+ * @param port The server port; versions only make sense for one server.
+ * @return int 0 on success, -1 if the cache is not usable; the client then works uncached.
+ */
+// <----------------------------------------------------------------> //
+int clientCacheOpen(int userId, int port)
+{
+    mkdir(CLIENT_CACHE_DIRECTORY, 0777);
+    snprintf(cachePath, sizeof(cachePath), CLIENT_CACHE_DIRECTORY "/%d.%d.cache", userId, port);
+
+    pthread_mutex_lock(&cacheLock);
+    FILE *file = fopen(cachePath, "r");
+    if (file == NULL)
+    {
+        pthread_mutex_unlock(&cacheLock);
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct stat status;
+    char *data = NULL;
+    size_t length = 0;
+    if (fstat(fileno(file), &status) == 0 && (data = malloc((size_t)status.st_size + 1)) != NULL)
+    {
+        length = fread(data, 1, (size_t)status.st_size, file);
+    }
+    fclose(file);
+    if (data == NULL)
+    {
+        pthread_mutex_unlock(&cacheLock);
+        return -1;
+    }
+
+    // Only complete batches count
+    size_t complete = 0;
+    size_t position;
+    for (position = 0; position + 1 < length; position++)
+    {
+        if ((position == 0 || data[position - 1] == '\n') && data[position] == 'V' && data[position + 1] == ',')
+        {
+            char *newline = memchr(data + position, '\n', length - position);
+            if (newline != NULL)
+            {
+                complete = (size_t)(newline - data) + 1;
+            }
+        }
+    }
+    clientCacheApplyEntries(data, complete);
+    free(data);
+    fileSize = complete;
+    int result = 0;
+    if (complete < length || fileSize > 2 * clientCacheLiveSize() + CLIENT_CACHE_COMPACT_SLACK)
+    {
+        result = clientCacheRewrite();
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return result;
+}
+
+long long clientCacheVersion(void)
+{
+    pthread_mutex_lock(&cacheLock);
+    long long version = cacheVersion;
+    pthread_mutex_unlock(&cacheLock);
+    return version;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Applies the entries of a completed sync and stores them.
+ *
+ * @param version The version the server reported for the sync.
+ * @param entries The journal lines of the sync, all frames joined.
+ * @param length Length of entries.
+ * @return int 0 on success, -1 if the file could not be written; memory is updated regardless.
+ */
+// <----------------------------------------------------------------> //
+int clientCacheApply(long long version, const char *entries, size_t length)
+{
+    char *copy = malloc(length + 1);
+    if (copy == NULL)
+    {
+        return -1;
+    }
+    memcpy(copy, entries, length);
+    copy[length] = '\0';
+
+    pthread_mutex_lock(&cacheLock);
+    clientCacheApplyEntries(copy, length);
+    int changed = length > 0 || version != cacheVersion;
+    cacheVersion = version;
+    int result = 0;
+    int reset = length >= 2 && entries[0] == 'X' && entries[1] == ',';
+    if (!changed)
+    {
+        // nothing happened since the last sync
+    }
+    else if (reset || fileSize + length > 2 * clientCacheLiveSize() + CLIENT_CACHE_COMPACT_SLACK)
+    {
+        result = clientCacheRewrite();
+    }
+    else
+    {
+        FILE *file = fopen(cachePath, "a");
+        if (file == NULL)
+        {
+            result = -1;
+        }
+        else
+        {
+            fwrite(copy, 1, length, file);
+            fprintf(file, "V,%lld\n", version);
+            fileSize = (size_t)ftell(file);
+            result = fclose(file) == 0 ? 0 : -1;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+    free(copy);
+    return result;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Copies the cached contact list.
+ *
+ * @return int The number of contacts copied.
+ */
+// <----------------------------------------------------------------> //
+int clientCacheContacts(User *list, int maxContacts)
+{
+    pthread_mutex_lock(&cacheLock);
+    int count = contactCount < maxContacts ? contactCount : maxContacts;
+    memcpy(list, contacts, (size_t)count * sizeof(User));
+    pthread_mutex_unlock(&cacheLock);
+    return count;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Copies the most recent cached messages of a conversation, oldest first.
+ *
+ * @param peer The other party of the conversation.
+ * @param lines Receives the mailbox lines, newline-terminated.
+ * @param size Size of lines.
+ * @param unread Receives the number of unread messages from the peer.
+ * @return int The number of lines copied.
+ */
+// <----------------------------------------------------------------> //
+int clientCacheConversation(int peer, char *lines, size_t size, int *unread)
+{
+    pthread_mutex_lock(&cacheLock);
+    *unread = 0;
+    size_t used = 0;
+    int first = messageCount;
+    int full = 0;
+    int i;
+    for (i = messageCount - 1; i >= 0; i--)
+    {
+        if (messages[i].peer != peer)
+        {
+            continue;
+        }
+        *unread += !messages[i].read;
+        size_t length = strlen(messages[i].line) + 1;
+        full = full || used + length >= size;
+        if (!full)
+        {
+            used += length;
+            first = i;
+        }
+    }
+    int count = 0;
+    used = 0;
+    for (i = first; i < messageCount; i++)
+    {
+        if (messages[i].peer == peer)
+        {
+            used += (size_t)sprintf(lines + used, "%s\n", messages[i].line);
+            count++;
+        }
+    }
+    if (size > 0)
+    {
+        lines[used] = '\0';
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return count;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Counts the cached unread messages of each conversation.
+ *
+ * @param peers Receives the peers with unread messages, in order of their first message.
+ * @param counts Receives the number of unread messages from each peer.
+ * @param maxPeers Size of peers and counts.
+ * @return int The number of peers filled in.
+ */
+// <----------------------------------------------------------------> //
+int clientCacheUnreadCounts(int *peers, int *counts, int maxPeers)
+{
+    pthread_mutex_lock(&cacheLock);
+    int peerCount = 0;
+    int i, j;
+    for (i = 0; i < messageCount; i++)
+    {
+        if (messages[i].read)
+        {
+            continue;
+        }
+        for (j = 0; j < peerCount && peers[j] != messages[i].peer; j++)
+        {
+            continue;
+        }
+        if (j == peerCount)
+        {
+            if (peerCount == maxPeers)
+            {
+                continue;
+            }
+            peers[peerCount] = messages[i].peer;
+            counts[peerCount++] = 0;
+        }
+        counts[j]++;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return peerCount;
+}
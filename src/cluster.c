@@ -0,0 +1,749 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "cluster.h"
+#include "log.h"
+#include "presence.h"
+#include "reactor.h"
+
+#define CLUSTER_LISTEN_BACKLOG 64
+
+// The outgoing link to one other node and the frames waiting for it
+typedef struct
+{
+    int index;
+    char host[64];
+    char port[8];
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    ClusterFrame *queue;
+    size_t queued;
+    size_t capacity;
+    ClusterFrame *unacked; // numbered frames written, or lost with a link, and not acknowledged yet
+    size_t unackedCount;
+    size_t unackedCapacity;
+    long long nextSequence;
+    long long acknowledged; // the last sequence the peer acknowledged
+    atomic_int connected;
+} ClusterPeer;
+
+static ClusterPeer peers[CLUSTER_MAX_NODES];
+static int nodeCount = 0;
+static int selfNode = -1;
+// Per user: the other node the user is logged in on, as link * CLUSTER_MAX_NODES + node
+// for the incoming link that announced it, -1 if none
+static atomic_int *routes = NULL;
+static atomic_int linkSerial;
+static atomic_llong handled[CLUSTER_MAX_NODES]; // per node: the last numbered frame received from it and handled
+static int routeCapacity = 0;
+static atomic_long remoteUsers;
+static pthread_mutex_t changedLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *changedBits = NULL; // per user: set while in changedIds
+static int32_t *changedIds = NULL;
+static int changedCount = 0;
+static ClusterReceiveFn clusterReceive;
+static void *clusterContext;
+
+static void clusterSleepMs(long milliseconds)
+{
+    struct timespec interval = {milliseconds / 1000, (milliseconds % 1000) * 1000000L};
+    nanosleep(&interval, NULL);
+}
+
+static int clusterIsNumbered(int kind)
+{
+    return kind == CLUSTER_DELIVER || kind == CLUSTER_REGISTERED;
+}
+
+static int clusterFramesAppend(ClusterFrame **frames, size_t *count, size_t *capacity, const ClusterFrame *frame)
+{
+    if (*count == *capacity)
+    {
+        size_t grownCapacity = *capacity > 0 ? *capacity * 2 : 16;
+        ClusterFrame *grown = realloc(*frames, grownCapacity * sizeof(ClusterFrame));
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        *frames = grown;
+        *capacity = grownCapacity;
+    }
+    (*frames)[(*count)++] = *frame;
+    return 0;
+}
+
+static int clusterWriteAll(int sock, const void *data, size_t length)
+{
+    const char *cursor = data;
+    while (length > 0)
+    {
+        ssize_t written = send(sock, cursor, length, MSG_NOSIGNAL);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        cursor += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+static int clusterConnect(const ClusterPeer *peer)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses;
+    if (getaddrinfo(peer->host, peer->port, &hints, &addresses) != 0)
+    {
+        return -1;
+    }
+    int sock = -1;
+    struct addrinfo *address;
+    for (address = addresses; address != NULL && sock < 0; address = address->ai_next)
+    {
+        sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (sock >= 0 && connect(sock, address->ai_addr, address->ai_addrlen) < 0)
+        {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (sock >= 0)
+    {
+        int enable = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+    return sock;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sends the greeting and the full list of local users to a new link.
+ *
+ * The peer may have restarted or dropped its routes to this node, so every
+ * link starts from a complete picture; later changes follow as deltas.
+ */
+// <----------------------------------------------------------------> //
+static int clusterSendHandshake(int sock)
+{
+    ClusterFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.kind = CLUSTER_HELLO;
+    frame.node = selfNode;
+    if (clusterWriteAll(sock, &frame, sizeof(frame)) < 0)
+    {
+        return -1;
+    }
+
+    frame.kind = CLUSTER_ROUTES;
+    frame.message.to = 0;
+    int userId;
+    for (userId = 0; userId < routeCapacity; userId++)
+    {
+        if (!presenceIsOnline(userId))
+        {
+            continue;
+        }
+        PresenceChange change = {userId, 1};
+        memcpy(frame.message.body + (size_t)frame.message.to * sizeof(change), &change, sizeof(change));
+        if (++frame.message.to == PRESENCE_CHANGES_PER_FRAME)
+        {
+            if (clusterWriteAll(sock, &frame, sizeof(frame)) < 0)
+            {
+                return -1;
+            }
+            frame.message.to = 0;
+        }
+    }
+    return frame.message.to > 0 ? clusterWriteAll(sock, &frame, sizeof(frame)) : 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Queues a frame for the outgoing link to a node.
+ *
+ * Numbered frames are queued while the link is down too and go out once
+ * it is back; other frames are only worth sending on a live link.
+ *
+ * @param message The frame's message, or NULL for an ACK.
+ * @param sequence The acknowledged sequence of an ACK; numbered frames get the link's next one.
+ */
+// <----------------------------------------------------------------> //
+static int clusterQueue(int node, int kind, const Message *message, long long sequence)
+{
+    if (node < 0 || node >= nodeCount || node == selfNode || (!clusterIsNumbered(kind) && !atomic_load(&peers[node].connected)))
+    {
+        return -1;
+    }
+    ClusterPeer *peer = &peers[node];
+    pthread_mutex_lock(&peer->lock);
+    if (kind == CLUSTER_ACK && peer->queued > 0 && peer->queue[peer->queued - 1].kind == CLUSTER_ACK)
+    {
+        // Acknowledgements are cumulative, so one waiting is enough
+        peer->queue[peer->queued - 1].sequence = sequence;
+        pthread_mutex_unlock(&peer->lock);
+        return 0;
+    }
+    ClusterFrame frame;
+    frame.kind = kind;
+    frame.node = selfNode;
+    frame.sequence = clusterIsNumbered(kind) ? peer->nextSequence + 1 : sequence;
+    if (message != NULL)
+    {
+        memcpy(&frame.message, message, sizeof(Message));
+    }
+    else
+    {
+        memset(&frame.message, 0, sizeof(Message));
+    }
+    if (clusterFramesAppend(&peer->queue, &peer->queued, &peer->capacity, &frame) < 0)
+    {
+        pthread_mutex_unlock(&peer->lock);
+        LOG_ERROR("Error growing cluster queue of node %d", node);
+        return -1;
+    }
+    if (clusterIsNumbered(kind))
+    {
+        peer->nextSequence++;
+    }
+    pthread_cond_signal(&peer->wake);
+    pthread_mutex_unlock(&peer->lock);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Puts the frames a peer has not acknowledged back at the head of its queue.
+ *
+ * Called with the peer's lock held once a new link is up; the peer drops
+ * the ones it had already handled.
+ */
+// <----------------------------------------------------------------> //
+static void clusterRequeueUnacked(ClusterPeer *peer)
+{
+    if (peer->unackedCount == 0)
+    {
+        return;
+    }
+    LOG_INFO("Resending %zu unacknowledged frames to node %d", peer->unackedCount, peer->index);
+    size_t i;
+    for (i = 0; i < peer->queued; i++)
+    {
+        if (clusterFramesAppend(&peer->unacked, &peer->unackedCount, &peer->unackedCapacity, &peer->queue[i]) < 0)
+        {
+            LOG_ERROR("Error requeueing frames for node %d, %zu dropped", peer->index, peer->queued - i);
+            break;
+        }
+    }
+    ClusterFrame *queue = peer->queue;
+    size_t capacity = peer->capacity;
+    peer->queue = peer->unacked;
+    peer->queued = peer->unackedCount;
+    peer->capacity = peer->unackedCapacity;
+    peer->unacked = queue;
+    peer->unackedCount = 0;
+    peer->unackedCapacity = capacity;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Owns the outgoing link to one peer: connects, then writes queued frames.
+ *
+ * Everything queued while the previous write was in progress goes out in
+ * a single write, so the link batches by itself as load grows. Numbered
+ * frames are kept until the peer acknowledges them and are written again,
+ * in order, on the next link if the current one fails first.
+ */
+// <----------------------------------------------------------------> //
+static void *clusterPeerLoop(void *arg)
+{
+    ClusterPeer *peer = arg;
+    int sock = -1;
+    ClusterFrame *batch = NULL;
+    size_t batchCapacity = 0;
+    while (1)
+    {
+        if (sock < 0)
+        {
+            sock = clusterConnect(peer);
+            if (sock < 0 || clusterSendHandshake(sock) < 0)
+            {
+                if (sock >= 0)
+                {
+                    close(sock);
+                    sock = -1;
+                }
+                clusterSleepMs(CLUSTER_RECONNECT_INTERVAL_MS);
+                continue;
+            }
+            pthread_mutex_lock(&peer->lock);
+            clusterRequeueUnacked(peer);
+            pthread_mutex_unlock(&peer->lock);
+            atomic_store(&peer->connected, 1);
+            LOG_INFO("Cluster link to node %d (%s:%s) up", peer->index, peer->host, peer->port);
+        }
+
+        pthread_mutex_lock(&peer->lock);
+        while (peer->queued == 0)
+        {
+            pthread_cond_wait(&peer->wake, &peer->lock);
+        }
+        ClusterFrame *frames = peer->queue;
+        size_t count = peer->queued;
+        size_t capacity = peer->capacity;
+        peer->queue = batch;
+        peer->capacity = batchCapacity;
+        peer->queued = 0;
+        pthread_mutex_unlock(&peer->lock);
+        batch = frames;
+        batchCapacity = capacity;
+
+        int failed = clusterWriteAll(sock, batch, count * sizeof(ClusterFrame)) < 0;
+        int error = errno;
+
+        pthread_mutex_lock(&peer->lock);
+        size_t i;
+        for (i = 0; i < count; i++)
+        {
+            if (clusterIsNumbered(batch[i].kind) && batch[i].sequence > peer->acknowledged &&
+                clusterFramesAppend(&peer->unacked, &peer->unackedCount, &peer->unackedCapacity, &batch[i]) < 0)
+            {
+                LOG_ERROR("Error keeping frame %lld for node %d until it is acknowledged", batch[i].sequence, peer->index);
+            }
+        }
+        pthread_mutex_unlock(&peer->lock);
+
+        if (failed)
+        {
+            LOG_WARN("Cluster link to node %d lost, unacknowledged frames are resent on reconnect: %s", peer->index,
+                     strerror(error));
+            atomic_store(&peer->connected, 0);
+            close(sock);
+            sock = -1;
+        }
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Forgets the frames a peer has acknowledged.
+ */
+// <----------------------------------------------------------------> //
+static void clusterAcknowledged(int node, long long sequence)
+{
+    ClusterPeer *peer = &peers[node];
+    pthread_mutex_lock(&peer->lock);
+    if (sequence > peer->acknowledged)
+    {
+        peer->acknowledged = sequence;
+    }
+    size_t done = 0;
+    while (done < peer->unackedCount && peer->unacked[done].sequence <= sequence)
+    {
+        done++;
+    }
+    memmove(peer->unacked, peer->unacked + done, (peer->unackedCount - done) * sizeof(ClusterFrame));
+    peer->unackedCount -= done;
+    pthread_mutex_unlock(&peer->lock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Applies a ROUTES frame received on one link.
+ *
+ * @param node The node the link comes from.
+ * @param route The value routes take for users the link announces.
+ * @param message The frame's message.
+ */
+// <----------------------------------------------------------------> //
+static void clusterApplyRoutes(int node, int route, const Message *message)
+{
+    int i;
+    for (i = 0; i < message->to && i < PRESENCE_CHANGES_PER_FRAME; i++)
+    {
+        PresenceChange change;
+        memcpy(&change, message->body + (size_t)i * sizeof(change), sizeof(change));
+        if (change.userId < 0 || change.userId >= routeCapacity)
+        {
+            continue;
+        }
+        if (change.online)
+        {
+            if (atomic_exchange(&routes[change.userId], route) < 0)
+            {
+                atomic_fetch_add(&remoteUsers, 1);
+            }
+        }
+        else
+        {
+            // The node logs the user out whichever of its links announced the login
+            int current = atomic_load(&routes[change.userId]);
+            while (current >= 0 && current % CLUSTER_MAX_NODES == node)
+            {
+                if (atomic_compare_exchange_weak(&routes[change.userId], &current, -1))
+                {
+                    atomic_fetch_sub(&remoteUsers, 1);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Reads frames from one incoming link until it closes.
+ *
+ * When the link goes down the users it announced are forgotten; they are
+ * announced again by the node's handshake once it is back. Users a newer
+ * link from the same node announced in the meantime are kept.
+ */
+// <----------------------------------------------------------------> //
+static void *clusterLinkLoop(void *arg)
+{
+    int sock = (int)(intptr_t)arg;
+    int node = -1;
+    int route = -1;
+    ClusterFrame frame;
+    while (recv(sock, &frame, sizeof(frame), MSG_WAITALL) == (ssize_t)sizeof(frame))
+    {
+        if (frame.kind == CLUSTER_HELLO)
+        {
+            if (frame.node < 0 || frame.node >= nodeCount || frame.node == selfNode)
+            {
+                LOG_WARN("Cluster link from unknown node %d rejected", frame.node);
+                break;
+            }
+            node = frame.node;
+            route = (int)((unsigned)atomic_fetch_add(&linkSerial, 1) % (INT_MAX / CLUSTER_MAX_NODES)) * CLUSTER_MAX_NODES + node;
+            LOG_INFO("Cluster link from node %d up", node);
+        }
+        else if (node < 0)
+        {
+            LOG_WARN("Cluster link sent frame %d before its greeting", frame.kind);
+            break;
+        }
+        else if (frame.kind == CLUSTER_ROUTES)
+        {
+            clusterApplyRoutes(node, route, &frame.message);
+        }
+        else if (clusterIsNumbered(frame.kind))
+        {
+            // A frame resent after a reconnect may have been handled already
+            if (frame.sequence > atomic_load(&handled[node]))
+            {
+                clusterReceive(node, frame.kind, &frame.message, clusterContext);
+                atomic_store(&handled[node], frame.sequence);
+            }
+            clusterQueue(node, CLUSTER_ACK, NULL, atomic_load(&handled[node]));
+        }
+        else if (frame.kind == CLUSTER_ACK)
+        {
+            clusterAcknowledged(node, frame.sequence);
+        }
+    }
+    close(sock);
+    if (node >= 0)
+    {
+        LOG_INFO("Cluster link from node %d down", node);
+        int userId;
+        for (userId = 0; userId < routeCapacity; userId++)
+        {
+            int expected = route;
+            if (atomic_compare_exchange_strong(&routes[userId], &expected, -1))
+            {
+                atomic_fetch_sub(&remoteUsers, 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *clusterListenLoop(void *arg)
+{
+    int listenSock = (int)(intptr_t)arg;
+    while (1)
+    {
+        int sock = accept(listenSock, NULL, NULL);
+        if (sock < 0)
+        {
+            if (errno != EINTR)
+            {
+                LOG_ERROR("Cluster accept error: %s", strerror(errno));
+                clusterSleepMs(CLUSTER_RECONNECT_INTERVAL_MS);
+            }
+            continue;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, clusterLinkLoop, (void *)(intptr_t)sock) != 0)
+        {
+            LOG_ERROR("Cluster link thread create error");
+            close(sock);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sends the local users whose presence changed to every peer, one batch per interval.
+ */
+// <----------------------------------------------------------------> //
+static void *clusterAnnounceLoop(void *arg)
+{
+    (void)arg;
+    int32_t *announcing = malloc((size_t)routeCapacity * sizeof(int32_t));
+    if (announcing == NULL)
+    {
+        LOG_ERROR("Error allocating cluster announcements");
+        return NULL;
+    }
+    while (1)
+    {
+        clusterSleepMs(CLUSTER_ANNOUNCE_INTERVAL_MS);
+        pthread_mutex_lock(&changedLock);
+        int count = changedCount;
+        memcpy(announcing, changedIds, (size_t)count * sizeof(int32_t));
+        int i;
+        for (i = 0; i < count; i++)
+        {
+            changedBits[announcing[i] / 64] &= ~(1ull << (announcing[i] % 64));
+        }
+        changedCount = 0;
+        pthread_mutex_unlock(&changedLock);
+
+        Message message;
+        memset(&message, 0, sizeof(message));
+        for (i = 0; i < count; i++)
+        {
+            PresenceChange change = {announcing[i], presenceIsOnline(announcing[i])};
+            memcpy(message.body + (size_t)message.to * sizeof(change), &change, sizeof(change));
+            if (++message.to == PRESENCE_CHANGES_PER_FRAME || i + 1 == count)
+            {
+                clusterBroadcast(CLUSTER_ROUTES, &message);
+                message.to = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int clusterParseNodes(const char *nodes)
+{
+    char *copy = strdup(nodes);
+    if (copy == NULL)
+    {
+        return -1;
+    }
+    char *saveptr = NULL;
+    char *item;
+    for (item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr))
+    {
+        char *colon = strrchr(item, ':');
+        if (nodeCount == CLUSTER_MAX_NODES || colon == NULL || colon == item ||
+            (size_t)(colon - item) >= sizeof(peers[0].host) || strlen(colon + 1) >= sizeof(peers[0].port))
+        {
+            LOG_ERROR("Invalid cluster node \"%s\"; expected host:port, at most %d nodes", item, CLUSTER_MAX_NODES);
+            free(copy);
+            return -1;
+        }
+        ClusterPeer *peer = &peers[nodeCount];
+        peer->index = nodeCount;
+        memcpy(peer->host, item, (size_t)(colon - item));
+        peer->host[colon - item] = '\0';
+        strcpy(peer->port, colon + 1);
+        nodeCount++;
+    }
+    free(copy);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Joins a cluster of server processes.
+ *
+ * Every node listens for the other nodes on its own entry of the node list
+ * and keeps one persistent outgoing link to each of them. Nodes tell each
+ * other which users are logged in on them, so each keeps a table from user
+ * to node and can forward messages to users logged in elsewhere.
+ *
+ * @param nodeId This node's index in the node list.
+ * @param nodes The cluster links of all nodes, "host:port,host:port,...".
+ * @param userCapacity The number of user IDs.
+ * @param receive Called with messages forwarded by other nodes.
+ * @param context Passed through to receive.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int clusterStart(int nodeId, const char *nodes, int userCapacity, ClusterReceiveFn receive, void *context)
+{
+    if (clusterParseNodes(nodes) < 0)
+    {
+        return -1;
+    }
+    if (nodeId < 0 || nodeId >= nodeCount)
+    {
+        LOG_ERROR("Cluster node %d is not in the node list of %d nodes", nodeId, nodeCount);
+        return -1;
+    }
+    routes = malloc((size_t)userCapacity * sizeof(atomic_int));
+    changedBits = calloc(((size_t)userCapacity + 63) / 64, sizeof(uint64_t));
+    changedIds = malloc((size_t)userCapacity * sizeof(int32_t));
+    if (routes == NULL || changedBits == NULL || changedIds == NULL)
+    {
+        LOG_ERROR("Error allocating cluster routes: %s", strerror(errno));
+        return -1;
+    }
+    int i;
+    for (i = 0; i < userCapacity; i++)
+    {
+        atomic_init(&routes[i], -1);
+    }
+    routeCapacity = userCapacity;
+    clusterReceive = receive;
+    clusterContext = context;
+    selfNode = nodeId;
+
+    int listenSock = reactorOpenListener(atoi(peers[selfNode].port), CLUSTER_LISTEN_BACKLOG, 0);
+    if (listenSock < 0)
+    {
+        return -1;
+    }
+    for (i = 0; i < nodeCount; i++)
+    {
+        pthread_mutex_init(&peers[i].lock, NULL);
+        pthread_cond_init(&peers[i].wake, NULL);
+        // Numbers from a restarted node start above the ones it used before
+        peers[i].nextSequence = (long long)time(NULL) << 32;
+    }
+    pthread_t thread;
+    for (i = 0; i < nodeCount; i++)
+    {
+        if (i == selfNode)
+        {
+            continue;
+        }
+        if (pthread_create(&thread, NULL, clusterPeerLoop, &peers[i]) != 0)
+        {
+            LOG_ERROR("Cluster link thread create error");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    if (pthread_create(&thread, NULL, clusterListenLoop, (void *)(intptr_t)listenSock) != 0 ||
+        pthread_detach(thread) != 0 ||
+        pthread_create(&thread, NULL, clusterAnnounceLoop, NULL) != 0 ||
+        pthread_detach(thread) != 0)
+    {
+        LOG_ERROR("Cluster thread create error");
+        return -1;
+    }
+    LOG_INFO("Cluster node %d of %d, links on port %s", selfNode, nodeCount, peers[selfNode].port);
+    return 0;
+}
+
+int clusterEnabled(void)
+{
+    return selfNode >= 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns the other node a user is logged in on, or -1; lock-free.
+ */
+// <----------------------------------------------------------------> //
+int clusterRouteOf(int userId)
+{
+    if (userId < 0 || userId >= routeCapacity)
+    {
+        return -1;
+    }
+    int route = atomic_load_explicit(&routes[userId], memory_order_relaxed);
+    return route < 0 ? -1 : route % CLUSTER_MAX_NODES;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Marks a local user whose presence changed for the next announcement.
+ */
+// <----------------------------------------------------------------> //
+void clusterUserChanged(int userId)
+{
+    if (userId < 0 || userId >= routeCapacity)
+    {
+        return;
+    }
+    pthread_mutex_lock(&changedLock);
+    if (!((changedBits[userId / 64] >> (userId % 64)) & 1))
+    {
+        changedBits[userId / 64] |= 1ull << (userId % 64);
+        changedIds[changedCount++] = userId;
+    }
+    pthread_mutex_unlock(&changedLock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Queues a frame for another node.
+ *
+ * DELIVER and REGISTERED frames are numbered and written again after a
+ * link failure until the node acknowledges them, so once queued they
+ * arrive even if the link is down or drops; the node handles each one once.
+ *
+ * @return int 0 if queued, -1 if the node is unknown, or the frame is not
+ * numbered and the link is down.
+ */
+// <----------------------------------------------------------------> //
+int clusterForward(int node, int kind, const Message *message)
+{
+    return clusterQueue(node, kind, message, 0);
+}
+
+void clusterBroadcast(int kind, const Message *message)
+{
+    int node;
+    for (node = 0; node < nodeCount; node++)
+    {
+        if (node != selfNode)
+        {
+            clusterForward(node, kind, message);
+        }
+    }
+}
+
+long clusterLinksUp(void)
+{
+    long count = 0;
+    int node;
+    for (node = 0; node < nodeCount; node++)
+    {
+        count += node != selfNode && atomic_load(&peers[node].connected);
+    }
+    return count;
+}
+
+long clusterRemoteUsers(void)
+{
+    return atomic_load(&remoteUsers);
+}
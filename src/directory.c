@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "directory.h"
+#include "log.h"
+#include "state.h"
+#include "storage.h"
+
+#define DIRECTORY_KEY_SIZE (REGISTRATION_BUFFER_SIZE - 1)
+#define DIRECTORY_RECENT_LIMIT 4096 // registrations kept aside before they are merged into the sorted index
+#define DIRECTORY_SCAN_LIMIT 256    // index entries examined per lookup
+#define DIRECTORY_MAX_QUERY_TERMS 4
+
+typedef enum
+{
+    DIRECTORY_FIELD_USERNAME,
+    DIRECTORY_FIELD_NAME,
+    DIRECTORY_FIELD_SURNAME,
+    DIRECTORY_FIELD_PHONE,
+    DIRECTORY_FIELD_COUNT
+} DirectoryField;
+
+// One searchable field of one user; the index is sorted by key, then user
+typedef struct
+{
+    char key[DIRECTORY_KEY_SIZE]; // normalised field, zero padded
+    uint8_t field;
+    int32_t userId;
+} DirectoryEntry;
+
+typedef struct
+{
+    int userId;
+    int rank; // lower is better
+} DirectoryCandidate;
+
+static pthread_rwlock_t directoryLock = PTHREAD_RWLOCK_INITIALIZER;
+static User *records = NULL; // indexed by user ID, userId -1 when unregistered
+static int recordCapacity = 0;
+static DirectoryEntry *entries = NULL;
+static size_t entryCount = 0;
+static size_t entryCapacity = 0;
+static DirectoryEntry recent[DIRECTORY_RECENT_LIMIT];
+static size_t recentCount = 0;
+
+static const char *directoryField(const User *user, int field)
+{
+    switch (field)
+    {
+    case DIRECTORY_FIELD_USERNAME:
+        return user->username;
+    case DIRECTORY_FIELD_NAME:
+        return user->name;
+    case DIRECTORY_FIELD_SURNAME:
+        return user->surname;
+    default:
+        return user->phoneNumber;
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Reduces text to its searchable form.
+ *
+ * ASCII letters are lower-cased, digits and bytes of multi-byte UTF-8
+ * sequences are kept, everything else (spaces, dashes, '+') is dropped so
+ * "+90 555-1234" and "905551234" compare equal.
+ *
+ * @param text The text; read up to its terminator or maxLength bytes.
+ * @param maxLength The most bytes of text to read.
+ * @param key Receives the result, zero padded to DIRECTORY_KEY_SIZE bytes.
+ * @return size_t The length of the key.
+ */
+// <----------------------------------------------------------------> //
+static size_t directoryNormalize(const char *text, size_t maxLength, char *key)
+{
+    size_t length = 0;
+    size_t i;
+    memset(key, 0, DIRECTORY_KEY_SIZE);
+    for (i = 0; i < maxLength && text[i] != '\0' && length < DIRECTORY_KEY_SIZE; i++)
+    {
+        unsigned char c = (unsigned char)text[i];
+        if (c >= 'A' && c <= 'Z')
+        {
+            key[length++] = (char)(c - 'A' + 'a');
+        }
+        else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80)
+        {
+            key[length++] = (char)c;
+        }
+    }
+    return length;
+}
+
+static int directoryCompareEntries(const void *a, const void *b)
+{
+    const DirectoryEntry *left = a;
+    const DirectoryEntry *right = b;
+    int order = memcmp(left->key, right->key, DIRECTORY_KEY_SIZE);
+    if (order != 0)
+    {
+        return order;
+    }
+    return (left->userId > right->userId) - (left->userId < right->userId);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns the first entry whose key is not below key.
+ */
+// <----------------------------------------------------------------> //
+static size_t directoryLowerBound(const DirectoryEntry *sorted, size_t count, const char *key)
+{
+    size_t low = 0;
+    size_t high = count;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (memcmp(sorted[middle].key, key, DIRECTORY_KEY_SIZE) < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Builds the index entries of a user, one per non-empty field.
+ *
+ * @return int The number of entries written.
+ */
+// <----------------------------------------------------------------> //
+static int directoryUserEntries(const User *user, DirectoryEntry *userEntries)
+{
+    int count = 0;
+    int field;
+    for (field = 0; field < DIRECTORY_FIELD_COUNT; field++)
+    {
+        DirectoryEntry *entry = &userEntries[count];
+        if (directoryNormalize(directoryField(user, field), REGISTRATION_BUFFER_SIZE, entry->key) > 0)
+        {
+            entry->field = (uint8_t)field;
+            entry->userId = user->userId;
+            count++;
+        }
+    }
+    return count;
+}
+
+static int directoryReserve(size_t count)
+{
+    if (count <= entryCapacity)
+    {
+        return 0;
+    }
+    size_t capacity = entryCapacity > 0 ? entryCapacity : 1024;
+    while (capacity < count)
+    {
+        capacity *= 2;
+    }
+    DirectoryEntry *grown = realloc(entries, capacity * sizeof(DirectoryEntry));
+    if (grown == NULL)
+    {
+        LOG_ERROR("Error growing user directory: %s", strerror(errno));
+        return -1;
+    }
+    entries = grown;
+    entryCapacity = capacity;
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Merges the recent registrations into the sorted index, back to front and in place.
+ */
+// <----------------------------------------------------------------> //
+static void directoryMergeRecent(void)
+{
+    if (recentCount == 0 || directoryReserve(entryCount + recentCount) < 0)
+    {
+        return;
+    }
+    size_t from = entryCount;
+    size_t pending = recentCount;
+    size_t to = entryCount + recentCount;
+    while (pending > 0)
+    {
+        if (from > 0 && directoryCompareEntries(&entries[from - 1], &recent[pending - 1]) > 0)
+        {
+            entries[--to] = entries[--from];
+        }
+        else
+        {
+            entries[--to] = recent[--pending];
+        }
+    }
+    entryCount += recentCount;
+    recentCount = 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Loads the registered users and sorts their fields into the prefix index.
+ *
+ * @param userCapacity The number of user IDs.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int directoryInit(int userCapacity)
+{
+    records = malloc((size_t)userCapacity * sizeof(User));
+    if (records == NULL)
+    {
+        LOG_ERROR("Error allocating user directory: %s", strerror(errno));
+        return -1;
+    }
+    int i;
+    for (i = 0; i < userCapacity; i++)
+    {
+        records[i].userId = -1;
+    }
+    recordCapacity = userCapacity;
+
+    FILE *file = fopen(STORAGE_USER_LIST_PATH, "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    int id;
+    char username[1024], phoneNumber[1024], name[1024], surname[1024];
+    while (fscanf(file, "%d,%[^,],%[^,],%[^,],%[^\n]\n", &id, username, phoneNumber, name, surname) == 5)
+    {
+        if (id < 0 || id >= recordCapacity)
+        {
+            continue;
+        }
+        User *user = &records[id];
+        memset(user, 0, sizeof(User));
+        user->userId = id;
+        strncpy(user->username, username, sizeof(user->username) - 1);
+        strncpy(user->phoneNumber, phoneNumber, sizeof(user->phoneNumber) - 1);
+        strncpy(user->name, name, sizeof(user->name) - 1);
+        strncpy(user->surname, surname, sizeof(user->surname) - 1);
+        if (directoryReserve(entryCount + DIRECTORY_FIELD_COUNT) < 0)
+        {
+            break;
+        }
+        entryCount += (size_t)directoryUserEntries(user, &entries[entryCount]);
+    }
+    fclose(file);
+
+    // Re-registrations leave entries of replaced fields behind; lookups skip them
+    qsort(entries, entryCount, sizeof(DirectoryEntry), directoryCompareEntries);
+    LOG_INFO("User directory indexed %zu fields", entryCount);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Adds or replaces a user in the directory.
+ *
+ * New fields go to a small sorted side index that is merged into the main
+ * one once it fills up, so a registration never moves the whole index.
+ */
+// <----------------------------------------------------------------> //
+void directoryUserRegistered(const User *user)
+{
+    if (user->userId < 0 || user->userId >= recordCapacity)
+    {
+        return;
+    }
+    User copy = *user;
+    copy.username[sizeof(copy.username) - 1] = '\0';
+    copy.phoneNumber[sizeof(copy.phoneNumber) - 1] = '\0';
+    copy.name[sizeof(copy.name) - 1] = '\0';
+    copy.surname[sizeof(copy.surname) - 1] = '\0';
+    DirectoryEntry userEntries[DIRECTORY_FIELD_COUNT];
+    int count = directoryUserEntries(&copy, userEntries);
+
+    pthread_rwlock_wrlock(&directoryLock);
+    records[copy.userId] = copy;
+    if (recentCount + (size_t)count > DIRECTORY_RECENT_LIMIT)
+    {
+        directoryMergeRecent();
+    }
+    int i;
+    for (i = 0; i < count && recentCount < DIRECTORY_RECENT_LIMIT; i++)
+    {
+        size_t position = recentCount;
+        while (position > 0 && directoryCompareEntries(&recent[position - 1], &userEntries[i]) > 0)
+        {
+            position--;
+        }
+        memmove(&recent[position + 1], &recent[position], (recentCount - position) * sizeof(DirectoryEntry));
+        recent[position] = userEntries[i];
+        recentCount++;
+    }
+    pthread_rwlock_unlock(&directoryLock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Checks that every term is a prefix of some field of a user.
+ */
+// <----------------------------------------------------------------> //
+static int directoryMatchesTerms(const User *user, char terms[][DIRECTORY_KEY_SIZE], const size_t *termLengths, int termCount)
+{
+    int i;
+    for (i = 0; i < termCount; i++)
+    {
+        int matched = 0;
+        int field;
+        for (field = 0; field < DIRECTORY_FIELD_COUNT && !matched; field++)
+        {
+            char key[DIRECTORY_KEY_SIZE];
+            directoryNormalize(directoryField(user, field), REGISTRATION_BUFFER_SIZE, key);
+            matched = memcmp(key, terms[i], termLengths[i]) == 0;
+        }
+        if (!matched)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Finds registered users by the start of their username, name, surname or phone number.
+ *
+ * The longest query term is looked up in the sorted index and at most
+ * DIRECTORY_SCAN_LIMIT entries from there on are examined, so the cost does
+ * not grow with the number of users. Further terms ("ali yil") must each
+ * start some field of a match. Contacts of the searching user come first,
+ * then users with a field equal to the term, then the rest in key order.
+ *
+ * @param userId The user searching; their contacts are ranked first.
+ * @param query The text typed so far.
+ * @param matches Receives the matching users.
+ * @param maxMatches The capacity of matches.
+ * @return int The number of matches.
+ */
+// <----------------------------------------------------------------> //
+int directoryLookup(int userId, const char *query, User *matches, int maxMatches)
+{
+    char terms[DIRECTORY_MAX_QUERY_TERMS][DIRECTORY_KEY_SIZE];
+    size_t termLengths[DIRECTORY_MAX_QUERY_TERMS];
+    int termCount = 0;
+    int longest = 0;
+    const char *cursor = query;
+    while (*cursor != '\0' && termCount < DIRECTORY_MAX_QUERY_TERMS)
+    {
+        size_t span = strcspn(cursor, " \t,");
+        if (span > 0)
+        {
+            termLengths[termCount] = directoryNormalize(cursor, span, terms[termCount]);
+            if (termLengths[termCount] > 0)
+            {
+                if (termLengths[termCount] > termLengths[longest])
+                {
+                    longest = termCount;
+                }
+                termCount++;
+            }
+        }
+        cursor += span;
+        cursor += strspn(cursor, " \t,");
+    }
+    if (termCount == 0 || maxMatches <= 0)
+    {
+        return 0;
+    }
+
+    DirectoryCandidate candidates[DIRECTORY_SCAN_LIMIT];
+    int candidateCount = 0;
+    pthread_rwlock_rdlock(&directoryLock);
+    const char *scanKey = terms[longest];
+    size_t scanLength = termLengths[longest];
+    size_t mainIndex = directoryLowerBound(entries, entryCount, scanKey);
+    size_t sideIndex = directoryLowerBound(recent, recentCount, scanKey);
+    int examined;
+    for (examined = 0; examined < DIRECTORY_SCAN_LIMIT; examined++)
+    {
+        // Walk both sorted indexes as one while their keys start with the term
+        int mainMatches = mainIndex < entryCount && memcmp(entries[mainIndex].key, scanKey, scanLength) == 0;
+        int sideMatches = sideIndex < recentCount && memcmp(recent[sideIndex].key, scanKey, scanLength) == 0;
+        const DirectoryEntry *entry;
+        if (mainMatches && (!sideMatches || directoryCompareEntries(&entries[mainIndex], &recent[sideIndex]) <= 0))
+        {
+            entry = &entries[mainIndex++];
+        }
+        else if (sideMatches)
+        {
+            entry = &recent[sideIndex++];
+        }
+        else
+        {
+            break;
+        }
+
+        const User *user = &records[entry->userId];
+        char current[DIRECTORY_KEY_SIZE];
+        directoryNormalize(directoryField(user, entry->field), REGISTRATION_BUFFER_SIZE, current);
+        if (user->userId != entry->userId || memcmp(current, entry->key, DIRECTORY_KEY_SIZE) != 0)
+        {
+            continue; // the field was replaced by a later registration
+        }
+        if (termCount > 1 && !directoryMatchesTerms(user, terms, termLengths, termCount))
+        {
+            continue;
+        }
+
+        int exact = scanLength == DIRECTORY_KEY_SIZE || entry->key[scanLength] == '\0';
+        int rank = (stateHasContact(userId, entry->userId) ? 0 : 2) + (exact ? 0 : 1);
+        int i;
+        for (i = 0; i < candidateCount && candidates[i].userId != entry->userId; i++)
+        {
+        }
+        if (i < candidateCount)
+        {
+            if (rank < candidates[i].rank)
+            {
+                candidates[i].rank = rank;
+            }
+            continue;
+        }
+        candidates[candidateCount].userId = entry->userId;
+        candidates[candidateCount].rank = rank;
+        candidateCount++;
+    }
+
+    // Stable selection keeps key order within a rank
+    int matchCount = 0;
+    int rank;
+    for (rank = 0; rank < 4 && matchCount < maxMatches; rank++)
+    {
+        int i;
+        for (i = 0; i < candidateCount && matchCount < maxMatches; i++)
+        {
+            if (candidates[i].rank == rank)
+            {
+                matches[matchCount++] = records[candidates[i].userId];
+            }
+        }
+    }
+    pthread_rwlock_unlock(&directoryLock);
+    return matchCount;
+}
+
+long directoryEntryCount(void)
+{
+    pthread_rwlock_rdlock(&directoryLock);
+    long count = (long)(entryCount + recentCount);
+    pthread_rwlock_unlock(&directoryLock);
+    return count;
+}
@@ -0,0 +1,463 @@
+#define _GNU_SOURCE // pthread_setaffinity_np
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "dispatch.h"
+#include "log.h"
+#include "trace.h"
+
+#define DISPATCH_MAX_SHARDS 256
+#define DISPATCH_ORDER_SLOTS 64 // users of a shard are hashed onto this many ordering slots
+
+typedef struct DispatchTask
+{
+    _Atomic(struct DispatchTask *) next;
+    DispatchTaskFn function; // NULL for a request
+    void *argument;
+    int sock;
+    unsigned generation; // of the connection on sock when the request arrived
+    int slot;            // the ordering slot of the task's user
+    TraceContext trace; // the sampled request this task belongs to, if any
+    Message message;    // only allocated for requests
+} DispatchTask;
+
+// A lock-free MPSC queue of tasks
+typedef struct
+{
+    _Atomic(DispatchTask *) head; // producers push here
+    DispatchTask *tail;           // only the shard thread pops
+    DispatchTask stub;
+    atomic_long depth;
+} DispatchQueue;
+
+// One shard: a thread that owns a subset of the users and a queue per priority class feeding it
+typedef struct
+{
+    DispatchQueue queues[DISPATCH_CLASS_COUNT];
+    int credits[DISPATCH_CLASS_COUNT]; // tasks each class may still run this round; shard thread only
+    atomic_int pending[DISPATCH_CLASS_COUNT][DISPATCH_ORDER_SLOTS]; // queued tasks per class and user slot
+    atomic_int parked; // 1 while the shard thread waits for the eventfd
+    int wakeFd;
+    atomic_long depth;
+    int index;
+} DispatchShard;
+
+// Tasks a class may run per round while other classes have work
+static const int dispatchWeights[DISPATCH_CLASS_COUNT] = {
+    [DISPATCH_INTERACTIVE] = 16,
+    [DISPATCH_BACKGROUND] = 4,
+    [DISPATCH_BULK] = 1,
+};
+
+static DispatchShard *shards = NULL;
+static int shardCount = 0;
+static DispatchHandlerFn dispatchHandler;
+static void *dispatchContext;
+static _Thread_local int currentShard = -1;
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Pushes a task; lock-free, safe from any thread.
+ */
+// <----------------------------------------------------------------> //
+static void dispatchPush(DispatchQueue *queue, DispatchTask *task)
+{
+    atomic_store_explicit(&task->next, NULL, memory_order_relaxed);
+    DispatchTask *previous = atomic_exchange_explicit(&queue->head, task, memory_order_acq_rel);
+    atomic_store_explicit(&previous->next, task, memory_order_release);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Pops the oldest task; called by the shard thread only.
+ *
+ * @return DispatchTask* The task, or NULL if the queue is empty or a push
+ * is halfway done (the pushing thread wakes the shard once it completes).
+ */
+// <----------------------------------------------------------------> //
+static DispatchTask *dispatchPop(DispatchQueue *queue)
+{
+    DispatchTask *tail = queue->tail;
+    DispatchTask *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &queue->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+    {
+        return NULL;
+    }
+    dispatchPush(queue, &queue->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Queues a task of a user on its shard, behind that user's tasks of higher classes.
+ *
+ * A task is moved up to the highest class still holding a task of the same
+ * user, so a read never overtakes the user's earlier change once the
+ * interactive credits of a round run out. Users sharing an ordering slot
+ * only cost each other a promotion, never the order.
+ */
+// <----------------------------------------------------------------> //
+static void dispatchEnqueue(DispatchShard *shard, int userId, DispatchClass priority, DispatchTask *task)
+{
+    task->slot = (int)((uint32_t)userId % DISPATCH_ORDER_SLOTS);
+    int higher;
+    for (higher = 0; higher < (int)priority; higher++)
+    {
+        if (atomic_load(&shard->pending[higher][task->slot]) > 0)
+        {
+            priority = (DispatchClass)higher;
+            break;
+        }
+    }
+    atomic_fetch_add(&shard->pending[priority][task->slot], 1);
+    atomic_fetch_add_explicit(&shard->depth, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->queues[priority].depth, 1, memory_order_relaxed);
+    dispatchPush(&shard->queues[priority], task);
+    atomic_thread_fence(memory_order_seq_cst); // pairs with the fence in dispatchShardLoop
+    if (atomic_exchange(&shard->parked, 0) == 1)
+    {
+        uint64_t one = 1;
+        if (write(shard->wakeFd, &one, sizeof(one)) < 0)
+        {
+            LOG_ERROR("Error waking shard %d: %s", shard->index, strerror(errno));
+        }
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Picks the next task by weighted fair scheduling over the priority classes.
+ *
+ * Each round, every class may run up to its weight in tasks, and the
+ * highest class that has both work and credit left always goes next. An
+ * interactive request thus waits for the task running when it arrives, not
+ * for a batch of reads, while background and bulk work still get their
+ * share of every round under sustained interactive load.
+ *
+ * @return DispatchTask* The task, or NULL if no queue has one ready.
+ */
+// <----------------------------------------------------------------> //
+static DispatchTask *dispatchNext(DispatchShard *shard)
+{
+    int round;
+    for (round = 0; round < 2; round++)
+    {
+        int priority;
+        for (priority = 0; priority < DISPATCH_CLASS_COUNT; priority++)
+        {
+            if (shard->credits[priority] > 0)
+            {
+                DispatchTask *task = dispatchPop(&shard->queues[priority]);
+                if (task != NULL)
+                {
+                    shard->credits[priority]--;
+                    atomic_fetch_sub(&shard->pending[priority][task->slot], 1);
+                    atomic_fetch_sub_explicit(&shard->queues[priority].depth, 1, memory_order_relaxed);
+                    return task;
+                }
+            }
+        }
+        // Every class with work has spent its credit: start a new round
+        for (priority = 0; priority < DISPATCH_CLASS_COUNT; priority++)
+        {
+            shard->credits[priority] = dispatchWeights[priority];
+        }
+    }
+    return NULL;
+}
+
+static void *dispatchShardLoop(void *arg)
+{
+    DispatchShard *shard = arg;
+    currentShard = shard->index;
+    while (1)
+    {
+        DispatchTask *task = dispatchNext(shard);
+        if (task == NULL)
+        {
+            // Announce the wait before the final check so a concurrent push cannot be missed
+            atomic_store(&shard->parked, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            task = dispatchNext(shard);
+            if (task == NULL)
+            {
+                uint64_t wakeups;
+                if (read(shard->wakeFd, &wakeups, sizeof(wakeups)) < 0 && errno != EINTR)
+                {
+                    LOG_ERROR("Error waiting on shard %d: %s", shard->index, strerror(errno));
+                }
+                continue;
+            }
+            atomic_store(&shard->parked, 0);
+        }
+        atomic_fetch_sub_explicit(&shard->depth, 1, memory_order_relaxed);
+
+        traceResume(&task->trace);
+        if (task->function != NULL)
+        {
+            uint64_t tracedAt = traceSpanBegin();
+            task->function(task->argument);
+            traceSpanEnd("shard_task", tracedAt);
+        }
+        else
+        {
+            dispatchHandler(task->sock, task->generation, &task->message, dispatchContext);
+        }
+        traceFinish();
+        free(task);
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Starts one shard thread per requested core.
+ *
+ * Every user is owned by exactly one shard, and everything that changes a
+ * user's files or state runs on that shard's thread. Requests for the same
+ * user are therefore serialised without locks, while different users are
+ * handled in parallel.
+ *
+ * @param count The number of shards; 0 for one per online core.
+ * @param handler The function that handles one request.
+ * @param context Passed through to the handler.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int dispatchStart(int count, DispatchHandlerFn handler, void *context)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+    {
+        cores = 1;
+    }
+    if (count <= 0)
+    {
+        count = (int)cores;
+    }
+    if (count > DISPATCH_MAX_SHARDS)
+    {
+        count = DISPATCH_MAX_SHARDS;
+    }
+
+    dispatchHandler = handler;
+    dispatchContext = context;
+    shards = calloc((size_t)count, sizeof(DispatchShard));
+    if (shards == NULL)
+    {
+        LOG_ERROR("Error allocating shards: %s", strerror(errno));
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        DispatchShard *shard = &shards[i];
+        shard->index = i;
+        int priority;
+        for (priority = 0; priority < DISPATCH_CLASS_COUNT; priority++)
+        {
+            DispatchQueue *queue = &shard->queues[priority];
+            atomic_store(&queue->stub.next, NULL);
+            atomic_store(&queue->head, &queue->stub);
+            queue->tail = &queue->stub;
+        }
+        shard->wakeFd = eventfd(0, EFD_CLOEXEC);
+        if (shard->wakeFd < 0)
+        {
+            LOG_ERROR("Error creating shard %d eventfd: %s", i, strerror(errno));
+            return -1;
+        }
+    }
+    shardCount = count;
+
+    for (i = 0; i < count; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, dispatchShardLoop, &shards[i]) != 0)
+        {
+            LOG_ERROR("Dispatch shard %d create error", i);
+            return -1;
+        }
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % cores, &cpus);
+        pthread_setaffinity_np(thread, sizeof(cpus), &cpus); // best effort
+        pthread_detach(thread);
+    }
+    LOG_INFO("Started %d shards on %ld cores", count, cores);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns the shard that owns a user.
+ */
+// <----------------------------------------------------------------> //
+int dispatchShardOf(int userId)
+{
+    return (int)(((uint32_t)userId * 2654435761u >> 8) % (uint32_t)shardCount);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Queues a request on the shard that owns a user.
+ *
+ * Requests for one user run in arrival order: a request may overtake the
+ * same user's requests of lower classes, but is queued behind those of
+ * higher ones (see dispatchEnqueue()). Requests
+ * for users on other shards run concurrently and may complete in any order.
+ *
+ * @param userId The user the request acts on.
+ * @param sock The socket the request arrived on.
+ * @param generation The generation of the connection on sock, handed back to the handler.
+ * @param message The request; copied.
+ * @param priority The request's class.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int dispatchSubmit(int userId, int sock, unsigned generation, const Message *message, DispatchClass priority)
+{
+    if (shardCount == 0)
+    {
+        return -1;
+    }
+    DispatchTask *task = malloc(sizeof(DispatchTask));
+    if (task == NULL)
+    {
+        return -1;
+    }
+    task->function = NULL;
+    task->argument = NULL;
+    task->sock = sock;
+    task->generation = generation;
+    traceHandOff(&task->trace);
+    memcpy(&task->message, message, sizeof(Message));
+    dispatchEnqueue(&shards[dispatchShardOf(userId)], userId, priority, task);
+    return 0;
+}
+
+static int dispatchQueueFunction(int userId, DispatchClass priority, DispatchTaskFn function, void *argument)
+{
+    DispatchTask *task = malloc(offsetof(DispatchTask, message));
+    if (task == NULL)
+    {
+        return -1;
+    }
+    task->function = function;
+    task->argument = argument;
+    task->sock = -1;
+    task->generation = 0;
+    traceHandOff(&task->trace);
+    dispatchEnqueue(&shards[dispatchShardOf(userId)], userId, priority, task);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Runs a function on the shard that owns a user.
+ *
+ * This is how a shard changes state of a user it does not own. When the
+ * caller already is the owning shard the function runs immediately;
+ * otherwise it is queued as interactive work.
+ *
+ * @param userId The user whose state the function changes.
+ * @param function The function; it owns argument.
+ * @param argument Passed to the function.
+ * @return int 0 on success, -1 on error (the function did not run).
+ */
+// <----------------------------------------------------------------> //
+int dispatchPost(int userId, DispatchTaskFn function, void *argument)
+{
+    if (shardCount == 0)
+    {
+        return -1;
+    }
+    if (dispatchShardOf(userId) == currentShard)
+    {
+        function(argument);
+        return 0;
+    }
+    return dispatchQueueFunction(userId, DISPATCH_INTERACTIVE, function, argument);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Queues a function on the shard that owns a user, behind the tasks already waiting.
+ *
+ * Unlike dispatchPost() it never runs the function immediately, so a long
+ * job can do a slice of its work and yield the shard to the requests that
+ * arrived meanwhile. Such jobs are bulk work and queue in that class.
+ *
+ * @return int 0 on success, -1 on error (the function did not run).
+ */
+// <----------------------------------------------------------------> //
+int dispatchYield(int userId, DispatchTaskFn function, void *argument)
+{
+    if (shardCount == 0)
+    {
+        return -1;
+    }
+    return dispatchQueueFunction(userId, DISPATCH_BULK, function, argument);
+}
+
+long dispatchQueueDepth(void)
+{
+    long depth = 0;
+    int i;
+    for (i = 0; i < shardCount; i++)
+    {
+        depth += atomic_load_explicit(&shards[i].depth, memory_order_relaxed);
+    }
+    return depth;
+}
+
+long dispatchShardQueueDepth(int userId)
+{
+    if (shardCount == 0)
+    {
+        return 0;
+    }
+    return atomic_load_explicit(&shards[dispatchShardOf(userId)].depth, memory_order_relaxed);
+}
+
+long dispatchClassQueueDepth(DispatchClass priority)
+{
+    long depth = 0;
+    int i;
+    for (i = 0; i < shardCount; i++)
+    {
+        depth += atomic_load_explicit(&shards[i].queues[priority].depth, memory_order_relaxed);
+    }
+    return depth;
+}
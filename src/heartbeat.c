@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "heartbeat.h"
+#include "log.h"
+#include "timerwheel.h"
+
+#define HEARTBEAT_TICK_MS 100
+#define HEARTBEAT_TICKS_PER_SECOND (1000 / HEARTBEAT_TICK_MS)
+
+typedef struct
+{
+    TimerEntry timer; // first member, so a TimerEntry* is a ConnectionTimer*
+    int sock;
+    atomic_ullong lastActivity; // tick of the last frame received
+} ConnectionTimer;
+
+static TimerWheel wheel;
+static pthread_mutex_t wheelLock = PTHREAD_MUTEX_INITIALIZER;
+static ConnectionTimer **timers = NULL; // indexed by socket descriptor
+static int timerCapacity = 0;
+static uint64_t idleTicks = 0;
+static atomic_ullong currentTick;
+
+static uint64_t heartbeatClockTicks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * HEARTBEAT_TICKS_PER_SECOND + (uint64_t)ts.tv_nsec / (HEARTBEAT_TICK_MS * 1000000ull);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Wheel callback: reaps a connection or pushes its deadline forward.
+ *
+ * Touches only record the time of the last frame, so an active connection
+ * is rescheduled here at most once per idle period instead of on every frame.
+ */
+// <----------------------------------------------------------------> //
+static void heartbeatExpire(TimerEntry *entry, void *context)
+{
+    (void)context;
+    ConnectionTimer *timer = (ConnectionTimer *)entry;
+    uint64_t lastActivity = atomic_load_explicit(&timer->lastActivity, memory_order_relaxed);
+    if (wheel.now < lastActivity + idleTicks)
+    {
+        timerWheelSchedule(&wheel, entry, lastActivity + idleTicks);
+        return;
+    }
+
+    // Wakes the connection's reader with EOF; it then cleans up as for any disconnect
+    LOG_INFO("Client %d idle for %llu s, closing", timer->sock, (unsigned long long)(idleTicks / HEARTBEAT_TICKS_PER_SECOND));
+    shutdown(timer->sock, SHUT_RDWR);
+}
+
+static void *heartbeatReaperLoop(void *arg)
+{
+    (void)arg;
+    struct timespec interval = {0, HEARTBEAT_TICK_MS * 1000000L};
+    while (1)
+    {
+        nanosleep(&interval, NULL);
+        uint64_t now = heartbeatClockTicks();
+        atomic_store_explicit(&currentTick, now, memory_order_relaxed);
+        pthread_mutex_lock(&wheelLock);
+        timerWheelAdvance(&wheel, now, heartbeatExpire, NULL);
+        pthread_mutex_unlock(&wheelLock);
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Starts idle-connection reaping.
+ *
+ * @param idleTimeoutSeconds Connections silent for this long are closed; 0 disables reaping.
+ * @param maxSockets One more than the highest socket descriptor that can be tracked.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int heartbeatInit(int idleTimeoutSeconds, int maxSockets)
+{
+    if (idleTimeoutSeconds <= 0)
+    {
+        return 0;
+    }
+
+    timers = calloc((size_t)maxSockets, sizeof(ConnectionTimer *));
+    if (timers == NULL)
+    {
+        LOG_ERROR("Error allocating connection timers");
+        return -1;
+    }
+    timerCapacity = maxSockets;
+    idleTicks = (uint64_t)idleTimeoutSeconds * HEARTBEAT_TICKS_PER_SECOND;
+    atomic_store(&currentTick, heartbeatClockTicks());
+    timerWheelInit(&wheel, atomic_load(&currentTick));
+
+    pthread_t reaper;
+    if (pthread_create(&reaper, NULL, heartbeatReaperLoop, NULL) != 0)
+    {
+        LOG_ERROR("Heartbeat reaper thread create error");
+        return -1;
+    }
+    pthread_detach(reaper);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Starts tracking a newly accepted connection.
+ */
+// <----------------------------------------------------------------> //
+void heartbeatTrack(int sock)
+{
+    if (sock < 0 || sock >= timerCapacity)
+    {
+        return;
+    }
+    ConnectionTimer *timer = calloc(1, sizeof(ConnectionTimer));
+    if (timer == NULL)
+    {
+        return;
+    }
+    timer->sock = sock;
+    uint64_t now = atomic_load_explicit(&currentTick, memory_order_relaxed);
+    atomic_store_explicit(&timer->lastActivity, now, memory_order_relaxed);
+
+    pthread_mutex_lock(&wheelLock);
+    timers[sock] = timer;
+    timerWheelSchedule(&wheel, &timer->timer, now + idleTicks);
+    pthread_mutex_unlock(&wheelLock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Records activity on a connection; lock-free, called for every frame.
+ *
+ * Must be called from the thread that owns the connection, which is also
+ * the only one that untracks it.
+ */
+// <----------------------------------------------------------------> //
+void heartbeatTouch(int sock)
+{
+    if (sock < 0 || sock >= timerCapacity)
+    {
+        return;
+    }
+    ConnectionTimer *timer = timers[sock];
+    if (timer != NULL)
+    {
+        atomic_store_explicit(&timer->lastActivity, atomic_load_explicit(&currentTick, memory_order_relaxed), memory_order_relaxed);
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Stops tracking a connection; call before closing its socket.
+ */
+// <----------------------------------------------------------------> //
+void heartbeatUntrack(int sock)
+{
+    if (sock < 0 || sock >= timerCapacity)
+    {
+        return;
+    }
+    pthread_mutex_lock(&wheelLock);
+    ConnectionTimer *timer = timers[sock];
+    if (timer != NULL)
+    {
+        timerWheelCancel(&wheel, &timer->timer);
+        timers[sock] = NULL;
+    }
+    pthread_mutex_unlock(&wheelLock);
+    free(timer);
+}
+
+long heartbeatTrackedConnections(void)
+{
+    pthread_mutex_lock(&wheelLock);
+    long count = wheel.count;
+    pthread_mutex_unlock(&wheelLock);
+    return count;
+}
@@ -0,0 +1,666 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "log.h"
+#include "protocol.h"
+#include "state.h"
+#include "storage.h"
+
+#define IMPORT_MAX_COMMAS 8           // separators remembered per line; the last one is always kept
+#define IMPORT_LIST_FIELD_SIZE 1024   // the server reads user list fields into buffers this large
+#define IMPORT_DATE_SIZE 50           // and message dates into this
+#define IMPORT_MAX_REPORTED 10        // dropped lines printed before only counting them
+
+// Separators of one line, found by importSplitLine()
+typedef struct
+{
+    const char *start;
+    const char *end; // the newline, or the end of the file
+    int commaCount;
+    const char *commas[IMPORT_MAX_COMMAS];
+    const char *lastComma;
+} ImportLine;
+
+// What a line of a file has to look like
+typedef enum
+{
+    IMPORT_USER_LIST, // id,username,phone,name,surname
+    IMPORT_CONTACTS,  // id,name,surname,phone
+    IMPORT_MESSAGES   // date, peer, text, status
+} ImportFormat;
+
+// A growable list of user IDs
+typedef struct
+{
+    int32_t *items;
+    int count;
+    int capacity;
+} ImportIds;
+
+// Per-thread scratch space and counters
+typedef struct
+{
+    ImportIds contacts;
+    ImportIds unreadPeers;
+    int messageCount;
+    long lines;
+    long dropped;
+    long repaired;
+    unsigned long long bytes;
+} ImportWorker;
+
+static const char *sourceRoot;
+static int *userIds = NULL; // legacy user directories
+static int userIdCount = 0;
+static long maxUserId = MAX_USER_ID - 1; // highest ID a contact or message may name, known once the user list is in
+static atomic_int nextUser;
+static int stateEnabled = 0;
+static atomic_long totalContacts;
+static atomic_long totalMessages;
+static atomic_long totalLines;
+static atomic_long totalDropped;
+static atomic_long totalRepaired;
+static atomic_long failedUsers;
+static atomic_ullong totalBytes;
+static atomic_int reported;
+
+static double importSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void importAddComma(ImportLine *line, const char *comma)
+{
+    if (line->commaCount < IMPORT_MAX_COMMAS)
+    {
+        line->commas[line->commaCount] = comma;
+    }
+    line->commaCount++;
+    line->lastComma = comma;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Finds the commas and the end of the line starting at cursor.
+ *
+ * With SSE2 sixteen bytes are compared against ',' and '\n' at once and
+ * only the matches are visited, so the bytes of long message texts are not
+ * looked at one by one. The scalar loop handles the tail of the file and
+ * targets without SSE2.
+ *
+ * @return const char* The start of the next line.
+ */
+// <----------------------------------------------------------------> //
+static const char *importSplitLine(const char *cursor, const char *limit, ImportLine *line)
+{
+    line->start = cursor;
+    line->commaCount = 0;
+    line->lastComma = NULL;
+#ifdef __SSE2__
+    const __m128i commas = _mm_set1_epi8(',');
+    const __m128i newlines = _mm_set1_epi8('\n');
+    while (limit - cursor >= 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)cursor);
+        unsigned commaMask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, commas));
+        unsigned newlineMask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newlines));
+        if (newlineMask != 0)
+        {
+            commaMask &= (newlineMask & -newlineMask) - 1; // only the commas before the newline
+        }
+        while (commaMask != 0)
+        {
+            importAddComma(line, cursor + __builtin_ctz(commaMask));
+            commaMask &= commaMask - 1;
+        }
+        if (newlineMask != 0)
+        {
+            line->end = cursor + __builtin_ctz(newlineMask);
+            return line->end + 1;
+        }
+        cursor += 16;
+    }
+#endif
+    for (; cursor < limit; cursor++)
+    {
+        if (*cursor == '\n')
+        {
+            line->end = cursor;
+            return cursor + 1;
+        }
+        if (*cursor == ',')
+        {
+            importAddComma(line, cursor);
+        }
+    }
+    line->end = limit;
+    return limit;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Parses an integer field the way the server's %d does.
+ *
+ * Leading whitespace is skipped; after the digits only whitespace may
+ * follow, and only when trailing is set (the last field of a line).
+ *
+ * @return int 0 on success, -1 if the field is not a number.
+ */
+// <----------------------------------------------------------------> //
+static int importParseInt(const char *cursor, const char *end, int trailing, long *value)
+{
+    while (cursor < end && (*cursor == ' ' || *cursor == '\t'))
+    {
+        cursor++;
+    }
+    int negative = cursor < end && *cursor == '-';
+    if (cursor < end && (*cursor == '-' || *cursor == '+'))
+    {
+        cursor++;
+    }
+    const char *digits = cursor;
+    long result = 0;
+    while (cursor < end && *cursor >= '0' && *cursor <= '9' && result <= 0x7fffffffL)
+    {
+        result = result * 10 + (*cursor++ - '0');
+    }
+    if (cursor == digits || result > 0x7fffffffL)
+    {
+        return -1;
+    }
+    while (trailing && cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r'))
+    {
+        cursor++;
+    }
+    if (cursor != end)
+    {
+        return -1;
+    }
+    *value = negative ? -result : result;
+    return 0;
+}
+
+static int importFieldFits(const char *start, const char *end, size_t size)
+{
+    return end > start && (size_t)(end - start) < size;
+}
+
+static int importIdsAdd(ImportIds *ids, int32_t id)
+{
+    if (ids->count == ids->capacity)
+    {
+        int capacity = ids->capacity > 0 ? ids->capacity * 2 : 64;
+        int32_t *items = realloc(ids->items, (size_t)capacity * sizeof(int32_t));
+        if (items == NULL)
+        {
+            return -1;
+        }
+        ids->items = items;
+        ids->capacity = capacity;
+    }
+    ids->items[ids->count++] = id;
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Checks one line against the format the server reads it with.
+ *
+ * Fields must be non-empty and fit the server's buffers, IDs must be
+ * numbers below MAX_USER_ID, which the server ignores users past; contacts
+ * and peers must also not exceed the highest user ID, since the state
+ * sizes its tables by it. A message whose text contains commas cannot be
+ * read back by the server, which splits on the first ones; the text is
+ * taken to run up to the last comma instead, and repaired is set so the
+ * caller replaces the commas inside it.
+ *
+ * @return int 1 if the line is kept, 0 if it is dropped.
+ */
+// <----------------------------------------------------------------> //
+static int importCheckLine(const ImportLine *line, ImportFormat format, ImportWorker *worker, long *id, int *repaired)
+{
+    *repaired = 0;
+    const char *const *commas = line->commas;
+    if (format == IMPORT_USER_LIST)
+    {
+        return line->commaCount >= 4 && importParseInt(line->start, commas[0], 0, id) == 0 && *id >= 0 && *id < MAX_USER_ID &&
+               importFieldFits(commas[0] + 1, commas[1], IMPORT_LIST_FIELD_SIZE) &&
+               importFieldFits(commas[1] + 1, commas[2], IMPORT_LIST_FIELD_SIZE) &&
+               importFieldFits(commas[2] + 1, commas[3], IMPORT_LIST_FIELD_SIZE) &&
+               importFieldFits(commas[3] + 1, line->end, IMPORT_LIST_FIELD_SIZE);
+    }
+    if (format == IMPORT_CONTACTS)
+    {
+        return line->commaCount >= 3 && importParseInt(line->start, commas[0], 0, id) == 0 && *id >= 0 && *id <= maxUserId &&
+               importFieldFits(commas[0] + 1, commas[1], REGISTRATION_BUFFER_SIZE) &&
+               importFieldFits(commas[1] + 1, commas[2], REGISTRATION_BUFFER_SIZE) &&
+               importFieldFits(commas[2] + 1, line->end, REGISTRATION_BUFFER_SIZE);
+    }
+
+    long status;
+    if (line->commaCount < 3 || !importFieldFits(line->start, commas[0], IMPORT_DATE_SIZE) ||
+        importParseInt(commas[0] + 1, commas[1], 0, id) != 0 || *id < 0 || *id > maxUserId ||
+        !importFieldFits(commas[1] + 1, line->lastComma, MESSAGE_BODY_SIZE) ||
+        importParseInt(line->lastComma + 1, line->end, 1, &status) != 0)
+    {
+        return 0;
+    }
+    *repaired = line->commaCount > 3;
+    worker->messageCount++;
+    if (status == 0 && importIdsAdd(&worker->unreadPeers, (int32_t)*id) < 0)
+    {
+        return 0;
+    }
+    return 1;
+}
+
+static int importWriteAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Validates one legacy file and writes the lines kept to its new place.
+ *
+ * The source is mapped, not read. As long as every line is kept unchanged
+ * the mapping itself is written out; the first dropped or repaired line
+ * switches to copying into a buffer. The new file gets the timestamps of
+ * the old one, so a state snapshot taken after the import treats it as
+ * unchanged. A missing source produces an empty file, as registration
+ * would have.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+static int importFile(const char *sourcePath, const char *targetPath, ImportFormat format, ImportWorker *worker, long *maxId)
+{
+    int source = open(sourcePath, O_RDONLY);
+    struct stat status;
+    if (source < 0 && errno != ENOENT)
+    {
+        fprintf(stderr, "Error opening %s: %s\n", sourcePath, strerror(errno));
+        return -1;
+    }
+    if (source >= 0 && fstat(source, &status) != 0)
+    {
+        fprintf(stderr, "Error reading %s: %s\n", sourcePath, strerror(errno));
+        close(source);
+        return -1;
+    }
+    size_t size = source >= 0 ? (size_t)status.st_size : 0;
+    const char *data = NULL;
+    if (size > 0)
+    {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, source, 0);
+        if (data == MAP_FAILED)
+        {
+            fprintf(stderr, "Error mapping %s: %s\n", sourcePath, strerror(errno));
+            close(source);
+            return -1;
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+
+    char *copy = NULL; // set once the output differs from the source
+    size_t copied = 0;
+    long lineNumber = 0;
+    int result = 0;
+    const char *cursor = data;
+    const char *limit = data + size;
+    while (cursor < limit && result == 0)
+    {
+        ImportLine line;
+        cursor = importSplitLine(cursor, limit, &line);
+        lineNumber++;
+        if (line.end == line.start || (line.end == line.start + 1 && line.start[0] == '\r'))
+        {
+            continue; // blank lines are skipped by the server's readers too
+        }
+        long id;
+        int repaired;
+        int kept = importCheckLine(&line, format, worker, &id, &repaired);
+        int unchanged = kept && !repaired && line.end < limit;
+        if (!unchanged && copy == NULL)
+        {
+            copy = malloc(size + 1);
+            if (copy == NULL)
+            {
+                result = -1;
+                break;
+            }
+            copied = (size_t)(line.start - data);
+            memcpy(copy, data, copied);
+        }
+        if (!kept)
+        {
+            worker->dropped++;
+            if (atomic_fetch_add(&reported, 1) < IMPORT_MAX_REPORTED)
+            {
+                fprintf(stderr, "%s:%ld: dropped malformed line\n", sourcePath, lineNumber);
+            }
+            continue;
+        }
+        worker->lines++;
+        if (format == IMPORT_CONTACTS && importIdsAdd(&worker->contacts, (int32_t)id) < 0)
+        {
+            result = -1;
+        }
+        if (format == IMPORT_USER_LIST && id > *maxId)
+        {
+            *maxId = id;
+        }
+        if (copy != NULL)
+        {
+            size_t length = (size_t)(line.end - line.start);
+            memcpy(copy + copied, line.start, length);
+            if (repaired)
+            {
+                worker->repaired++;
+                char *text = copy + copied + (line.commas[1] - line.start) + 1;
+                char *textEnd = copy + copied + (line.lastComma - line.start);
+                for (; text < textEnd; text++)
+                {
+                    if (*text == ',')
+                    {
+                        *text = ';';
+                    }
+                }
+            }
+            copied += length;
+            copy[copied++] = '\n';
+        }
+    }
+
+    int target = result == 0 ? open(targetPath, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+    if (target < 0 || importWriteAll(target, copy != NULL ? copy : data, copy != NULL ? copied : size) < 0)
+    {
+        fprintf(stderr, "Error writing %s: %s\n", targetPath, strerror(errno));
+        result = -1;
+    }
+    else if (source >= 0)
+    {
+        struct timespec times[2] = {status.st_atim, status.st_mtim};
+        futimens(target, times);
+    }
+    worker->bytes += size;
+    if (target >= 0)
+    {
+        close(target);
+    }
+    free(copy);
+    if (data != NULL)
+    {
+        munmap((void *)data, size);
+    }
+    if (source >= 0)
+    {
+        close(source);
+    }
+    return result;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Imports one legacy user directory and hands what it found to the state.
+ */
+// <----------------------------------------------------------------> //
+static int importUser(int userId, ImportWorker *worker)
+{
+    char sourcePath[4096];
+    char targetPath[STORAGE_PATH_SIZE];
+    long unusedMaxId = 0;
+    worker->contacts.count = 0;
+    worker->unreadPeers.count = 0;
+    worker->messageCount = 0;
+    if (storageCreateUserDirectory(userId) < 0)
+    {
+        return -1;
+    }
+    snprintf(sourcePath, sizeof(sourcePath), "%s/users/%d/contact_list.txt", sourceRoot, userId);
+    if (importFile(sourcePath, storageUserPath(userId, STORAGE_USER_CONTACTS, targetPath), IMPORT_CONTACTS, worker, &unusedMaxId) < 0)
+    {
+        return -1;
+    }
+    snprintf(sourcePath, sizeof(sourcePath), "%s/users/%d/messages.txt", sourceRoot, userId);
+    if (importFile(sourcePath, storageUserPath(userId, STORAGE_USER_MESSAGES, targetPath), IMPORT_MESSAGES, worker, &unusedMaxId) < 0)
+    {
+        return -1;
+    }
+    if (stateEnabled)
+    {
+        stateImportUser(userId, worker->contacts.items, worker->contacts.count, worker->unreadPeers.items, worker->unreadPeers.count,
+                        (uint32_t)worker->messageCount);
+    }
+    atomic_fetch_add(&totalContacts, worker->contacts.count);
+    atomic_fetch_add(&totalMessages, worker->messageCount);
+    return 0;
+}
+
+static void *importWorkerLoop(void *arg)
+{
+    (void)arg;
+    ImportWorker worker;
+    memset(&worker, 0, sizeof(worker));
+    int index;
+    while ((index = atomic_fetch_add(&nextUser, 1)) < userIdCount)
+    {
+        if (importUser(userIds[index], &worker) < 0)
+        {
+            atomic_fetch_add(&failedUsers, 1);
+        }
+    }
+    atomic_fetch_add(&totalLines, worker.lines);
+    atomic_fetch_add(&totalDropped, worker.dropped);
+    atomic_fetch_add(&totalRepaired, worker.repaired);
+    atomic_fetch_add(&totalBytes, worker.bytes);
+    free(worker.contacts.items);
+    free(worker.unreadPeers.items);
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Lists the numeric user directories of the legacy tree.
+ *
+ * Directories of IDs the server does not serve are reported and skipped.
+ *
+ * @return long The highest user ID found, or -1 on error.
+ */
+// <----------------------------------------------------------------> //
+static long importListUsers(void)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/users", sourceRoot);
+    DIR *directory = opendir(path);
+    if (directory == NULL)
+    {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int capacity = 0;
+    long maxId = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        char *end;
+        long userId = strtol(entry->d_name, &end, 10);
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9' || *end != '\0' || userId > 0x7fffffff)
+        {
+            continue; // not a user directory
+        }
+        if (userId >= MAX_USER_ID)
+        {
+            fprintf(stderr, "%s/%s: skipped, the server only serves user IDs below %d\n", path, entry->d_name, MAX_USER_ID);
+            continue;
+        }
+        if (userIdCount == capacity)
+        {
+            capacity = capacity > 0 ? capacity * 2 : 1024;
+            int *grown = realloc(userIds, (size_t)capacity * sizeof(int));
+            if (grown == NULL)
+            {
+                closedir(directory);
+                return -1;
+            }
+            userIds = grown;
+        }
+        userIds[userIdCount++] = (int)userId;
+        if (userId > maxId)
+        {
+            maxId = userId;
+        }
+    }
+    closedir(directory);
+    return maxId;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Prints the command line usage.
+ */
+// <----------------------------------------------------------------> //
+static void printUsage(const char *program)
+{
+    printf("Usage: %s [-j threads] [-S] legacy-directory\n", program);
+    printf("Imports a TerChatApp directory of the original flat layout into ./TerChatApp.\n");
+    printf("  -j threads  User directories imported in parallel (default: one per core)\n");
+    printf("  -S          Do not write a state snapshot; the server then reads every file on first use\n");
+    printf("Malformed lines are dropped, message texts containing commas are repaired, file timestamps are kept.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    int writeSnapshot = 1;
+    int option;
+    while ((option = getopt(argc, argv, "j:Sh")) != -1)
+    {
+        switch (option)
+        {
+        case 'j':
+            threadCount = atol(optarg);
+            break;
+        case 'S':
+            writeSnapshot = 0;
+            break;
+        default:
+            printUsage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || threadCount < 1)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+    sourceRoot = argv[optind];
+
+    logInit();
+    if (getenv("TERCHAT_LOG_LEVEL") == NULL)
+    {
+        logSetLevel(LOG_LEVEL_WARN);
+    }
+    struct stat existing;
+    if (stat(STORAGE_USER_LIST_PATH, &existing) == 0)
+    {
+        fprintf(stderr, "%s already exists; import into an empty directory\n", STORAGE_USER_LIST_PATH);
+        return 1;
+    }
+    mkdir("TerChatApp", 0777);
+    if ((mkdir(STORAGE_USERS_DIRECTORY, 0777) == -1 && errno != EEXIST) || (mkdir(STORAGE_SHARDS_DIRECTORY, 0777) == -1 && errno != EEXIST))
+    {
+        perror("Error creating " STORAGE_SHARDS_DIRECTORY);
+        return 1;
+    }
+
+    double startedAt = importSeconds();
+    long maxId = importListUsers();
+    if (maxId < 0)
+    {
+        return 1;
+    }
+
+    // The user list first: the state reads it to know who is registered
+    char sourcePath[4096];
+    snprintf(sourcePath, sizeof(sourcePath), "%s/users/user_list.txt", sourceRoot);
+    ImportWorker listWorker;
+    memset(&listWorker, 0, sizeof(listWorker));
+    if (importFile(sourcePath, STORAGE_USER_LIST_PATH, IMPORT_USER_LIST, &listWorker, &maxId) < 0)
+    {
+        return 1;
+    }
+    long registeredUsers = listWorker.lines;
+    maxUserId = maxId;
+    atomic_fetch_add(&totalLines, listWorker.lines);
+    atomic_fetch_add(&totalDropped, listWorker.dropped);
+    atomic_fetch_add(&totalBytes, listWorker.bytes);
+
+    if (writeSnapshot)
+    {
+        stateEnabled = stateInit((int)maxId + 1, STATE_SNAPSHOT_PATH) >= 0;
+    }
+
+    if (threadCount > userIdCount)
+    {
+        threadCount = userIdCount > 0 ? userIdCount : 1;
+    }
+    pthread_t *threads = calloc((size_t)threadCount, sizeof(pthread_t));
+    long started = 0;
+    while (threads != NULL && started < threadCount && pthread_create(&threads[started], NULL, importWorkerLoop, NULL) == 0)
+    {
+        started++;
+    }
+    if (started == 0)
+    {
+        importWorkerLoop(NULL);
+    }
+    long i;
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    if (stateEnabled && stateSave() < 0)
+    {
+        fprintf(stderr, "Error writing the state snapshot; the server will read every file on first use\n");
+    }
+    double elapsed = importSeconds() - startedAt;
+    double megabytes = (double)atomic_load(&totalBytes) / (1024.0 * 1024.0);
+    printf("Imported %ld registered users and %d user directories with %ld threads in %.2f s\n", registeredUsers, userIdCount, started > 0 ? started : 1, elapsed);
+    printf("  %ld contacts, %ld messages, %ld lines kept, %ld dropped, %ld repaired\n", atomic_load(&totalContacts), atomic_load(&totalMessages),
+           atomic_load(&totalLines), atomic_load(&totalDropped), atomic_load(&totalRepaired));
+    printf("  %.1f MB read, %.1f MB/s%s\n", megabytes, elapsed > 0 ? megabytes / elapsed : 0.0, stateEnabled ? ", state snapshot written" : "");
+    logShutdown();
+    return atomic_load(&failedUsers) > 0 ? 1 : 0;
+}
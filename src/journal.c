@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "log.h"
+#include "storage.h"
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Writes lines to a stream with "<kind>," in front of each one.
+ *
+ * A last line without a newline gets one.
+ */
+// <----------------------------------------------------------------> //
+static void journalWriteEntries(FILE *stream, JournalEntryKind kind, const char *lines, size_t length)
+{
+    const char *cursor = lines;
+    const char *end = lines + length;
+    while (cursor < end)
+    {
+        const char *newline = memchr(cursor, '\n', (size_t)(end - cursor));
+        size_t lineLength = newline != NULL ? (size_t)(newline - cursor) : (size_t)(end - cursor);
+        fprintf(stream, "%c,%.*s\n", (char)kind, (int)lineLength, cursor);
+        cursor += lineLength + 1;
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Reads a file from an offset to its end.
+ *
+ * @return int 0 on success, -1 if the file could not be read; a missing file reads as empty.
+ */
+// <----------------------------------------------------------------> //
+static int journalReadFile(const char *path, long offset, char **data, size_t *length)
+{
+    *data = NULL;
+    *length = 0;
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct stat status;
+    if (fstat(fileno(file), &status) != 0 || fseek(file, offset, SEEK_SET) != 0)
+    {
+        fclose(file);
+        return -1;
+    }
+    size_t size = status.st_size > offset ? (size_t)(status.st_size - offset) : 0;
+    *data = malloc(size + 1);
+    if (*data == NULL)
+    {
+        fclose(file);
+        return -1;
+    }
+    *length = fread(*data, 1, size, file);
+    (*data)[*length] = '\0';
+    fclose(file);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Changes a user's file and records the change in their journal, in one storage batch.
+ *
+ * @param userId The user whose data changed.
+ * @param kind What changed.
+ * @param filePath The file to append lines to as well, or NULL if the change is journaled only.
+ * @param lines One or more lines.
+ * @param length Length of lines.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int journalAppend(int userId, JournalEntryKind kind, const char *filePath, const char *lines, size_t length)
+{
+    char journalPath[STORAGE_PATH_SIZE];
+    char *entries = NULL;
+    size_t entriesLength = 0;
+    FILE *stream = open_memstream(&entries, &entriesLength);
+    if (stream == NULL)
+    {
+        LOG_ERROR("Error formatting journal entries of %d: %s", userId, strerror(errno));
+        return -1;
+    }
+    journalWriteEntries(stream, kind, lines, length);
+    fclose(stream);
+
+    StorageWrite writes[2];
+    int count = 0;
+    if (filePath != NULL)
+    {
+        writes[count++] = (StorageWrite){filePath, lines, length};
+    }
+    writes[count++] = (StorageWrite){storageUserPath(userId, STORAGE_USER_CHANGES, journalPath), entries, entriesLength};
+    int result = storageAppendBatch(writes, count);
+    free(entries);
+    return result;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Collects what changed for a user since a version of their journal.
+ *
+ * Versions are byte offsets into the journal, so the changes since one are
+ * read with a single seek. An unknown version (0, past the end or not at an
+ * entry boundary) gets a RESET entry and the full contact list and mailbox
+ * instead. The version is taken before the files are read, so a change
+ * racing with the call may be sent again but is never lost.
+ *
+ * @param userId The user.
+ * @param since The version the client has, 0 if none.
+ * @param changes Receives the entries; free() it.
+ * @param length Receives the length of changes.
+ * @param version Receives the version the client has after applying changes.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int journalChangesSince(int userId, long long since, char **changes, size_t *length, long long *version)
+{
+    storageSyncUser(userId); // pending appends must be visible before the files are read
+    char path[STORAGE_PATH_SIZE];
+    struct stat status;
+    *version = stat(storageUserPath(userId, STORAGE_USER_CHANGES, path), &status) == 0 ? (long long)status.st_size : 0;
+
+    if (since > 0 && since <= *version)
+    {
+        char *data;
+        size_t dataLength;
+        if (journalReadFile(path, (long)since - 1, &data, &dataLength) == 0 && dataLength > 0 && data[0] == '\n')
+        {
+            memmove(data, data + 1, dataLength); // drop the end of the entry before the version
+            *changes = data;
+            *length = dataLength - 1;
+            return 0;
+        }
+        free(data);
+    }
+
+    FILE *stream = open_memstream(changes, length);
+    if (stream == NULL)
+    {
+        LOG_ERROR("Error collecting changes of %d: %s", userId, strerror(errno));
+        return -1;
+    }
+    fprintf(stream, "%c,\n", (char)JOURNAL_RESET);
+    const StorageUserFile files[] = {STORAGE_USER_CONTACTS, STORAGE_USER_MESSAGES};
+    const JournalEntryKind kinds[] = {JOURNAL_CONTACT_ADDED, JOURNAL_MESSAGE};
+    int result = 0;
+    size_t i;
+    for (i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+    {
+        char *data;
+        size_t dataLength;
+        if (journalReadFile(storageUserPath(userId, files[i], path), 0, &data, &dataLength) < 0)
+        {
+            LOG_ERROR("Error reading %s: %s", path, strerror(errno));
+            result = -1;
+            continue;
+        }
+        journalWriteEntries(stream, kinds[i], data, dataLength);
+        free(data);
+    }
+    fclose(stream);
+    if (result < 0)
+    {
+        free(*changes);
+        *changes = NULL;
+    }
+    return result;
+}
@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "log.h"
+
+#define LOG_RING_CAPACITY 128 // records per thread, must be a power of two
+#define LOG_STRING_SPACE 160
+#define LOG_FLUSH_INTERVAL_NS 5000000
+#define LOG_OUTPUT_BUFFER_SIZE (64 * 1024)
+#define LOG_LINE_SIZE 1024
+
+typedef struct
+{
+    uint64_t timestampNs;
+    const char *format;
+    uint8_t level;
+    uint8_t argCount;
+    uint16_t stringsUsed;
+    LogArg args[LOG_MAX_ARGS]; // string arguments hold an offset into strings
+    char strings[LOG_STRING_SPACE];
+} LogRecord;
+
+// Single-producer (the owning thread) single-consumer (the flusher) ring
+typedef struct LogRing
+{
+    LogRecord records[LOG_RING_CAPACITY];
+    atomic_uint head; // next slot the producer writes
+    atomic_uint tail; // next slot the flusher reads
+    atomic_uint dropped;
+    atomic_int orphaned; // set when the owning thread exits
+    int threadNumber;
+    struct LogRing *next;
+} LogRing;
+
+volatile int logMinLevel = LOG_LEVEL_INFO;
+
+static LogRing *rings = NULL;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+static _Thread_local LogRing *localRing;
+static int nextThreadNumber = 0;
+
+static pthread_t flusherThread;
+static atomic_int flusherRunning;
+
+static const char *levelNames[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+static void orphanRing(void *ring)
+{
+    atomic_store_explicit(&((LogRing *)ring)->orphaned, 1, memory_order_release);
+}
+
+static void createRingKey(void)
+{
+    pthread_key_create(&ringKey, orphanRing);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns the calling thread's ring, registering a new one on first use.
+ */
+// <----------------------------------------------------------------> //
+static LogRing *logRing(void)
+{
+    if (localRing != NULL)
+    {
+        return localRing;
+    }
+
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    pthread_once(&ringKeyOnce, createRingKey);
+    pthread_setspecific(ringKey, ring);
+
+    pthread_mutex_lock(&ringsLock);
+    ring->threadNumber = nextThreadNumber++;
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&ringsLock);
+
+    localRing = ring;
+    return ring;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sets the minimum level that is recorded.
+ */
+// <----------------------------------------------------------------> //
+void logSetLevel(LogLevel level)
+{
+    logMinLevel = level;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Captures a log record into the calling thread's ring without formatting it.
+ *
+ * String arguments are copied (truncated to the record's string space) since
+ * they usually point at stack buffers; everything else is stored by value.
+ * When the ring is full the record is dropped and counted instead of blocking.
+ *
+ * @param level The level of the record.
+ * @param format The printf-style format string, which must outlive the process.
+ * @param args The captured arguments.
+ * @param argCount The number of captured arguments.
+ */
+// <----------------------------------------------------------------> //
+void logEmit(LogLevel level, const char *format, const LogArg *args, int argCount)
+{
+    LogRing *ring = logRing();
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_CAPACITY)
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogRecord *record = &ring->records[head & (LOG_RING_CAPACITY - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->timestampNs = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    record->format = format;
+    record->level = (uint8_t)level;
+    record->argCount = (uint8_t)(argCount < LOG_MAX_ARGS ? argCount : LOG_MAX_ARGS);
+    record->stringsUsed = 0;
+
+    int i;
+    for (i = 0; i < record->argCount; i++)
+    {
+        record->args[i] = args[i];
+        if (args[i].type == LOG_ARG_STRING)
+        {
+            const char *value = args[i].value.s != NULL ? args[i].value.s : "(null)";
+            if (record->stringsUsed >= LOG_STRING_SPACE)
+            {
+                // Out of space: point at the terminator of the last copied string
+                record->args[i].value.i = LOG_STRING_SPACE - 1;
+                continue;
+            }
+            size_t room = LOG_STRING_SPACE - record->stringsUsed - 1;
+            size_t length = strnlen(value, room);
+            memcpy(record->strings + record->stringsUsed, value, length);
+            record->strings[record->stringsUsed + length] = '\0';
+            record->args[i].value.i = record->stringsUsed;
+            record->stringsUsed += (uint16_t)(length + 1);
+        }
+    }
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Formats one captured record into a line of text.
+ *
+ * Conversion specifications are rewritten to match the captured argument
+ * type, so length modifiers in the original format do not matter.
+ *
+ * @return size_t The length of the formatted line.
+ */
+// <----------------------------------------------------------------> //
+static size_t logFormatRecord(const LogRecord *record, int threadNumber, char *line, size_t size)
+{
+    time_t seconds = (time_t)(record->timestampNs / 1000000000ull);
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    size_t used = (size_t)snprintf(line, size, "%04d-%02d-%02dT%02d:%02d:%02d.%06luZ %s [t%d] ",
+                                   tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                                   (unsigned long)(record->timestampNs % 1000000000ull / 1000),
+                                   levelNames[record->level], threadNumber);
+
+    const char *p = record->format;
+    int argIndex = 0;
+    while (*p != '\0' && used < size - 1)
+    {
+        if (*p != '%')
+        {
+            line[used++] = *p++;
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            line[used++] = '%';
+            p += 2;
+            continue;
+        }
+
+        // Copy flags, width and precision; drop length modifiers
+        char spec[32];
+        size_t specLength = 0;
+        spec[specLength++] = *p++;
+        while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL && specLength < sizeof(spec) - 4)
+        {
+            spec[specLength++] = *p++;
+        }
+        while (*p != '\0' && strchr("hlLqjzt", *p) != NULL)
+        {
+            p++;
+        }
+        char conversion = *p != '\0' ? *p++ : 's';
+
+        int written;
+        if (argIndex >= record->argCount)
+        {
+            written = snprintf(line + used, size - used, "(missing)");
+        }
+        else
+        {
+            const LogArg *arg = &record->args[argIndex++];
+            if (arg->type == LOG_ARG_STRING)
+            {
+                spec[specLength++] = 's';
+                spec[specLength] = '\0';
+                written = snprintf(line + used, size - used, spec, record->strings + arg->value.i);
+            }
+            else if (arg->type == LOG_ARG_DOUBLE)
+            {
+                spec[specLength++] = strchr("eEfFgGaA", conversion) != NULL ? conversion : 'g';
+                spec[specLength] = '\0';
+                written = snprintf(line + used, size - used, spec, arg->value.d);
+            }
+            else if (arg->type == LOG_ARG_POINTER || conversion == 'p')
+            {
+                written = snprintf(line + used, size - used, "%p", arg->value.p);
+            }
+            else if (conversion == 'c')
+            {
+                spec[specLength++] = 'c';
+                spec[specLength] = '\0';
+                written = snprintf(line + used, size - used, spec, (int)arg->value.i);
+            }
+            else
+            {
+                spec[specLength++] = 'l';
+                spec[specLength++] = 'l';
+                spec[specLength++] = strchr("diouxX", conversion) != NULL ? conversion : 'd';
+                spec[specLength] = '\0';
+                written = snprintf(line + used, size - used, spec, (long long)arg->value.i);
+            }
+        }
+        if (written > 0)
+        {
+            used += (size_t)written;
+        }
+        if (used >= size)
+        {
+            used = size - 1;
+        }
+    }
+
+    // Messages carry their own newlines from the printf days; normalise to exactly one
+    while (used > 0 && line[used - 1] == '\n')
+    {
+        used--;
+    }
+    line[used++] = '\n';
+    return used;
+}
+
+static void logWriteAll(const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(STDOUT_FILENO, buffer, length);
+        if (n <= 0)
+        {
+            return;
+        }
+        buffer += n;
+        length -= (size_t)n;
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Drains every ring once, writing formatted lines to stdout in large writes.
+ */
+// <----------------------------------------------------------------> //
+static void logDrain(void)
+{
+    static char output[LOG_OUTPUT_BUFFER_SIZE];
+    char line[LOG_LINE_SIZE];
+    size_t outputUsed = 0;
+
+    pthread_mutex_lock(&ringsLock);
+    LogRing **link = &rings;
+    while (*link != NULL)
+    {
+        LogRing *ring = *link;
+        int orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        while (tail != head)
+        {
+            size_t length = logFormatRecord(&ring->records[tail & (LOG_RING_CAPACITY - 1)], ring->threadNumber, line, sizeof(line));
+            if (outputUsed + length > sizeof(output))
+            {
+                logWriteAll(output, outputUsed);
+                outputUsed = 0;
+            }
+            memcpy(output + outputUsed, line, length);
+            outputUsed += length;
+            tail++;
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+
+        unsigned dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped > 0)
+        {
+            int length = snprintf(line, sizeof(line), "log: dropped %u records from thread t%d\n", dropped, ring->threadNumber);
+            logWriteAll(output, outputUsed);
+            outputUsed = 0;
+            logWriteAll(line, (size_t)length);
+        }
+
+        // The owner has exited and everything it wrote is out, so the ring can go
+        if (orphaned)
+        {
+            *link = ring->next;
+            free(ring);
+        }
+        else
+        {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&ringsLock);
+
+    logWriteAll(output, outputUsed);
+}
+
+static void *logFlusherLoop(void *arg)
+{
+    (void)arg;
+    struct timespec interval = {0, LOG_FLUSH_INTERVAL_NS};
+    while (atomic_load(&flusherRunning))
+    {
+        logDrain();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Starts the background flusher; the level comes from TERCHAT_LOG_LEVEL.
+ */
+// <----------------------------------------------------------------> //
+void logInit(void)
+{
+    const char *level = getenv("TERCHAT_LOG_LEVEL");
+    if (level != NULL)
+    {
+        if (strcasecmp(level, "debug") == 0)
+            logSetLevel(LOG_LEVEL_DEBUG);
+        else if (strcasecmp(level, "info") == 0)
+            logSetLevel(LOG_LEVEL_INFO);
+        else if (strcasecmp(level, "warn") == 0)
+            logSetLevel(LOG_LEVEL_WARN);
+        else if (strcasecmp(level, "error") == 0)
+            logSetLevel(LOG_LEVEL_ERROR);
+        else if (strcasecmp(level, "off") == 0)
+            logSetLevel(LOG_LEVEL_OFF);
+    }
+
+    atomic_store(&flusherRunning, 1);
+    if (pthread_create(&flusherThread, NULL, logFlusherLoop, NULL) != 0)
+    {
+        perror("Log flusher thread create error");
+        atomic_store(&flusherRunning, 0);
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Stops the flusher and writes out everything still buffered.
+ */
+// <----------------------------------------------------------------> //
+void logShutdown(void)
+{
+    if (atomic_exchange(&flusherRunning, 0))
+    {
+        pthread_join(flusherThread, NULL);
+    }
+    logDrain();
+}
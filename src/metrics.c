@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "metrics.h"
+
+#define METRICS_SHARDS 32
+#define METRICS_SUB_BUCKET_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_MAX_EXPONENT 35 // ~9.5 hours in microseconds
+#define METRICS_BUCKETS ((METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 2) * METRICS_SUB_BUCKETS)
+#define METRICS_RENDER_BUFFER_SIZE (64 * 1024)
+
+typedef struct
+{
+    atomic_ulong count;
+    atomic_ulong sumUs;
+    atomic_ulong buckets[METRICS_BUCKETS];
+} MetricsHistogram;
+
+// Each thread writes to its own shard, so increments never contend on a cache line
+typedef struct
+{
+    MetricsHistogram requests[METRIC_TYPE_COUNT];
+    atomic_ulong connectionsOpened;
+    atomic_ulong connectionsClosed;
+    atomic_ulong bytesIn;
+    atomic_ulong bytesOut;
+    atomic_long inFlight;
+} __attribute__((aligned(64))) MetricsShard;
+
+typedef struct
+{
+    const char *name;
+    const char *help;
+    MetricsGaugeFn fn;
+} MetricsGauge;
+
+static MetricsShard shards[METRICS_SHARDS];
+static atomic_uint nextShard;
+static _Thread_local MetricsShard *localShard;
+
+static MetricsGauge *gauges = NULL; // grows as modules register theirs
+static int gaugeCount = 0;
+static int gaugeCapacity = 0;
+static pthread_mutex_t gaugeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *metricTypeNames[METRIC_TYPE_COUNT] = {
+    "login", "register", "list_contacts", "add_user", "delete_user", "send", "check", "read", "batch_send", "search", "find_users", "presence", "sync", "blob_upload", "blob_download", "other"};
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns the shard owned by the calling thread, assigning one on first use.
+ */
+// <----------------------------------------------------------------> //
+static MetricsShard *metricsShard(void)
+{
+    if (localShard == NULL)
+    {
+        unsigned index = atomic_fetch_add_explicit(&nextShard, 1, memory_order_relaxed);
+        localShard = &shards[index % METRICS_SHARDS];
+    }
+    return localShard;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Maps a latency in microseconds to a log-linear histogram bucket.
+ *
+ * Values below METRICS_SUB_BUCKETS get exact buckets; above that each power of
+ * two is split into METRICS_SUB_BUCKETS linear sub-buckets (~12% precision).
+ */
+// <----------------------------------------------------------------> //
+static int metricsBucketIndex(uint64_t value)
+{
+    if (value < METRICS_SUB_BUCKETS)
+    {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > METRICS_MAX_EXPONENT)
+    {
+        return METRICS_BUCKETS - 1;
+    }
+    int sub = (int)((value >> (exponent - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1));
+    return (exponent - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns the exclusive upper bound in microseconds of a histogram bucket.
+ */
+// <----------------------------------------------------------------> //
+static uint64_t metricsBucketUpperBound(int index)
+{
+    if (index < METRICS_SUB_BUCKETS)
+    {
+        return (uint64_t)index + 1;
+    }
+    int exponent = index / METRICS_SUB_BUCKETS + METRICS_SUB_BUCKET_BITS - 1;
+    int sub = index % METRICS_SUB_BUCKETS;
+    return (uint64_t)(METRICS_SUB_BUCKETS + sub + 1) << (exponent - METRICS_SUB_BUCKET_BITS);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Maps a protocol message type to its metrics class.
+ *
+ * @param messageType The type field of the received message.
+ * @return MetricType The class the request is accounted under.
+ */
+// <----------------------------------------------------------------> //
+MetricType metricsTypeFromMessage(int messageType)
+{
+    switch (messageType)
+    {
+    case 0:
+        return METRIC_LOGIN;
+    case 2:
+        return METRIC_REGISTER;
+    case 4:
+        return METRIC_LIST_CONTACTS;
+    case 5:
+        return METRIC_ADD_USER;
+    case 6:
+        return METRIC_DELETE_USER;
+    case 7:
+        return METRIC_SEND;
+    case 8:
+        return METRIC_CHECK;
+    case 9:
+        return METRIC_READ;
+    case 10:
+        return METRIC_BATCH_SEND;
+    case 12:
+        return METRIC_SEARCH;
+    case 13:
+        return METRIC_FIND_USERS;
+    case 14:
+        return METRIC_PRESENCE;
+    case 15:
+        return METRIC_SYNC;
+    case 16:
+        return METRIC_BLOB_UPLOAD;
+    case 17:
+        return METRIC_BLOB_DOWNLOAD;
+    default:
+        return METRIC_OTHER;
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns the label of a metrics class, as used in the scrape output.
+ */
+// <----------------------------------------------------------------> //
+const char *metricsTypeName(MetricType type)
+{
+    return type >= 0 && type < METRIC_TYPE_COUNT ? metricTypeNames[type] : metricTypeNames[METRIC_OTHER];
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+// <----------------------------------------------------------------> //
+uint64_t metricsNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Records one handled request and its latency.
+ *
+ * @param type The class of the request.
+ * @param elapsedNs The time spent handling the request in nanoseconds.
+ */
+// <----------------------------------------------------------------> //
+void metricsRecordRequest(MetricType type, uint64_t elapsedNs)
+{
+    MetricsHistogram *histogram = &metricsShard()->requests[type];
+    uint64_t elapsedUs = elapsedNs / 1000;
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sumUs, elapsedUs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->buckets[metricsBucketIndex(elapsedUs)], 1, memory_order_relaxed);
+}
+
+void metricsConnectionOpened(void)
+{
+    atomic_fetch_add_explicit(&metricsShard()->connectionsOpened, 1, memory_order_relaxed);
+}
+
+void metricsConnectionClosed(void)
+{
+    atomic_fetch_add_explicit(&metricsShard()->connectionsClosed, 1, memory_order_relaxed);
+}
+
+void metricsBytesIn(size_t bytes)
+{
+    atomic_fetch_add_explicit(&metricsShard()->bytesIn, bytes, memory_order_relaxed);
+}
+
+void metricsBytesOut(size_t bytes)
+{
+    atomic_fetch_add_explicit(&metricsShard()->bytesOut, bytes, memory_order_relaxed);
+}
+
+void metricsInFlight(int delta)
+{
+    atomic_fetch_add_explicit(&metricsShard()->inFlight, delta, memory_order_relaxed);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Registers a gauge that is sampled every time the metrics are rendered.
+ *
+ * @param name The metric name, without the "terchat_" prefix.
+ * @param help The one-line description emitted as # HELP.
+ * @param fn The callback returning the current value.
+ * @return int 0 on success, -1 if the gauge could not be stored.
+ */
+// <----------------------------------------------------------------> //
+int metricsRegisterGauge(const char *name, const char *help, MetricsGaugeFn fn)
+{
+    pthread_mutex_lock(&gaugeLock);
+    if (gaugeCount == gaugeCapacity)
+    {
+        int capacity = gaugeCapacity > 0 ? gaugeCapacity * 2 : 16;
+        MetricsGauge *grown = realloc(gauges, (size_t)capacity * sizeof(MetricsGauge));
+        if (grown == NULL)
+        {
+            pthread_mutex_unlock(&gaugeLock);
+            LOG_ERROR("Error allocating metrics gauge %s", name);
+            return -1;
+        }
+        gauges = grown;
+        gaugeCapacity = capacity;
+    }
+    gauges[gaugeCount].name = name;
+    gauges[gaugeCount].help = help;
+    gauges[gaugeCount].fn = fn;
+    gaugeCount++;
+    pthread_mutex_unlock(&gaugeLock);
+    return 0;
+}
+
+static unsigned long sumShards(size_t offset)
+{
+    unsigned long total = 0;
+    int i;
+    for (i = 0; i < METRICS_SHARDS; i++)
+    {
+        total += atomic_load_explicit((atomic_ulong *)((char *)&shards[i] + offset), memory_order_relaxed);
+    }
+    return total;
+}
+
+// Appends formatted text to the render buffer, silently truncating when it is full
+#define RENDER(...)                                                       \
+    do                                                                    \
+    {                                                                     \
+        if (used < size)                                                  \
+        {                                                                 \
+            int written = snprintf(buffer + used, size - used, __VA_ARGS__); \
+            used += written > 0 ? (size_t)written : 0;                    \
+        }                                                                 \
+    } while (0)
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Renders all metrics in the Prometheus text exposition format.
+ *
+ * @param buffer The buffer to write into.
+ * @param size The size of the buffer.
+ * @return size_t The number of bytes written (excluding the terminator).
+ */
+// <----------------------------------------------------------------> //
+size_t metricsRender(char *buffer, size_t size)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    size_t used = 0;
+    int type, i, q;
+
+    unsigned long opened = sumShards(offsetof(MetricsShard, connectionsOpened));
+    unsigned long closed = sumShards(offsetof(MetricsShard, connectionsClosed));
+    long inFlight = 0;
+    for (i = 0; i < METRICS_SHARDS; i++)
+    {
+        inFlight += atomic_load_explicit(&shards[i].inFlight, memory_order_relaxed);
+    }
+
+    RENDER("# HELP terchat_connections_total Connections accepted since start.\n");
+    RENDER("# TYPE terchat_connections_total counter\n");
+    RENDER("terchat_connections_total %lu\n", opened);
+    RENDER("# HELP terchat_connections_active Connections currently open.\n");
+    RENDER("# TYPE terchat_connections_active gauge\n");
+    RENDER("terchat_connections_active %ld\n", (long)(opened - closed));
+    RENDER("# HELP terchat_requests_in_flight Requests currently being handled.\n");
+    RENDER("# TYPE terchat_requests_in_flight gauge\n");
+    RENDER("terchat_requests_in_flight %ld\n", inFlight);
+    RENDER("# HELP terchat_bytes_received_total Bytes received from clients.\n");
+    RENDER("# TYPE terchat_bytes_received_total counter\n");
+    RENDER("terchat_bytes_received_total %lu\n", sumShards(offsetof(MetricsShard, bytesIn)));
+    RENDER("# HELP terchat_bytes_sent_total Bytes sent to clients.\n");
+    RENDER("# TYPE terchat_bytes_sent_total counter\n");
+    RENDER("terchat_bytes_sent_total %lu\n", sumShards(offsetof(MetricsShard, bytesOut)));
+
+    pthread_mutex_lock(&gaugeLock);
+    for (i = 0; i < gaugeCount; i++)
+    {
+        RENDER("# HELP terchat_%s %s\n", gauges[i].name, gauges[i].help);
+        RENDER("# TYPE terchat_%s gauge\n", gauges[i].name);
+        RENDER("terchat_%s %ld\n", gauges[i].name, gauges[i].fn());
+    }
+    pthread_mutex_unlock(&gaugeLock);
+
+    RENDER("# HELP terchat_request_latency_us Request handling latency in microseconds.\n");
+    RENDER("# TYPE terchat_request_latency_us histogram\n");
+    for (type = 0; type < METRIC_TYPE_COUNT; type++)
+    {
+        // Merge the shards into one snapshot of this type's histogram
+        unsigned long buckets[METRICS_BUCKETS] = {0};
+        unsigned long count = 0, sumUs = 0;
+        for (i = 0; i < METRICS_SHARDS; i++)
+        {
+            MetricsHistogram *histogram = &shards[i].requests[type];
+            int b;
+            for (b = 0; b < METRICS_BUCKETS; b++)
+            {
+                buckets[b] += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+            }
+            count += atomic_load_explicit(&histogram->count, memory_order_relaxed);
+            sumUs += atomic_load_explicit(&histogram->sumUs, memory_order_relaxed);
+        }
+        if (count == 0)
+        {
+            continue;
+        }
+
+        // Export cumulative buckets at power-of-two boundaries to keep scrapes small
+        unsigned long cumulative = 0;
+        int b = 0;
+        uint64_t le;
+        for (le = 1; le <= (1ull << METRICS_MAX_EXPONENT); le <<= 1)
+        {
+            while (b < METRICS_BUCKETS && metricsBucketUpperBound(b) <= le)
+            {
+                cumulative += buckets[b++];
+            }
+            RENDER("terchat_request_latency_us_bucket{type=\"%s\",le=\"%llu\"} %lu\n",
+                   metricTypeNames[type], (unsigned long long)le, cumulative);
+            if (cumulative == count)
+            {
+                break;
+            }
+        }
+        RENDER("terchat_request_latency_us_bucket{type=\"%s\",le=\"+Inf\"} %lu\n", metricTypeNames[type], count);
+        RENDER("terchat_request_latency_us_sum{type=\"%s\"} %lu\n", metricTypeNames[type], sumUs);
+        RENDER("terchat_request_latency_us_count{type=\"%s\"} %lu\n", metricTypeNames[type], count);
+
+        // Quantiles come from the fine-grained buckets
+        for (q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++)
+        {
+            unsigned long target = (unsigned long)(quantiles[q] * count);
+            unsigned long seen = 0;
+            for (b = 0; b < METRICS_BUCKETS; b++)
+            {
+                seen += buckets[b];
+                if (seen > target)
+                {
+                    break;
+                }
+            }
+            if (b == METRICS_BUCKETS)
+            {
+                b--;
+            }
+            RENDER("terchat_request_latency_quantile_us{type=\"%s\",quantile=\"%g\"} %llu\n",
+                   metricTypeNames[type], quantiles[q], (unsigned long long)metricsBucketUpperBound(b));
+        }
+    }
+    return used < size ? used : size - 1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Serves one rendered scrape to every client connecting to the endpoint.
+ *
+ * @param arg The listening Unix socket, cast to a pointer.
+ */
+// <----------------------------------------------------------------> //
+static void *metricsEndpointLoop(void *arg)
+{
+    int listenSock = (int)(intptr_t)arg;
+    char *buffer = malloc(METRICS_RENDER_BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        perror("Error allocating metrics buffer");
+        return NULL;
+    }
+
+    while (1)
+    {
+        int client = accept(listenSock, NULL, NULL);
+        if (client < 0)
+        {
+            continue;
+        }
+        size_t length = metricsRender(buffer, METRICS_RENDER_BUFFER_SIZE);
+        size_t sent = 0;
+        while (sent < length)
+        {
+            ssize_t n = write(client, buffer + sent, length - sent);
+            if (n <= 0)
+            {
+                break;
+            }
+            sent += (size_t)n;
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Starts the local Unix-socket endpoint that serves metrics scrapes.
+ *
+ * @param socketPath The filesystem path of the socket to create.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int metricsStartEndpoint(const char *socketPath)
+{
+    struct sockaddr_un addr;
+    if (strlen(socketPath) >= sizeof(addr.sun_path))
+    {
+        printf("Metrics socket path too long: %s\n", socketPath);
+        return -1;
+    }
+
+    int listenSock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSock < 0)
+    {
+        perror("Metrics socket failed");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+    unlink(socketPath);
+
+    if (bind(listenSock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenSock, 16) < 0)
+    {
+        perror("Metrics endpoint err");
+        close(listenSock);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metricsEndpointLoop, (void *)(intptr_t)listenSock) != 0)
+    {
+        perror("Metrics thread create error");
+        close(listenSock);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "log.h"
+#include "presence.h"
+
+#define PRESENCE_CHUNK_USERS 65536
+#define PRESENCE_CHUNK_WORDS (PRESENCE_CHUNK_USERS / 64)
+
+// Online bits of one range of user IDs; allocated when the first user of the range logs in
+typedef struct
+{
+    atomic_ullong words[PRESENCE_CHUNK_WORDS];
+} PresenceChunk;
+
+typedef struct
+{
+    int32_t *ids;
+    uint32_t count;
+    uint32_t capacity;
+} PresenceList;
+
+// A frame built under the lock and sent after it is released
+typedef struct
+{
+    int sock;
+    unsigned generation; // of the subscriber's connection, so a reused socket is not pushed to
+    Message message;
+} PresenceFrame;
+
+static pthread_mutex_t presenceLock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(PresenceChunk *) *onlineChunks = NULL; // read without the lock
+static int chunkCount = 0;
+static atomic_long onlineUsers;
+static long subscriberCount = 0;
+static int userCapacity = 0;
+static PresenceList *connections = NULL;   // per user: the sockets logged in as the user
+static atomic_int *socketUsers = NULL;     // per socket: the user logged in on it, -1 if none; read without the lock
+static atomic_int *userSockets = NULL;     // per user: the connection messages go to, -1 if none; read without the lock
+static int socketCapacity = 0;
+static uint64_t *published = NULL;        // per user: the state last pushed to subscribers
+static uint64_t *dirty = NULL;            // per user: set while in changed
+static PresenceList changed;              // users whose state changed since the last flush
+static PresenceList *watchers = NULL;     // per user: subscribers who have the user as a contact
+static PresenceList *subscriptions = NULL; // per subscriber: the contacts watched
+static PresenceList *pending = NULL;       // per subscriber: contacts to push on the next flush
+static PresenceList pendingSubscribers;
+static int *subscriberSockets = NULL; // per user: the subscribed connection, -1 if none
+static unsigned *subscriberGenerations = NULL; // per user: the generation given with the subscription
+static PresenceSendFn presenceSend;
+
+static int presenceListAdd(PresenceList *list, int32_t id)
+{
+    if (list->count == list->capacity)
+    {
+        uint32_t capacity = list->capacity > 0 ? list->capacity * 2 : 4;
+        int32_t *grown = realloc(list->ids, capacity * sizeof(int32_t));
+        if (grown == NULL)
+        {
+            LOG_ERROR("Error growing presence list: %s", strerror(errno));
+            return -1;
+        }
+        list->ids = grown;
+        list->capacity = capacity;
+    }
+    list->ids[list->count++] = id;
+    return 0;
+}
+
+static void presenceListRemove(PresenceList *list, int32_t id)
+{
+    uint32_t i;
+    for (i = 0; i < list->count; i++)
+    {
+        if (list->ids[i] == id)
+        {
+            list->ids[i] = list->ids[--list->count];
+            return;
+        }
+    }
+}
+
+static int presenceBit(const uint64_t *bitmap, int userId)
+{
+    return (int)(bitmap[userId / 64] >> (userId % 64)) & 1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Flips a user's online bit and queues the change for the next flush.
+ *
+ * Called with presenceLock held, which serialises all writers.
+ */
+// <----------------------------------------------------------------> //
+static void presenceSetOnline(int userId, int online)
+{
+    _Atomic(PresenceChunk *) *slot = &onlineChunks[userId / PRESENCE_CHUNK_USERS];
+    PresenceChunk *chunk = atomic_load_explicit(slot, memory_order_acquire);
+    if (chunk == NULL)
+    {
+        if (!online || (chunk = calloc(1, sizeof(PresenceChunk))) == NULL)
+        {
+            return;
+        }
+        atomic_store_explicit(slot, chunk, memory_order_release);
+    }
+    int bit = userId % PRESENCE_CHUNK_USERS;
+    unsigned long long mask = 1ull << (bit % 64);
+    if (online)
+    {
+        atomic_fetch_or_explicit(&chunk->words[bit / 64], mask, memory_order_release);
+        atomic_fetch_add(&onlineUsers, 1);
+    }
+    else
+    {
+        atomic_fetch_and_explicit(&chunk->words[bit / 64], ~mask, memory_order_release);
+        atomic_fetch_sub(&onlineUsers, 1);
+    }
+
+    if (!presenceBit(dirty, userId) && presenceListAdd(&changed, userId) == 0)
+    {
+        dirty[userId / 64] |= 1ull << (userId % 64);
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Queues a contact's current state for a subscriber; presenceLock held.
+ */
+// <----------------------------------------------------------------> //
+static void presenceQueue(int subscriberId, int contactId)
+{
+    if (pending[subscriberId].count == 0 && presenceListAdd(&pendingSubscribers, subscriberId) < 0)
+    {
+        return;
+    }
+    presenceListAdd(&pending[subscriberId], contactId);
+}
+
+static void presenceUnsubscribe(int userId)
+{
+    uint32_t i;
+    for (i = 0; i < subscriptions[userId].count; i++)
+    {
+        presenceListRemove(&watchers[subscriptions[userId].ids[i]], userId);
+    }
+    subscriptions[userId].count = 0;
+    pending[userId].count = 0; // left in pendingSubscribers; the flush skips it
+    subscriberSockets[userId] = -1;
+    subscriberCount--;
+}
+
+// Forgets the user logged in on a socket; presenceLock held
+static int presenceDropConnection(int sock)
+{
+    int userId = atomic_load_explicit(&socketUsers[sock], memory_order_relaxed);
+    if (userId < 0)
+    {
+        return -1;
+    }
+    atomic_store_explicit(&socketUsers[sock], -1, memory_order_release);
+    PresenceList *sockets = &connections[userId];
+    presenceListRemove(sockets, sock);
+    if (sockets->count == 0)
+    {
+        presenceSetOnline(userId, 0);
+        atomic_store_explicit(&userSockets[userId], -1, memory_order_release);
+    }
+    else if (atomic_load_explicit(&userSockets[userId], memory_order_relaxed) == sock)
+    {
+        // Fall back to another connection of the user
+        atomic_store_explicit(&userSockets[userId], sockets->ids[sockets->count - 1], memory_order_release);
+    }
+    if (subscriberSockets[userId] == sock)
+    {
+        presenceUnsubscribe(userId);
+    }
+    return userId;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Pushes the changes since the last flush, one batch per subscriber.
+ *
+ * A user who went offline and back within one interval is not reported at
+ * all, and a subscriber gets the changes of all its contacts in as few
+ * frames as fit, so a mass reconnect costs one frame per subscriber instead
+ * of one per pair of contacts.
+ */
+// <----------------------------------------------------------------> //
+static void presenceFlush(void)
+{
+    PresenceFrame *frames = NULL;
+    size_t frameCount = 0;
+    size_t frameCapacity = 0;
+
+    pthread_mutex_lock(&presenceLock);
+    uint32_t i;
+    for (i = 0; i < changed.count; i++)
+    {
+        int userId = changed.ids[i];
+        dirty[userId / 64] &= ~(1ull << (userId % 64));
+        int online = presenceIsOnline(userId);
+        if (online == presenceBit(published, userId))
+        {
+            continue;
+        }
+        published[userId / 64] ^= 1ull << (userId % 64);
+        uint32_t j;
+        for (j = 0; j < watchers[userId].count; j++)
+        {
+            presenceQueue(watchers[userId].ids[j], userId);
+        }
+    }
+    changed.count = 0;
+
+    for (i = 0; i < pendingSubscribers.count; i++)
+    {
+        int subscriberId = pendingSubscribers.ids[i];
+        PresenceList *contacts = &pending[subscriberId];
+        uint32_t j;
+        for (j = 0; j < contacts->count && subscriberSockets[subscriberId] >= 0; j++)
+        {
+            if (j % PRESENCE_CHANGES_PER_FRAME == 0)
+            {
+                if (frameCount == frameCapacity)
+                {
+                    size_t capacity = frameCapacity > 0 ? frameCapacity * 2 : 16;
+                    PresenceFrame *grown = realloc(frames, capacity * sizeof(PresenceFrame));
+                    if (grown == NULL)
+                    {
+                        LOG_ERROR("Error allocating presence frames: %s", strerror(errno));
+                        break;
+                    }
+                    frames = grown;
+                    frameCapacity = capacity;
+                }
+                PresenceFrame *frame = &frames[frameCount++];
+                memset(frame, 0, sizeof(PresenceFrame));
+                frame->sock = subscriberSockets[subscriberId];
+                frame->generation = subscriberGenerations[subscriberId];
+                frame->message.type = 14;
+                frame->message.from = -1;
+                frame->message.to = 0;
+            }
+            Message *message = &frames[frameCount - 1].message;
+            PresenceChange change = {contacts->ids[j], presenceIsOnline(contacts->ids[j])};
+            memcpy(message->body + (size_t)message->to * sizeof(PresenceChange), &change, sizeof(change));
+            message->to++;
+        }
+        contacts->count = 0;
+    }
+    pendingSubscribers.count = 0;
+    pthread_mutex_unlock(&presenceLock);
+
+    size_t k;
+    for (k = 0; k < frameCount; k++)
+    {
+        presenceSend(frames[k].sock, frames[k].generation, &frames[k].message);
+    }
+    free(frames);
+}
+
+static void *presenceFlusherLoop(void *arg)
+{
+    (void)arg;
+    struct timespec interval = {0, PRESENCE_FLUSH_INTERVAL_MS * 1000000L};
+    while (1)
+    {
+        nanosleep(&interval, NULL);
+        presenceFlush();
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Allocates the presence tables and starts the flusher thread.
+ *
+ * @param capacity The number of user IDs.
+ * @param maxSockets One more than the highest socket descriptor that can log in.
+ * @param send Sends the pushed frames.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int presenceStart(int capacity, int maxSockets, PresenceSendFn send)
+{
+    size_t words = ((size_t)capacity + 63) / 64;
+    chunkCount = (capacity + PRESENCE_CHUNK_USERS - 1) / PRESENCE_CHUNK_USERS;
+    onlineChunks = calloc((size_t)chunkCount, sizeof(*onlineChunks));
+    connections = calloc((size_t)capacity, sizeof(PresenceList));
+    socketUsers = malloc((size_t)maxSockets * sizeof(atomic_int));
+    published = calloc(words, sizeof(uint64_t));
+    dirty = calloc(words, sizeof(uint64_t));
+    watchers = calloc((size_t)capacity, sizeof(PresenceList));
+    subscriptions = calloc((size_t)capacity, sizeof(PresenceList));
+    pending = calloc((size_t)capacity, sizeof(PresenceList));
+    subscriberSockets = malloc((size_t)capacity * sizeof(int));
+    subscriberGenerations = calloc((size_t)capacity, sizeof(unsigned));
+    userSockets = malloc((size_t)capacity * sizeof(atomic_int));
+    if (onlineChunks == NULL || connections == NULL || socketUsers == NULL || published == NULL || dirty == NULL ||
+        watchers == NULL || subscriptions == NULL || pending == NULL || subscriberSockets == NULL || subscriberGenerations == NULL ||
+        userSockets == NULL)
+    {
+        LOG_ERROR("Error allocating presence tables: %s", strerror(errno));
+        return -1;
+    }
+    int i;
+    for (i = 0; i < maxSockets; i++)
+    {
+        atomic_init(&socketUsers[i], -1);
+    }
+    for (i = 0; i < capacity; i++)
+    {
+        subscriberSockets[i] = -1;
+        atomic_init(&userSockets[i], -1);
+    }
+    presenceSend = send;
+    socketCapacity = maxSockets;
+    userCapacity = capacity;
+
+    pthread_t flusher;
+    if (pthread_create(&flusher, NULL, presenceFlusherLoop, NULL) != 0)
+    {
+        LOG_ERROR("Presence flusher thread create error");
+        return -1;
+    }
+    pthread_detach(flusher);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Records a user logging in on a connection.
+ *
+ * A connection that was logged in as another user is switched over.
+ */
+// <----------------------------------------------------------------> //
+void presenceConnected(int sock, int userId)
+{
+    if (sock < 0 || sock >= socketCapacity || userId < 0 || userId >= userCapacity)
+    {
+        return;
+    }
+    pthread_mutex_lock(&presenceLock);
+    if (atomic_load_explicit(&socketUsers[sock], memory_order_relaxed) != userId)
+    {
+        presenceDropConnection(sock);
+        if (presenceListAdd(&connections[userId], sock) < 0)
+        {
+            pthread_mutex_unlock(&presenceLock);
+            return;
+        }
+        atomic_store_explicit(&socketUsers[sock], userId, memory_order_release);
+        if (connections[userId].count == 1)
+        {
+            presenceSetOnline(userId, 1);
+        }
+    }
+    atomic_store_explicit(&userSockets[userId], sock, memory_order_release); // the latest login receives the user's messages
+    pthread_mutex_unlock(&presenceLock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Records a connection closing; call before its socket is closed.
+ *
+ * @return int The user that was logged in on the connection, or -1.
+ */
+// <----------------------------------------------------------------> //
+int presenceDisconnected(int sock)
+{
+    if (sock < 0 || sock >= socketCapacity)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&presenceLock);
+    int userId = presenceDropConnection(sock);
+    pthread_mutex_unlock(&presenceLock);
+    return userId;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Tells whether a user has a logged-in connection; lock-free.
+ */
+// <----------------------------------------------------------------> //
+int presenceIsOnline(int userId)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return 0;
+    }
+    PresenceChunk *chunk = atomic_load_explicit(&onlineChunks[userId / PRESENCE_CHUNK_USERS], memory_order_acquire);
+    if (chunk == NULL)
+    {
+        return 0;
+    }
+    int bit = userId % PRESENCE_CHUNK_USERS;
+    return (int)(atomic_load_explicit(&chunk->words[bit / 64], memory_order_acquire) >> (bit % 64)) & 1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Finds the connection a user's messages are delivered to; lock-free.
+ *
+ * @return int The socket the user most recently logged in on that is still
+ *             open, or -1 if the user is offline.
+ */
+// <----------------------------------------------------------------> //
+int presenceSocketOf(int userId)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return -1;
+    }
+    return atomic_load_explicit(&userSockets[userId], memory_order_acquire);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns the user logged in on a connection, or -1 if none; lock-free.
+ */
+// <----------------------------------------------------------------> //
+int presenceUserOf(int sock)
+{
+    if (sock < 0 || sock >= socketCapacity)
+    {
+        return -1;
+    }
+    return atomic_load_explicit(&socketUsers[sock], memory_order_acquire);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Subscribes a connection to the presence of a user's contacts.
+ *
+ * Changes are pushed until the connection closes or subscribes again; the
+ * caller replies with the current state of the contacts.
+ *
+ * @param sock The connection to push to.
+ * @param generation The connection's generation, passed back with every push.
+ * @param userId The subscribing user.
+ * @param contacts The user's contact list.
+ * @param contactCount The number of contacts.
+ */
+// <----------------------------------------------------------------> //
+void presenceSubscribe(int sock, unsigned generation, int userId, const int32_t *contacts, int contactCount)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return;
+    }
+    pthread_mutex_lock(&presenceLock);
+    if (subscriberSockets[userId] >= 0)
+    {
+        presenceUnsubscribe(userId);
+    }
+    subscriberSockets[userId] = sock;
+    subscriberGenerations[userId] = generation;
+    subscriberCount++;
+    int i;
+    for (i = 0; i < contactCount; i++)
+    {
+        if (contacts[i] >= 0 && contacts[i] < userCapacity && presenceListAdd(&subscriptions[userId], contacts[i]) == 0)
+        {
+            presenceListAdd(&watchers[contacts[i]], userId);
+        }
+    }
+    pthread_mutex_unlock(&presenceLock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Starts watching a new contact of a subscribed user and pushes its state.
+ */
+// <----------------------------------------------------------------> //
+void presenceContactAdded(int userId, int contactId)
+{
+    if (userId < 0 || userId >= userCapacity || contactId < 0 || contactId >= userCapacity)
+    {
+        return;
+    }
+    pthread_mutex_lock(&presenceLock);
+    if (subscriberSockets[userId] >= 0 && presenceListAdd(&subscriptions[userId], contactId) == 0)
+    {
+        presenceListAdd(&watchers[contactId], userId);
+        presenceQueue(userId, contactId);
+    }
+    pthread_mutex_unlock(&presenceLock);
+}
+
+void presenceContactRemoved(int userId, int contactId)
+{
+    if (userId < 0 || userId >= userCapacity || contactId < 0 || contactId >= userCapacity)
+    {
+        return;
+    }
+    pthread_mutex_lock(&presenceLock);
+    if (subscriberSockets[userId] >= 0)
+    {
+        presenceListRemove(&subscriptions[userId], contactId);
+        presenceListRemove(&watchers[contactId], userId);
+    }
+    pthread_mutex_unlock(&presenceLock);
+}
+
+long presenceOnlineUsers(void)
+{
+    return atomic_load(&onlineUsers);
+}
+
+long presenceSubscribers(void)
+{
+    pthread_mutex_lock(&presenceLock);
+    long count = subscriberCount;
+    pthread_mutex_unlock(&presenceLock);
+    return count;
+}
@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "reactor.h"
+#include "trace.h"
+
+#define REACTOR_MAX_EVENTS 256
+
+typedef struct
+{
+    int sock;
+    int isListener;
+    size_t received; // bytes of the current frame read so far
+    unsigned char frame[];
+} ReactorConnection;
+
+typedef struct
+{
+    int id;
+    int listenSock;
+    int epollFd;
+    const ReactorConfig *config;
+    pthread_t thread;
+} Reactor;
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Opens a listening TCP socket on all interfaces.
+ *
+ * @param port The port to listen on.
+ * @param backlog The accept queue length passed to listen().
+ * @param reusePort Whether to set SO_REUSEPORT so several listeners can share the port.
+ * @return int The listening socket, or -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int reactorOpenListener(int port, int backlog, int reusePort)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        LOG_ERROR("Server Socket Failed: %s", strerror(errno));
+        return -1;
+    }
+
+    int enable = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    // Inherited by accepted sockets: multi-frame replies must not wait for delayed ACKs
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    if (reusePort && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+    {
+        LOG_ERROR("SO_REUSEPORT err: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    struct sockaddr_in servAddr;
+    memset(&servAddr, 0, sizeof(servAddr));
+    servAddr.sin_family = AF_INET;
+    servAddr.sin_addr.s_addr = INADDR_ANY;
+    servAddr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0)
+    {
+        LOG_ERROR("Binding Server socket err: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+    if (listen(sock, backlog) < 0)
+    {
+        LOG_ERROR("server listen err: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Removes a connection from the reactor and closes it.
+ */
+// <----------------------------------------------------------------> //
+static void reactorClose(Reactor *reactor, ReactorConnection *connection)
+{
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_DEL, connection->sock, NULL);
+    if (reactor->config->onClose != NULL)
+    {
+        reactor->config->onClose(connection->sock, reactor->config->context);
+    }
+    close(connection->sock);
+    free(connection);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Accepts every pending connection on the reactor's listener.
+ *
+ * Draining the whole accept queue per wakeup is what lets a reconnect storm
+ * be absorbed quickly instead of one accept per epoll round trip.
+ */
+// <----------------------------------------------------------------> //
+static void reactorAccept(Reactor *reactor)
+{
+    const ReactorConfig *config = reactor->config;
+    while (1)
+    {
+        int sock = accept4(reactor->listenSock, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                LOG_ERROR("Reactor %d accept err: %s", reactor->id, strerror(errno));
+            }
+            return;
+        }
+
+        ReactorConnection *connection = malloc(sizeof(ReactorConnection) + config->frameSize);
+        if (connection == NULL)
+        {
+            close(sock);
+            continue;
+        }
+        connection->sock = sock;
+        connection->isListener = 0;
+        connection->received = 0;
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = connection;
+        if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, sock, &event) < 0)
+        {
+            LOG_ERROR("Reactor %d epoll add err: %s", reactor->id, strerror(errno));
+            close(sock);
+            free(connection);
+            continue;
+        }
+        if (config->onAccept != NULL)
+        {
+            config->onAccept(sock, config->context);
+        }
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Reads whatever is available on a connection and dispatches complete frames.
+ *
+ * Client sockets stay in blocking mode so handlers can keep using plain
+ * send(), bounded by the send timeout the onAccept callback sets; reads use
+ * MSG_DONTWAIT so the loop never blocks on a slow client.
+ */
+// <----------------------------------------------------------------> //
+static void reactorRead(Reactor *reactor, ReactorConnection *connection)
+{
+    const ReactorConfig *config = reactor->config;
+    while (1)
+    {
+        traceReadStarted();
+        ssize_t n = recv(connection->sock, connection->frame + connection->received,
+                         config->frameSize - connection->received, MSG_DONTWAIT);
+        if (n > 0)
+        {
+            connection->received += (size_t)n;
+            if (connection->received == config->frameSize)
+            {
+                connection->received = 0;
+                if (config->onFrame(connection->sock, connection->frame, config->context) < 0)
+                {
+                    reactorClose(reactor, connection);
+                    return;
+                }
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        reactorClose(reactor, connection);
+        return;
+    }
+}
+
+static void *reactorLoop(void *arg)
+{
+    Reactor *reactor = (Reactor *)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    LOG_INFO("Reactor %d listening on port %d", reactor->id, reactor->config->port);
+    while (1)
+    {
+        int count = epoll_wait(reactor->epollFd, events, REACTOR_MAX_EVENTS, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOG_ERROR("Reactor %d epoll_wait err: %s", reactor->id, strerror(errno));
+            break;
+        }
+
+        int i;
+        for (i = 0; i < count; i++)
+        {
+            ReactorConnection *connection = events[i].data.ptr;
+            if (connection->isListener)
+            {
+                reactorAccept(reactor);
+            }
+            else
+            {
+                reactorRead(reactor, connection);
+            }
+        }
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Raises the open file limit to the hard limit so many connections fit.
+ *
+ * @return long The resulting soft limit, or -1 if it cannot be read.
+ */
+// <----------------------------------------------------------------> //
+long reactorRaiseFileLimit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+    {
+        return -1;
+    }
+    if (limit.rlim_cur < limit.rlim_max && setrlimit(RLIMIT_NOFILE, &(struct rlimit){limit.rlim_max, limit.rlim_max}) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+    }
+    return limit.rlim_cur == RLIM_INFINITY ? -1 : (long)limit.rlim_cur;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Runs the configured number of reactor threads and blocks forever.
+ *
+ * Each reactor owns a SO_REUSEPORT listener and an epoll instance, so the
+ * kernel spreads incoming connections across reactors and no accept lock
+ * is shared between them.
+ *
+ * @param config The reactor configuration; must outlive the reactors.
+ * @return int -1 if the reactors could not be started.
+ */
+// <----------------------------------------------------------------> //
+int reactorRun(const ReactorConfig *config)
+{
+    reactorRaiseFileLimit();
+
+    Reactor *reactors = calloc((size_t)config->reactorCount, sizeof(Reactor));
+    if (reactors == NULL)
+    {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < config->reactorCount; i++)
+    {
+        Reactor *reactor = &reactors[i];
+        reactor->id = i;
+        reactor->config = config;
+        reactor->listenSock = reactorOpenListener(config->port, config->backlog, 1);
+        reactor->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactor->listenSock < 0 || reactor->epollFd < 0)
+        {
+            LOG_ERROR("Reactor %d could not be started", i);
+            return -1;
+        }
+
+        ReactorConnection *listener = calloc(1, sizeof(ReactorConnection));
+        listener->sock = reactor->listenSock;
+        listener->isListener = 1;
+        int flags = fcntl(reactor->listenSock, F_GETFL, 0);
+        if (fcntl(reactor->listenSock, F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            LOG_ERROR("Reactor %d listener nonblocking err: %s", i, strerror(errno));
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = listener;
+        epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->listenSock, &event);
+
+        if (pthread_create(&reactor->thread, NULL, reactorLoop, reactor) != 0)
+        {
+            LOG_ERROR("Reactor %d thread create error", i);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < config->reactorCount; i++)
+    {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    free(reactors);
+    return 0;
+}
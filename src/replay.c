@@ -0,0 +1,671 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "capture.h"
+#include "protocol.h"
+
+#define REPLAY_MAX_TYPES 32
+#define REPLAY_EPOLL_EVENTS 256
+#define REPLAY_MAX_DESCRIPTOR (1u << 24) // larger connection numbers mean a corrupt capture
+#define REPLAY_DEFAULT_DRAIN_MS 2000 // how long to wait for outstanding replies once everything is sent
+
+// One step of the replay, in capture order
+typedef struct
+{
+    uint8_t kind;
+    int connection; // index into connections
+    uint64_t timestampUs;
+    const char *frame; // CaptureFrame and body, for CAPTURE_FRAME
+    int request;       // index into requests, -1 if the frame carries no request ID
+} ReplayEvent;
+
+// A connection of the capture and the socket it is replayed on
+typedef struct
+{
+    int fd; // -1 until opened, or if the connection failed
+    size_t filled;
+    char buffer[sizeof(Message)];
+} ReplayConnection;
+
+// A request of the capture and how long its first reply took, then and now
+typedef struct
+{
+    int type;
+    int connection;
+    int32_t requestId;
+    uint64_t sentUs;       // in the capture
+    int64_t recordedUs;    // latency in the capture, -1 if no reply was recorded
+    atomic_ullong sentNs;  // when the replay sent it, 0 until then
+    atomic_llong replayNs; // latency in the replay, -1 until the first reply
+} ReplayRequest;
+
+// Maps (connection, request ID) to the request last sent with that ID
+typedef struct
+{
+    uint64_t key; // 0 for an empty slot
+    atomic_int request;
+} ReplaySlot;
+
+static ReplayEvent *events = NULL;
+static size_t eventCount = 0;
+static ReplayConnection *connections = NULL;
+static int connectionCount = 0;
+static ReplayRequest *requests = NULL;
+static int requestCount = 0;
+static ReplaySlot *slots = NULL;
+static size_t slotMask = 0;
+static int epollFd = -1;
+static atomic_int stopping;
+static atomic_long framesReceived;
+
+static uint64_t replayNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t replayKey(int connection, int32_t requestId)
+{
+    return ((uint64_t)(uint32_t)(connection + 1) << 32) | (uint32_t)requestId;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Finds the slot of a key, or the empty slot where it would go.
+ *
+ * Every key is claimed while the capture is parsed, so during the replay
+ * the table is only read and the request indices in it swapped.
+ */
+// <----------------------------------------------------------------> //
+static ReplaySlot *replayFindSlot(uint64_t key)
+{
+    size_t i = (size_t)(key * 0x9e3779b97f4a7c15ull) & slotMask;
+    while (slots[i].key != 0 && slots[i].key != key)
+    {
+        i = (i + 1) & slotMask;
+    }
+    return &slots[i];
+}
+
+static ReplaySlot *replayClaimSlot(uint64_t key)
+{
+    ReplaySlot *slot = replayFindSlot(key);
+    slot->key = key;
+    return slot;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Reads a whole capture file into memory.
+ *
+ * @return char* The contents; free() them. NULL on error.
+ */
+// <----------------------------------------------------------------> //
+static char *replayReadFile(const char *path, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    char *data = NULL;
+    size_t capacity = 0;
+    *length = 0;
+    while (1)
+    {
+        if (*length == capacity)
+        {
+            capacity = capacity > 0 ? capacity * 2 : 1 << 20;
+            char *grown = realloc(data, capacity);
+            if (grown == NULL)
+            {
+                free(data);
+                fclose(file);
+                return NULL;
+            }
+            data = grown;
+        }
+        size_t read = fread(data + *length, 1, capacity - *length, file);
+        if (read == 0)
+        {
+            break;
+        }
+        *length += read;
+    }
+    fclose(file);
+    return data;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Turns a capture into events, connections and requests.
+ *
+ * Socket descriptors are reused by the server, so each CAPTURE_OPEN starts
+ * a new connection; a frame of a descriptor with no open connection (the
+ * capture started in the middle of a session) opens one implicitly. The
+ * latency of each request in the capture is taken from its first reply.
+ *
+ * @return int 0 on success, -1 if the capture is malformed or memory runs out.
+ */
+// <----------------------------------------------------------------> //
+static int replayParse(const char *data, size_t length)
+{
+    size_t offset = strlen(CAPTURE_MAGIC);
+    if (length < offset || memcmp(data, CAPTURE_MAGIC, offset) != 0)
+    {
+        fprintf(stderr, "Not a capture file\n");
+        return -1;
+    }
+
+    // Upper bounds first: every record is at least a header long
+    size_t maxRecords = (length - offset) / sizeof(CaptureRecord) + 1;
+    events = calloc(maxRecords * 2, sizeof(ReplayEvent));
+    connections = calloc(maxRecords, sizeof(ReplayConnection));
+    requests = calloc(maxRecords, sizeof(ReplayRequest));
+    size_t slotCount = 16;
+    while (slotCount < maxRecords * 2)
+    {
+        slotCount *= 2;
+    }
+    slots = calloc(slotCount, sizeof(ReplaySlot));
+    slotMask = slotCount - 1;
+    int descriptorCapacity = 1024;
+    int *openConnections = malloc((size_t)descriptorCapacity * sizeof(int));
+    if (events == NULL || connections == NULL || requests == NULL || slots == NULL || openConnections == NULL)
+    {
+        free(openConnections);
+        fprintf(stderr, "Out of memory for %zu records\n", maxRecords);
+        return -1;
+    }
+    int i;
+    for (i = 0; i < descriptorCapacity; i++)
+    {
+        openConnections[i] = -1;
+    }
+
+    int result = 0;
+    while (offset + sizeof(CaptureRecord) <= length)
+    {
+        CaptureRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        offset += sizeof(record);
+        if (record.connection >= REPLAY_MAX_DESCRIPTOR)
+        {
+            result = -1;
+            break;
+        }
+        int descriptor = (int)record.connection;
+        while (descriptor >= descriptorCapacity)
+        {
+            int *grown = realloc(openConnections, (size_t)descriptorCapacity * 2 * sizeof(int));
+            if (grown == NULL)
+            {
+                free(openConnections);
+                return -1;
+            }
+            openConnections = grown;
+            for (i = descriptorCapacity; i < descriptorCapacity * 2; i++)
+            {
+                openConnections[i] = -1;
+            }
+            descriptorCapacity *= 2;
+        }
+
+        if (record.kind == CAPTURE_OPEN || (record.kind == CAPTURE_FRAME && openConnections[descriptor] < 0))
+        {
+            connections[connectionCount].fd = -1;
+            openConnections[descriptor] = connectionCount++;
+            events[eventCount++] = (ReplayEvent){CAPTURE_OPEN, openConnections[descriptor], record.timestampUs, NULL, -1};
+        }
+        int connection = openConnections[descriptor];
+
+        if (record.kind == CAPTURE_FRAME)
+        {
+            CaptureFrame frame;
+            if (offset + sizeof(frame) > length)
+            {
+                result = -1;
+                break;
+            }
+            memcpy(&frame, data + offset, sizeof(frame));
+            if (frame.bodyLength > MESSAGE_BODY_SIZE || offset + sizeof(frame) + frame.bodyLength > length)
+            {
+                result = -1;
+                break;
+            }
+            int request = -1;
+            if (frame.requestId != 0)
+            {
+                request = requestCount++;
+                requests[request] = (ReplayRequest){.type = frame.type, .connection = connection, .requestId = frame.requestId, .sentUs = record.timestampUs, .recordedUs = -1};
+                atomic_store(&requests[request].replayNs, -1);
+                atomic_store(&replayClaimSlot(replayKey(connection, frame.requestId))->request, request);
+            }
+            events[eventCount++] = (ReplayEvent){CAPTURE_FRAME, connection, record.timestampUs, data + offset, request};
+            offset += sizeof(frame) + frame.bodyLength;
+        }
+        else if (record.kind == CAPTURE_REPLY)
+        {
+            int32_t requestId;
+            if (offset + sizeof(requestId) > length)
+            {
+                result = -1;
+                break;
+            }
+            memcpy(&requestId, data + offset, sizeof(requestId));
+            offset += sizeof(requestId);
+            if (connection >= 0)
+            {
+                ReplaySlot *slot = replayFindSlot(replayKey(connection, requestId));
+                int request = slot->key != 0 ? atomic_load(&slot->request) : -1;
+                if (request >= 0 && requests[request].recordedUs < 0)
+                {
+                    requests[request].recordedUs = (int64_t)(record.timestampUs - requests[request].sentUs);
+                }
+            }
+        }
+        else if (record.kind == CAPTURE_CLOSE)
+        {
+            if (connection >= 0)
+            {
+                events[eventCount++] = (ReplayEvent){CAPTURE_CLOSE, connection, record.timestampUs, NULL, -1};
+            }
+            openConnections[descriptor] = -1;
+        }
+        else if (record.kind != CAPTURE_OPEN)
+        {
+            result = -1;
+            break;
+        }
+    }
+    free(openConnections);
+    if (result < 0)
+    {
+        fprintf(stderr, "Capture is corrupt at byte %zu; replaying what came before\n", offset);
+    }
+
+    // The replay maps request IDs afresh as it sends
+    size_t slot;
+    for (slot = 0; slot <= slotMask; slot++)
+    {
+        atomic_store(&slots[slot].request, -1);
+    }
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Matches a reply with the request it answers and records the first reply's latency.
+ */
+// <----------------------------------------------------------------> //
+static void replayReplyReceived(int connection, const Message *reply, uint64_t now)
+{
+    atomic_fetch_add_explicit(&framesReceived, 1, memory_order_relaxed);
+    if (reply->requestId == 0)
+    {
+        return;
+    }
+    ReplaySlot *slot = replayFindSlot(replayKey(connection, reply->requestId));
+    int request = slot->key != 0 ? atomic_load(&slot->request) : -1;
+    if (request < 0)
+    {
+        return;
+    }
+    long long unanswered = -1;
+    uint64_t sentNs = atomic_load(&requests[request].sentNs);
+    atomic_compare_exchange_strong(&requests[request].replayNs, &unanswered, (long long)(now - sentNs));
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Receiving thread: reads the replies on every connection.
+ */
+// <----------------------------------------------------------------> //
+static void *replayReceive(void *arg)
+{
+    (void)arg;
+    struct epoll_event ready[REPLAY_EPOLL_EVENTS];
+    while (!atomic_load(&stopping))
+    {
+        int count = epoll_wait(epollFd, ready, REPLAY_EPOLL_EVENTS, 100);
+        int i;
+        for (i = 0; i < count; i++)
+        {
+            ReplayConnection *connection = &connections[ready[i].data.u32];
+            while (1)
+            {
+                ssize_t received = recv(connection->fd, connection->buffer + connection->filled, sizeof(Message) - connection->filled, MSG_DONTWAIT);
+                if (received <= 0)
+                {
+                    if (received == 0 || (errno != EAGAIN && errno != EINTR))
+                    {
+                        epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, NULL); // closed once the replay ends
+                    }
+                    break;
+                }
+                connection->filled += (size_t)received;
+                if (connection->filled == sizeof(Message))
+                {
+                    Message reply;
+                    memcpy(&reply, connection->buffer, sizeof(reply));
+                    connection->filled = 0;
+                    replayReplyReceived((int)ready[i].data.u32, &reply, replayNow());
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Opens a connection of the capture and hands it to the receiving thread.
+ *
+ * @return int 0 on success, -1 on error; the connection's fd stays -1 then.
+ */
+// <----------------------------------------------------------------> //
+static int replayConnect(const struct sockaddr_in *address, int index)
+{
+    ReplayConnection *connection = &connections[index];
+    connection->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connection->fd < 0)
+    {
+        return -1;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = (uint32_t)index};
+    if (connect(connection->fd, (const struct sockaddr *)address, sizeof(*address)) != 0 ||
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, connection->fd, &event) != 0)
+    {
+        close(connection->fd);
+        connection->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int replaySendAll(int fd, const Message *message)
+{
+    const char *data = (const char *)message;
+    size_t left = sizeof(Message);
+    while (left > 0)
+    {
+        ssize_t sent = send(fd, data, left, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        left -= (size_t)sent;
+    }
+    return 0;
+}
+
+static int compareLatencies(const void *a, const void *b)
+{
+    int64_t left = *(const int64_t *)a;
+    int64_t right = *(const int64_t *)b;
+    return (left > right) - (left < right);
+}
+
+static double replayPercentileMs(int64_t *values, int count, double percentile, double unitsPerMs)
+{
+    if (count == 0)
+    {
+        return 0.0;
+    }
+    int index = (int)(percentile * (count - 1) + 0.5);
+    return (double)values[index] / unitsPerMs;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Prints, per message type, the reply latencies of the capture next to those of the replay.
+ */
+// <----------------------------------------------------------------> //
+static void replayReport(double seconds, double speed, uint64_t maxSlipNs, long sendErrors)
+{
+    printf("Replayed %zu events on %d connections in %.2f s", eventCount, connectionCount, seconds);
+    if (speed > 0)
+    {
+        printf(" at %gx speed", speed);
+    }
+    else
+    {
+        printf(" at full speed");
+    }
+    printf("; %ld frames received, %ld failed sends, max schedule slip %.2f ms\n",
+           atomic_load(&framesReceived), sendErrors, (double)maxSlipNs / 1e6);
+    printf("%-5s %9s %9s %9s | %12s %12s | %12s %12s | %9s\n", "type", "requests", "recorded", "replayed",
+           "rec p50 ms", "rec p99 ms", "rep p50 ms", "rep p99 ms", "p99 diff");
+
+    int64_t *recorded = malloc((size_t)(requestCount > 0 ? requestCount : 1) * sizeof(int64_t));
+    int64_t *replayed = malloc((size_t)(requestCount > 0 ? requestCount : 1) * sizeof(int64_t));
+    if (recorded == NULL || replayed == NULL)
+    {
+        free(recorded);
+        free(replayed);
+        return;
+    }
+    int type;
+    for (type = -1; type < REPLAY_MAX_TYPES; type++) // -1 stands for all types
+    {
+        int total = 0;
+        int recordedCount = 0;
+        int replayedCount = 0;
+        int i;
+        for (i = 0; i < requestCount; i++)
+        {
+            if (type >= 0 && requests[i].type != type)
+            {
+                continue;
+            }
+            total++;
+            if (requests[i].recordedUs >= 0)
+            {
+                recorded[recordedCount++] = requests[i].recordedUs;
+            }
+            long long latency = atomic_load(&requests[i].replayNs);
+            if (latency >= 0)
+            {
+                replayed[replayedCount++] = latency;
+            }
+        }
+        if (total == 0)
+        {
+            continue;
+        }
+        qsort(recorded, (size_t)recordedCount, sizeof(int64_t), compareLatencies);
+        qsort(replayed, (size_t)replayedCount, sizeof(int64_t), compareLatencies);
+        double recordedP99 = replayPercentileMs(recorded, recordedCount, 0.99, 1e3);
+        double replayedP99 = replayPercentileMs(replayed, replayedCount, 0.99, 1e6);
+        char label[8];
+        snprintf(label, sizeof(label), type < 0 ? "all" : "%d", type);
+        printf("%-5s %9d %9d %9d | %12.3f %12.3f | %12.3f %12.3f | ", label, total, recordedCount, replayedCount,
+               replayPercentileMs(recorded, recordedCount, 0.50, 1e3), recordedP99,
+               replayPercentileMs(replayed, replayedCount, 0.50, 1e6), replayedP99);
+        if (recordedCount > 0 && replayedCount > 0 && recordedP99 > 0)
+        {
+            printf("%+8.1f%%\n", (replayedP99 - recordedP99) * 100.0 / recordedP99);
+        }
+        else
+        {
+            printf("%9s\n", "-");
+        }
+    }
+    free(recorded);
+    free(replayed);
+}
+
+static void printUsage(const char *program)
+{
+    printf("Usage: %s [-a address] [-p port] [-s speed] [-d ms] capture-file\n", program);
+    printf("  -a address   Server to replay against (default: 127.0.0.1)\n");
+    printf("  -p port      Its port (default: %d)\n", PORT);
+    printf("  -s speed     Time scale, e.g. 1 for real time or 10 for ten times faster; 0 sends without pauses (default: 1)\n");
+    printf("  -d ms        Wait this long for outstanding replies after the last frame (default: %d)\n", REPLAY_DEFAULT_DRAIN_MS);
+    printf("The server should start from a copy of the data the capture was recorded against.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *address = "127.0.0.1";
+    int port = PORT;
+    double speed = 1.0;
+    int drainMs = REPLAY_DEFAULT_DRAIN_MS;
+    int option;
+    while ((option = getopt(argc, argv, "a:p:s:d:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'a':
+            address = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'd':
+            drainMs = atoi(optarg);
+            break;
+        default:
+            printUsage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    size_t length;
+    char *capture = replayReadFile(argv[optind], &length);
+    if (capture == NULL)
+    {
+        perror("Error reading the capture");
+        return 1;
+    }
+    if (replayParse(capture, length) < 0)
+    {
+        return 1;
+    }
+
+    struct sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &serverAddr.sin_addr) <= 0)
+    {
+        fprintf(stderr, "Invalid address %s\n", address);
+        return 1;
+    }
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    pthread_t receiver;
+    if (epollFd < 0 || pthread_create(&receiver, NULL, replayReceive, NULL) != 0)
+    {
+        perror("Error starting the receiver");
+        return 1;
+    }
+
+    // Send every event at its time in the capture, scaled by the speed
+    uint64_t startedAt = replayNow();
+    uint64_t maxSlipNs = 0;
+    long sendErrors = 0;
+    size_t i;
+    for (i = 0; i < eventCount; i++)
+    {
+        ReplayEvent *event = &events[i];
+        if (speed > 0)
+        {
+            uint64_t due = startedAt + (uint64_t)((double)event->timestampUs * 1000.0 / speed);
+            struct timespec wake = {(time_t)(due / 1000000000ull), (long)(due % 1000000000ull)};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+            {
+            }
+            uint64_t now = replayNow();
+            if (now > due && now - due > maxSlipNs)
+            {
+                maxSlipNs = now - due;
+            }
+        }
+        ReplayConnection *connection = &connections[event->connection];
+        if (event->kind == CAPTURE_OPEN)
+        {
+            if (replayConnect(&serverAddr, event->connection) < 0)
+            {
+                sendErrors++;
+            }
+        }
+        else if (event->kind == CAPTURE_CLOSE && connection->fd >= 0)
+        {
+            shutdown(connection->fd, SHUT_WR);
+        }
+        else if (event->kind == CAPTURE_FRAME)
+        {
+            CaptureFrame frame;
+            memcpy(&frame, event->frame, sizeof(frame));
+            Message message;
+            memset(&message, 0, sizeof(message));
+            message.type = frame.type;
+            message.to = frame.to;
+            message.from = frame.from;
+            message.requestId = frame.requestId;
+            memcpy(message.body, event->frame + sizeof(frame), frame.bodyLength);
+            if (event->request >= 0)
+            {
+                atomic_store(&requests[event->request].sentNs, replayNow());
+                atomic_store(&replayFindSlot(replayKey(event->connection, frame.requestId))->request, event->request);
+            }
+            if (connection->fd < 0 || replaySendAll(connection->fd, &message) < 0)
+            {
+                sendErrors++;
+            }
+        }
+    }
+
+    // Give the last requests time to be answered
+    uint64_t drainUntil = replayNow() + (uint64_t)drainMs * 1000000ull;
+    int waiting = 1;
+    while (waiting && replayNow() < drainUntil)
+    {
+        waiting = 0;
+        int request;
+        for (request = 0; request < requestCount && !waiting; request++)
+        {
+            waiting = requests[request].recordedUs >= 0 && atomic_load(&requests[request].replayNs) < 0 &&
+                      connections[requests[request].connection].fd >= 0;
+        }
+        usleep(10000);
+    }
+    double seconds = (double)(replayNow() - startedAt) / 1e9;
+    atomic_store(&stopping, 1);
+    pthread_join(receiver, NULL);
+
+    replayReport(seconds, speed, maxSlipNs, sendErrors);
+    int connection;
+    for (connection = 0; connection < connectionCount; connection++)
+    {
+        if (connections[connection].fd >= 0)
+        {
+            close(connections[connection].fd);
+        }
+    }
+    free(capture);
+    return 0;
+}
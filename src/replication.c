@@ -0,0 +1,710 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "reactor.h"
+#include "replication.h"
+
+#define REPLICATION_LISTEN_BACKLOG 8
+#define REPLICATION_CHUNK_SIZE (256 * 1024)
+#define REPLICATION_MAX_PATH 256
+#define REPLICATION_MAX_DATA (1u << 30) // largest file a record may carry
+#define REPLICATION_IDLE_CHECK_MS 1000 // how often an idle link checks whether its follower left
+
+// Kinds of records on a replication link
+typedef enum
+{
+    REPLICATION_APPEND,  // data is appended to the file
+    REPLICATION_REPLACE, // data is the new content of the file
+    REPLICATION_SYNCED,  // the snapshot is complete; live records follow
+} ReplicationRecordKind;
+
+// Header of one record; the path and then the data follow it on the link
+typedef struct
+{
+    uint32_t kind;
+    uint32_t pathLength;
+    uint32_t dataLength;
+} ReplicationRecord;
+
+// A file to copy into a snapshot, and its size when the snapshot was taken
+typedef struct
+{
+    char path[REPLICATION_MAX_PATH];
+    off_t size;
+} ReplicationSnapshotFile;
+
+// The files of a snapshot, listed while mutations are frozen
+typedef struct
+{
+    ReplicationSnapshotFile *files;
+    size_t count;
+    size_t capacity;
+} ReplicationSnapshotList;
+
+// Mutations not yet sent to every follower, in a ring addressed by absolute byte positions
+static char *logBuffer = NULL;
+static uint64_t logHead = 0;
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logGrew = PTHREAD_COND_INITIALIZER;
+static uint64_t followerCursors[REPLICATION_MAX_FOLLOWERS];
+static int followerActive[REPLICATION_MAX_FOLLOWERS];
+static int followerCount = 0;
+
+static char primaryHost[64];
+static char primaryPort[8];
+static ReplicationApplyFn replicationApplied;
+static atomic_int linkUp;
+
+static void replicationSleepMs(long milliseconds)
+{
+    struct timespec interval = {milliseconds / 1000, (milliseconds % 1000) * 1000000L};
+    nanosleep(&interval, NULL);
+}
+
+static int replicationWriteAll(int sock, const void *data, size_t length)
+{
+    const char *cursor = data;
+    while (length > 0)
+    {
+        ssize_t written = send(sock, cursor, length, MSG_NOSIGNAL);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        cursor += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+// Called with logLock held
+static void replicationLogWrite(const void *data, size_t length)
+{
+    size_t offset = (size_t)(logHead % REPLICATION_LOG_SIZE);
+    size_t first = length < REPLICATION_LOG_SIZE - offset ? length : REPLICATION_LOG_SIZE - offset;
+    memcpy(logBuffer + offset, data, first);
+    memcpy(logBuffer, (const char *)data + first, length - first);
+    logHead += length;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Storage observer: adds a mutation to the log the followers read.
+ *
+ * Nothing is logged while no follower is connected; a follower that
+ * connects later starts from a snapshot instead. A record larger than the
+ * whole log only advances the head, which makes every follower resync.
+ */
+// <----------------------------------------------------------------> //
+static void replicationRecordMutation(StorageMutation mutation, const char *path, const char *data, size_t length)
+{
+    ReplicationRecord record;
+    record.kind = mutation == STORAGE_MUTATION_APPEND ? REPLICATION_APPEND : REPLICATION_REPLACE;
+    record.pathLength = (uint32_t)strlen(path);
+    record.dataLength = (uint32_t)length;
+    size_t total = sizeof(record) + record.pathLength + length;
+
+    pthread_mutex_lock(&logLock);
+    if (followerCount == 0)
+    {
+        pthread_mutex_unlock(&logLock);
+        return;
+    }
+    if (total > REPLICATION_LOG_SIZE)
+    {
+        logHead += total;
+    }
+    else
+    {
+        replicationLogWrite(&record, sizeof(record));
+        replicationLogWrite(path, record.pathLength);
+        replicationLogWrite(data, length);
+    }
+    pthread_cond_broadcast(&logGrew);
+    pthread_mutex_unlock(&logLock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Writes a REPLACE record with the first size bytes of a file.
+ *
+ * The file may have grown or been replaced since it was listed; the log
+ * the follower reads next carries those changes. A file removed meanwhile
+ * is left out.
+ */
+// <----------------------------------------------------------------> //
+static int replicationSnapshotFile(const ReplicationSnapshotFile *listed, FILE *snapshot)
+{
+    FILE *file = fopen(listed->path, "r");
+    if (file == NULL)
+    {
+        if (errno == ENOENT)
+        {
+            return 0;
+        }
+        LOG_ERROR("Error opening %s for replication: %s", listed->path, strerror(errno));
+        return -1;
+    }
+    char *data = malloc(listed->size > 0 ? (size_t)listed->size : 1);
+    size_t length = data != NULL ? fread(data, 1, (size_t)listed->size, file) : 0;
+    fclose(file);
+    if (data == NULL)
+    {
+        LOG_ERROR("Error allocating %lld bytes to replicate %s", (long long)listed->size, listed->path);
+        return -1;
+    }
+    ReplicationRecord record = {REPLICATION_REPLACE, (uint32_t)strlen(listed->path), (uint32_t)length};
+    fwrite(&record, sizeof(record), 1, snapshot);
+    fwrite(listed->path, 1, record.pathLength, snapshot);
+    fwrite(data, 1, length, snapshot);
+    free(data);
+    return ferror(snapshot) ? -1 : 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Lists every file below a directory with its current size.
+ *
+ * Temporary files of replacements in progress are left out.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+static int replicationListDirectory(const char *directoryPath, ReplicationSnapshotList *list)
+{
+    DIR *directory = opendir(directoryPath);
+    if (directory == NULL)
+    {
+        LOG_ERROR("Error opening %s for replication: %s", directoryPath, strerror(errno));
+        return -1;
+    }
+    int result = 0;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(directory)) != NULL)
+    {
+        size_t nameLength = strlen(entry->d_name);
+        size_t suffixLength = strlen(STORAGE_TEMPORARY_SUFFIX);
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            (nameLength > suffixLength && strcmp(entry->d_name + nameLength - suffixLength, STORAGE_TEMPORARY_SUFFIX) == 0))
+        {
+            continue;
+        }
+        char path[REPLICATION_MAX_PATH];
+        struct stat status;
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", directoryPath, entry->d_name) >= sizeof(path) ||
+            lstat(path, &status) != 0)
+        {
+            continue;
+        }
+        if (S_ISDIR(status.st_mode))
+        {
+            result = replicationListDirectory(path, list);
+        }
+        else if (S_ISREG(status.st_mode))
+        {
+            if (status.st_size > (off_t)REPLICATION_MAX_DATA)
+            {
+                LOG_ERROR("%s is too large to replicate (%lld bytes)", path, (long long)status.st_size);
+                result = -1;
+                break;
+            }
+            if (list->count == list->capacity)
+            {
+                size_t grownCapacity = list->capacity > 0 ? list->capacity * 2 : 1024;
+                ReplicationSnapshotFile *grown = realloc(list->files, grownCapacity * sizeof(ReplicationSnapshotFile));
+                if (grown == NULL)
+                {
+                    LOG_ERROR("Error listing files to replicate: %s", strerror(errno));
+                    result = -1;
+                    break;
+                }
+                list->files = grown;
+                list->capacity = grownCapacity;
+            }
+            memcpy(list->files[list->count].path, path, sizeof(path));
+            list->files[list->count].size = status.st_size;
+            list->count++;
+        }
+    }
+    closedir(directory);
+    return result;
+}
+
+static int replicationFollowerGone(int sock)
+{
+    char byte;
+    ssize_t received = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+static void replicationRemoveFollower(int slot)
+{
+    pthread_mutex_lock(&logLock);
+    followerActive[slot] = 0;
+    followerCount--;
+    pthread_mutex_unlock(&logLock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Copies every file to a snapshot and gives the follower a log position.
+ *
+ * Mutations are frozen only while the files and their sizes are listed and
+ * the position is taken. The files are copied afterwards, each up to its
+ * listed size, so writers are not held up by the copy; whatever changed
+ * since is in the log from the position on, and the snapshot and the log
+ * still join without a gap or an overlap.
+ *
+ * @return int The follower's slot, or -1 on error.
+ */
+// <----------------------------------------------------------------> //
+static int replicationAddFollower(FILE *snapshot)
+{
+    ReplicationSnapshotList list = {NULL, 0, 0};
+    storageFreeze();
+    int listed = replicationListDirectory(STORAGE_USERS_DIRECTORY, &list);
+    int slot = 0;
+    pthread_mutex_lock(&logLock);
+    while (slot < REPLICATION_MAX_FOLLOWERS && followerActive[slot])
+    {
+        slot++;
+    }
+    if (listed < 0 || slot == REPLICATION_MAX_FOLLOWERS)
+    {
+        slot = -1;
+    }
+    else
+    {
+        followerActive[slot] = 1;
+        followerCursors[slot] = logHead;
+        followerCount++;
+    }
+    pthread_mutex_unlock(&logLock);
+    storageThaw();
+    if (listed == 0 && slot < 0)
+    {
+        LOG_WARN("Replication follower rejected, already %d followers", REPLICATION_MAX_FOLLOWERS);
+    }
+
+    size_t i;
+    for (i = 0; slot >= 0 && i < list.count; i++)
+    {
+        if (replicationSnapshotFile(&list.files[i], snapshot) < 0)
+        {
+            replicationRemoveFollower(slot);
+            slot = -1;
+        }
+    }
+    free(list.files);
+    return slot;
+}
+
+static int replicationSendSnapshot(int sock, FILE *snapshot, char *chunk)
+{
+    rewind(snapshot);
+    size_t length;
+    while ((length = fread(chunk, 1, REPLICATION_CHUNK_SIZE, snapshot)) > 0)
+    {
+        if (replicationWriteAll(sock, chunk, length) < 0)
+        {
+            return -1;
+        }
+    }
+    ReplicationRecord synced = {REPLICATION_SYNCED, 0, 0};
+    return replicationWriteAll(sock, &synced, sizeof(synced));
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sends the log to a follower from its position on, as it grows.
+ *
+ * Returns when the follower disconnects or falls more than the log size
+ * behind; it starts over from a snapshot when it reconnects.
+ */
+// <----------------------------------------------------------------> //
+static void replicationStreamLog(int sock, int slot, char *chunk)
+{
+    pthread_mutex_lock(&logLock);
+    uint64_t cursor = followerCursors[slot];
+    while (1)
+    {
+        followerCursors[slot] = cursor;
+        if (logHead == cursor)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += REPLICATION_IDLE_CHECK_MS / 1000;
+            if (pthread_cond_timedwait(&logGrew, &logLock, &deadline) == ETIMEDOUT && replicationFollowerGone(sock))
+            {
+                LOG_INFO("Replication follower %d disconnected", slot);
+                break;
+            }
+            continue;
+        }
+        if (logHead - cursor > REPLICATION_LOG_SIZE)
+        {
+            LOG_WARN("Replication follower %d fell %llu bytes behind, dropping it", slot, (unsigned long long)(logHead - cursor));
+            break;
+        }
+        size_t length = logHead - cursor < REPLICATION_CHUNK_SIZE ? (size_t)(logHead - cursor) : REPLICATION_CHUNK_SIZE;
+        size_t offset = (size_t)(cursor % REPLICATION_LOG_SIZE);
+        size_t first = length < REPLICATION_LOG_SIZE - offset ? length : REPLICATION_LOG_SIZE - offset;
+        memcpy(chunk, logBuffer + offset, first);
+        memcpy(chunk + first, logBuffer, length - first);
+        pthread_mutex_unlock(&logLock);
+
+        int sent = replicationWriteAll(sock, chunk, length);
+        pthread_mutex_lock(&logLock);
+        if (sent < 0)
+        {
+            LOG_WARN("Replication follower %d lost: %s", slot, strerror(errno));
+            break;
+        }
+        cursor += length;
+    }
+    pthread_mutex_unlock(&logLock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Feeds one follower: a snapshot of every file, then the live log.
+ */
+// <----------------------------------------------------------------> //
+static void *replicationFollowerLoop(void *arg)
+{
+    int sock = (int)(intptr_t)arg;
+    char *chunk = malloc(REPLICATION_CHUNK_SIZE);
+    FILE *snapshot = tmpfile();
+    if (chunk == NULL || snapshot == NULL)
+    {
+        LOG_ERROR("Error preparing replication snapshot: %s", strerror(errno));
+    }
+    else
+    {
+        int slot = replicationAddFollower(snapshot);
+        if (slot >= 0)
+        {
+            long snapshotBytes = ftell(snapshot);
+            if (replicationSendSnapshot(sock, snapshot, chunk) < 0)
+            {
+                LOG_WARN("Replication follower %d lost during snapshot: %s", slot, strerror(errno));
+            }
+            else
+            {
+                LOG_INFO("Replication follower %d synced with a %ld byte snapshot", slot, snapshotBytes);
+                replicationStreamLog(sock, slot, chunk);
+            }
+            replicationRemoveFollower(slot);
+        }
+    }
+    if (snapshot != NULL)
+    {
+        fclose(snapshot);
+    }
+    free(chunk);
+    close(sock);
+    return NULL;
+}
+
+static void *replicationListenLoop(void *arg)
+{
+    int listenSock = (int)(intptr_t)arg;
+    while (1)
+    {
+        int sock = accept(listenSock, NULL, NULL);
+        if (sock < 0)
+        {
+            if (errno != EINTR)
+            {
+                LOG_ERROR("Replication accept error: %s", strerror(errno));
+                replicationSleepMs(REPLICATION_RECONNECT_INTERVAL_MS);
+            }
+            continue;
+        }
+        int enable = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, replicationFollowerLoop, (void *)(intptr_t)sock) != 0)
+        {
+            LOG_ERROR("Replication follower thread create error");
+            close(sock);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Streams every storage mutation to followers that connect on a port.
+ *
+ * Replication is asynchronous: a mutation is acknowledged to the client
+ * before any follower has it, and followers that connect or reconnect
+ * catch up from a fresh snapshot.
+ *
+ * @param port The port followers connect to.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int replicationStartPrimary(int port)
+{
+    logBuffer = malloc(REPLICATION_LOG_SIZE);
+    if (logBuffer == NULL)
+    {
+        LOG_ERROR("Error allocating the replication log: %s", strerror(errno));
+        return -1;
+    }
+    int listenSock = reactorOpenListener(port, REPLICATION_LISTEN_BACKLOG, 0);
+    if (listenSock < 0)
+    {
+        return -1;
+    }
+    storageSetObserver(replicationRecordMutation);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, replicationListenLoop, (void *)(intptr_t)listenSock) != 0)
+    {
+        LOG_ERROR("Replication listener thread create error");
+        return -1;
+    }
+    pthread_detach(thread);
+    LOG_INFO("Replicating storage to followers on port %d", port);
+    return 0;
+}
+
+static int replicationConnect(void)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses;
+    if (getaddrinfo(primaryHost, primaryPort, &hints, &addresses) != 0)
+    {
+        return -1;
+    }
+    int sock = -1;
+    struct addrinfo *address;
+    for (address = addresses; address != NULL && sock < 0; address = address->ai_next)
+    {
+        sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (sock >= 0 && connect(sock, address->ai_addr, address->ai_addrlen) < 0)
+        {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    return sock;
+}
+
+static int replicationReadAll(int sock, void *data, size_t length)
+{
+    return length == 0 || recv(sock, data, length, MSG_WAITALL) == (ssize_t)length ? 0 : -1;
+}
+
+// Creates the directories above a file, like mkdir -p
+static void replicationCreateParents(const char *path)
+{
+    char directory[REPLICATION_MAX_PATH];
+    snprintf(directory, sizeof(directory), "%s", path);
+    char *slash;
+    for (slash = strchr(directory + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        mkdir(directory, 0777);
+        *slash = '/';
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Applies one record received from the primary through storage.
+ *
+ * Only paths below the users directory are accepted.
+ *
+ * @return int 0 on success, -1 if the record is invalid.
+ */
+// <----------------------------------------------------------------> //
+static int replicationApply(uint32_t kind, const char *path, const char *data, size_t length)
+{
+    if (strncmp(path, STORAGE_USERS_DIRECTORY "/", strlen(STORAGE_USERS_DIRECTORY "/")) != 0 || strstr(path, "..") != NULL)
+    {
+        LOG_WARN("Replication record for %s ignored: outside %s", path, STORAGE_USERS_DIRECTORY);
+        return -1;
+    }
+    if (kind == REPLICATION_APPEND)
+    {
+        replicationApplied(STORAGE_MUTATION_APPEND, path, data, length);
+        return storageAppend(path, data, length);
+    }
+    if (kind == REPLICATION_REPLACE)
+    {
+        replicationCreateParents(path);
+        if (storageReplace(path, data, length) < 0)
+        {
+            return -1;
+        }
+        replicationApplied(STORAGE_MUTATION_REPLACE, path, data, length);
+        return 0;
+    }
+    LOG_WARN("Replication record of unknown kind %u", kind);
+    return -1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Keeps the link to the primary up and applies what it sends.
+ */
+// <----------------------------------------------------------------> //
+static void *replicationFollowLoop(void *arg)
+{
+    (void)arg;
+    char path[REPLICATION_MAX_PATH];
+    char *data = NULL;
+    size_t capacity = 0;
+    while (1)
+    {
+        int sock = replicationConnect();
+        if (sock < 0)
+        {
+            replicationSleepMs(REPLICATION_RECONNECT_INTERVAL_MS);
+            continue;
+        }
+        atomic_store(&linkUp, 1);
+        LOG_INFO("Replication link to %s:%s up", primaryHost, primaryPort);
+
+        ReplicationRecord record;
+        while (replicationReadAll(sock, &record, sizeof(record)) == 0)
+        {
+            if (record.kind == REPLICATION_SYNCED)
+            {
+                LOG_INFO("Replica caught up with %s:%s", primaryHost, primaryPort);
+                continue;
+            }
+            if (record.pathLength == 0 || record.pathLength >= sizeof(path))
+            {
+                LOG_WARN("Replication record with a %u byte path rejected", record.pathLength);
+                break;
+            }
+            if (record.dataLength > REPLICATION_MAX_DATA)
+            {
+                LOG_WARN("Replication record with %u bytes of data rejected", record.dataLength);
+                break;
+            }
+            size_t needed = (size_t)record.dataLength + 1;
+            if (needed > capacity)
+            {
+                char *grown = realloc(data, needed);
+                if (grown == NULL)
+                {
+                    LOG_ERROR("Error allocating %u bytes for a replication record", record.dataLength);
+                    break;
+                }
+                data = grown;
+                capacity = needed;
+            }
+            if (replicationReadAll(sock, path, record.pathLength) < 0 ||
+                replicationReadAll(sock, data, record.dataLength) < 0)
+            {
+                break;
+            }
+            path[record.pathLength] = '\0';
+            data[record.dataLength] = '\0';
+            replicationApply(record.kind, path, data, record.dataLength);
+        }
+        close(sock);
+        atomic_store(&linkUp, 0);
+        LOG_WARN("Replication link to %s:%s down", primaryHost, primaryPort);
+        replicationSleepMs(REPLICATION_RECONNECT_INTERVAL_MS);
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Makes this server a read-only replica of a primary.
+ *
+ * Every reconnect starts with a full snapshot, so the local files converge
+ * on the primary's even after a long outage.
+ *
+ * @param primary The primary's replication port as "host:port".
+ * @param applied Called for every record applied, to refresh cached state.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int replicationStartFollower(const char *primary, ReplicationApplyFn applied)
+{
+    const char *colon = strrchr(primary, ':');
+    if (colon == NULL || colon == primary || (size_t)(colon - primary) >= sizeof(primaryHost) || strlen(colon + 1) >= sizeof(primaryPort))
+    {
+        LOG_ERROR("Invalid primary \"%s\"; expected host:port", primary);
+        return -1;
+    }
+    memcpy(primaryHost, primary, (size_t)(colon - primary));
+    primaryHost[colon - primary] = '\0';
+    strcpy(primaryPort, colon + 1);
+    replicationApplied = applied;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, replicationFollowLoop, NULL) != 0)
+    {
+        LOG_ERROR("Replication thread create error");
+        return -1;
+    }
+    pthread_detach(thread);
+    LOG_INFO("Following the primary at %s:%s", primaryHost, primaryPort);
+    return 0;
+}
+
+long replicationFollowers(void)
+{
+    pthread_mutex_lock(&logLock);
+    long count = followerCount;
+    pthread_mutex_unlock(&logLock);
+    return count;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns how many logged bytes the slowest follower has not been sent.
+ */
+// <----------------------------------------------------------------> //
+long replicationBacklogBytes(void)
+{
+    uint64_t backlog = 0;
+    pthread_mutex_lock(&logLock);
+    int slot;
+    for (slot = 0; slot < REPLICATION_MAX_FOLLOWERS; slot++)
+    {
+        if (followerActive[slot] && logHead - followerCursors[slot] > backlog)
+        {
+            backlog = logHead - followerCursors[slot];
+        }
+    }
+    pthread_mutex_unlock(&logLock);
+    return (long)backlog;
+}
+
+long replicationLinkUp(void)
+{
+    return atomic_load(&linkUp);
+}
@@ -0,0 +1,602 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "protocol.h"
+#include "search.h"
+#include "storage.h"
+
+#define SEARCH_MAX_TERM_LENGTH 32
+#define SEARCH_MAX_QUERY_TERMS 8
+#define SEARCH_MAX_MESSAGE_TERMS 512
+#define SEARCH_INITIAL_BUCKETS 64
+#define SEARCH_BM25_K1 1.2f
+#define SEARCH_BM25_B 0.75f
+
+typedef struct SearchTerm
+{
+    struct SearchTerm *next; // hash chain
+    uint32_t hash;
+    uint32_t lastOrdinal;
+    uint32_t documentCount;
+    uint32_t length; // of postings
+    uint32_t capacity;
+    uint8_t *postings; // varint pairs: ordinal delta, term frequency
+    uint8_t termLength;
+    char term[];
+} SearchTerm;
+
+// Inverted index of one mailbox; only ever touched by the shard owning the user
+typedef struct
+{
+    SearchTerm **buckets;
+    uint32_t bucketCount;
+    uint32_t termCount;
+    uint32_t messageCount;
+    uint32_t messageCapacity;
+    uint64_t tokenTotal;
+    uint64_t nextOffset; // where the next appended line starts
+    uint64_t *offsets;
+    int32_t *peers;
+    uint16_t *tokenCounts;
+} SearchIndex;
+
+typedef struct
+{
+    const char *text;
+    uint8_t length;
+    uint16_t frequency;
+} SearchToken;
+
+static SearchIndex **indexes = NULL;
+static int indexCapacity = 0;
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Allocates the per-user index table; indexes are built on first search.
+ */
+// <----------------------------------------------------------------> //
+int searchInit(int userCapacity)
+{
+    indexes = calloc((size_t)userCapacity, sizeof(SearchIndex *));
+    if (indexes == NULL)
+    {
+        LOG_ERROR("Error allocating search indexes: %s", strerror(errno));
+        return -1;
+    }
+    indexCapacity = userCapacity;
+    return 0;
+}
+
+static int searchIsWordByte(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Splits text into distinct lower-cased terms with their frequencies.
+ *
+ * Terms are runs of ASCII letters and digits; bytes of multi-byte UTF-8
+ * sequences count as letters so non-English words stay whole. Each term is
+ * lower-cased in place and cut at SEARCH_MAX_TERM_LENGTH bytes.
+ *
+ * @return int The number of distinct terms stored in tokens.
+ */
+// <----------------------------------------------------------------> //
+static int searchTokenize(char *text, size_t length, SearchToken *tokens, int maxTokens, uint32_t *tokenTotal)
+{
+    int count = 0;
+    size_t i = 0;
+    *tokenTotal = 0;
+    while (i < length)
+    {
+        while (i < length && !searchIsWordByte((unsigned char)text[i]))
+        {
+            i++;
+        }
+        size_t start = i;
+        while (i < length && searchIsWordByte((unsigned char)text[i]))
+        {
+            if (text[i] >= 'A' && text[i] <= 'Z')
+            {
+                text[i] = (char)(text[i] - 'A' + 'a');
+            }
+            i++;
+        }
+        if (i == start)
+        {
+            break;
+        }
+        size_t termLength = i - start < SEARCH_MAX_TERM_LENGTH ? i - start : SEARCH_MAX_TERM_LENGTH;
+        (*tokenTotal)++;
+
+        int existing;
+        for (existing = 0; existing < count; existing++)
+        {
+            if (tokens[existing].length == termLength && memcmp(tokens[existing].text, text + start, termLength) == 0)
+            {
+                break;
+            }
+        }
+        if (existing < count)
+        {
+            if (tokens[existing].frequency < UINT16_MAX)
+            {
+                tokens[existing].frequency++;
+            }
+        }
+        else if (count < maxTokens)
+        {
+            tokens[count].text = text + start;
+            tokens[count].length = (uint8_t)termLength;
+            tokens[count].frequency = 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+static uint32_t searchHash(const char *text, size_t length)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    size_t i;
+    for (i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)text[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static SearchTerm *searchFindTerm(const SearchIndex *index, const char *text, size_t length, uint32_t hash)
+{
+    SearchTerm *term = index->buckets[hash & (index->bucketCount - 1)];
+    while (term != NULL && (term->hash != hash || term->termLength != length || memcmp(term->term, text, length) != 0))
+    {
+        term = term->next;
+    }
+    return term;
+}
+
+static int searchGrowBuckets(SearchIndex *index)
+{
+    uint32_t bucketCount = index->bucketCount * 2;
+    SearchTerm **buckets = calloc(bucketCount, sizeof(SearchTerm *));
+    if (buckets == NULL)
+    {
+        return -1;
+    }
+    uint32_t i;
+    for (i = 0; i < index->bucketCount; i++)
+    {
+        SearchTerm *term = index->buckets[i];
+        while (term != NULL)
+        {
+            SearchTerm *next = term->next;
+            term->next = buckets[term->hash & (bucketCount - 1)];
+            buckets[term->hash & (bucketCount - 1)] = term;
+            term = next;
+        }
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bucketCount = bucketCount;
+    return 0;
+}
+
+static void searchPutVarint(uint8_t *out, uint32_t *length, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        out[(*length)++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[(*length)++] = (uint8_t)value;
+}
+
+static uint32_t searchGetVarint(const uint8_t *in, uint32_t *position)
+{
+    uint32_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do
+    {
+        byte = in[(*position)++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while ((byte & 0x80) && shift < 35);
+    return value;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Appends one posting to a term, creating the term if needed.
+ */
+// <----------------------------------------------------------------> //
+static int searchAddPosting(SearchIndex *index, const SearchToken *token, uint32_t ordinal)
+{
+    uint32_t hash = searchHash(token->text, token->length);
+    SearchTerm *term = searchFindTerm(index, token->text, token->length, hash);
+    if (term == NULL)
+    {
+        if (index->termCount >= index->bucketCount * 2 && searchGrowBuckets(index) < 0)
+        {
+            return -1;
+        }
+        term = calloc(1, sizeof(SearchTerm) + token->length);
+        if (term == NULL)
+        {
+            return -1;
+        }
+        term->hash = hash;
+        term->termLength = token->length;
+        memcpy(term->term, token->text, token->length);
+        term->next = index->buckets[hash & (index->bucketCount - 1)];
+        index->buckets[hash & (index->bucketCount - 1)] = term;
+        index->termCount++;
+    }
+
+    if (term->length + 10 > term->capacity) // two varints of at most 5 bytes
+    {
+        uint32_t capacity = term->capacity > 0 ? term->capacity * 2 : 16;
+        uint8_t *postings = realloc(term->postings, capacity);
+        if (postings == NULL)
+        {
+            return -1;
+        }
+        term->postings = postings;
+        term->capacity = capacity;
+    }
+    searchPutVarint(term->postings, &term->length, ordinal - term->lastOrdinal);
+    searchPutVarint(term->postings, &term->length, token->frequency);
+    term->lastOrdinal = ordinal;
+    term->documentCount++;
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Indexes one mailbox line ("date, peer, text, status").
+ */
+// <----------------------------------------------------------------> //
+static void searchAddLine(SearchIndex *index, const char *line, size_t length)
+{
+    if (index->messageCount == index->messageCapacity)
+    {
+        uint32_t capacity = index->messageCapacity > 0 ? index->messageCapacity * 2 : 64;
+        uint64_t *offsets = realloc(index->offsets, capacity * sizeof(uint64_t));
+        if (offsets != NULL)
+        {
+            index->offsets = offsets;
+        }
+        int32_t *peers = realloc(index->peers, capacity * sizeof(int32_t));
+        if (peers != NULL)
+        {
+            index->peers = peers;
+        }
+        uint16_t *tokenCounts = realloc(index->tokenCounts, capacity * sizeof(uint16_t));
+        if (tokenCounts != NULL)
+        {
+            index->tokenCounts = tokenCounts;
+        }
+        if (offsets == NULL || peers == NULL || tokenCounts == NULL)
+        {
+            LOG_ERROR("Error growing search index: %s", strerror(errno));
+            index->nextOffset += length; // keep later offsets right even though this line is lost
+            return;
+        }
+        index->messageCapacity = capacity;
+    }
+
+    uint32_t ordinal = index->messageCount++;
+    index->offsets[ordinal] = index->nextOffset;
+    index->nextOffset += length;
+
+    // The text sits between the peer id and the read status
+    char text[MESSAGE_BODY_SIZE];
+    int peer = -1;
+    const char *textStart = memchr(line, ',', length);
+    const char *textEnd = NULL;
+    size_t i;
+    for (i = length; i > 0; i--)
+    {
+        if (line[i - 1] == ',')
+        {
+            textEnd = line + i - 1;
+            break;
+        }
+    }
+    size_t textLength = 0;
+    if (textStart != NULL && sscanf(textStart + 1, " %d", &peer) == 1)
+    {
+        textStart = memchr(textStart + 1, ',', (size_t)(line + length - textStart - 1));
+        if (textStart != NULL && textEnd != NULL && textEnd > textStart)
+        {
+            textLength = (size_t)(textEnd - textStart - 1);
+            if (textLength >= sizeof(text))
+            {
+                textLength = sizeof(text) - 1;
+            }
+            memcpy(text, textStart + 1, textLength);
+        }
+    }
+    index->peers[ordinal] = peer;
+
+    SearchToken tokens[SEARCH_MAX_MESSAGE_TERMS];
+    uint32_t tokenTotal;
+    int tokenCount = searchTokenize(text, textLength, tokens, SEARCH_MAX_MESSAGE_TERMS, &tokenTotal);
+    index->tokenCounts[ordinal] = tokenTotal < UINT16_MAX ? (uint16_t)tokenTotal : UINT16_MAX;
+    index->tokenTotal += tokenTotal;
+    int t;
+    for (t = 0; t < tokenCount; t++)
+    {
+        if (searchAddPosting(index, &tokens[t], ordinal) < 0)
+        {
+            LOG_ERROR("Error adding search posting: %s", strerror(errno));
+            return;
+        }
+    }
+}
+
+static void searchAddLines(SearchIndex *index, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        const char *newline = memchr(data, '\n', length);
+        size_t lineLength = newline != NULL ? (size_t)(newline - data) + 1 : length;
+        searchAddLine(index, data, lineLength);
+        data += lineLength;
+        length -= lineLength;
+    }
+}
+
+static void searchFreeIndex(SearchIndex *index)
+{
+    uint32_t i;
+    for (i = 0; i < index->bucketCount; i++)
+    {
+        SearchTerm *term = index->buckets[i];
+        while (term != NULL)
+        {
+            SearchTerm *next = term->next;
+            free(term->postings);
+            free(term);
+            term = next;
+        }
+    }
+    free(index->buckets);
+    free(index->offsets);
+    free(index->peers);
+    free(index->tokenCounts);
+    free(index);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns a user's index, building it from their mailbox on first use.
+ */
+// <----------------------------------------------------------------> //
+static SearchIndex *searchLoadIndex(int userId)
+{
+    if (indexes[userId] != NULL)
+    {
+        return indexes[userId];
+    }
+    SearchIndex *index = calloc(1, sizeof(SearchIndex));
+    if (index == NULL || (index->buckets = calloc(SEARCH_INITIAL_BUCKETS, sizeof(SearchTerm *))) == NULL)
+    {
+        LOG_ERROR("Error allocating search index: %s", strerror(errno));
+        free(index);
+        return NULL;
+    }
+    index->bucketCount = SEARCH_INITIAL_BUCKETS;
+
+    storageSyncUser(userId); // queued appends must be in the file before it is read
+    char filename[STORAGE_PATH_SIZE];
+    FILE *file = fopen(storageUserPath(userId, STORAGE_USER_MESSAGES, filename), "r");
+    if (file != NULL)
+    {
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t length;
+        while ((length = getline(&line, &size, file)) > 0)
+        {
+            searchAddLine(index, line, (size_t)length);
+        }
+        free(line);
+        fclose(file);
+    }
+    indexes[userId] = index;
+    LOG_DEBUG("Built search index of user %d: %u messages, %u terms", userId, index->messageCount, index->termCount);
+    return index;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Indexes lines appended to a user's mailbox.
+ *
+ * Must be called on the shard owning the user, with the exact bytes
+ * appended. Users without an index yet are skipped; their index is built
+ * from the file when they first search.
+ */
+// <----------------------------------------------------------------> //
+void searchMailboxAppended(int userId, const char *data, size_t length)
+{
+    if (userId < 0 || userId >= indexCapacity || indexes[userId] == NULL)
+    {
+        return;
+    }
+    searchAddLines(indexes[userId], data, length);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Notes that a user's mailbox was rewritten in place.
+ *
+ * Read-status updates keep every line's length, so the index stays valid;
+ * if the file size moved anyway the index is dropped and rebuilt on demand.
+ */
+// <----------------------------------------------------------------> //
+void searchMailboxRewritten(int userId)
+{
+    if (userId < 0 || userId >= indexCapacity || indexes[userId] == NULL)
+    {
+        return;
+    }
+    char filename[STORAGE_PATH_SIZE];
+    struct stat st;
+    if (stat(storageUserPath(userId, STORAGE_USER_MESSAGES, filename), &st) != 0 ||
+        (uint64_t)st.st_size != indexes[userId]->nextOffset)
+    {
+        searchFreeIndex(indexes[userId]);
+        indexes[userId] = NULL;
+    }
+}
+
+// A query term's postings, decoded for merging
+typedef struct
+{
+    uint32_t *ordinals;
+    uint16_t *frequencies;
+    uint32_t count;
+    uint32_t position;
+    float idf;
+} SearchCursor;
+
+static void searchKeepHit(SearchHit *hits, int *hitCount, int maxHits, const SearchHit *hit)
+{
+    // Ties go to the newer message
+    int position = *hitCount;
+    while (position > 0 && (hits[position - 1].score < hit->score ||
+                            (hits[position - 1].score == hit->score && hits[position - 1].ordinal < hit->ordinal)))
+    {
+        position--;
+    }
+    if (position >= maxHits)
+    {
+        return;
+    }
+    int last = *hitCount < maxHits ? *hitCount : maxHits - 1;
+    memmove(&hits[position + 1], &hits[position], (size_t)(last - position) * sizeof(SearchHit));
+    hits[position] = *hit;
+    if (*hitCount < maxHits)
+    {
+        (*hitCount)++;
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Finds the messages of a user's mailbox that best match a query.
+ *
+ * Messages containing any query term are ranked with BM25; only the
+ * posting lists of the query terms are decoded.
+ *
+ * @param userId The mailbox owner; call on the shard owning the user.
+ * @param query Free text.
+ * @param hits Receives the best matches, best first.
+ * @param maxHits Capacity of hits.
+ * @param totalHits Set to the number of matching messages.
+ * @return int The number of hits stored, or -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int searchMessages(int userId, const char *query, SearchHit *hits, int maxHits, int *totalHits)
+{
+    *totalHits = 0;
+    if (userId < 0 || userId >= indexCapacity || maxHits <= 0)
+    {
+        return -1;
+    }
+    SearchIndex *index = searchLoadIndex(userId);
+    if (index == NULL)
+    {
+        return -1;
+    }
+
+    char text[MESSAGE_BODY_SIZE];
+    snprintf(text, sizeof(text), "%s", query);
+    SearchToken tokens[SEARCH_MAX_QUERY_TERMS];
+    uint32_t tokenTotal;
+    int tokenCount = searchTokenize(text, strlen(text), tokens, SEARCH_MAX_QUERY_TERMS, &tokenTotal);
+
+    SearchCursor cursors[SEARCH_MAX_QUERY_TERMS];
+    int cursorCount = 0;
+    float averageLength = index->messageCount > 0 ? (float)index->tokenTotal / (float)index->messageCount : 1.0f;
+    int t;
+    for (t = 0; t < tokenCount; t++)
+    {
+        SearchTerm *term = searchFindTerm(index, tokens[t].text, tokens[t].length, searchHash(tokens[t].text, tokens[t].length));
+        if (term == NULL)
+        {
+            continue;
+        }
+        SearchCursor *cursor = &cursors[cursorCount];
+        cursor->ordinals = malloc(term->documentCount * sizeof(uint32_t));
+        cursor->frequencies = malloc(term->documentCount * sizeof(uint16_t));
+        if (cursor->ordinals == NULL || cursor->frequencies == NULL)
+        {
+            free(cursor->ordinals);
+            free(cursor->frequencies);
+            continue;
+        }
+        uint32_t position = 0, ordinal = 0;
+        for (cursor->count = 0; cursor->count < term->documentCount; cursor->count++)
+        {
+            ordinal += searchGetVarint(term->postings, &position);
+            cursor->ordinals[cursor->count] = ordinal;
+            cursor->frequencies[cursor->count] = (uint16_t)searchGetVarint(term->postings, &position);
+        }
+        cursor->position = 0;
+        float documents = (float)index->messageCount;
+        cursor->idf = logf(1.0f + (documents - (float)term->documentCount + 0.5f) / ((float)term->documentCount + 0.5f));
+        cursorCount++;
+    }
+
+    // Merge the posting lists in ordinal order, scoring each message once
+    int hitCount = 0;
+    while (1)
+    {
+        uint32_t ordinal = UINT32_MAX;
+        int c;
+        for (c = 0; c < cursorCount; c++)
+        {
+            if (cursors[c].position < cursors[c].count && cursors[c].ordinals[cursors[c].position] < ordinal)
+            {
+                ordinal = cursors[c].ordinals[cursors[c].position];
+            }
+        }
+        if (ordinal == UINT32_MAX || ordinal >= index->messageCount)
+        {
+            break;
+        }
+
+        float lengthRatio = (float)index->tokenCounts[ordinal] / averageLength;
+        SearchHit hit = {ordinal, index->peers[ordinal], index->offsets[ordinal], 0, 0.0f};
+        for (c = 0; c < cursorCount; c++)
+        {
+            if (cursors[c].position < cursors[c].count && cursors[c].ordinals[cursors[c].position] == ordinal)
+            {
+                float frequency = cursors[c].frequencies[cursors[c].position++];
+                hit.score += cursors[c].idf * frequency * (SEARCH_BM25_K1 + 1.0f) /
+                             (frequency + SEARCH_BM25_K1 * (1.0f - SEARCH_BM25_B + SEARCH_BM25_B * lengthRatio));
+            }
+        }
+        uint64_t end = ordinal + 1 < index->messageCount ? index->offsets[ordinal + 1] : index->nextOffset;
+        hit.length = (uint32_t)(end - hit.offset);
+        (*totalHits)++;
+        searchKeepHit(hits, &hitCount, maxHits, &hit);
+    }
+
+    for (t = 0; t < cursorCount; t++)
+    {
+        free(cursors[t].ordinals);
+        free(cursors[t].frequencies);
+    }
+    return hitCount;
+}
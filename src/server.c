@@ -4,67 +4,214 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include "admission.h"
+#include "blob.h"
+#include "capture.h"
+#include "cluster.h"
+#include "directory.h"
+#include "dispatch.h"
+#include "heartbeat.h"
+#include "journal.h"
+#include "log.h"
+#include "metrics.h"
+#include "presence.h"
+#include "protocol.h"
+#include "reactor.h"
+#include "replication.h"
+#include "search.h"
+#include "server.h"
+#include "state.h"
+#include "storage.h"
+#include "trace.h"
 
-#define PORT 8081
 #define MAX_USERS 10
-#define REGISTRATION_BUFFER_SIZE 16
+#define DEFAULT_BACKLOG 1024
+#define DEFAULT_SHARDS 0 // one per online core
+#define SEND_LOCK_STRIPES 64
+#define SEND_TIMEOUT_MS 500 // a client whose socket buffer stays full this long is disconnected
+#define DEFAULT_IDLE_TIMEOUT 90 // seconds; three missed client heartbeats
+#define MAX_TRACKED_SOCKETS (1 << 20)
+#define METRICS_SOCKET_PATH "TerChatApp/metrics.sock"
+#define CLUSTER_METRICS_SOCKET_FORMAT "TerChatApp/metrics.%d.sock" // nodes sharing a directory need their own files
+#define CLUSTER_STATE_SNAPSHOT_FORMAT "TerChatApp/state.%d.snapshot"
+#define DEFAULT_SNAPSHOT_INTERVAL 300 // seconds
 
 typedef struct // Struct to pass arguments to the thread
 {
     int newSocket;
-    int *clients;
 } ThreadArgs;
 
-typedef struct // Struct to represent a message
-{
-    /*
-    message type / explanation
-        -1       /  disconnect
-        0        /  login request
-        1        /  server message
-        2        /  registration request
-        3        /  confirmation message
-        4        /  list contacts
-        5        /  add user
-        6        /  delete user
-        7        /  send message
-        8        /  check message
-        9        /  read messages
-    */
-    int type;
-    char body[1024];
-    int to;   // -1 for server, user_id for specific user
-    int from; // -1 for server, user_id for specific user
-} Message;
+// Serialises frames written to the same socket from different threads
+static pthread_mutex_t sendLocks[SEND_LOCK_STRIPES];
 
-typedef struct
+// Request ID of the message the current thread is handling, echoed on replies
+static _Thread_local int currentRequestId = 0;
+
+// Per socket: bumped under the socket's send lock when a connection on it
+// closes, so work queued for that connection never reaches a later one
+// given the same descriptor
+static atomic_uint socketGenerations[MAX_TRACKED_SOCKETS];
+
+// Per socket: set while a client connection is open on it, so shutdown
+// only notifies clients and leaves the server's own descriptors alone
+static atomic_bool socketOpen[MAX_TRACKED_SOCKETS];
+static atomic_int socketCeiling; // one more than the highest socket ever opened
+
+// Generation of the connection whose request the current thread is handling
+static _Thread_local unsigned currentGeneration = 0;
+
+// Set on a follower: the files belong to the primary and are only read here
+static int replicaMode = 0;
+
+// Client threads alive in thread-per-client mode, at most MAX_USERS
+static atomic_int clientThreads;
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Initialises the locks that serialise frames sent to a socket; called once before any send.
+ */
+// <----------------------------------------------------------------> //
+void initSendLocks(void)
 {
-    /* data */
-    int userId;
-    char username[REGISTRATION_BUFFER_SIZE];
-    char phoneNumber[REGISTRATION_BUFFER_SIZE];
-    char name[REGISTRATION_BUFFER_SIZE];
-    char surname[REGISTRATION_BUFFER_SIZE];
-} User;
+    int i;
+    for (i = 0; i < SEND_LOCK_STRIPES; i++)
+    {
+        pthread_mutex_init(&sendLocks[i], NULL);
+    }
+}
+
+static unsigned connectionGeneration(int sock)
+{
+    return sock >= 0 && sock < MAX_TRACKED_SOCKETS ? atomic_load(&socketGenerations[sock]) : 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Marks the connection on a socket as gone; call before the socket is closed.
+ */
+// <----------------------------------------------------------------> //
+static void connectionClosing(int sock)
+{
+    if (sock < 0 || sock >= MAX_TRACKED_SOCKETS)
+    {
+        return;
+    }
+    pthread_mutex_t *lock = &sendLocks[(unsigned)sock % SEND_LOCK_STRIPES];
+    pthread_mutex_lock(lock);
+    atomic_fetch_add(&socketGenerations[sock], 1);
+    atomic_store(&socketOpen[sock], 0);
+    pthread_mutex_unlock(lock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sends a message frame to one connection and accounts the bytes sent.
+ *
+ * @param sock The socket to send the message to.
+ * @param generation The generation the connection had when the frame was
+ *                   meant for it; if it has closed since, nothing is sent.
+ * @param msg The message to send.
+ * @return ssize_t The result of send(), or -1 with errno ECONNRESET for a closed
+ *                 connection and ETIMEDOUT for one that fell behind.
+ */
+// <----------------------------------------------------------------> //
+static ssize_t sendFrameIfCurrent(int sock, unsigned generation, const Message *msg)
+{
+    uint64_t tracedAt = traceSpanBegin();
+    pthread_mutex_t *lock = &sendLocks[(unsigned)sock % SEND_LOCK_STRIPES];
+    pthread_mutex_lock(lock);
+    ssize_t sent = -1;
+    if (connectionGeneration(sock) == generation)
+    {
+        sent = send(sock, msg, sizeof(Message), MSG_NOSIGNAL);
+        if ((sent >= 0 && sent < (ssize_t)sizeof(Message)) || (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+        {
+            // The send timed out; a frame cut short cannot be resumed, so the
+            // connection goes, and its reader closes it as for any hang-up
+            LOG_WARN("Client %d is not reading its frames, disconnecting it", sock);
+            shutdown(sock, SHUT_RDWR);
+            sent = -1;
+            errno = ETIMEDOUT;
+        }
+    }
+    else
+    {
+        errno = ECONNRESET;
+    }
+    pthread_mutex_unlock(lock);
+    traceSpanEnd("socket_send", tracedAt);
+    if (sent > 0)
+    {
+        metricsBytesOut((size_t)sent);
+        captureReplySent(sock, msg);
+    }
+    return sent;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sends a message frame to a socket and accounts the bytes sent.
+ *
+ * @param sock The socket to send the message to.
+ * @param msg The message to send.
+ * @return ssize_t The result of send().
+ */
+// <----------------------------------------------------------------> //
+ssize_t sendFrame(int sock, const Message *msg)
+{
+    return sendFrameIfCurrent(sock, connectionGeneration(sock), msg);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sends a reply to the request being handled, tagged with its request ID.
+ *
+ * A reply to a connection that closed while the request was queued or
+ * running is dropped.
+ *
+ * @param sock The socket to send the reply to.
+ * @param msg The reply; its requestId field is overwritten.
+ * @return ssize_t The result of send().
+ */
+// <----------------------------------------------------------------> //
+ssize_t sendReply(int sock, Message *msg)
+{
+    msg->requestId = currentRequestId;
+    return sendFrameIfCurrent(sock, currentGeneration, msg);
+}
 
 // <----------------------------------------------------------------> //
 /**
- * @brief Notifies all connected clients about the server shutdown and closes their connections.
+ * @brief Notifies all connected clients about the server shutdown and ends their connections.
+ *
+ * Only sockets of open client connections are touched; they are shut down
+ * rather than closed, since their readers may still be running.
  */
 // <----------------------------------------------------------------> //
 void notifyClientsAndShutdown()
 {
     Message disconnectMessage;
+    memset(&disconnectMessage, 0, sizeof(disconnectMessage));
     disconnectMessage.type = -1; // -1 indicates a disconnect message
+    int ceiling = atomic_load(&socketCeiling);
     int i;
-    for (i = 0; i < MAX_USERS; i++)
+    for (i = 0; i < ceiling; i++)
     {
-        send(i, &disconnectMessage, sizeof(disconnectMessage), 0);
-        close(i);
+        if (atomic_load(&socketOpen[i]))
+        {
+            sendFrame(i, &disconnectMessage);
+            shutdown(i, SHUT_RDWR);
+        }
     }
-    close(0);
 }
 
 // <----------------------------------------------------------------> //
@@ -78,9 +225,10 @@ void notifyClientsAndShutdown()
 void sendConfirmationMessage(int newSocket, const char *message)
 {
     Message confirmationMessage;
+    memset(&confirmationMessage, 0, sizeof(confirmationMessage));
     confirmationMessage.type = 3; // Assuming 3 is the type for a registration confirmation
     strcpy(confirmationMessage.body, message);
-    send(newSocket, &confirmationMessage, sizeof(confirmationMessage), 0);
+    sendReply(newSocket, &confirmationMessage);
 }
 
 // <----------------------------------------------------------------> //
@@ -88,22 +236,21 @@ void sendConfirmationMessage(int newSocket, const char *message)
  * @brief Finds the socket associated with the given user ID.
  *
  * @param userId The user ID to search for.
- * @param clients The array of sockets to search in.
- * @return int The socket associated with the given user ID.
+ * @return int The socket associated with the given user ID, or -1 if the user is offline.
  */
 // <----------------------------------------------------------------> //
 
-int findSocketByUserId(int userId, int *clients)
+int findSocketByUserId(int userId)
 {
     // Check if the user ID is within the range of the array
-    if (userId < 0 || userId >= MAX_USERS)
+    if (userId < 0 || userId >= MAX_USER_ID)
     {
-        printf("User ID out of range: %d\n", userId);
+        LOG_WARN("User ID out of range: %d", userId);
         return -1;
     }
 
-    // Return the socket associated with the user ID
-    return clients[userId];
+    // Presence follows every login and close, in both threading modes
+    return presenceSocketOf(userId);
 }
 
 // <----------------------------------------------------------------> //
@@ -115,41 +262,27 @@ int findSocketByUserId(int userId, int *clients)
 // <----------------------------------------------------------------> //
 void disconnectClient(int newSocket, int userId)
 {
-    printf("Client %d with userId %d  disconnected\n", newSocket, userId);
+    LOG_INFO("Client %d with userId %d disconnected", newSocket, userId);
+    metricsConnectionClosed();
+    captureConnectionClosed(newSocket);
+    heartbeatUntrack(newSocket);
+    clusterUserChanged(presenceDisconnected(newSocket));
+    connectionClosing(newSocket);
     close(newSocket);
+    atomic_fetch_sub(&clientThreads, 1);
     pthread_exit(NULL);
 }
 
 // <----------------------------------------------------------------> //
 /**
- * @brief Checks if a user is registered in the "TerChatApp/users/user_list.txt" file.
- *
- * @param userId The user ID to check.
- * @return int 1 if the user is registered, 0 otherwise.
+ * @brief Shard task: drops the cached state and search index of a user.
  */
 // <----------------------------------------------------------------> //
-int isUserRegistered(int userId)
+static void reloadUserFiles(void *argument)
 {
-    FILE *file = fopen("TerChatApp/users/user_list.txt", "r");
-    if (file != NULL)
-    {
-        int id;
-        char username[1024], phoneNumber[1024], name[1024], surname[1024];
-        while (fscanf(file, "%d,%[^,],%[^,],%[^,],%[^\n]\n", &id, username, phoneNumber, name, surname) != EOF)
-        {
-            if (id == userId)
-            {
-                fclose(file);
-                return 1; // User is registered
-            }
-        }
-        fclose(file);
-    }
-    else
-    {
-        printf("Error opening file\n");
-    }
-    return 0; // User is not registered
+    int userId = (int)(intptr_t)argument;
+    stateReloadUser(userId);
+    searchMailboxRewritten(userId);
 }
 
 // <----------------------------------------------------------------> //
@@ -158,25 +291,37 @@ int isUserRegistered(int userId)
  *
  * @param newSocket The socket descriptor of the client.
  * @param receivedMessage The message received from the client.
- * @param clients The array of sockets.
  */
 // <----------------------------------------------------------------> //
-void handleLoginRequest(int newSocket, Message receivedMessage, int *clients)
+void handleLoginRequest(int newSocket, Message receivedMessage)
 {
-    printf("Login request received from client: %d userId: %d\n", newSocket, receivedMessage.from);
-    clients[receivedMessage.from] = newSocket;
-    if (isUserRegistered(receivedMessage.from))
+    LOG_INFO("Login request received from client: %d userId: %d", newSocket, receivedMessage.from);
+    if (receivedMessage.from < 0 || receivedMessage.from >= MAX_USER_ID)
+    {
+        LOG_WARN("User ID out of range: %d", receivedMessage.from);
+        sendConfirmationMessage(newSocket, "Invalid user id");
+        return;
+    }
+    presenceConnected(newSocket, receivedMessage.from);
+    clusterUserChanged(receivedMessage.from);
+    if (clusterEnabled())
+    {
+        // Another node may have written the user's files since they were last read here
+        dispatchPost(receivedMessage.from, reloadUserFiles, (void *)(intptr_t)receivedMessage.from);
+    }
+    if (stateIsRegistered(receivedMessage.from))
     {
-        printf("User is registered\n");
+        LOG_DEBUG("User %d is registered", receivedMessage.from);
         sendConfirmationMessage(newSocket, "logged in");
     }
     else
     {
-        printf("User is not registered\n");
+        LOG_DEBUG("User %d is not registered", receivedMessage.from);
         // Reject login request and send registration request to the client
         Message registrationRequest;
+        memset(&registrationRequest, 0, sizeof(registrationRequest));
         registrationRequest.type = 2; // 2 indicates a registration request
-        send(newSocket, &registrationRequest, sizeof(registrationRequest), 0);
+        sendReply(newSocket, &registrationRequest);
     }
 }
 
@@ -190,7 +335,18 @@ void handleLoginRequest(int newSocket, Message receivedMessage, int *clients)
 // <----------------------------------------------------------------> //
 void handleRegistrationRequest(int newSocket, Message receivedMessage)
 {
-    printf("Registration request received from client: %d userId: %d\n", newSocket, receivedMessage.from);
+    LOG_INFO("Registration request received from client: %d userId: %d", newSocket, receivedMessage.from);
+    if (receivedMessage.from < 0 || receivedMessage.from >= MAX_USER_ID)
+    {
+        sendConfirmationMessage(newSocket, "Invalid user id");
+        return;
+    }
+    if (stateIsRegistered(receivedMessage.from))
+    {
+        // Registered on another node meanwhile; a second line would duplicate the user
+        sendConfirmationMessage(newSocket, "User is already registered");
+        return;
+    }
 
     // Extract user's information from receivedMessage.body
     char *username = strtok(receivedMessage.body, ",");
@@ -199,61 +355,47 @@ void handleRegistrationRequest(int newSocket, Message receivedMessage)
     char *surname = strtok(NULL, ",");
 
     // Print received information
-    printf("Received registration request:\n");
-    printf("Username: %s\n", username);
-    printf("Phone number: %s\n", phoneNumber);
-    printf("Name: %s\n", name);
-    printf("Surname: %s\n", surname);
-
-    // Open the file for appending
-    FILE *file = fopen("TerChatApp/users/user_list.txt", "a");
-    if (file == NULL)
-    {
-        printf("Error opening file\n");
-        return;
-    }
-    // Write the user's information to the file
-    fprintf(file, "%d,%s,%s,%s,%s\n", receivedMessage.from, username, phoneNumber, name, surname);
-    fclose(file);
+    LOG_DEBUG("Received registration request: username=%s phone=%s name=%s surname=%s", username, phoneNumber, name, surname);
 
-    // Create a directory for the user
-    char *dirPath = malloc((strlen("TerChatApp/users/") + sizeof(receivedMessage.from) + 1) * sizeof(char));
-    sprintf(dirPath, "TerChatApp/users/%d", receivedMessage.from);
-    if (mkdir(dirPath, 0777) == -1)
+    // Append the user's information to the user list
+    if (storageAppendf(STORAGE_USER_LIST_PATH, "%d,%s,%s,%s,%s\n", receivedMessage.from, username, phoneNumber, name, surname) < 0)
     {
-        printf("Error creating directory\n");
+        sendConfirmationMessage(newSocket, "Error occured in server");
         return;
     }
+    stateUserRegistered(receivedMessage.from);
+    User registered;
+    memset(&registered, 0, sizeof(registered));
+    registered.userId = receivedMessage.from;
+    strncpy(registered.username, username != NULL ? username : "", sizeof(registered.username) - 1);
+    strncpy(registered.phoneNumber, phoneNumber != NULL ? phoneNumber : "", sizeof(registered.phoneNumber) - 1);
+    strncpy(registered.name, name != NULL ? name : "", sizeof(registered.name) - 1);
+    strncpy(registered.surname, surname != NULL ? surname : "", sizeof(registered.surname) - 1);
+    directoryUserRegistered(&registered);
+    Message announcement;
+    memset(&announcement, 0, sizeof(announcement));
+    memcpy(announcement.body, &registered, sizeof(User));
+    clusterBroadcast(CLUSTER_REGISTERED, &announcement);
 
-    // Create a file for the user's contact list
-    char *filePath = malloc((strlen(dirPath) + strlen("/contact_list.txt") + 1) * sizeof(char));
-    sprintf(filePath, "%s/contact_list.txt", dirPath);
-    file = fopen(filePath, "w");
-    if (file == NULL)
+    // Create a directory for the user
+    if (storageCreateUserDirectory(receivedMessage.from) < 0)
     {
-        perror("Error opening file");
-        free(dirPath);
-        free(filePath);
+        sendConfirmationMessage(newSocket, "Error occured in server");
         return;
     }
-    fclose(file);
-    free(filePath);
 
-    // Create a file for the user's messages
-    filePath = malloc((strlen(dirPath) + strlen("/messages.txt") + 1) * sizeof(char));
-    sprintf(filePath, "%s/messages.txt", dirPath);
-    file = fopen(filePath, "w");
-    if (file == NULL)
+    // Create the user's contact list and messages files
+    StorageUserFile userFiles[] = {STORAGE_USER_CONTACTS, STORAGE_USER_MESSAGES};
+    size_t i;
+    for (i = 0; i < sizeof(userFiles) / sizeof(userFiles[0]); i++)
     {
-        perror("Error opening file");
-        free(dirPath);
-        free(filePath);
-        return;
+        char filePath[STORAGE_PATH_SIZE];
+        if (storageReplace(storageUserPath(receivedMessage.from, userFiles[i], filePath), "", 0) < 0)
+        {
+            sendConfirmationMessage(newSocket, "Error occured in server");
+            return;
+        }
     }
-    fclose(file);
-
-    free(filePath);
-    free(dirPath);
 
     // Send a confirmation message back to the client
     sendConfirmationMessage(newSocket, "registered");
@@ -269,16 +411,21 @@ void handleRegistrationRequest(int newSocket, Message receivedMessage)
 // <----------------------------------------------------------------> //
 void sendContactList(int sock, int userId)
 {
+    if (stateContactCount(userId) == 0)
+    {
+        sendConfirmationMessage(sock, "Contact list is empty");
+        return;
+    }
+    storageSyncUser(userId); // pending appends must be visible before the file is read
     User users[MAX_USERS];
     int userCount = 0;
 
     // Open the contact list file
-    char filePath[100];
-    sprintf(filePath, "TerChatApp/users/%d/contact_list.txt", userId);
-    FILE *file = fopen(filePath, "r");
+    char filePath[STORAGE_PATH_SIZE];
+    FILE *file = fopen(storageUserPath(userId, STORAGE_USER_CONTACTS, filePath), "r");
     if (file == NULL)
     {
-        perror("Error opening contact list");
+        LOG_ERROR("Error opening contact list: %s", strerror(errno));
         sendConfirmationMessage(sock, "Error occured in server");
         return;
     }
@@ -310,9 +457,9 @@ void sendContactList(int sock, int userId)
         msg.from = -1;
         msg.to = userCount;                         // Set the message to to the number of users
         memcpy(&msg.body, &users[i], sizeof(User)); // Copy the user struct into the message body
-        if (send(sock, &msg, sizeof(msg), 0) == -1)
+        if (sendReply(sock, &msg) == -1)
         {
-            perror("Error sending user");
+            LOG_ERROR("Error sending user: %s", strerror(errno));
             return;
         }
     }
@@ -329,42 +476,28 @@ void sendContactList(int sock, int userId)
 // <----------------------------------------------------------------> //
 void addUserToContactList(int sock, int userId, User user)
 {
-    char filePath[100];
-    sprintf(filePath, "TerChatApp/users/%d/contact_list.txt", userId);
-    printf("Adding user to contact list: %s\n", filePath);
+    char filePath[STORAGE_PATH_SIZE];
+    storageUserPath(userId, STORAGE_USER_CONTACTS, filePath);
+    LOG_DEBUG("Adding user to contact list: %s", filePath);
 
-    FILE *file = fopen(filePath, "r");
-    if (file == NULL)
+    if (stateHasContact(userId, user.userId))
     {
-        perror("Error opening contact list");
-        sendConfirmationMessage(sock, "Error occured in server");
+        LOG_DEBUG("User %d already exists in contact list of %d", user.userId, userId);
+        sendConfirmationMessage(sock, "User already exists in contact list");
         return;
     }
 
-    int existingUserId;
-    while (fscanf(file, "%d,%*[^\n]\n", &existingUserId) != EOF)
-    {
-        if (existingUserId == user.userId)
-        {
-            printf("User already exists in contact list\n");
-            fclose(file);
-            sendConfirmationMessage(sock, "User already exists in contact list");
-            return;
-        }
-    }
-
-    fclose(file);
-
-    file = fopen(filePath, "a");
-    if (file == NULL)
+    stateContactAdded(userId, user.userId);
+    char line[4 * REGISTRATION_BUFFER_SIZE + 16];
+    int length = snprintf(line, sizeof(line), "%d,%.*s,%.*s,%.*s\n", user.userId,
+                          REGISTRATION_BUFFER_SIZE - 1, user.name, REGISTRATION_BUFFER_SIZE - 1, user.surname, REGISTRATION_BUFFER_SIZE - 1, user.phoneNumber);
+    if (journalAppend(userId, JOURNAL_CONTACT_ADDED, filePath, line, (size_t)length) < 0)
     {
-        perror("Error opening contact list");
+        stateContactRemoved(userId, user.userId);
+        sendConfirmationMessage(sock, "Error occured in server");
         return;
     }
-
-    fprintf(file, "%d,%s,%s,%s\n", user.userId, user.name, user.surname, user.phoneNumber);
-
-    fclose(file);
+    presenceContactAdded(userId, user.userId);
     sendConfirmationMessage(sock, "User added to contact list");
 }
 
@@ -379,30 +512,39 @@ void addUserToContactList(int sock, int userId, User user)
 // <----------------------------------------------------------------> //
 void deleteUserFromFile(int sock, int userId, int userIdToDelete)
 {
+    if (!stateHasContact(userId, userIdToDelete))
+    {
+        sendConfirmationMessage(sock, "User deleted from contact list");
+        return;
+    }
+    stateContactRemoved(userId, userIdToDelete);
+    presenceContactRemoved(userId, userIdToDelete);
+    storageSyncUser(userId); // pending appends must be visible before the file is read
     FILE *file;
-    char filename[50];
-    sprintf(filename, "TerChatApp/users/%d/contact_list.txt", userId);
+    char filename[STORAGE_PATH_SIZE];
+    storageUserPath(userId, STORAGE_USER_CONTACTS, filename);
 
     // Open the file in read mode
     file = fopen(filename, "r");
     if (file == NULL)
     {
-        perror("Error opening file");
+        LOG_ERROR("Error opening file: %s", strerror(errno));
         return;
     }
 
     // Read all the lines into a dynamic array
-    char **lines = NULL;
+    char **lines = calloc(1, sizeof(char *));
     size_t len = 0;
     ssize_t read;
     int lineCount = 0;
-    while ((read = getline(&lines[lineCount], &len, file)) != -1)
+    while (lines != NULL && (read = getline(&lines[lineCount], &len, file)) != -1)
     {
+        len = 0;
         lineCount++;
         lines = realloc(lines, (lineCount + 1) * sizeof(char *));
         if (lines == NULL)
         {
-            perror("Error reallocating memory");
+            LOG_ERROR("Error reallocating memory: %s", strerror(errno));
             return;
         }
         lines[lineCount] = NULL;
@@ -411,11 +553,13 @@ void deleteUserFromFile(int sock, int userId, int userIdToDelete)
     // Close the file
     fclose(file);
 
-    // Open the file again in write mode
-    file = fopen(filename, "w");
+    // Collect the new content in memory; storage replaces the file in one step
+    char *contents = NULL;
+    size_t contentsLength = 0;
+    file = open_memstream(&contents, &contentsLength);
     if (file == NULL)
     {
-        perror("Error opening file");
+        LOG_ERROR("Error opening file: %s", strerror(errno));
         return;
     }
 
@@ -434,12 +578,94 @@ void deleteUserFromFile(int sock, int userId, int userIdToDelete)
 
     // Close the file
     fclose(file);
+    if (storageReplace(filename, contents, contentsLength) == 0)
+    {
+        char entry[16];
+        journalAppend(userId, JOURNAL_CONTACT_REMOVED, NULL, entry, (size_t)sprintf(entry, "%d\n", userIdToDelete));
+    }
+    free(contents);
 
     // Free the dynamic array
     free(lines);
     sendConfirmationMessage(sock, "User deleted from contact list");
 }
 
+// <----------------------------------------------------------------> //
+/**
+ * @brief Appends lines to a mailbox owned by the calling shard and indexes them.
+ *
+ * @param userId Owner of the mailbox.
+ * @param data The formatted lines.
+ * @param length Length of data.
+ */
+// <----------------------------------------------------------------> //
+static void appendToOwnMailbox(int userId, const char *data, size_t length)
+{
+    char filename[STORAGE_PATH_SIZE];
+    if (journalAppend(userId, JOURNAL_MESSAGE, storageUserPath(userId, STORAGE_USER_MESSAGES, filename), data, length) == 0)
+    {
+        searchMailboxAppended(userId, data, length);
+    }
+}
+
+// Lines for a mailbox owned by another shard, appended on that shard
+typedef struct
+{
+    int userId;
+    int peerId;
+    int lineCount;
+    size_t length;
+    char data[];
+} MailboxAppend;
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Shard task: records and appends lines to a mailbox the shard owns.
+ */
+// <----------------------------------------------------------------> //
+static void appendToMailbox(void *argument)
+{
+    MailboxAppend *append = argument;
+    int i;
+    for (i = 0; i < append->lineCount; i++)
+    {
+        stateMessageStored(append->userId, append->peerId);
+    }
+    appendToOwnMailbox(append->userId, append->data, append->length);
+    free(append);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Hands lines for another user's mailbox to the shard that owns it.
+ *
+ * @param userId Owner of the mailbox.
+ * @param peerId The user the lines were exchanged with.
+ * @param lineCount Number of lines in data.
+ * @param data The formatted lines; copied.
+ * @param length Length of data.
+ */
+// <----------------------------------------------------------------> //
+static void postMailboxAppend(int userId, int peerId, int lineCount, const char *data, size_t length)
+{
+    MailboxAppend *append = malloc(sizeof(MailboxAppend) + length);
+    if (append == NULL)
+    {
+        LOG_ERROR("Error allocating mailbox append for %d", userId);
+        return;
+    }
+    append->userId = userId;
+    append->peerId = peerId;
+    append->lineCount = lineCount;
+    append->length = length;
+    memcpy(append->data, data, length);
+    if (dispatchPost(userId, appendToMailbox, append) < 0)
+    {
+        LOG_ERROR("Error posting mailbox append for %d", userId);
+        free(append);
+    }
+}
+
 // <----------------------------------------------------------------> //
 /**
  * @brief Processes a message received from a client.
@@ -453,30 +679,34 @@ void deleteUserFromFile(int sock, int userId, int userIdToDelete)
 // <----------------------------------------------------------------> //
 void processMessage(int sock, int fromUserId, int toUserId, int recipientSocket, char *messageText)
 {
-    // Find the socket associated with the recipient user ID
-
-    if (recipientSocket == -1)
-    {
-        printf("Recipient user ID not found: %d\n", toUserId);
-        return;
-    }
-
-    // Send the message to the recipient
     Message msg;
+    memset(&msg, 0, sizeof(msg));
     msg.type = 7;                                         // Set the message type to 7 (send message)
     msg.from = fromUserId;                                // Set the from field to the current userId
     msg.to = toUserId;                                    // Set the to field to the userId of the recipient
     strncpy(msg.body, messageText, sizeof(msg.body) - 1); // Copy the message text into the body field
+    msg.requestId = 0;                                    // Delivery to the recipient is not a reply
 
-    if (send(recipientSocket, &msg, sizeof(msg), 0) == -1)
+    // A recipient logged in on another node gets the message from that node, which also stores its copy
+    int remoteNode = -1;
+    if (recipientSocket <= 0)
+    {
+        remoteNode = clusterRouteOf(toUserId);
+        if (remoteNode < 0 || clusterForward(remoteNode, CLUSTER_DELIVER, &msg) < 0)
+        {
+            LOG_WARN("Recipient user ID not found: %d", toUserId);
+            sendConfirmationMessage(sock, "Recipient is offline");
+            return;
+        }
+    }
+    else if (sendFrame(recipientSocket, &msg) == -1)
     {
-        perror("Error sending message");
+        // As in a batch, a recipient that could not take the message counts as offline
+        LOG_ERROR("Error sending message: %s", strerror(errno));
+        sendConfirmationMessage(sock, "Recipient is offline");
         return;
     }
 
-    char filename[50];
-    FILE *file;
-
     // Get the current date and time
     time_t t = time(NULL);
     struct tm tm = *localtime(&t);
@@ -484,163 +714,281 @@ void processMessage(int sock, int fromUserId, int toUserId, int recipientSocket,
     sprintf(date, "%d-%02d-%02d %02d:%02d:%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
 
     // Write the message to the sender's messages file
-    sprintf(filename, "TerChatApp/users/%d/messages.txt", fromUserId);
-    file = fopen(filename, "a");
-    if (file != NULL)
-    {
-        int readStatus = 0;
-        fprintf(file, "%s, %d, %s, %d\n", date, toUserId, messageText, readStatus);
-        fclose(file);
-    }
-    else
+    int readStatus = 0;
+    char line[MESSAGE_BODY_SIZE + 128];
+    int length = snprintf(line, sizeof(line), "%s, %d, %s, %d\n", date, toUserId, messageText, readStatus);
+    if (length > 0)
     {
-        perror("Error opening sender's messages file");
+        stateMessageStored(fromUserId, toUserId);
+        appendToOwnMailbox(fromUserId, line, (size_t)length < sizeof(line) ? (size_t)length : sizeof(line) - 1);
     }
 
-    // Write the message to the recipient's messages file
-    sprintf(filename, "TerChatApp/users/%d/messages.txt", toUserId);
-    file = fopen(filename, "a");
-    if (file != NULL)
+    // Write the message to the recipient's messages file, on the recipient's shard
+    length = snprintf(line, sizeof(line), "%s, %d, %s, %d\n", date, fromUserId, messageText, readStatus);
+    if (length > 0 && remoteNode < 0)
     {
-        int readStatus = 0;
-        fprintf(file, "%s, %d, %s, %d\n", date, fromUserId, messageText, readStatus);
-        fclose(file);
+        postMailboxAppend(toUserId, fromUserId, 1, line, (size_t)length < sizeof(line) ? (size_t)length : sizeof(line) - 1);
     }
-    else
+    sendConfirmationMessage(sock, "Message sent");
+}
+
+// An entry of a batch send that was delivered and still has to be stored
+typedef struct
+{
+    int to;
+    int length;
+    int remote; // delivered and stored by another node
+    const char *text;
+} BatchDelivery;
+
+static int compareBatchDeliveries(const void *a, const void *b)
+{
+    const BatchDelivery *left = a;
+    const BatchDelivery *right = b;
+    if (left->to != right->to)
     {
-        perror("Error opening recipient's messages file");
+        return left->to < right->to ? -1 : 1;
     }
-    sendConfirmationMessage(sock, "Message sent");
+    return left->text < right->text ? -1 : (left->text > right->text); // keep sending order per recipient
 }
 
 // <----------------------------------------------------------------> //
 /**
- * @brief Counts the unread messages for a user and sends the counts to the client.
+ * @brief Delivers a batch of messages with one mailbox append per user.
+ *
+ * Each entry is delivered like a type 7 message, but the sender's mailbox
+ * gets one append for the whole batch, each recipient's shard gets one
+ * append for all entries addressed to them, and the client receives one
+ * aggregated confirmation.
  *
  * @param sock The socket descriptor of the client.
- * @param userId The user ID of the user whose unread messages are to be counted.
+ * @param receivedMessage The batch message; "to" holds the number of entries.
  */
 // <----------------------------------------------------------------> //
-void countUnreadMessagesAndSend(int sock, int userId)
+void processBatchMessage(int sock, const Message *receivedMessage)
 {
-    printf("Counting unread messages for user %d\n", userId);
-    char filename[50];
-    sprintf(filename, "TerChatApp/users/%d/messages.txt", userId);
+    BatchDelivery deliveries[MESSAGE_BODY_SIZE / sizeof(BatchEntry)];
+    int entryCount = receivedMessage->to;
+    int deliveredCount = 0, offlineCount = 0, invalidCount = 0;
+    int fromUserId = receivedMessage->from;
+    size_t offset = 0;
+    int i;
 
-    FILE *file = fopen(filename, "r");
-    if (file != NULL)
+    if (entryCount < 0 || entryCount > (int)(sizeof(deliveries) / sizeof(deliveries[0])))
     {
-        char line[256];
-        int unreadCounts[MAX_USERS] = {0}; // This will hold the counts of unread messages for each user
+        sendConfirmationMessage(sock, "Invalid batch");
+        return;
+    }
 
-        while (fgets(line, sizeof(line), file))
+    for (i = 0; i < entryCount; i++)
+    {
+        BatchEntry entry;
+        if (offset + sizeof(BatchEntry) > MESSAGE_BODY_SIZE)
         {
-            char date[50];
-            int fromUserId;
-            char messageText[1024];
-            int readStatus;
-
-            // Parse the line
-            sscanf(line, "%[^,], %d, %[^,], %d\n", date, &fromUserId, messageText, &readStatus);
-
-            // Check if the message is unread
-            if (readStatus == 0)
-            {
-                unreadCounts[fromUserId]++; // Increment the count for this user
-            }
+            invalidCount = entryCount - i;
+            break;
         }
-        fclose(file);
+        memcpy(&entry, receivedMessage->body + offset, sizeof(BatchEntry));
+        offset += sizeof(BatchEntry);
+        if (offset + entry.length > MESSAGE_BODY_SIZE)
+        {
+            invalidCount = entryCount - i;
+            break;
+        }
+        const char *text = receivedMessage->body + offset;
+        offset += entry.length;
 
-        // Send the counts for each user to the client
-        char msgBody[1024] = ""; // This will hold the entire message body
-        int findedUnread = 0;
-        for (int i = 0; i < MAX_USERS; i++)
+        Message msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = 7; // delivered exactly like a single send
+        msg.from = fromUserId;
+        msg.to = entry.to;
+        memcpy(msg.body, text, entry.length < sizeof(msg.body) ? entry.length : sizeof(msg.body) - 1);
+
+        int recipientSocket = findSocketByUserId(entry.to);
+        int remote = 0;
+        if (recipientSocket <= 0)
         {
-            if (unreadCounts[i] > 0)
+            int remoteNode = clusterRouteOf(entry.to);
+            if (remoteNode < 0 || clusterForward(remoteNode, CLUSTER_DELIVER, &msg) < 0)
             {
-                findedUnread = 1;
-                char temp[128];
-                sprintf(temp, "%d Unread message from user %d\n", unreadCounts[i], i);
-                strcat(msgBody, temp); // Append the count for this user to the message body
+                offlineCount++;
+                continue;
             }
+            remote = 1;
         }
+        else if (sendFrame(recipientSocket, &msg) == -1)
+        {
+            LOG_ERROR("Error sending batch entry to %d: %s", entry.to, strerror(errno));
+            offlineCount++;
+            continue;
+        }
+        deliveries[deliveredCount].to = entry.to;
+        deliveries[deliveredCount].remote = remote;
+        deliveries[deliveredCount].length = entry.length;
+        deliveries[deliveredCount].text = text;
+        deliveredCount++;
+    }
 
-        if (findedUnread == 0)
+    if (deliveredCount > 0)
+    {
+        time_t t = time(NULL);
+        struct tm tm;
+        localtime_r(&t, &tm);
+        char date[50];
+        sprintf(date, "%d-%02d-%02d %02d:%02d:%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+        // Each line is the text plus at most ~60 bytes of date, ids and separators
+        size_t lineOverhead = 64;
+        char *arena = malloc(offset + (size_t)deliveredCount * lineOverhead);
+        if (arena == NULL)
         {
-            sendConfirmationMessage(sock, "No unread message");
+            LOG_ERROR("Error allocating batch buffers");
+            sendConfirmationMessage(sock, "Error occured in server");
             return;
         }
 
-        Message msg;
-        msg.type = 8; // type 8 for unread message count
-        strcpy(msg.body, msgBody);
-        msg.to = userId;
-        msg.from = -1; // from server
+        // Sender's mailbox: every delivered entry in sending order, one append
+        size_t used = 0;
+        for (i = 0; i < deliveredCount; i++)
+        {
+            stateMessageStored(fromUserId, deliveries[i].to);
+            used += (size_t)sprintf(arena + used, "%s, %d, %.*s, %d\n", date, deliveries[i].to, deliveries[i].length, deliveries[i].text, 0);
+        }
+        appendToOwnMailbox(fromUserId, arena, used);
 
-        // printf("Sending message to client %d: %s\n", sock, msg.body);
-        if (send(sock, &msg, sizeof(msg), 0) == -1)
+        // Recipients' mailboxes: one append per distinct local recipient, on the recipient's shard
+        qsort(deliveries, (size_t)deliveredCount, sizeof(BatchDelivery), compareBatchDeliveries);
+        int groupLines = 0;
+        used = 0;
+        for (i = 0; i < deliveredCount; i++)
         {
-            perror("Error sending message");
+            if (!deliveries[i].remote)
+            {
+                used += (size_t)sprintf(arena + used, "%s, %d, %.*s, %d\n", date, fromUserId, deliveries[i].length, deliveries[i].text, 0);
+                groupLines++;
+            }
+            if ((i + 1 == deliveredCount || deliveries[i + 1].to != deliveries[i].to) && groupLines > 0)
+            {
+                postMailboxAppend(deliveries[i].to, fromUserId, groupLines, arena, used);
+                groupLines = 0;
+                used = 0;
+            }
         }
+        free(arena);
     }
-    else
-    {
-        perror("Error opening messages file");
-    }
+
+    char summary[128];
+    snprintf(summary, sizeof(summary), "Batch: %d sent, %d offline, %d invalid", deliveredCount, offlineCount, invalidCount);
+    sendConfirmationMessage(sock, summary);
 }
 
 // <----------------------------------------------------------------> //
 /**
- * @brief Reads the messages of a user and sets the read status to read.
+ * @brief Counts the unread messages for a user and sends the counts to the client.
  *
  * @param sock The socket descriptor of the client.
- * @param userId The user ID of the user whose messages are to be read.
- * @param targetUserId The user ID of the user whose messages are to be read.
+ * @param userId The user ID of the user whose unread messages are to be counted.
  */
 // <----------------------------------------------------------------> //
-void readUserMessagesAndSetReadStatus(int sock, int userId, int targetUserId)
+void countUnreadMessagesAndSend(int sock, int userId)
 {
-    char filename[50];
-    sprintf(filename, "TerChatApp/users/%d/messages.txt", userId);
-
-    FILE *file = fopen(filename, "r");
-    if (file != NULL)
+    LOG_DEBUG("Counting unread messages for user %d", userId);
+    StateUnread unread[MESSAGE_BODY_SIZE / 32]; // more lines than that would not fit in the body anyway
+    int unreadCount = stateUnreadCounts(userId, unread, (int)(sizeof(unread) / sizeof(unread[0])));
+    if (unreadCount == 0)
     {
-        char line[256];
-        int messageCount = 0;
+        sendConfirmationMessage(sock, "No unread message");
+        return;
+    }
 
-        // Define a struct to hold the message data
-        typedef struct
+    // Send the counts for each user to the client
+    char msgBody[MESSAGE_BODY_SIZE]; // This will hold the entire message body
+    size_t used = 0;
+    int i;
+    for (i = 0; i < unreadCount; i++)
+    {
+        int length = snprintf(msgBody + used, sizeof(msgBody) - used, "%u Unread message from user %d\n", unread[i].count, unread[i].peer);
+        if (length < 0 || (size_t)length >= sizeof(msgBody) - used)
         {
-            char *date;
-            int fromUserId;
-            char *messageText;
-            int readStatus;
+            msgBody[used] = '\0';
+            break;
+        }
+        used += (size_t)length;
+    }
+
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 8; // type 8 for unread message count
+    strcpy(msg.body, msgBody);
+    msg.to = userId;
+    msg.from = -1; // from server
+
+    if (sendReply(sock, &msg) == -1)
+    {
+        LOG_ERROR("Error sending message: %s", strerror(errno));
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Reads the messages of a user and sets the read status to read.
+ *
+ * @param sock The socket descriptor of the client.
+ * @param userId The user ID of the user whose messages are to be read.
+ * @param targetUserId The user ID of the user whose messages are to be read.
+ */
+// <----------------------------------------------------------------> //
+void readUserMessagesAndSetReadStatus(int sock, int userId, int targetUserId)
+{
+    storageSyncUser(userId); // pending appends must be visible before the file is read
+    char filename[STORAGE_PATH_SIZE];
+    storageUserPath(userId, STORAGE_USER_MESSAGES, filename);
+
+    FILE *file = fopen(filename, "r");
+    if (file != NULL)
+    {
+        char line[MESSAGE_BODY_SIZE + 128]; // as long as processMessage() writes them
+        int messageCount = 0;
+
+        // Define a struct to hold the message data
+        typedef struct
+        {
+            char *date;
+            int fromUserId;
+            char *messageText;
+            int readStatus;
         } MessageData;
 
         MessageData *messages = NULL; // This will hold all the messages
+        int statusChanged = 0;        // a message of targetUserId was unread
 
         while (fgets(line, sizeof(line), file))
         {
             char date[50];
             int fromUserId;
-            char messageText[1024];
+            char messageText[MESSAGE_BODY_SIZE];
             int readStatus;
 
             // Parse the line
-            sscanf(line, "%[^,], %d, %[^,], %d\n", date, &fromUserId, messageText, &readStatus);
+            sscanf(line, "%49[^,], %d, %1023[^,], %d\n", date, &fromUserId, messageText, &readStatus);
             int setRead = 0;
             // Reallocate memory for the messages
             messages = realloc(messages, (messageCount + 1) * sizeof(MessageData));
             if (messages == NULL)
             {
-                perror("Error reallocating memory for messages");
+                LOG_ERROR("Error reallocating memory for messages: %s", strerror(errno));
                 return;
             }
             if (fromUserId == targetUserId)
             {
+                statusChanged |= readStatus != 1;
                 setRead = 1;
             }
+            else
+            {
+                setRead = readStatus; // other conversations keep their status
+            }
 
             // Store the message
             messages[messageCount].date = strdup(date);
@@ -651,8 +999,10 @@ void readUserMessagesAndSetReadStatus(int sock, int userId, int targetUserId)
         }
         fclose(file);
 
-        // Rewrite the messages with the updated read status
-        file = fopen(filename, "w");
+        // Rewrite the messages with the updated read status, unless none changed; a replica only reads them
+        char *contents = NULL;
+        size_t contentsLength = 0;
+        file = open_memstream(&contents, &contentsLength);
         if (file != NULL)
         {
             // Send the messages to the client
@@ -661,14 +1011,14 @@ void readUserMessagesAndSetReadStatus(int sock, int userId, int targetUserId)
             {
                 Message msg;
                 msg.type = 9; // type 9 for read message
-                sprintf(msg.body, "%s, %d, %s, %d\n", messages[i].date, messages[i].fromUserId, messages[i].messageText, messages[i].readStatus);
+                snprintf(msg.body, sizeof(msg.body), "%s, %d, %s, %d\n", messages[i].date, messages[i].fromUserId, messages[i].messageText, messages[i].readStatus);
                 msg.to = userId;                   // to server
                 msg.from = messages[i].fromUserId; // from server
                 if (messages[i].fromUserId == targetUserId)
                 {
-                    if (send(sock, &msg, sizeof(msg), 0) == -1)
+                    if (sendReply(sock, &msg) == -1)
                     {
-                        perror("Error sending message");
+                        LOG_ERROR("Error sending message: %s", strerror(errno));
                     }
                 }
 
@@ -679,10 +1029,18 @@ void readUserMessagesAndSetReadStatus(int sock, int userId, int targetUserId)
                 free(messages[i].messageText);
             }
             fclose(file);
+            if (!replicaMode && statusChanged && storageReplace(filename, contents, contentsLength) == 0)
+            {
+                char entry[16];
+                journalAppend(userId, JOURNAL_READ, NULL, entry, (size_t)sprintf(entry, "%d\n", targetUserId));
+                stateMessagesRead(userId, targetUserId);
+                searchMailboxRewritten(userId);
+            }
+            free(contents);
         }
         else
         {
-            perror("Error opening messages file for writing");
+            LOG_ERROR("Error opening messages file for writing: %s", strerror(errno));
         }
 
         // Free the memory allocated for the messages
@@ -690,169 +1048,1289 @@ void readUserMessagesAndSetReadStatus(int sock, int userId, int targetUserId)
     }
     else
     {
-        perror("Error opening messages file");
+        LOG_ERROR("Error opening messages file: %s", strerror(errno));
     }
     sendConfirmationMessage(sock, "Messages read");
 }
 
 // <----------------------------------------------------------------> //
 /**
- * @brief Handles a client connection.
+ * @brief Searches a user's message history and sends the best matches.
  *
- * @param args The arguments passed to the thread.
+ * The index answers with line offsets, so only the matching lines are read
+ * from the mailbox. Each hit is sent as one type 12 frame.
+ *
+ * @param sock The socket descriptor of the client.
+ * @param userId The user whose mailbox is searched.
+ * @param query The search text.
+ * @param maxResults The maximum number of hits to send; 0 for the default.
  */
 // <----------------------------------------------------------------> //
-void *handleClient(void *args)
+void searchMessagesAndSend(int sock, int userId, const char *query, int maxResults)
 {
-    ThreadArgs *threadArgs = (ThreadArgs *)args;
-    int newSocket = threadArgs->newSocket;
-    int *clients = threadArgs->clients;
-    Message receivedMessage;
+    if (maxResults <= 0)
+    {
+        maxResults = SEARCH_DEFAULT_RESULTS;
+    }
+    if (maxResults > SEARCH_MAX_RESULTS)
+    {
+        maxResults = SEARCH_MAX_RESULTS;
+    }
 
-    while (1)
+    SearchHit hits[SEARCH_MAX_RESULTS];
+    int totalHits;
+    int hitCount = searchMessages(userId, query, hits, maxResults, &totalHits);
+    if (hitCount < 0)
     {
-        int valrec = recv(newSocket, &receivedMessage, sizeof(receivedMessage), 0);
-        if (valrec <= 0) // Client disconnected
-        {
-            printf("Client %d disconnected\n", newSocket);
-            disconnectClient(newSocket, receivedMessage.from);
-        }
-        if (receivedMessage.type == -1) // disconnect request
-        {
-            disconnectClient(newSocket, receivedMessage.from);
-        }
-        else if (receivedMessage.type == 0) // login request
-        {
-            handleLoginRequest(newSocket, receivedMessage, clients);
-        }
+        sendConfirmationMessage(sock, "Error occured in server");
+        return;
+    }
+    if (hitCount == 0)
+    {
+        sendConfirmationMessage(sock, "No messages found");
+        return;
+    }
+    LOG_DEBUG("Search of user %d matched %d messages", userId, totalHits);
 
-        else if (receivedMessage.type == 1) // server message
+    storageSyncUser(userId); // hits may point at appends still queued
+    char filename[STORAGE_PATH_SIZE];
+    int fd = open(storageUserPath(userId, STORAGE_USER_MESSAGES, filename), O_RDONLY);
+    if (fd < 0)
+    {
+        LOG_ERROR("Error opening messages file: %s", strerror(errno));
+        sendConfirmationMessage(sock, "Error occured in server");
+        return;
+    }
+    int i;
+    for (i = 0; i < hitCount; i++)
+    {
+        Message msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = 12;
+        msg.from = hits[i].peer;
+        msg.to = hitCount; // the client counts frames like a contact list
+        size_t length = hits[i].length < sizeof(msg.body) ? hits[i].length : sizeof(msg.body) - 1;
+        if (pread(fd, msg.body, length, (off_t)hits[i].offset) < 0)
         {
-            printf("Message from client %d: %s\n", newSocket, receivedMessage.body);
+            LOG_ERROR("Error reading message: %s", strerror(errno));
         }
-        else if (receivedMessage.type == 2) // registration request
+        if (sendReply(sock, &msg) == -1)
         {
-            handleRegistrationRequest(newSocket, receivedMessage);
+            LOG_ERROR("Error sending search hit: %s", strerror(errno));
+            break;
         }
-        else if (receivedMessage.type == 4) // list contacts
+    }
+    close(fd);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Looks up registered users by the start of a field and sends the matches.
+ *
+ * Each match is sent as one type 13 frame holding the user, like a contact
+ * list, so the client can add it without knowing the ID beforehand.
+ *
+ * @param sock The socket descriptor of the client.
+ * @param userId The user searching; their contacts are listed first.
+ * @param query The text typed so far.
+ * @param maxResults The maximum number of matches to send; 0 for the default.
+ */
+// <----------------------------------------------------------------> //
+void findUsersAndSend(int sock, int userId, const char *query, int maxResults)
+{
+    if (maxResults <= 0)
+    {
+        maxResults = DIRECTORY_DEFAULT_RESULTS;
+    }
+    if (maxResults > DIRECTORY_MAX_RESULTS)
+    {
+        maxResults = DIRECTORY_MAX_RESULTS;
+    }
+
+    User matches[DIRECTORY_MAX_RESULTS];
+    int matchCount = directoryLookup(userId, query, matches, maxResults);
+    if (matchCount == 0)
+    {
+        sendConfirmationMessage(sock, "No users found");
+        return;
+    }
+    int i;
+    for (i = 0; i < matchCount; i++)
+    {
+        Message msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = 13;
+        msg.from = -1;
+        msg.to = matchCount;
+        memcpy(msg.body, &matches[i], sizeof(User));
+        if (sendReply(sock, &msg) == -1)
         {
-            sendContactList(newSocket, receivedMessage.from);
+            LOG_ERROR("Error sending user: %s", strerror(errno));
+            return;
         }
-        else if (receivedMessage.type == 5) // add user
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Subscribes a connection to its user's contacts' presence and sends their current state.
+ *
+ * The state is sent as type 14 frames of PresenceChange records; only the
+ * last one carries the request ID. Later changes are pushed by the
+ * presence flusher in the same format.
+ *
+ * @param sock The socket descriptor of the client.
+ * @param userId The subscribing user.
+ */
+// <----------------------------------------------------------------> //
+void subscribePresenceAndSend(int sock, int userId)
+{
+    int contactCount = stateContactCount(userId);
+    int32_t *contacts = malloc(((size_t)contactCount + 1) * sizeof(int32_t));
+    if (contacts == NULL)
+    {
+        sendConfirmationMessage(sock, "Error occured in server");
+        return;
+    }
+    contactCount = stateContacts(userId, contacts, contactCount);
+    presenceSubscribe(sock, currentGeneration, userId, contacts, contactCount);
+
+    Message msg;
+    int i = 0;
+    do
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.type = 14;
+        msg.from = -1;
+        for (; i < contactCount && msg.to < PRESENCE_CHANGES_PER_FRAME; i++)
         {
-            User userToAdd;
-            memcpy(&userToAdd, receivedMessage.body, sizeof(User));
-            addUserToContactList(newSocket, receivedMessage.from, userToAdd);
+            PresenceChange change = {contacts[i], presenceIsOnline(contacts[i])};
+            memcpy(msg.body + (size_t)msg.to * sizeof(change), &change, sizeof(change));
+            msg.to++;
         }
-        else if (receivedMessage.type == 6) // delete user
+        if ((i < contactCount ? sendFrame(sock, &msg) : sendReply(sock, &msg)) == -1)
         {
-            deleteUserFromFile(newSocket, receivedMessage.from, receivedMessage.to);
+            LOG_ERROR("Error sending presence: %s", strerror(errno));
+            break;
         }
-        else if (receivedMessage.type == 7) // send message
+    } while (i < contactCount);
+    free(contacts);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sends a user the changes to their contacts and mailbox since a version.
+ *
+ * The entries go out as type 15 frames of whole journal lines, a line too
+ * long for one frame being cut short. Every frame's body starts with the
+ * version reached once all frames are applied and "to" holds the frame
+ * count, so a client that loses the connection half way simply asks again
+ * with its old version.
+ *
+ * @param sock The socket descriptor of the client.
+ * @param userId The user to sync.
+ * @param since The version the client has, as decimal text; empty or 0 for a full copy.
+ */
+// <----------------------------------------------------------------> //
+void syncChangesAndSend(int sock, int userId, const char *since)
+{
+    char *changes;
+    size_t length;
+    long long version;
+    if (journalChangesSince(userId, strtoll(since, NULL, 10), &changes, &length, &version) < 0)
+    {
+        sendConfirmationMessage(sock, "Error occured in server");
+        return;
+    }
+
+    // Cut the entries into frames first, the count goes into every frame
+    char header[32];
+    size_t headerLength = (size_t)snprintf(header, sizeof(header), "%lld\n", version);
+    size_t room = MESSAGE_BODY_SIZE - 1 - headerLength;
+    size_t frameCapacity = length / room + 2;
+    size_t *frameEnds = malloc(frameCapacity * sizeof(size_t));
+    size_t frameCount = 0;
+    size_t start = 0;
+    while (frameEnds != NULL && (start < length || frameCount == 0))
+    {
+        size_t end = start;
+        while (end < length)
         {
-            int recipientSocket = findSocketByUserId(receivedMessage.to, clients);
-            processMessage(newSocket, receivedMessage.from, receivedMessage.to, recipientSocket, receivedMessage.body);
+            const char *newline = memchr(changes + end, '\n', length - end);
+            size_t next = newline != NULL ? (size_t)(newline - changes) + 1 : length;
+            if (next - start > room && end > start)
+            {
+                break; // the line goes into the next frame
+            }
+            end = next;
+            if (end - start >= room)
+            {
+                break;
+            }
         }
-        else if (receivedMessage.type == 8) // check message
+        if (frameCount == frameCapacity)
         {
-            countUnreadMessagesAndSend(newSocket, receivedMessage.from);
+            frameCapacity *= 2;
+            size_t *grown = realloc(frameEnds, frameCapacity * sizeof(size_t));
+            if (grown == NULL)
+            {
+                free(frameEnds);
+                frameEnds = NULL;
+                break;
+            }
+            frameEnds = grown;
         }
-        else if (receivedMessage.type == 9) // read messages
+        frameEnds[frameCount++] = end;
+        start = end;
+    }
+    if (frameEnds == NULL)
+    {
+        LOG_ERROR("Error allocating sync frames for %d", userId);
+        free(changes);
+        sendConfirmationMessage(sock, "Error occured in server");
+        return;
+    }
+
+    Message msg;
+    start = 0;
+    size_t i;
+    for (i = 0; i < frameCount; i++)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.type = 15;
+        msg.from = -1;
+        msg.to = (int)frameCount;
+        size_t used = frameEnds[i] - start < room ? frameEnds[i] - start : room;
+        memcpy(msg.body, header, headerLength);
+        memcpy(msg.body + headerLength, changes + start, used);
+        if (used < frameEnds[i] - start)
         {
-            readUserMessagesAndSetReadStatus(newSocket, receivedMessage.from, receivedMessage.to);
+            msg.body[headerLength + used - 1] = '\n'; // a single line longer than a frame, cut short
         }
-        else
+        start = frameEnds[i];
+        if (sendReply(sock, &msg) == -1)
         {
-            printf("Client %d: %s\n", newSocket, receivedMessage.body);
+            LOG_ERROR("Error sending changes: %s", strerror(errno));
+            break;
         }
     }
-
-    close(newSocket);
-    free(args);
-    pthread_exit(NULL);
+    free(frameEnds);
+    free(changes);
 }
 
-int main()
+// <----------------------------------------------------------------> //
+/**
+ * @brief Stores one chunk of an upload and, after the last one, sends the blob to the recipient.
+ *
+ * Each chunk is written to disk as it arrives on the uploader's shard, so a
+ * large upload is never held in memory and the shard handles other requests
+ * between its chunks. The finished blob is sent as a text message that
+ * references it; mailboxes and journals only ever hold that reference. Only
+ * the last chunk is answered, unless the recipient is offline when the
+ * first one arrives: then that one is answered and the upload refused, so
+ * the uploader can stop before sending the rest. Blobs stay on the node
+ * that received them, so the recipient must be logged in on the same node.
+ *
+ * @param sock The socket descriptor of the client.
+ * @param receivedMessage The chunk.
+ */
+// <----------------------------------------------------------------> //
+void receiveBlobChunk(int sock, const Message *receivedMessage)
 {
-    printf("Server started\n");
-    mkdir("TerChatApp", 0777);       // Create the TerChatApp directory if it does not exist
-    mkdir("TerChatApp/users", 0777); // Create the users directory if it does not exist
-
-    int clients[MAX_USERS] = {0};
-    int sockets[MAX_USERS] = {0};
-    pthread_t threads[MAX_USERS];
-    int threadCount = 0;
-
-    int serverSock = 0;
-    struct sockaddr_in servAddr;
-    int addrlen = sizeof(servAddr);
-
-    serverSock = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSock < 0)
+    BlobChunk chunk;
+    memcpy(&chunk, receivedMessage->body, sizeof(chunk));
+    if (chunk.offset == 0 && findSocketByUserId(receivedMessage->to) <= 0)
     {
-        perror("Server Socket Failed");
-        exit(EXIT_FAILURE);
+        blobRefuse(receivedMessage->from, receivedMessage->to, &chunk);
+        sendConfirmationMessage(sock, "Recipient is offline");
+        return;
     }
-
-    servAddr.sin_family = AF_INET;
-    servAddr.sin_addr.s_addr = INADDR_ANY;
-    servAddr.sin_port = htons(PORT);
-
-    // bind the socket
-    if (bind(serverSock, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0)
+    long long blobId;
+    char name[BLOB_NAME_SIZE];
+    size_t size;
+    int result = blobReceive(receivedMessage->from, receivedMessage->to, &chunk, receivedMessage->body + sizeof(chunk), &blobId, name, &size);
+    if (result == -1 && chunk.last)
     {
-        perror("Binding Server socket err");
-        exit(EXIT_FAILURE);
+        sendConfirmationMessage(sock, "Attachment rejected");
+    }
+    if (result <= 0)
+    {
+        return;
     }
 
-    // listen the prot
-    if (listen(serverSock, 5) < 0)
+    int recipientSocket = findSocketByUserId(receivedMessage->to);
+    if (recipientSocket <= 0)
     {
-        perror("server listen err");
-        exit(EXIT_FAILURE);
+        blobDiscard(blobId, receivedMessage->from, receivedMessage->to);
+        sendConfirmationMessage(sock, "Recipient is offline");
+        return;
     }
+    char reference[MESSAGE_BODY_SIZE];
+    snprintf(reference, sizeof(reference), BLOB_REFERENCE_FORMAT, blobId, size, name);
+    processMessage(sock, receivedMessage->from, receivedMessage->to, recipientSocket, reference);
+}
 
-    atexit(notifyClientsAndShutdown);
+// A blob being sent to a client, a window of chunks at a time
+typedef struct
+{
+    int sock;
+    unsigned generation; // of the connection on sock; the download stops if it closes
+    int userId;
+    int peerId;
+    int requestId;
+    int fd;
+    size_t offset;
+    size_t size;
+} BlobDownload;
 
-    while (1)
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sends the next window of a download.
+ *
+ * @return int 1 once the download is over, 0 if chunks are left.
+ */
+// <----------------------------------------------------------------> //
+static int sendBlobChunks(BlobDownload *download)
+{
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.to = download->userId;
+    msg.from = download->peerId;
+    msg.requestId = download->requestId;
+    int i;
+    for (i = 0; i < BLOB_WINDOW_CHUNKS; i++)
     {
-        int newClient = accept(serverSock, (struct sockaddr *)&servAddr, (socklen_t *)&addrlen);
-        if (newClient < 0)
+        BlobChunk chunk = {0, (unsigned int)download->offset, 0, 0};
+        ssize_t length = pread(download->fd, msg.body + sizeof(chunk), BLOB_CHUNK_DATA_SIZE, (off_t)download->offset);
+        if (length < 0)
         {
-            perror("Error! When server accepting new client");
-            exit(EXIT_FAILURE);
+            LOG_ERROR("Error reading blob for %d: %s", download->userId, strerror(errno));
+            msg.type = 3;
+            strcpy(msg.body, "Error occured in server");
+            sendFrameIfCurrent(download->sock, download->generation, &msg);
+            return 1;
         }
-
-        printf("\nnew client connected with client id: %d\n", newClient);
-
-        clients[threadCount] = newClient;
-        ThreadArgs *args = malloc(sizeof(ThreadArgs));
-        args->newSocket = newClient;
-        args->clients = sockets;
-
-        int thread_create = pthread_create(&threads[threadCount], NULL, handleClient, (void *)args);
-        if (thread_create < 0)
+        download->offset += (size_t)length;
+        chunk.length = (unsigned short)length;
+        chunk.last = download->offset >= download->size || length == 0;
+        msg.type = 16;
+        memcpy(msg.body, &chunk, sizeof(chunk));
+        if (sendFrameIfCurrent(download->sock, download->generation, &msg) == -1)
         {
-            perror("thread create for client error");
-            exit(EXIT_FAILURE);
+            LOG_ERROR("Error sending blob: %s", strerror(errno));
+            return 1;
         }
+        if (chunk.last)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-        // Detach the thread
-        pthread_detach(threads[threadCount]);
-
-        threadCount++;
-        if (threadCount >= MAX_USERS)
+// <----------------------------------------------------------------> //
+/**
+ * @brief Shard task: sends a download a window at a time, yielding the shard in between.
+ *
+ * Requests queued behind a download, small messages of the same user
+ * included, wait for one window rather than the whole blob. Without shards
+ * the windows go out back to back.
+ */
+// <----------------------------------------------------------------> //
+static void sendBlobWindow(void *argument)
+{
+    BlobDownload *download = argument;
+    while (!sendBlobChunks(download))
+    {
+        if (dispatchYield(download->userId, sendBlobWindow, download) == 0)
         {
-            printf("too many clients.Abort new connections\n");
-            close(newClient);
+            return;
         }
     }
+    close(download->fd);
+    free(download);
+}
 
-    int i;
-    for (i = 0; i < threadCount; i++)
+// <----------------------------------------------------------------> //
+/**
+ * @brief Starts sending a blob to one of the two users it was exchanged between.
+ *
+ * @param sock The socket descriptor of the client.
+ * @param userId The user asking for the blob.
+ * @param peerId The other user of the conversation.
+ * @param blobId The blob ID as decimal text.
+ */
+// <----------------------------------------------------------------> //
+void sendBlob(int sock, int userId, int peerId, const char *blobId)
+{
+    size_t size;
+    int fd = blobOpen(strtoll(blobId, NULL, 10), userId, peerId, &size);
+    if (fd < 0)
+    {
+        sendConfirmationMessage(sock, "Attachment not found");
+        return;
+    }
+    BlobDownload *download = malloc(sizeof(BlobDownload));
+    if (download == NULL)
+    {
+        LOG_ERROR("Error allocating download for %d", userId);
+        close(fd);
+        sendConfirmationMessage(sock, "Error occured in server");
+        return;
+    }
+    *download = (BlobDownload){sock, currentGeneration, userId, peerId, currentRequestId, fd, 0, size};
+    sendBlobWindow(download);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Tells whether handling a message type writes to the user files.
+ *
+ * A replica answers these with "Read-only replica"; reading messages is
+ * served but leaves their read status alone.
+ */
+// <----------------------------------------------------------------> //
+static int typeChangesStorage(int type)
+{
+    return type == 2 || type == 5 || type == 6 || type == 7 || type == 10 || type == 16 ||
+           type == 12; // the search index is built from mailboxes the replica does not own
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Dispatches one received message to its handler.
+ *
+ * @param newSocket The socket descriptor of the client.
+ * @param receivedMessage The message received from the client.
+ * @return int -1 if the client asked to disconnect, 0 otherwise.
+ */
+// <----------------------------------------------------------------> //
+int dispatchMessage(int newSocket, Message *receivedMessage)
+{
+    if (receivedMessage->type == -1) // disconnect request
     {
-        pthread_join(threads[i], NULL);
+        return -1;
+    }
+
+    metricsInFlight(1);
+    uint64_t startedAt = metricsNow();
+    uint64_t tracedAt = traceSpanBegin();
+    currentRequestId = receivedMessage->requestId;
+
+    if (replicaMode && typeChangesStorage(receivedMessage->type))
+    {
+        sendConfirmationMessage(newSocket, "Read-only replica");
+    }
+    else if (replicaMode && receivedMessage->type == 17) // blobs live outside the replicated tree
+    {
+        sendConfirmationMessage(newSocket, "Attachments are only served by the primary");
+    }
+    else if (receivedMessage->type == 0) // login request
+    {
+        handleLoginRequest(newSocket, *receivedMessage);
+    }
+    else if (receivedMessage->type == 1) // server message
+    {
+        LOG_INFO("Message from client %d: %s", newSocket, receivedMessage->body);
+    }
+    else if (receivedMessage->type == 2) // registration request
+    {
+        handleRegistrationRequest(newSocket, *receivedMessage);
+    }
+    else if (receivedMessage->type == 4) // list contacts
+    {
+        sendContactList(newSocket, receivedMessage->from);
+    }
+    else if (receivedMessage->type == 5) // add user
+    {
+        User userToAdd;
+        memcpy(&userToAdd, receivedMessage->body, sizeof(User));
+        addUserToContactList(newSocket, receivedMessage->from, userToAdd);
+    }
+    else if (receivedMessage->type == 6) // delete user
+    {
+        deleteUserFromFile(newSocket, receivedMessage->from, receivedMessage->to);
+    }
+    else if (receivedMessage->type == 7) // send message
+    {
+        int recipientSocket = findSocketByUserId(receivedMessage->to);
+        processMessage(newSocket, receivedMessage->from, receivedMessage->to, recipientSocket, receivedMessage->body);
+    }
+    else if (receivedMessage->type == 10) // batch send
+    {
+        processBatchMessage(newSocket, receivedMessage);
+    }
+    else if (receivedMessage->type == 11) // heartbeat
+    {
+        Message pong;
+        memset(&pong, 0, sizeof(pong));
+        pong.type = 11;
+        pong.from = -1;
+        pong.to = receivedMessage->from;
+        sendReply(newSocket, &pong);
+    }
+    else if (receivedMessage->type == 8) // check message
+    {
+        countUnreadMessagesAndSend(newSocket, receivedMessage->from);
+    }
+    else if (receivedMessage->type == 9) // read messages
+    {
+        readUserMessagesAndSetReadStatus(newSocket, receivedMessage->from, receivedMessage->to);
+    }
+    else if (receivedMessage->type == 12) // search messages
+    {
+        receivedMessage->body[MESSAGE_BODY_SIZE - 1] = '\0';
+        searchMessagesAndSend(newSocket, receivedMessage->from, receivedMessage->body, receivedMessage->to);
+    }
+    else if (receivedMessage->type == 13) // find users
+    {
+        receivedMessage->body[MESSAGE_BODY_SIZE - 1] = '\0';
+        findUsersAndSend(newSocket, receivedMessage->from, receivedMessage->body, receivedMessage->to);
+    }
+    else if (receivedMessage->type == 14) // presence
+    {
+        subscribePresenceAndSend(newSocket, receivedMessage->from);
+    }
+    else if (receivedMessage->type == 15) // sync changes
+    {
+        receivedMessage->body[MESSAGE_BODY_SIZE - 1] = '\0';
+        syncChangesAndSend(newSocket, receivedMessage->from, receivedMessage->body);
+    }
+    else if (receivedMessage->type == 16) // blob chunk
+    {
+        receiveBlobChunk(newSocket, receivedMessage);
+    }
+    else if (receivedMessage->type == 17) // fetch blob
+    {
+        receivedMessage->body[MESSAGE_BODY_SIZE - 1] = '\0';
+        sendBlob(newSocket, receivedMessage->from, receivedMessage->to, receivedMessage->body);
+    }
+    else
+    {
+        LOG_WARN("Client %d sent unknown message type %d: %s", newSocket, receivedMessage->type, receivedMessage->body);
+    }
+
+    currentRequestId = 0;
+    traceSpanEnd(metricsTypeName(metricsTypeFromMessage(receivedMessage->type)), tracedAt);
+    metricsRecordRequest(metricsTypeFromMessage(receivedMessage->type), metricsNow() - startedAt);
+    metricsInFlight(-1);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns the priority class a message type is scheduled in.
+ *
+ * The class only orders different users' work: a read queued while the
+ * same user's change waits is moved up behind it, so it still sees the
+ * change. Reading a conversation (type 9) counts as a change: it rewrites
+ * the mailbox that deliveries append to, so it stays interactive with them.
+ */
+// <----------------------------------------------------------------> //
+static DispatchClass priorityOfType(int type)
+{
+    switch (type)
+    {
+    case 4:
+    case 8:
+    case 12:
+    case 13:
+    case 15:
+        return DISPATCH_BACKGROUND;
+    case 16:
+    case 17:
+        return DISPATCH_BULK;
+    default:
+        return DISPATCH_INTERACTIVE;
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Handles a message inline or hands it to the shard that owns its user.
+ *
+ * Everything that reads or changes a user's files runs on the sender's
+ * shard, in arrival order per user; requests of users
+ * on different shards run in parallel and, when they carry request IDs,
+ * may complete out of order. Connection-level messages (disconnect, login, server messages,
+ * heartbeats) are handled on the connection's thread.
+ *
+ * Admission control runs first, so a refused request never reaches a
+ * queue; it is answered with a type 18 frame on the connection's thread.
+ * Every frame from a client passes here, which is where it is captured.
+ *
+ * @return int -1 if the client asked to disconnect, 0 otherwise.
+ */
+// <----------------------------------------------------------------> //
+int routeMessage(int newSocket, Message *receivedMessage)
+{
+    int type = receivedMessage->type;
+    currentGeneration = connectionGeneration(newSocket); // the connection is open while its thread reads from it
+    captureFrameReceived(newSocket, receivedMessage);
+    traceRequestReceived(receivedMessage);
+    uint64_t routedAt = traceSpanBegin();
+    int result = 0;
+    int retryAfterMs;
+    AdmissionResult admission = admissionCheck(receivedMessage, presenceUserOf(newSocket), dispatchShardQueueDepth(receivedMessage->from), &retryAfterMs);
+    traceSpanEnd("admission", routedAt);
+    if (admission != ADMISSION_ACCEPTED)
+    {
+        Message retry;
+        memset(&retry, 0, sizeof(retry));
+        retry.type = 18;
+        retry.from = -1;
+        retry.to = retryAfterMs;
+        retry.requestId = receivedMessage->requestId;
+        strcpy(retry.body, "Server busy, retry later");
+        sendFrame(newSocket, &retry);
+    }
+    else if (type == -1 || type == 0 || type == 1 || type == 11 ||
+             dispatchSubmit(receivedMessage->from, newSocket, currentGeneration, receivedMessage, priorityOfType(type)) < 0)
+    {
+        result = dispatchMessage(newSocket, receivedMessage);
+    }
+    traceSpanEnd("route", routedAt);
+    traceFinish();
+    return result;
+}
+
+#ifndef SERVER_NO_MAIN // the benchmarks link the handlers with their own main()
+// <----------------------------------------------------------------> //
+/**
+ * @brief Prepares a new client socket: marks it open, and sends to it give up after SEND_TIMEOUT_MS.
+ *
+ * Sockets stay blocking for the handlers' plain send(), so without the
+ * timeout a client that stops reading would stall the shard or the
+ * presence flusher sending to it.
+ */
+// <----------------------------------------------------------------> //
+static void connectionOpened(int sock)
+{
+    if (sock >= 0 && sock < MAX_TRACKED_SOCKETS)
+    {
+        atomic_store(&socketOpen[sock], 1);
+        int ceiling = atomic_load(&socketCeiling);
+        while (sock >= ceiling)
+        {
+            if (atomic_compare_exchange_weak(&socketCeiling, &ceiling, sock + 1))
+            {
+                break;
+            }
+        }
+    }
+    struct timeval timeout = {SEND_TIMEOUT_MS / 1000, (SEND_TIMEOUT_MS % 1000) * 1000};
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+    {
+        LOG_WARN("Error setting send timeout of %d: %s", sock, strerror(errno));
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Shard callback: runs one request of a user the shard owns.
+ */
+// <----------------------------------------------------------------> //
+static void dispatchShardHandle(int sock, unsigned generation, Message *message, void *context)
+{
+    (void)context;
+    // A read for a connection that is gone has no one to answer; changes
+    // still run, so a client that sends and quits does not lose its writes
+    if (generation != connectionGeneration(sock) && !typeChangesStorage(message->type))
+    {
+        LOG_DEBUG("Dropping request %d of closed connection %d", message->type, sock);
+        return;
+    }
+    currentGeneration = generation;
+    dispatchMessage(sock, message);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Handles a client connection.
+ *
+ * @param args The arguments passed to the thread.
+ */
+// <----------------------------------------------------------------> //
+void *handleClient(void *args)
+{
+    ThreadArgs *threadArgs = (ThreadArgs *)args;
+    int newSocket = threadArgs->newSocket;
+    Message receivedMessage;
+    free(args);
+
+    while (1)
+    {
+        if (traceSampleEvery > 0)
+        {
+            // Wait for the frame first so the recv span leaves out the time the client was idle
+            struct pollfd readable = {newSocket, POLLIN, 0};
+            poll(&readable, 1, -1);
+            traceReadStarted();
+        }
+        int valrec = recv(newSocket, &receivedMessage, sizeof(receivedMessage), MSG_WAITALL);
+        if (valrec != (int)sizeof(receivedMessage)) // Client disconnected, possibly in the middle of a frame
+        {
+            LOG_INFO("Client %d disconnected", newSocket);
+            disconnectClient(newSocket, presenceUserOf(newSocket));
+        }
+        metricsBytesIn((size_t)valrec);
+        heartbeatTouch(newSocket);
+
+        if (routeMessage(newSocket, &receivedMessage) < 0)
+        {
+            disconnectClient(newSocket, receivedMessage.from);
+        }
+    }
+
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Reactor callback: dispatches one complete frame.
+ */
+// <----------------------------------------------------------------> //
+static int reactorFrameReceived(int sock, void *frame, void *context)
+{
+    (void)context;
+    Message *receivedMessage = (Message *)frame;
+    metricsBytesIn(sizeof(Message));
+    heartbeatTouch(sock);
+    if (routeMessage(sock, receivedMessage) < 0)
+    {
+        LOG_INFO("Client %d with userId %d disconnected", sock, receivedMessage->from);
+        return -1;
+    }
+    return 0;
+}
+
+static void reactorClientAccepted(int sock, void *context)
+{
+    (void)context;
+    LOG_INFO("New client connected with client id: %d", sock);
+    connectionOpened(sock);
+    metricsConnectionOpened();
+    captureConnectionOpened(sock);
+    heartbeatTrack(sock);
+}
+
+static void reactorClientClosed(int sock, void *context)
+{
+    (void)context;
+    LOG_INFO("Client %d disconnected", sock);
+    metricsConnectionClosed();
+    captureConnectionClosed(sock);
+    heartbeatUntrack(sock);
+    clusterUserChanged(presenceDisconnected(sock));
+    connectionClosing(sock);
+}
+
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Shard task: delivers a forwarded message and stores the recipient's copy.
+ *
+ * The sender was already told the message was sent, so the copy is stored
+ * even if the recipient logged out while it was on its way.
+ */
+// <----------------------------------------------------------------> //
+static void deliverForwardedMessage(void *argument)
+{
+    Message *msg = argument;
+    int recipientSocket = findSocketByUserId(msg->to);
+    if (recipientSocket > 0 && sendFrame(recipientSocket, msg) == -1)
+    {
+        LOG_ERROR("Error sending forwarded message: %s", strerror(errno));
+    }
+
+    time_t t = time(NULL);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char date[50];
+    sprintf(date, "%d-%02d-%02d %02d:%02d:%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    char line[MESSAGE_BODY_SIZE + 128];
+    int length = snprintf(line, sizeof(line), "%s, %d, %s, %d\n", date, msg->from, msg->body, 0);
+    if (length > 0)
+    {
+        stateMessageStored(msg->to, msg->from);
+        appendToOwnMailbox(msg->to, line, (size_t)length < sizeof(line) ? (size_t)length : sizeof(line) - 1);
+    }
+    free(msg);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Cluster callback: handles a frame another node sent on its link.
+ */
+// <----------------------------------------------------------------> //
+static void clusterMessageReceived(int node, int kind, const Message *message, void *context)
+{
+    (void)context;
+    if (kind == CLUSTER_DELIVER)
+    {
+        if (message->to < 0 || message->to >= MAX_USER_ID)
+        {
+            LOG_WARN("Node %d forwarded a message for unknown user %d", node, message->to);
+            return;
+        }
+        Message *forwarded = malloc(sizeof(Message));
+        if (forwarded == NULL)
+        {
+            LOG_ERROR("Error allocating forwarded message for %d", message->to);
+            return;
+        }
+        memcpy(forwarded, message, sizeof(Message));
+        forwarded->body[MESSAGE_BODY_SIZE - 1] = '\0';
+        if (dispatchPost(message->to, deliverForwardedMessage, forwarded) < 0)
+        {
+            free(forwarded);
+        }
+    }
+    else if (kind == CLUSTER_REGISTERED)
+    {
+        User user;
+        memcpy(&user, message->body, sizeof(User));
+        if (user.userId >= 0 && user.userId < MAX_USER_ID)
+        {
+            stateUserRegistered(user.userId); // the user list itself is shared
+            directoryUserRegistered(&user);
+        }
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Replication callback: keeps cached state in line with the files the primary changed.
+ *
+ * Appends get the same state updates the primary made when it wrote them;
+ * a replaced file is read again on next use.
+ */
+// <----------------------------------------------------------------> //
+static void replicaFileChanged(StorageMutation mutation, const char *path, const char *data, size_t length)
+{
+    (void)length;
+    char *copy = strdup(data);
+    if (copy == NULL)
+    {
+        LOG_ERROR("Error copying replicated lines of %s", path);
+        return;
+    }
+    char userPath[STORAGE_PATH_SIZE];
+    int userId = storageUserOfPath(path);
+    char *saveptr = NULL;
+    char *line;
+    if (strcmp(path, STORAGE_USER_LIST_PATH) == 0)
+    {
+        for (line = strtok_r(copy, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr))
+        {
+            User user;
+            memset(&user, 0, sizeof(user));
+            char username[MESSAGE_BODY_SIZE], phoneNumber[MESSAGE_BODY_SIZE], name[MESSAGE_BODY_SIZE], surname[MESSAGE_BODY_SIZE];
+            if (sscanf(line, "%d,%[^,],%[^,],%[^,],%[^\n]", &user.userId, username, phoneNumber, name, surname) != 5 ||
+                user.userId < 0 || user.userId >= MAX_USER_ID ||
+                (mutation == STORAGE_MUTATION_REPLACE && stateIsRegistered(user.userId)))
+            {
+                continue; // a full copy repeats the users known from the local files
+            }
+            strncpy(user.username, username, sizeof(user.username) - 1);
+            strncpy(user.phoneNumber, phoneNumber, sizeof(user.phoneNumber) - 1);
+            strncpy(user.name, name, sizeof(user.name) - 1);
+            strncpy(user.surname, surname, sizeof(user.surname) - 1);
+            stateUserRegistered(user.userId);
+            directoryUserRegistered(&user);
+        }
+    }
+    else if (userId < 0 || userId >= MAX_USER_ID)
+    {
+        LOG_DEBUG("Replicated %s is not a user file", path);
+    }
+    else if (mutation == STORAGE_MUTATION_REPLACE)
+    {
+        stateReloadUser(userId);
+    }
+    else if (strcmp(path, storageUserPath(userId, STORAGE_USER_CONTACTS, userPath)) == 0)
+    {
+        for (line = strtok_r(copy, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr))
+        {
+            int contactId;
+            if (sscanf(line, "%d", &contactId) == 1)
+            {
+                stateContactAdded(userId, contactId);
+                presenceContactAdded(userId, contactId);
+            }
+        }
+    }
+    else if (strcmp(path, storageUserPath(userId, STORAGE_USER_MESSAGES, userPath)) == 0)
+    {
+        for (line = strtok_r(copy, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr))
+        {
+            int peerId;
+            if (sscanf(line, "%*[^,], %d", &peerId) == 1)
+            {
+                stateMessageStored(userId, peerId);
+            }
+        }
+    }
+    free(copy);
+}
+
+static void sendPresenceFrame(int sock, unsigned generation, const Message *message)
+{
+    if (sendFrameIfCurrent(sock, generation, message) == -1)
+    {
+        LOG_DEBUG("Error pushing presence to %d: %s", sock, strerror(errno));
+    }
+}
+
+// Gauges of the shard queues, one per priority class
+static long interactiveQueueDepth(void)
+{
+    return dispatchClassQueueDepth(DISPATCH_INTERACTIVE);
+}
+
+static long backgroundQueueDepth(void)
+{
+    return dispatchClassQueueDepth(DISPATCH_BACKGROUND);
+}
+
+static long bulkQueueDepth(void)
+{
+    return dispatchClassQueueDepth(DISPATCH_BULK);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Writes the final state snapshot; registered with atexit().
+ */
+// <----------------------------------------------------------------> //
+static void saveStateOnExit(void)
+{
+    stateSave();
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Turns SIGINT/SIGTERM into a normal exit so the atexit handlers run.
+ *
+ * @param arg The set of signals blocked in every thread.
+ */
+// <----------------------------------------------------------------> //
+static void *waitForShutdownSignal(void *arg)
+{
+    int signalNumber;
+    if (sigwait((sigset_t *)arg, &signalNumber) == 0)
+    {
+        LOG_INFO("Received signal %d, shutting down", signalNumber);
+        exit(0);
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Prints the command line usage.
+ */
+// <----------------------------------------------------------------> //
+static void printUsage(const char *program)
+{
+    printf("Usage: %s [-p port] [-r reactors] [-b backlog] [-w shards] [-t seconds] [-s seconds] [-u] [-l rate] [-L rate] [-q depth] [-C file] [-T file [-S n]] [-n node -c nodes] [-f port | -F host:port]\n", program);
+    printf("  -p port      Port clients connect to (default: %d)\n", PORT);
+    printf("  -r reactors  Run N epoll reactors with SO_REUSEPORT listeners (default: thread per client)\n");
+    printf("  -b backlog   Listen backlog (default: %d)\n", DEFAULT_BACKLOG);
+    printf("  -w shards    Shard threads owning user state (default: one per core)\n");
+    printf("  -t seconds   Close connections idle for this long, 0 to disable (default: %d)\n", DEFAULT_IDLE_TIMEOUT);
+    printf("  -s seconds   Write a state snapshot this often, 0 for shutdown only (default: %d)\n", DEFAULT_SNAPSHOT_INTERVAL);
+    printf("  -u           Queue storage appends to an io_uring writer thread when available\n");
+    printf("  -l rate      Request tokens each user earns per second, 0 for no limit (default: %d)\n", ADMISSION_DEFAULT_USER_RATE);
+    printf("  -L rate      Request tokens all users together earn per second, 0 for no limit (default: %d)\n", ADMISSION_DEFAULT_GLOBAL_RATE);
+    printf("  -q depth     Shed requests once this many tasks wait on a shard, 0 to never shed (default: %d)\n", ADMISSION_DEFAULT_SHED_DEPTH);
+    printf("  -C file      Record connections, incoming frames and reply times to a capture file for replay\n");
+    printf("  -T file      Write spans of sampled requests to a trace file for chrome://tracing or Perfetto\n");
+    printf("  -S n         Trace one request in n (default: %d)\n", TRACE_DEFAULT_SAMPLE_EVERY);
+    printf("  -n node      This server's index in the cluster node list\n");
+    printf("  -c nodes     Run as a cluster node; host:port of every node's cluster link, comma separated\n");
+    printf("  -f port      Stream storage changes to followers connecting on this port\n");
+    printf("  -F host:port Run as a read-only follower of the primary replicating on host:port\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int reactorCount = 0;
+    int backlog = DEFAULT_BACKLOG;
+    int shardCount = DEFAULT_SHARDS;
+    int idleTimeout = DEFAULT_IDLE_TIMEOUT;
+    int snapshotInterval = DEFAULT_SNAPSHOT_INTERVAL;
+    StorageBackend storageBackend = STORAGE_BACKEND_SYNC;
+    int port = PORT;
+    int clusterNode = 0;
+    const char *clusterNodes = NULL;
+    int replicationPort = 0;
+    const char *primary = NULL;
+    int userRate = ADMISSION_DEFAULT_USER_RATE;
+    int globalRate = ADMISSION_DEFAULT_GLOBAL_RATE;
+    long shedDepth = ADMISSION_DEFAULT_SHED_DEPTH;
+    const char *capturePath = NULL;
+    const char *tracePath = NULL;
+    int traceEvery = TRACE_DEFAULT_SAMPLE_EVERY;
+    int option;
+    while ((option = getopt(argc, argv, "p:r:b:w:t:s:ul:L:q:C:T:S:n:c:f:F:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'f':
+            replicationPort = atoi(optarg);
+            break;
+        case 'F':
+            primary = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            clusterNode = atoi(optarg);
+            break;
+        case 'c':
+            clusterNodes = optarg;
+            break;
+        case 'r':
+            reactorCount = atoi(optarg);
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'w':
+            shardCount = atoi(optarg);
+            break;
+        case 't':
+            idleTimeout = atoi(optarg);
+            break;
+        case 's':
+            snapshotInterval = atoi(optarg);
+            break;
+        case 'u':
+            storageBackend = STORAGE_BACKEND_IO_URING;
+            break;
+        case 'l':
+            userRate = atoi(optarg);
+            break;
+        case 'L':
+            globalRate = atoi(optarg);
+            break;
+        case 'q':
+            shedDepth = atol(optarg);
+            break;
+        case 'C':
+            capturePath = optarg;
+            break;
+        case 'T':
+            tracePath = optarg;
+            break;
+        case 'S':
+            traceEvery = atoi(optarg);
+            break;
+        default:
+            printUsage(argv[0]);
+            return option == 'h' ? 0 : EXIT_FAILURE;
+        }
+    }
+
+    // Signals are taken by a dedicated thread; block them before any other thread starts
+    static sigset_t shutdownSignals;
+    sigemptyset(&shutdownSignals);
+    sigaddset(&shutdownSignals, SIGINT);
+    sigaddset(&shutdownSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdownSignals, NULL);
+
+    logInit();
+    atexit(logShutdown);
+    LOG_INFO("Server started");
+    mkdir("TerChatApp", 0777);       // Create the TerChatApp directory if it does not exist
+    mkdir(STORAGE_USERS_DIRECTORY, 0777); // Create the users directory if it does not exist
+    storageMigrateLegacyLayout();
+    storageInit(storageBackend);
+    metricsRegisterGauge("storage_pending_appends", "Appends queued for the storage writer.", storagePendingAppends);
+    if (blobInit() < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    metricsRegisterGauge("blob_uploads_in_progress", "Uploads whose last chunk has not arrived yet.", blobUploadsInProgress);
+    char metricsSocketPath[STORAGE_PATH_SIZE] = METRICS_SOCKET_PATH;
+    char snapshotPath[STORAGE_PATH_SIZE] = STATE_SNAPSHOT_PATH;
+    if (clusterNodes != NULL)
+    {
+        snprintf(metricsSocketPath, sizeof(metricsSocketPath), CLUSTER_METRICS_SOCKET_FORMAT, clusterNode);
+        snprintf(snapshotPath, sizeof(snapshotPath), CLUSTER_STATE_SNAPSHOT_FORMAT, clusterNode);
+    }
+    metricsStartEndpoint(metricsSocketPath);
+
+
+    atexit(notifyClientsAndShutdown);
+    if (capturePath != NULL)
+    {
+        if (captureOpen(capturePath) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        atexit(captureClose); // flushed before the shutdown closes every descriptor
+    }
+    if (tracePath != NULL)
+    {
+        if (traceStart(tracePath, traceEvery) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        atexit(traceShutdown);
+        metricsRegisterGauge("trace_dropped_spans", "Spans lost because a thread's trace ring was full.", traceDroppedSpans);
+    }
+
+    if (stateInit(MAX_USER_ID, snapshotPath) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    atexit(saveStateOnExit); // runs before the clients are disconnected
+    if (searchInit(MAX_USER_ID) < 0 || directoryInit(MAX_USER_ID) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    stateStartSnapshots(snapshotInterval);
+    metricsRegisterGauge("state_unverified_users", "Registered users whose files have not been read since start.", stateUnverifiedUsers);
+    metricsRegisterGauge("directory_entries", "Name, surname, username and phone fields in the user lookup index.", directoryEntryCount);
+
+    pthread_t signalThread;
+    if (pthread_create(&signalThread, NULL, waitForShutdownSignal, &shutdownSignals) == 0)
+    {
+        pthread_detach(signalThread);
+    }
+
+    initSendLocks();
+    if (dispatchStart(shardCount, dispatchShardHandle, NULL) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    metricsRegisterGauge("dispatch_queue_depth", "Requests and cross-shard operations waiting for a shard.", dispatchQueueDepth);
+    metricsRegisterGauge("dispatch_interactive_queue_depth", "Chat deliveries and changes waiting for a shard.", interactiveQueueDepth);
+    metricsRegisterGauge("dispatch_background_queue_depth", "Reads waiting for a shard.", backgroundQueueDepth);
+    metricsRegisterGauge("dispatch_bulk_queue_depth", "Blob transfers waiting for a shard.", bulkQueueDepth);
+    if (admissionInit(MAX_USER_ID, userRate, globalRate, shedDepth) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    metricsRegisterGauge("admission_throttled_requests", "Requests refused because their user or the server ran out of tokens.", admissionThrottledRequests);
+    metricsRegisterGauge("admission_shed_requests", "Requests refused because their shard was overloaded.", admissionShedRequests);
+
+    long fileLimit = reactorRaiseFileLimit();
+    if (fileLimit < 0 || fileLimit > MAX_TRACKED_SOCKETS)
+    {
+        fileLimit = MAX_TRACKED_SOCKETS;
+    }
+    if (heartbeatInit(idleTimeout, (int)fileLimit) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    metricsRegisterGauge("heartbeat_tracked_connections", "Connections watched by the idle reaper.", heartbeatTrackedConnections);
+    if (presenceStart(MAX_USER_ID, (int)fileLimit, sendPresenceFrame) < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    metricsRegisterGauge("presence_online_users", "Users with at least one logged-in connection.", presenceOnlineUsers);
+    metricsRegisterGauge("presence_subscribers", "Connections receiving presence pushes.", presenceSubscribers);
+    if (clusterNodes != NULL)
+    {
+        if (clusterStart(clusterNode, clusterNodes, MAX_USER_ID, clusterMessageReceived, NULL) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        metricsRegisterGauge("cluster_links_up", "Outgoing links to other cluster nodes that are connected.", clusterLinksUp);
+        metricsRegisterGauge("cluster_remote_users", "Users logged in on other cluster nodes.", clusterRemoteUsers);
+    }
+    if (primary != NULL)
+    {
+        replicaMode = 1;
+        if (replicationStartFollower(primary, replicaFileChanged) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        metricsRegisterGauge("replication_link_up", "Whether the link to the primary is connected.", replicationLinkUp);
+    }
+    if (replicationPort > 0)
+    {
+        if (replicationStartPrimary(replicationPort) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        metricsRegisterGauge("replication_followers", "Followers receiving storage changes.", replicationFollowers);
+        metricsRegisterGauge("replication_backlog_bytes", "Logged changes the slowest follower has not been sent.", replicationBacklogBytes);
+    }
+
+    if (reactorCount > 0)
+    {
+        ReactorConfig config = {
+            .port = port,
+            .backlog = backlog,
+            .reactorCount = reactorCount,
+            .frameSize = sizeof(Message),
+            .onFrame = reactorFrameReceived,
+            .onAccept = reactorClientAccepted,
+            .onClose = reactorClientClosed,
+            .context = NULL,
+        };
+        LOG_INFO("Starting %d reactors with backlog %d", reactorCount, backlog);
+        return reactorRun(&config) < 0 ? EXIT_FAILURE : 0;
+    }
+
+    struct sockaddr_in servAddr;
+    int addrlen = sizeof(servAddr);
+
+    int serverSock = reactorOpenListener(port, backlog, 0);
+    if (serverSock < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    while (1)
+    {
+        int newClient = accept(serverSock, (struct sockaddr *)&servAddr, (socklen_t *)&addrlen);
+        if (newClient < 0)
+        {
+            perror("Error! When server accepting new client");
+            exit(EXIT_FAILURE);
+        }
+
+        // Only client threads decrement the count, so it cannot rise past the limit between check and increment
+        if (atomic_load(&clientThreads) >= MAX_USERS)
+        {
+            LOG_WARN("Too many clients. Rejecting connection %d", newClient);
+            close(newClient);
+            continue;
+        }
+
+        LOG_INFO("New client connected with client id: %d", newClient);
+        connectionOpened(newClient);
+        metricsConnectionOpened();
+        captureConnectionOpened(newClient);
+        heartbeatTrack(newClient);
+
+        ThreadArgs *args = malloc(sizeof(ThreadArgs));
+        if (args == NULL)
+        {
+            LOG_ERROR("Out of memory for client %d", newClient);
+            close(newClient);
+            continue;
+        }
+        args->newSocket = newClient;
+
+        pthread_t thread;
+        atomic_fetch_add(&clientThreads, 1);
+        if (pthread_create(&thread, NULL, handleClient, (void *)args) != 0)
+        {
+            perror("thread create for client error");
+            exit(EXIT_FAILURE);
+        }
+
+        // Detach the thread
+        pthread_detach(thread);
     }
 
     return 0;
 }
+#endif
@@ -0,0 +1,866 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "protocol.h"
+#include "state.h"
+#include "storage.h"
+
+#define STATE_LOCK_STRIPES 64
+#define STATE_SNAPSHOT_MAGIC "TCSNAP1"
+#define STATE_SNAPSHOT_VERSION 1
+#define STATE_MTIME_SLACK_NS 1000000000LL // file timestamps come from a coarse clock
+
+#define STATE_REGISTERED 0x1 // present in the user list
+#define STATE_LOADED 0x2     // contacts and counters are known
+#define STATE_UNCHECKED 0x4  // loaded from a snapshot, files not yet compared against it
+
+// Snapshot layout: header, one record per user ID, contact IDs, unread entries.
+// Every section is 8-byte aligned so the file can be used in place once mapped.
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t userCapacity;
+    int64_t takenAt; // CLOCK_REALTIME in ns, taken before the first user was copied
+    uint64_t contactTotal;
+    uint64_t unreadTotal;
+} StateSnapshotHeader;
+
+typedef struct
+{
+    uint32_t flags;
+    uint32_t contactCount;
+    uint32_t unreadCount;
+    uint32_t messageCount;
+    uint64_t contactIndex;
+    uint64_t unreadIndex;
+} StateSnapshotUser;
+
+typedef struct
+{
+    uint32_t flags;
+    uint32_t messageCount;          // lines in the user's message log
+    int32_t *contacts;              // sorted
+    uint32_t contactCount;
+    uint32_t contactCapacity;       // 0 while the array is borrowed from the snapshot mapping
+    StateUnread *unread;            // sorted by peer
+    uint32_t unreadCount;
+    uint32_t unreadCapacity;        // 0 while the array is borrowed from the snapshot mapping
+} StateUser;
+
+static StateUser *users = NULL;
+static int userCapacity = 0;
+static pthread_mutex_t userLocks[STATE_LOCK_STRIPES];
+static pthread_mutex_t saveLock = PTHREAD_MUTEX_INITIALIZER;
+static char snapshotPath[256];
+static int64_t snapshotTakenAt = 0; // of the snapshot the unchecked users came from
+static atomic_long coldUsers;       // registered users whose files still have to be read
+
+static pthread_mutex_t *stateLockUser(int userId)
+{
+    pthread_mutex_t *lock = &userLocks[(unsigned)userId % STATE_LOCK_STRIPES];
+    pthread_mutex_lock(lock);
+    return lock;
+}
+
+static int64_t stateRealtimeNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Grows a per-user array, copying it out of the snapshot mapping if needed.
+ *
+ * @param items The array.
+ * @param count Number of items in use.
+ * @param capacity Allocated items; 0 if the array is borrowed.
+ * @param needed Number of items the array must hold.
+ * @param itemSize Size of one item.
+ * @return void* The (possibly moved) array, or NULL if it could not be grown.
+ */
+// <----------------------------------------------------------------> //
+static void *stateReserve(void *items, uint32_t count, uint32_t *capacity, uint32_t needed, size_t itemSize)
+{
+    if (*capacity >= needed && *capacity > 0)
+    {
+        return items;
+    }
+    uint32_t grown = *capacity > 0 ? *capacity : 4;
+    while (grown < needed)
+    {
+        grown *= 2;
+    }
+    void *copy = malloc((size_t)grown * itemSize);
+    if (copy == NULL)
+    {
+        LOG_ERROR("Error allocating user state: %s", strerror(errno));
+        return NULL;
+    }
+    if (count > 0)
+    {
+        memcpy(copy, items, (size_t)count * itemSize);
+    }
+    if (*capacity > 0)
+    {
+        free(items);
+    }
+    *capacity = grown;
+    return copy;
+}
+
+static void stateResetUser(StateUser *user)
+{
+    if (user->contactCapacity > 0)
+    {
+        free(user->contacts);
+    }
+    if (user->unreadCapacity > 0)
+    {
+        free(user->unread);
+    }
+    uint32_t registered = user->flags & STATE_REGISTERED;
+    memset(user, 0, sizeof(*user));
+    user->flags = registered;
+}
+
+static uint32_t stateFindContact(const StateUser *user, int contactId)
+{
+    uint32_t low = 0, high = user->contactCount;
+    while (low < high)
+    {
+        uint32_t middle = (low + high) / 2;
+        if (user->contacts[middle] < contactId)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static uint32_t stateFindUnread(const StateUser *user, int peerId)
+{
+    uint32_t low = 0, high = user->unreadCount;
+    while (low < high)
+    {
+        uint32_t middle = (low + high) / 2;
+        if (user->unread[middle].peer < peerId)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static void stateInsertContact(StateUser *user, int contactId)
+{
+    uint32_t index = stateFindContact(user, contactId);
+    if (index < user->contactCount && user->contacts[index] == contactId)
+    {
+        return;
+    }
+    int32_t *contacts = stateReserve(user->contacts, user->contactCount, &user->contactCapacity, user->contactCount + 1, sizeof(int32_t));
+    if (contacts == NULL)
+    {
+        return;
+    }
+    user->contacts = contacts;
+    memmove(&contacts[index + 1], &contacts[index], (user->contactCount - index) * sizeof(int32_t));
+    contacts[index] = contactId;
+    user->contactCount++;
+}
+
+static void stateAddUnread(StateUser *user, int peerId)
+{
+    uint32_t index = stateFindUnread(user, peerId);
+    StateUnread *unread = stateReserve(user->unread, user->unreadCount, &user->unreadCapacity, user->unreadCount + 1, sizeof(StateUnread));
+    if (unread == NULL)
+    {
+        return;
+    }
+    user->unread = unread;
+    if (index < user->unreadCount && unread[index].peer == peerId)
+    {
+        unread[index].count++;
+        return;
+    }
+    memmove(&unread[index + 1], &unread[index], (user->unreadCount - index) * sizeof(StateUnread));
+    unread[index].peer = peerId;
+    unread[index].count = 1;
+    user->unreadCount++;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Rebuilds a user's contact set and message index from their files.
+ */
+// <----------------------------------------------------------------> //
+static void stateScanUser(int userId, StateUser *user)
+{
+    char filePath[STORAGE_PATH_SIZE];
+    FILE *file = fopen(storageUserPath(userId, STORAGE_USER_CONTACTS, filePath), "r");
+    if (file != NULL)
+    {
+        int contactId;
+        int matched;
+        while ((matched = fscanf(file, "%d,%*[^\n]\n", &contactId)) != EOF)
+        {
+            if (matched == 1)
+            {
+                stateInsertContact(user, contactId);
+            }
+            else if (fscanf(file, "%*[^\n]\n") == EOF) // skip a malformed line
+            {
+                break;
+            }
+        }
+        fclose(file);
+    }
+
+    file = fopen(storageUserPath(userId, STORAGE_USER_MESSAGES, filePath), "r");
+    if (file != NULL)
+    {
+        char line[MESSAGE_BODY_SIZE + 128];
+        while (fgets(line, sizeof(line), file))
+        {
+            char date[50];
+            int peerId;
+            char messageText[MESSAGE_BODY_SIZE];
+            int readStatus;
+            if (sscanf(line, "%49[^,], %d, %1023[^,], %d\n", date, &peerId, messageText, &readStatus) != 4)
+            {
+                continue;
+            }
+            user->messageCount++;
+            if (readStatus == 0)
+            {
+                stateAddUnread(user, peerId);
+            }
+        }
+        fclose(file);
+    }
+}
+
+static int stateFileChangedSince(const char *path, int64_t since)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return 1;
+    }
+    int64_t modifiedAt = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return modifiedAt >= since - STATE_MTIME_SLACK_NS;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Drops snapshot data of a user if their files changed after the snapshot.
+ *
+ * A stat per file replaces the full parse: only users written to after the
+ * snapshot was taken (or whose writes never made it to disk) are rescanned.
+ */
+// <----------------------------------------------------------------> //
+static void stateCheckUser(int userId, StateUser *user)
+{
+    if (!(user->flags & STATE_UNCHECKED))
+    {
+        return;
+    }
+    user->flags &= ~STATE_UNCHECKED;
+
+    char filePath[STORAGE_PATH_SIZE];
+    int changed = stateFileChangedSince(storageUserPath(userId, STORAGE_USER_CONTACTS, filePath), snapshotTakenAt) ||
+                  stateFileChangedSince(storageUserPath(userId, STORAGE_USER_MESSAGES, filePath), snapshotTakenAt);
+    if (changed)
+    {
+        stateResetUser(user); // stays cold until scanned
+    }
+    else if (user->flags & STATE_REGISTERED)
+    {
+        atomic_fetch_sub(&coldUsers, 1);
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Makes a user's state usable; called with the user's lock held.
+ */
+// <----------------------------------------------------------------> //
+static StateUser *stateLoadUser(int userId)
+{
+    StateUser *user = &users[userId];
+    stateCheckUser(userId, user);
+    if (!(user->flags & STATE_LOADED))
+    {
+        stateScanUser(userId, user);
+        user->flags |= STATE_LOADED;
+        if (user->flags & STATE_REGISTERED)
+        {
+            atomic_fetch_sub(&coldUsers, 1);
+        }
+    }
+    return user;
+}
+
+static void stateScanUserList(void)
+{
+    FILE *file = fopen(STORAGE_USER_LIST_PATH, "r");
+    if (file == NULL)
+    {
+        return;
+    }
+    int id;
+    char username[1024], phoneNumber[1024], name[1024], surname[1024];
+    while (fscanf(file, "%d,%[^,],%[^,],%[^,],%[^\n]\n", &id, username, phoneNumber, name, surname) == 5)
+    {
+        if (id >= 0 && id < userCapacity && !(users[id].flags & STATE_REGISTERED))
+        {
+            users[id].flags |= STATE_REGISTERED;
+            if (!(users[id].flags & STATE_LOADED) || (users[id].flags & STATE_UNCHECKED))
+            {
+                atomic_fetch_add(&coldUsers, 1);
+            }
+        }
+    }
+    fclose(file);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Maps a snapshot and adopts its records; contact and unread arrays stay in the mapping.
+ *
+ * @return int 0 if the snapshot was loaded, -1 if it is missing or unusable.
+ */
+// <----------------------------------------------------------------> //
+static int stateLoadSnapshot(void)
+{
+    int fd = open(snapshotPath, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(StateSnapshotHeader))
+    {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        LOG_ERROR("Error mapping state snapshot: %s", strerror(errno));
+        return -1;
+    }
+
+    const StateSnapshotHeader *header = (const StateSnapshotHeader *)mapping;
+    size_t recordsOffset = sizeof(StateSnapshotHeader);
+    size_t contactsOffset = recordsOffset + (size_t)header->userCapacity * sizeof(StateSnapshotUser);
+    size_t unreadOffset = contactsOffset + ((header->contactTotal * sizeof(int32_t) + 7) & ~(size_t)7);
+    if (memcmp(header->magic, STATE_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != STATE_SNAPSHOT_VERSION ||
+        header->contactTotal > size || header->unreadTotal > size ||
+        unreadOffset + header->unreadTotal * sizeof(StateUnread) != size)
+    {
+        LOG_WARN("Ignoring invalid state snapshot %s", snapshotPath);
+        munmap((void *)mapping, size);
+        return -1;
+    }
+
+    const StateSnapshotUser *records = (const StateSnapshotUser *)(mapping + recordsOffset);
+    int32_t *contacts = (int32_t *)(mapping + contactsOffset);
+    StateUnread *unread = (StateUnread *)(mapping + unreadOffset);
+    int count = header->userCapacity < (uint32_t)userCapacity ? (int)header->userCapacity : userCapacity;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        const StateSnapshotUser *record = &records[i];
+        if (record->contactIndex + record->contactCount > header->contactTotal ||
+            record->unreadIndex + record->unreadCount > header->unreadTotal)
+        {
+            continue; // leave the user cold
+        }
+        StateUser *user = &users[i];
+        user->flags = record->flags & (STATE_REGISTERED | STATE_LOADED);
+        if (user->flags & STATE_LOADED)
+        {
+            user->flags |= STATE_UNCHECKED;
+            user->messageCount = record->messageCount;
+            user->contacts = contacts + record->contactIndex;
+            user->contactCount = record->contactCount;
+            user->unread = unread + record->unreadIndex;
+            user->unreadCount = record->unreadCount;
+        }
+        if (user->flags & STATE_REGISTERED)
+        {
+            atomic_fetch_add(&coldUsers, 1); // until checked against the files
+        }
+    }
+    snapshotTakenAt = header->takenAt;
+    // The mapping stays for the life of the process; users copy their arrays out before changing them
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Creates the in-memory user state, warm-starting from a snapshot when one exists.
+ *
+ * Without a usable snapshot only the user list is read here; every user's
+ * files are scanned on first use instead.
+ *
+ * @param capacity Number of user IDs, [0, capacity).
+ * @param path The snapshot file.
+ * @return int 0 if a snapshot was loaded, 1 on a cold start, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int stateInit(int capacity, const char *path)
+{
+    users = calloc((size_t)capacity, sizeof(StateUser));
+    if (users == NULL)
+    {
+        LOG_ERROR("Error allocating user state: %s", strerror(errno));
+        return -1;
+    }
+    userCapacity = capacity;
+    snprintf(snapshotPath, sizeof(snapshotPath), "%s", path);
+    int i;
+    for (i = 0; i < STATE_LOCK_STRIPES; i++)
+    {
+        pthread_mutex_init(&userLocks[i], NULL);
+    }
+
+    uint64_t startedAt = (uint64_t)stateRealtimeNs();
+    int loaded = stateLoadSnapshot() == 0;
+    if (!loaded || stateFileChangedSince(STORAGE_USER_LIST_PATH, snapshotTakenAt))
+    {
+        stateScanUserList(); // registrations are only ever added
+    }
+    LOG_INFO("User state %s in %llu us, %ld users to verify", loaded ? "loaded from snapshot" : "rebuilt from user list",
+             (unsigned long long)(((uint64_t)stateRealtimeNs() - startedAt) / 1000), atomic_load(&coldUsers));
+    return loaded ? 0 : 1;
+}
+
+static int stateAppendItems(void **buffer, size_t *used, size_t *capacity, const void *items, size_t size)
+{
+    if (*used + size > *capacity)
+    {
+        size_t grown = *capacity > 0 ? *capacity * 2 : 4096;
+        while (grown < *used + size)
+        {
+            grown *= 2;
+        }
+        void *copy = realloc(*buffer, grown);
+        if (copy == NULL)
+        {
+            return -1;
+        }
+        *buffer = copy;
+        *capacity = grown;
+    }
+    if (size > 0)
+    {
+        memcpy((char *)*buffer + *used, items, size);
+    }
+    *used += size;
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Writes a snapshot of all user state, atomically replacing the previous one.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int stateSave(void)
+{
+    if (users == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&saveLock);
+    StateSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATE_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = STATE_SNAPSHOT_VERSION;
+    header.userCapacity = (uint32_t)userCapacity;
+    header.takenAt = stateRealtimeNs(); // before any user is copied: later writes make files newer
+
+    StateSnapshotUser *records = calloc((size_t)userCapacity, sizeof(StateSnapshotUser));
+    void *contacts = NULL, *unread = NULL;
+    size_t contactsUsed = 0, contactsCapacity = 0, unreadUsed = 0, unreadCapacity = 0;
+    int failed = records == NULL;
+    int i;
+    for (i = 0; i < userCapacity && !failed; i++)
+    {
+        pthread_mutex_t *lock = stateLockUser(i);
+        StateUser *user = &users[i];
+        stateCheckUser(i, user); // unchecked data is only valid against the snapshot it came from
+        StateSnapshotUser *record = &records[i];
+        record->flags = user->flags & (STATE_REGISTERED | STATE_LOADED);
+        if (user->flags & STATE_LOADED)
+        {
+            record->messageCount = user->messageCount;
+            record->contactCount = user->contactCount;
+            record->contactIndex = contactsUsed / sizeof(int32_t);
+            record->unreadCount = user->unreadCount;
+            record->unreadIndex = unreadUsed / sizeof(StateUnread);
+            failed = stateAppendItems(&contacts, &contactsUsed, &contactsCapacity, user->contacts, user->contactCount * sizeof(int32_t)) < 0 ||
+                     stateAppendItems(&unread, &unreadUsed, &unreadCapacity, user->unread, user->unreadCount * sizeof(StateUnread)) < 0;
+        }
+        pthread_mutex_unlock(lock);
+    }
+    header.contactTotal = contactsUsed / sizeof(int32_t);
+    header.unreadTotal = unreadUsed / sizeof(StateUnread);
+
+    char temporaryPath[sizeof(snapshotPath) + 4];
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", snapshotPath);
+    FILE *file = failed ? NULL : fopen(temporaryPath, "wb");
+    if (file != NULL)
+    {
+        static const char padding[8] = {0};
+        size_t paddingSize = ((contactsUsed + 7) & ~(size_t)7) - contactsUsed;
+        failed = fwrite(&header, sizeof(header), 1, file) != 1 ||
+                 fwrite(records, sizeof(StateSnapshotUser), (size_t)userCapacity, file) != (size_t)userCapacity ||
+                 fwrite(contacts, 1, contactsUsed, file) != contactsUsed ||
+                 fwrite(padding, 1, paddingSize, file) != paddingSize ||
+                 fwrite(unread, 1, unreadUsed, file) != unreadUsed ||
+                 fflush(file) != 0 || fsync(fileno(file)) != 0;
+        failed = fclose(file) != 0 || failed;
+        failed = failed || rename(temporaryPath, snapshotPath) != 0;
+    }
+    else
+    {
+        failed = 1;
+    }
+
+    if (failed)
+    {
+        LOG_ERROR("Error writing state snapshot %s: %s", snapshotPath, strerror(errno));
+        unlink(temporaryPath);
+    }
+    else
+    {
+        LOG_INFO("State snapshot written: %llu contacts, %llu unread entries",
+                 (unsigned long long)header.contactTotal, (unsigned long long)header.unreadTotal);
+    }
+    free(records);
+    free(contacts);
+    free(unread);
+    pthread_mutex_unlock(&saveLock);
+    return failed ? -1 : 0;
+}
+
+static void *stateSnapshotLoop(void *arg)
+{
+    int intervalSeconds = (int)(long)arg;
+    while (1)
+    {
+        sleep((unsigned)intervalSeconds);
+        stateSave();
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Writes a snapshot every intervalSeconds on a background thread.
+ *
+ * @return int 0 on success (or when disabled with 0), -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int stateStartSnapshots(int intervalSeconds)
+{
+    if (intervalSeconds <= 0)
+    {
+        return 0;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stateSnapshotLoop, (void *)(long)intervalSeconds) != 0)
+    {
+        LOG_ERROR("State snapshot thread create error");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int stateIsRegistered(int userId)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return 0;
+    }
+    pthread_mutex_t *lock = stateLockUser(userId);
+    int registered = (users[userId].flags & STATE_REGISTERED) != 0;
+    pthread_mutex_unlock(lock);
+    return registered;
+}
+
+void stateUserRegistered(int userId)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return;
+    }
+    pthread_mutex_t *lock = stateLockUser(userId);
+    StateUser *user = &users[userId];
+    if (!(user->flags & STATE_REGISTERED))
+    {
+        user->flags |= STATE_REGISTERED;
+        if (!(user->flags & STATE_LOADED) || (user->flags & STATE_UNCHECKED))
+        {
+            atomic_fetch_add(&coldUsers, 1);
+        }
+    }
+    pthread_mutex_unlock(lock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Forgets what is known about a user's files so they are read again on next use.
+ *
+ * For files another process may have written, such as those of a user who
+ * was logged in on another cluster node.
+ */
+// <----------------------------------------------------------------> //
+void stateReloadUser(int userId)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return;
+    }
+    pthread_mutex_t *lock = stateLockUser(userId);
+    StateUser *user = &users[userId];
+    int wasWarm = (user->flags & STATE_LOADED) && !(user->flags & STATE_UNCHECKED);
+    stateResetUser(user);
+    if (wasWarm && (user->flags & STATE_REGISTERED))
+    {
+        atomic_fetch_add(&coldUsers, 1);
+    }
+    pthread_mutex_unlock(lock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Takes a user's contacts and counters from a caller that has read their files itself.
+ *
+ * The importer parses every file anyway; handing the results over lets the
+ * snapshot it writes start the server warm.
+ *
+ * @param userId The user.
+ * @param contactIds The contact list, in any order.
+ * @param contactCount Number of contactIds.
+ * @param unreadPeers The other party of every unread message.
+ * @param unreadCount Number of unreadPeers.
+ * @param messageCount Lines in the user's message log.
+ */
+// <----------------------------------------------------------------> //
+void stateImportUser(int userId, const int32_t *contactIds, int contactCount, const int32_t *unreadPeers, int unreadCount, uint32_t messageCount)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return;
+    }
+    pthread_mutex_t *lock = stateLockUser(userId);
+    StateUser *user = &users[userId];
+    int wasCold = (user->flags & STATE_REGISTERED) && (!(user->flags & STATE_LOADED) || (user->flags & STATE_UNCHECKED));
+    stateResetUser(user);
+    int i;
+    for (i = 0; i < contactCount; i++)
+    {
+        stateInsertContact(user, contactIds[i]);
+    }
+    for (i = 0; i < unreadCount; i++)
+    {
+        stateAddUnread(user, unreadPeers[i]);
+    }
+    user->messageCount = messageCount;
+    user->flags |= STATE_LOADED;
+    if (wasCold)
+    {
+        atomic_fetch_sub(&coldUsers, 1);
+    }
+    pthread_mutex_unlock(lock);
+}
+
+int stateHasContact(int userId, int contactId)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return 0;
+    }
+    pthread_mutex_t *lock = stateLockUser(userId);
+    StateUser *user = stateLoadUser(userId);
+    uint32_t index = stateFindContact(user, contactId);
+    int found = index < user->contactCount && user->contacts[index] == contactId;
+    pthread_mutex_unlock(lock);
+    return found;
+}
+
+int stateContactCount(int userId)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return 0;
+    }
+    pthread_mutex_t *lock = stateLockUser(userId);
+    int count = (int)stateLoadUser(userId)->contactCount;
+    pthread_mutex_unlock(lock);
+    return count;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Copies the IDs in a user's contact list, in ascending order.
+ *
+ * @return int The number of IDs copied.
+ */
+// <----------------------------------------------------------------> //
+int stateContacts(int userId, int32_t *contacts, int maxContacts)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return 0;
+    }
+    pthread_mutex_t *lock = stateLockUser(userId);
+    StateUser *user = stateLoadUser(userId);
+    int count = user->contactCount < (uint32_t)maxContacts ? (int)user->contactCount : maxContacts;
+    memcpy(contacts, user->contacts, (size_t)count * sizeof(int32_t));
+    pthread_mutex_unlock(lock);
+    return count;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Records a contact appended to a user's contact list.
+ *
+ * Like the other mutation hooks, call it before the file is written so the
+ * user's state is loaded from the files as they were before the change.
+ */
+// <----------------------------------------------------------------> //
+void stateContactAdded(int userId, int contactId)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return;
+    }
+    pthread_mutex_t *lock = stateLockUser(userId);
+    stateInsertContact(stateLoadUser(userId), contactId);
+    pthread_mutex_unlock(lock);
+}
+
+void stateContactRemoved(int userId, int contactId)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return;
+    }
+    pthread_mutex_t *lock = stateLockUser(userId);
+    StateUser *user = stateLoadUser(userId);
+    uint32_t index = stateFindContact(user, contactId);
+    if (index < user->contactCount && user->contacts[index] == contactId)
+    {
+        int32_t *contacts = stateReserve(user->contacts, user->contactCount, &user->contactCapacity, user->contactCount, sizeof(int32_t));
+        if (contacts != NULL)
+        {
+            user->contacts = contacts;
+            memmove(&contacts[index], &contacts[index + 1], (user->contactCount - index - 1) * sizeof(int32_t));
+            user->contactCount--;
+        }
+    }
+    pthread_mutex_unlock(lock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Records an unread line appended to a user's message log.
+ *
+ * @param userId Owner of the message log.
+ * @param peerId The other party of the conversation, as written in the line.
+ */
+// <----------------------------------------------------------------> //
+void stateMessageStored(int userId, int peerId)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return;
+    }
+    pthread_mutex_t *lock = stateLockUser(userId);
+    StateUser *user = stateLoadUser(userId);
+    user->messageCount++;
+    stateAddUnread(user, peerId);
+    pthread_mutex_unlock(lock);
+}
+
+void stateMessagesRead(int userId, int peerId)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return;
+    }
+    pthread_mutex_t *lock = stateLockUser(userId);
+    StateUser *user = stateLoadUser(userId);
+    uint32_t index = stateFindUnread(user, peerId);
+    if (index < user->unreadCount && user->unread[index].peer == peerId)
+    {
+        StateUnread *unread = stateReserve(user->unread, user->unreadCount, &user->unreadCapacity, user->unreadCount, sizeof(StateUnread));
+        if (unread != NULL)
+        {
+            user->unread = unread;
+            memmove(&unread[index], &unread[index + 1], (user->unreadCount - index - 1) * sizeof(StateUnread));
+            user->unreadCount--;
+        }
+    }
+    pthread_mutex_unlock(lock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Copies a user's unread counters, ordered by peer.
+ *
+ * @param userId The user.
+ * @param counts Receives up to maxCounts entries.
+ * @param maxCounts Capacity of counts.
+ * @return int The number of entries copied.
+ */
+// <----------------------------------------------------------------> //
+int stateUnreadCounts(int userId, StateUnread *counts, int maxCounts)
+{
+    if (userId < 0 || userId >= userCapacity)
+    {
+        return 0;
+    }
+    pthread_mutex_t *lock = stateLockUser(userId);
+    StateUser *user = stateLoadUser(userId);
+    int count = user->unreadCount < (uint32_t)maxCounts ? (int)user->unreadCount : maxCounts;
+    memcpy(counts, user->unread, (size_t)count * sizeof(StateUnread));
+    pthread_mutex_unlock(lock);
+    return count;
+}
+
+long stateUnverifiedUsers(void)
+{
+    return atomic_load(&coldUsers);
+}
@@ -0,0 +1,874 @@
+#define _GNU_SOURCE // writer-preferring rwlock
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "log.h"
+#include "storage.h"
+#include "trace.h"
+
+#define STORAGE_RING_ENTRIES 256
+#define STORAGE_MAX_BATCH STORAGE_RING_ENTRIES // one SQE per distinct file in a batch
+#define STORAGE_LINE_SIZE 2048
+
+typedef struct StorageEntry
+{
+    struct StorageEntry *next;
+    unsigned long sequence;
+    size_t length;
+    int userId; // owner of the file, -1 for files outside user directories
+    const char *path; // points into data, after the payload
+    char data[];
+} StorageEntry;
+
+// All appends of one batch that target the same file, coalesced into one write
+typedef struct
+{
+    const char *path;
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    int fd;
+} StorageGroup;
+
+typedef struct
+{
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    int currentPosition; // kernel supports offset -1 for "current position"
+} StorageRing;
+
+static StorageBackend backend = STORAGE_BACKEND_SYNC;
+static StorageRing ring;
+
+static StorageEntry *queueHead = NULL;
+static StorageEntry *queueTail = NULL;
+static StorageEntry *writing = NULL; // the batch the writer thread is on
+static unsigned long enqueuedSequence = 0;
+static unsigned long completedSequence = 0;
+static atomic_long pendingAppends;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueNotEmpty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batchCompleted = PTHREAD_COND_INITIALIZER;
+
+// Held shared by every mutation and exclusively by storageFreeze()
+static pthread_rwlock_t mutationLock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static StorageObserverFn observer = NULL;
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sets up an io_uring instance with raw syscalls and maps its rings.
+ *
+ * @return int 0 on success, -1 if io_uring is unavailable.
+ */
+// <----------------------------------------------------------------> //
+static int storageRingSetup(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, STORAGE_RING_ENTRIES, &params);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap && cqSize > sqSize)
+    {
+        sqSize = cqSize;
+    }
+
+    char *sqPtr = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqPtr == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    char *cqPtr = sqPtr;
+    if (!singleMap)
+    {
+        cqPtr = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqPtr == MAP_FAILED)
+        {
+            munmap(sqPtr, sqSize);
+            close(fd);
+            return -1;
+        }
+    }
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        munmap(sqPtr, sqSize);
+        if (!singleMap)
+        {
+            munmap(cqPtr, cqSize);
+        }
+        close(fd);
+        return -1;
+    }
+
+    ring.fd = fd;
+    ring.sqHead = (unsigned *)(sqPtr + params.sq_off.head);
+    ring.sqTail = (unsigned *)(sqPtr + params.sq_off.tail);
+    ring.sqMask = (unsigned *)(sqPtr + params.sq_off.ring_mask);
+    ring.sqArray = (unsigned *)(sqPtr + params.sq_off.array);
+    ring.cqHead = (unsigned *)(cqPtr + params.cq_off.head);
+    ring.cqTail = (unsigned *)(cqPtr + params.cq_off.tail);
+    ring.cqMask = (unsigned *)(cqPtr + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cqPtr + params.cq_off.cqes);
+    ring.sqes = sqes;
+    ring.currentPosition = (params.features & IORING_FEAT_RW_CUR_POS) != 0;
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Writes a whole buffer with plain write(), retrying short writes.
+ */
+// <----------------------------------------------------------------> //
+static void storageWriteAll(int fd, const char *path, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, buffer, length);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            LOG_ERROR("Error appending to %s: %s", path, strerror(errno));
+            return;
+        }
+        buffer += n;
+        length -= (size_t)n;
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Submits one write per group in a single io_uring_enter and waits for them.
+ *
+ * Groups the kernel only partially wrote, that failed, or whose SQE it
+ * never consumed are finished with plain write() so an append is never
+ * lost; an SQE the kernel did consume is never written a second time.
+ */
+// <----------------------------------------------------------------> //
+static void storageSubmitGroups(StorageGroup *groups, int groupCount)
+{
+    size_t written[STORAGE_MAX_BATCH] = {0};
+    unsigned firstTail = atomic_load_explicit((_Atomic unsigned *)ring.sqTail, memory_order_relaxed);
+    unsigned tail = firstTail;
+    int submitted = 0;
+    int i;
+
+    for (i = 0; i < groupCount; i++)
+    {
+        if (groups[i].fd < 0)
+        {
+            continue;
+        }
+        unsigned index = tail & *ring.sqMask;
+        struct io_uring_sqe *sqe = &ring.sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = groups[i].fd;
+        sqe->addr = (unsigned long)groups[i].buffer;
+        sqe->len = (unsigned)groups[i].length;
+        sqe->off = ring.currentPosition ? (unsigned long long)-1 : 0; // files are O_APPEND either way
+        sqe->user_data = (unsigned long long)i;
+        ring.sqArray[index] = index;
+        tail++;
+        submitted++;
+    }
+    atomic_store_explicit((_Atomic unsigned *)ring.sqTail, tail, memory_order_release);
+
+    int consumed = 0; // SQEs the kernel has taken; only those complete
+    int completed = 0;
+    int submitting = submitted > 0;
+    while (submitting || completed < consumed)
+    {
+        // The kernel does not wait when it consumes fewer SQEs than asked
+        int result = (int)syscall(__NR_io_uring_enter, ring.fd, submitting ? submitted - consumed : 0,
+                                  (submitting ? submitted : consumed) - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        int failed = result < 0 && errno != EINTR;
+        int error = errno;
+        consumed = (int)(atomic_load_explicit((_Atomic unsigned *)ring.sqHead, memory_order_acquire) - firstTail);
+        if (submitting && failed)
+        {
+            LOG_ERROR("io_uring_enter failed: %s, writing %d of %d files directly", strerror(error),
+                      submitted - consumed, submitted);
+            // Take back the SQEs the kernel never saw, they are written below
+            atomic_store_explicit((_Atomic unsigned *)ring.sqTail, firstTail + (unsigned)consumed, memory_order_release);
+            submitting = 0;
+        }
+        else if (failed)
+        {
+            // The kernel still holds the buffers, so they cannot be freed yet
+            LOG_ERROR("io_uring_enter failed while waiting: %s", strerror(error));
+            nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 1000000}, NULL);
+        }
+        else if (consumed == submitted)
+        {
+            submitting = 0;
+        }
+
+        unsigned head = atomic_load_explicit((_Atomic unsigned *)ring.cqHead, memory_order_relaxed);
+        unsigned cqTail = atomic_load_explicit((_Atomic unsigned *)ring.cqTail, memory_order_acquire);
+        while (head != cqTail)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            int group = (int)cqe->user_data;
+            if (cqe->res > 0)
+            {
+                written[group] = (size_t)cqe->res;
+            }
+            head++;
+            completed++;
+        }
+        atomic_store_explicit((_Atomic unsigned *)ring.cqHead, head, memory_order_release);
+    }
+
+    for (i = 0; i < groupCount; i++)
+    {
+        if (groups[i].fd >= 0 && written[i] < groups[i].length)
+        {
+            storageWriteAll(groups[i].fd, groups[i].path, groups[i].buffer + written[i], groups[i].length - written[i]);
+        }
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Writes one batch of queued appends, coalescing appends per file.
+ *
+ * @param batch The first entry of a list of at most STORAGE_MAX_BATCH entries.
+ */
+// <----------------------------------------------------------------> //
+static void storageWriteBatch(StorageEntry *batch)
+{
+    StorageGroup groups[STORAGE_MAX_BATCH];
+    int groupCount = 0;
+    int i;
+    StorageEntry *entry;
+
+    for (entry = batch; entry != NULL; entry = entry->next)
+    {
+        StorageGroup *group = NULL;
+        for (i = 0; i < groupCount; i++)
+        {
+            if (strcmp(groups[i].path, entry->path) == 0)
+            {
+                group = &groups[i];
+                break;
+            }
+        }
+        if (group == NULL)
+        {
+            group = &groups[groupCount++];
+            group->path = entry->path;
+            group->buffer = NULL;
+            group->length = 0;
+            group->capacity = 0;
+        }
+        if (group->length + entry->length > group->capacity)
+        {
+            size_t capacity = (group->length + entry->length) * 2;
+            char *buffer = realloc(group->buffer, capacity);
+            if (buffer == NULL)
+            {
+                LOG_ERROR("Error allocating append buffer for %s", entry->path);
+                continue;
+            }
+            group->buffer = buffer;
+            group->capacity = capacity;
+        }
+        memcpy(group->buffer + group->length, entry->data, entry->length);
+        group->length += entry->length;
+    }
+
+    for (i = 0; i < groupCount; i++)
+    {
+        groups[i].fd = open(groups[i].path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+        if (groups[i].fd < 0)
+        {
+            LOG_ERROR("Error opening %s for append: %s", groups[i].path, strerror(errno));
+        }
+    }
+
+    storageSubmitGroups(groups, groupCount);
+
+    for (i = 0; i < groupCount; i++)
+    {
+        if (groups[i].fd >= 0)
+        {
+            close(groups[i].fd);
+        }
+        free(groups[i].buffer);
+    }
+}
+
+static void *storageWriterLoop(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&queueLock);
+        while (queueHead == NULL)
+        {
+            pthread_cond_wait(&queueNotEmpty, &queueLock);
+        }
+
+        // Detach up to one batch worth of entries from the queue
+        StorageEntry *batch = queueHead;
+        StorageEntry *last = batch;
+        long count = 1;
+        while (last->next != NULL && count < STORAGE_MAX_BATCH)
+        {
+            last = last->next;
+            count++;
+        }
+        queueHead = last->next;
+        if (queueHead == NULL)
+        {
+            queueTail = NULL;
+        }
+        last->next = NULL;
+        writing = batch;
+        pthread_mutex_unlock(&queueLock);
+
+        storageWriteBatch(batch);
+
+        pthread_mutex_lock(&queueLock);
+        writing = NULL;
+        completedSequence = last->sequence;
+        atomic_fetch_sub(&pendingAppends, count);
+        pthread_cond_broadcast(&batchCompleted);
+        pthread_mutex_unlock(&queueLock);
+
+        while (batch != NULL)
+        {
+            StorageEntry *next = batch->next;
+            free(batch);
+            batch = next;
+        }
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Selects the storage backend, falling back to synchronous appends.
+ *
+ * @param requested The backend asked for on the command line.
+ * @return StorageBackend The backend actually in use.
+ */
+// <----------------------------------------------------------------> //
+StorageBackend storageInit(StorageBackend requested)
+{
+    backend = STORAGE_BACKEND_SYNC;
+    if (requested != STORAGE_BACKEND_IO_URING)
+    {
+        return backend;
+    }
+
+    if (storageRingSetup() < 0)
+    {
+        LOG_WARN("io_uring unavailable (%s), using synchronous appends", strerror(errno));
+        return backend;
+    }
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, storageWriterLoop, NULL) != 0)
+    {
+        LOG_ERROR("Storage writer thread create error, using synchronous appends");
+        return backend;
+    }
+    pthread_detach(writer);
+    backend = STORAGE_BACKEND_IO_URING;
+    LOG_INFO("Storage appends use io_uring");
+    return backend;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Copies one append into a queue entry.
+ */
+// <----------------------------------------------------------------> //
+static StorageEntry *storageEntryCreate(const char *path, const char *data, size_t length)
+{
+    size_t pathLength = strlen(path) + 1;
+    StorageEntry *entry = malloc(sizeof(StorageEntry) + length + pathLength);
+    if (entry == NULL)
+    {
+        LOG_ERROR("Error allocating append for %s", path);
+        return NULL;
+    }
+    memcpy(entry->data, data, length);
+    memcpy(entry->data + length, path, pathLength);
+    entry->path = entry->data + length;
+    entry->length = length;
+    entry->userId = storageUserOfPath(path);
+    entry->next = NULL;
+    return entry;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Appends data to files, either inline or through the writer queue.
+ *
+ * With the io_uring backend the data is copied and queued in one step,
+ * and the call returns without touching the disk; use storageSyncUser()
+ * before reading a file that may have pending appends. The observer, if
+ * any, sees the appends in the order they reach each file.
+ *
+ * @param writes The appends; each target file is created if missing.
+ * @param count The number of appends.
+ * @return int 0 on success, -1 if any append failed.
+ */
+// <----------------------------------------------------------------> //
+int storageAppendBatch(const StorageWrite *writes, int count)
+{
+    uint64_t tracedAt = traceSpanBegin();
+    int i;
+    if (backend == STORAGE_BACKEND_SYNC)
+    {
+        int result = 0;
+        pthread_rwlock_rdlock(&mutationLock);
+        for (i = 0; i < count; i++)
+        {
+            FILE *file = fopen(writes[i].path, "a");
+            if (file == NULL)
+            {
+                LOG_ERROR("Error opening %s for append: %s", writes[i].path, strerror(errno));
+                result = -1;
+                continue;
+            }
+            fwrite(writes[i].data, 1, writes[i].length, file);
+            fclose(file);
+            if (observer != NULL)
+            {
+                observer(STORAGE_MUTATION_APPEND, writes[i].path, writes[i].data, writes[i].length);
+            }
+        }
+        pthread_rwlock_unlock(&mutationLock);
+        traceSpanEnd("storage_append", tracedAt);
+        return result;
+    }
+
+    StorageEntry *first = NULL;
+    StorageEntry *last = NULL;
+    for (i = 0; i < count; i++)
+    {
+        StorageEntry *entry = storageEntryCreate(writes[i].path, writes[i].data, writes[i].length);
+        if (entry == NULL)
+        {
+            break;
+        }
+        if (last != NULL)
+        {
+            last->next = entry;
+        }
+        else
+        {
+            first = entry;
+        }
+        last = entry;
+    }
+    if (i < count)
+    {
+        while (first != NULL)
+        {
+            StorageEntry *next = first->next;
+            free(first);
+            first = next;
+        }
+        return -1;
+    }
+    if (first == NULL)
+    {
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&mutationLock);
+    pthread_mutex_lock(&queueLock);
+    StorageEntry *entry;
+    for (entry = first; entry != NULL; entry = entry->next)
+    {
+        entry->sequence = ++enqueuedSequence;
+        if (observer != NULL)
+        {
+            observer(STORAGE_MUTATION_APPEND, entry->path, entry->data, entry->length); // in queue order
+        }
+    }
+    if (queueTail != NULL)
+    {
+        queueTail->next = first;
+    }
+    else
+    {
+        queueHead = first;
+    }
+    queueTail = last;
+    atomic_fetch_add(&pendingAppends, count);
+    pthread_cond_signal(&queueNotEmpty);
+    pthread_mutex_unlock(&queueLock);
+    pthread_rwlock_unlock(&mutationLock);
+    traceSpanEnd("storage_queue_append", tracedAt);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Appends data to a file.
+ *
+ * @param path The file to append to; created if missing.
+ * @param data The bytes to append.
+ * @param length The number of bytes.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int storageAppend(const char *path, const char *data, size_t length)
+{
+    StorageWrite single = {path, data, length};
+    return storageAppendBatch(&single, 1);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Formats a line and appends it with storageAppend().
+ */
+// <----------------------------------------------------------------> //
+int storageAppendf(const char *path, const char *format, ...)
+{
+    char line[STORAGE_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        return -1;
+    }
+    if ((size_t)length >= sizeof(line))
+    {
+        length = sizeof(line) - 1;
+    }
+    return storageAppend(path, line, (size_t)length);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Waits until every append queued before the call is on disk.
+ */
+// <----------------------------------------------------------------> //
+void storageSync(void)
+{
+    if (backend == STORAGE_BACKEND_SYNC)
+    {
+        return;
+    }
+    uint64_t tracedAt = traceSpanBegin();
+    pthread_mutex_lock(&queueLock);
+    unsigned long target = enqueuedSequence;
+    while (completedSequence < target)
+    {
+        pthread_cond_wait(&batchCompleted, &queueLock);
+    }
+    pthread_mutex_unlock(&queueLock);
+    traceSpanEnd("storage_sync", tracedAt);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Waits until every append queued before the call to one user's files is on disk.
+ *
+ * Appends to other files are not waited for, so a reader does not stall
+ * behind a backlog that does not concern it.
+ */
+// <----------------------------------------------------------------> //
+void storageSyncUser(int userId)
+{
+    if (backend == STORAGE_BACKEND_SYNC)
+    {
+        return;
+    }
+    uint64_t tracedAt = traceSpanBegin();
+    pthread_mutex_lock(&queueLock);
+    // Sequences grow along the in-flight batch and then along the queue
+    unsigned long target = 0;
+    const StorageEntry *entry;
+    for (entry = writing; entry != NULL; entry = entry->next)
+    {
+        if (entry->userId == userId)
+        {
+            target = entry->sequence;
+        }
+    }
+    for (entry = queueHead; entry != NULL; entry = entry->next)
+    {
+        if (entry->userId == userId)
+        {
+            target = entry->sequence;
+        }
+    }
+    while (completedSequence < target)
+    {
+        pthread_cond_wait(&batchCompleted, &queueLock);
+    }
+    pthread_mutex_unlock(&queueLock);
+    traceSpanEnd("storage_sync", tracedAt);
+}
+
+long storagePendingAppends(void)
+{
+    return atomic_load(&pendingAppends);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Replaces the whole content of a file.
+ *
+ * The data goes to a temporary file that is then renamed over the target,
+ * so readers see either the old or the new content. Call storageSyncUser()
+ * first if the file may have pending appends.
+ *
+ * @param path The file to replace; created if missing.
+ * @param data The new content.
+ * @param length The number of bytes.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int storageReplace(const char *path, const char *data, size_t length)
+{
+    uint64_t tracedAt = traceSpanBegin();
+    char temporaryPath[STORAGE_PATH_SIZE + 8];
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s" STORAGE_TEMPORARY_SUFFIX, path);
+    pthread_rwlock_rdlock(&mutationLock);
+    FILE *file = fopen(temporaryPath, "w");
+    if (file == NULL)
+    {
+        LOG_ERROR("Error opening %s for writing: %s", temporaryPath, strerror(errno));
+        pthread_rwlock_unlock(&mutationLock);
+        return -1;
+    }
+    int result = 0;
+    size_t written = length > 0 ? fwrite(data, 1, length, file) : 0;
+    int closed = fclose(file);
+    if (written != length || closed != 0 || rename(temporaryPath, path) != 0)
+    {
+        LOG_ERROR("Error replacing %s: %s", path, strerror(errno));
+        unlink(temporaryPath);
+        result = -1;
+    }
+    else if (observer != NULL)
+    {
+        observer(STORAGE_MUTATION_REPLACE, path, data, length);
+    }
+    pthread_rwlock_unlock(&mutationLock);
+    traceSpanEnd("storage_replace", tracedAt);
+    return result;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Installs a function called with every append and replacement.
+ *
+ * The observer runs on the mutating thread while the mutation is in
+ * progress, so it must be quick and must not call back into storage.
+ */
+// <----------------------------------------------------------------> //
+void storageSetObserver(StorageObserverFn function)
+{
+    pthread_rwlock_wrlock(&mutationLock);
+    observer = function;
+    pthread_rwlock_unlock(&mutationLock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Blocks every mutation until storageThaw() and flushes pending appends.
+ *
+ * Between the two calls the files on disk are exactly what the observer
+ * has seen so far, so they can be copied as a consistent snapshot.
+ */
+// <----------------------------------------------------------------> //
+void storageFreeze(void)
+{
+    pthread_rwlock_wrlock(&mutationLock);
+    storageSync();
+}
+
+void storageThaw(void)
+{
+    pthread_rwlock_unlock(&mutationLock);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Picks the fan-out bucket of a user.
+ *
+ * A multiplicative hash spreads sequential IDs over all 65536 buckets, so
+ * no directory grows beyond a few hundred entries even with millions of users.
+ */
+// <----------------------------------------------------------------> //
+static unsigned storageUserBucket(int userId)
+{
+    return ((uint32_t)userId * 2654435761u) >> 16;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Formats the path of a user's directory or of one of their files.
+ *
+ * @param userId The user.
+ * @param file Which path to format.
+ * @param path Receives the path.
+ * @return const char* path, for use inline.
+ */
+// <----------------------------------------------------------------> //
+const char *storageUserPath(int userId, StorageUserFile file, char path[STORAGE_PATH_SIZE])
+{
+    static const char *const fileNames[] = {"", "/contact_list.txt", "/messages.txt", "/changes.txt"};
+    unsigned bucket = storageUserBucket(userId);
+    snprintf(path, STORAGE_PATH_SIZE, STORAGE_SHARDS_DIRECTORY "/%02x/%02x/%d%s", bucket >> 8, bucket & 0xff, userId, fileNames[file]);
+    return path;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Finds the user a per-user path belongs to.
+ *
+ * @param path A path formatted by storageUserPath().
+ * @return int The user ID, or -1 if the path is not under a user's directory.
+ */
+// <----------------------------------------------------------------> //
+int storageUserOfPath(const char *path)
+{
+    size_t prefixLength = strlen(STORAGE_SHARDS_DIRECTORY "/");
+    if (strncmp(path, STORAGE_SHARDS_DIRECTORY "/", prefixLength) != 0)
+    {
+        return -1;
+    }
+    unsigned high;
+    unsigned low;
+    int userId;
+    int consumed = 0;
+    if (sscanf(path + prefixLength, "%2x/%2x/%d%n", &high, &low, &userId, &consumed) != 3 ||
+        userId < 0 || storageUserBucket(userId) != (high << 8 | low))
+    {
+        return -1;
+    }
+    char next = path[prefixLength + (size_t)consumed];
+    return next == '\0' || next == '/' ? userId : -1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Creates a user's directory, and the buckets above it if needed.
+ *
+ * @return int 0 on success, -1 if it could not be created or already exists.
+ */
+// <----------------------------------------------------------------> //
+int storageCreateUserDirectory(int userId)
+{
+    char path[STORAGE_PATH_SIZE];
+    storageUserPath(userId, STORAGE_USER_DIRECTORY, path);
+
+    // Parent buckets end at the 2nd and 3rd slash after the shards directory
+    char *cursor = path + strlen(STORAGE_SHARDS_DIRECTORY);
+    int level;
+    for (level = 0; level < 2; level++)
+    {
+        cursor = strchr(cursor + 1, '/');
+        *cursor = '\0';
+        if (mkdir(path, 0777) == -1 && errno != EEXIST)
+        {
+            LOG_ERROR("Error creating directory %s: %s", path, strerror(errno));
+            return -1;
+        }
+        *cursor = '/';
+    }
+    if (mkdir(path, 0777) == -1)
+    {
+        LOG_ERROR("Error creating directory %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Moves user directories of the original flat layout into their buckets.
+ *
+ * Only directories are renamed; the files inside keep their format and timestamps.
+ *
+ * @return int The number of users moved, or -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int storageMigrateLegacyLayout(void)
+{
+    if (mkdir(STORAGE_SHARDS_DIRECTORY, 0777) == -1 && errno != EEXIST)
+    {
+        LOG_ERROR("Error creating directory %s: %s", STORAGE_SHARDS_DIRECTORY, strerror(errno));
+        return -1;
+    }
+    DIR *directory = opendir(STORAGE_USERS_DIRECTORY);
+    if (directory == NULL)
+    {
+        LOG_ERROR("Error opening %s: %s", STORAGE_USERS_DIRECTORY, strerror(errno));
+        return -1;
+    }
+
+    int moved = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        char *end;
+        long userId = strtol(entry->d_name, &end, 10);
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9' || *end != '\0' || userId > 0x7fffffff)
+        {
+            continue; // not a legacy user directory
+        }
+
+        char legacyPath[STORAGE_PATH_SIZE + 256];
+        char path[STORAGE_PATH_SIZE];
+        snprintf(legacyPath, sizeof(legacyPath), STORAGE_USERS_DIRECTORY "/%s", entry->d_name);
+        if (storageCreateUserDirectory((int)userId) < 0 ||
+            rename(legacyPath, storageUserPath((int)userId, STORAGE_USER_DIRECTORY, path)) != 0)
+        {
+            LOG_ERROR("Error moving %s into the sharded layout: %s", legacyPath, strerror(errno));
+            continue;
+        }
+        moved++;
+    }
+    closedir(directory);
+    if (moved > 0)
+    {
+        LOG_INFO("Moved %d user directories into %s", moved, STORAGE_SHARDS_DIRECTORY);
+    }
+    return moved;
+}
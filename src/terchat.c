@@ -0,0 +1,1006 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "terchat.h"
+
+#define TERCHAT_MAX_EVENTS 256
+#define TERCHAT_TICK_MS 1000 // how often idle sessions are checked for a due heartbeat
+#define TERCHAT_OUTPUT_INITIAL_FRAMES 4
+#define TERCHAT_UPLOAD_WINDOW_FRAMES 16 // output an upload is refilled up to; more waits in its file
+
+// A request sent to the server that has not been fully answered yet
+typedef struct
+{
+    int requestId;
+    int type;
+    int remainingFrames; // for multi-frame replies such as contact lists, -1 until known
+} TerchatPendingRequest;
+
+// A file being streamed to the server; uploads of a session go out one after another
+typedef struct TerchatUpload
+{
+    FILE *file;     // owned, closed when the upload ends
+    Message frame;  // the next chunk; its body starts with the blob's name until the first one is sent
+    BlobChunk chunk;
+    size_t nameLength; // bytes of the name still at the start of the frame's data
+    int requestId;     // carried by the last chunk
+    struct TerchatUpload *next;
+} TerchatUpload;
+
+struct TerchatSession
+{
+    int sock;
+    int userId;
+    TerchatFrameFn onFrame;
+    void *context;
+    TerchatLoop *loop;
+
+    // Guards everything below up to the received frame; requests come from any thread
+    pthread_mutex_t lock;
+    int connecting;      // until the non-blocking connect completes
+    int waitingWritable; // EPOLLOUT is registered
+    int closing;         // terchatClose() was called
+    int error;           // what closed the connection, 0 when the server did
+    char *output;        // frames not yet accepted by the socket
+    size_t outputStart;
+    size_t outputEnd;
+    size_t outputCapacity;
+    long long lastSentAt; // ms, for heartbeats
+    int lastRequestId;
+    int lastUploadId;
+    TerchatUpload *uploads; // the first one is read from by the loop's thread, without the lock
+    TerchatUpload *lastUpload;
+    TerchatPendingRequest pending[TERCHAT_MAX_PENDING_REQUESTS];
+
+    // Only touched by the loop's thread
+    size_t received; // bytes of the current frame read so far
+    Message frame;
+    TerchatSession *previous;
+    TerchatSession *next;
+};
+
+struct TerchatLoop
+{
+    int epollFd;
+    pthread_mutex_t lock; // guards the session list
+    TerchatSession *sessions;
+    long long nextTickAt;
+};
+
+static long long terchatNowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Creates an event loop for client sessions.
+ *
+ * @return TerchatLoop* The loop, or NULL on error.
+ */
+// <----------------------------------------------------------------> //
+TerchatLoop *terchatLoopCreate(void)
+{
+    TerchatLoop *loop = calloc(1, sizeof(TerchatLoop));
+    if (loop == NULL)
+    {
+        return NULL;
+    }
+    loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epollFd < 0)
+    {
+        free(loop);
+        return NULL;
+    }
+    pthread_mutex_init(&loop->lock, NULL);
+    loop->nextTickAt = terchatNowMs() + TERCHAT_TICK_MS;
+    return loop;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns a descriptor that is readable whenever the loop has work.
+ *
+ * Lets the loop be embedded in another event loop: poll this descriptor and
+ * call terchatLoopRun() with a timeout of 0 when it is readable, and at
+ * least once a second so heartbeats go out.
+ */
+// <----------------------------------------------------------------> //
+int terchatLoopFd(const TerchatLoop *loop)
+{
+    return loop->epollFd;
+}
+
+// Called with the session lock held
+static void terchatWatch(TerchatSession *session, int writable)
+{
+    if (session->waitingWritable == writable)
+    {
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | (writable ? EPOLLOUT : 0);
+    event.data.ptr = session;
+    epoll_ctl(session->loop->epollFd, EPOLL_CTL_MOD, session->sock, &event);
+    session->waitingWritable = writable;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Writes as much queued output as the socket takes without blocking.
+ *
+ * Whatever is left waits for EPOLLOUT. A failed write shuts the socket
+ * down, so the loop sees the hang-up and closes the session on its thread.
+ * Called with the session lock held.
+ *
+ * @return int 0 on success, -1 if the connection failed.
+ */
+// <----------------------------------------------------------------> //
+static int terchatFlush(TerchatSession *session)
+{
+    while (session->outputStart < session->outputEnd)
+    {
+        ssize_t sent = send(session->sock, session->output + session->outputStart, session->outputEnd - session->outputStart,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent > 0)
+        {
+            session->outputStart += (size_t)sent;
+            continue;
+        }
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        session->error = errno;
+        shutdown(session->sock, SHUT_RDWR);
+        return -1;
+    }
+    if (session->outputStart == session->outputEnd)
+    {
+        session->outputStart = 0;
+        session->outputEnd = 0;
+    }
+    terchatWatch(session, session->outputEnd > 0 || session->uploads != NULL); // uploads are refilled on EPOLLOUT
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Appends a frame to the session's output and tries to send it.
+ *
+ * Called with the session lock held.
+ *
+ * @return int 0 on success, -1 with errno set on error.
+ */
+// <----------------------------------------------------------------> //
+static int terchatQueue(TerchatSession *session, const Message *msg)
+{
+    if (session->closing || session->error != 0)
+    {
+        errno = session->error != 0 ? session->error : EPIPE;
+        return -1;
+    }
+    if (session->outputEnd + sizeof(Message) > session->outputCapacity)
+    {
+        if (session->outputStart > 0) // reclaim what was sent before growing
+        {
+            memmove(session->output, session->output + session->outputStart, session->outputEnd - session->outputStart);
+            session->outputEnd -= session->outputStart;
+            session->outputStart = 0;
+        }
+        size_t capacity = session->outputCapacity > 0 ? session->outputCapacity : TERCHAT_OUTPUT_INITIAL_FRAMES * sizeof(Message);
+        while (session->outputEnd + sizeof(Message) > capacity)
+        {
+            capacity *= 2;
+        }
+        if (capacity != session->outputCapacity)
+        {
+            char *grown = realloc(session->output, capacity);
+            if (grown == NULL)
+            {
+                return -1;
+            }
+            session->output = grown;
+            session->outputCapacity = capacity;
+        }
+    }
+    memcpy(session->output + session->outputEnd, msg, sizeof(Message));
+    session->outputEnd += sizeof(Message);
+    session->lastSentAt = terchatNowMs();
+    if (session->connecting)
+    {
+        return 0; // sent once connected
+    }
+    if (terchatFlush(session) < 0)
+    {
+        errno = session->error;
+        return -1;
+    }
+    return 0;
+}
+
+// Assigns a fresh request ID and records the request as pending; called with the session lock held
+static void terchatTrack(TerchatSession *session, Message *msg)
+{
+    msg->requestId = ++session->lastRequestId;
+    if (session->lastRequestId == 0x7fffffff)
+    {
+        session->lastRequestId = 0;
+    }
+    TerchatPendingRequest *slot = &session->pending[msg->requestId % TERCHAT_MAX_PENDING_REQUESTS];
+    slot->requestId = msg->requestId;
+    slot->type = msg->type;
+    slot->remainingFrames = -1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Matches a reply frame with its pending request.
+ *
+ * Called with the session lock held.
+ *
+ * @param reply The frame received from the server.
+ * @param requestType Set to the type of the matched request, or -1 if unknown.
+ * @return int 1 if the reply completes the request, 0 otherwise.
+ */
+// <----------------------------------------------------------------> //
+static int terchatMatchReply(TerchatSession *session, const Message *reply, int *requestType)
+{
+    *requestType = -1;
+    if (reply->requestId == 0)
+    {
+        return 0;
+    }
+    TerchatPendingRequest *slot = &session->pending[reply->requestId % TERCHAT_MAX_PENDING_REQUESTS];
+    if (slot->requestId != reply->requestId)
+    {
+        return 0;
+    }
+
+    int complete;
+    *requestType = slot->type;
+    if (reply->type == 4 || reply->type == 12 || reply->type == 13 || reply->type == 15) // contact lists, search hits, found users and changes arrive one per frame, "to" holds the count
+    {
+        if (slot->remainingFrames < 0)
+        {
+            slot->remainingFrames = reply->to;
+        }
+        complete = --slot->remainingFrames <= 0;
+    }
+    else if (reply->type == 16) // blob chunks, the last one is flagged
+    {
+        BlobChunk chunk;
+        memcpy(&chunk, reply->body, sizeof(chunk));
+        complete = chunk.last;
+    }
+    else
+    {
+        complete = reply->type != 9; // history lines are followed by a confirmation
+    }
+    if (complete)
+    {
+        slot->requestId = 0;
+    }
+    return complete;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Opens a session: starts a non-blocking connect to the server.
+ *
+ * Requests can be made right away; they are sent once the connection is
+ * up. A failed connect is reported like any other close, with a NULL frame.
+ *
+ * @param loop The loop that will drive the session.
+ * @param host IPv4 address of any node of the cluster.
+ * @param port Its port.
+ * @param userId The user the session acts as.
+ * @param onFrame Receives every frame; see TerchatFrameFn.
+ * @param context Passed to onFrame.
+ * @return TerchatSession* The session, or NULL with errno set on error.
+ */
+// <----------------------------------------------------------------> //
+TerchatSession *terchatConnect(TerchatLoop *loop, const char *host, int port, int userId, TerchatFrameFn onFrame, void *context)
+{
+    struct sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &serverAddr.sin_addr) != 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    TerchatSession *session = calloc(1, sizeof(TerchatSession));
+    if (session == NULL)
+    {
+        return NULL;
+    }
+    session->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (session->sock < 0)
+    {
+        free(session);
+        return NULL;
+    }
+    int enable = 1;
+    setsockopt(session->sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)); // blob chunks go out back to back
+    if (connect(session->sock, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
+    {
+        if (errno != EINPROGRESS)
+        {
+            int error = errno;
+            close(session->sock);
+            free(session);
+            errno = error;
+            return NULL;
+        }
+        session->connecting = 1;
+    }
+    session->userId = userId;
+    session->onFrame = onFrame;
+    session->context = context;
+    session->loop = loop;
+    session->lastSentAt = terchatNowMs();
+    session->waitingWritable = session->connecting; // completion of the connect shows as writable
+    pthread_mutex_init(&session->lock, NULL);
+
+    pthread_mutex_lock(&loop->lock);
+    session->next = loop->sessions;
+    if (loop->sessions != NULL)
+    {
+        loop->sessions->previous = session;
+    }
+    loop->sessions = session;
+    pthread_mutex_unlock(&loop->lock);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | (session->connecting ? EPOLLOUT : 0);
+    event.data.ptr = session;
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, session->sock, &event) < 0)
+    {
+        int error = errno;
+        pthread_mutex_lock(&loop->lock);
+        loop->sessions = session->next;
+        if (session->next != NULL)
+        {
+            session->next->previous = NULL;
+        }
+        pthread_mutex_unlock(&loop->lock);
+        close(session->sock);
+        pthread_mutex_destroy(&session->lock);
+        free(session);
+        errno = error;
+        return NULL;
+    }
+    return session;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Closes a session from any thread.
+ *
+ * The socket is shut down here; the loop then reports the close with a
+ * NULL frame and frees the session.
+ */
+// <----------------------------------------------------------------> //
+void terchatClose(TerchatSession *session)
+{
+    pthread_mutex_lock(&session->lock);
+    session->closing = 1;
+    shutdown(session->sock, SHUT_RDWR);
+    terchatWatch(session, 1); // wakes the loop even while still connecting
+    pthread_mutex_unlock(&session->lock);
+}
+
+int terchatUserId(const TerchatSession *session)
+{
+    return session->userId;
+}
+
+// The errno that closed the connection, 0 if the server closed it; meaningful in the closing callback
+int terchatError(const TerchatSession *session)
+{
+    return session->error;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Removes a closed session from the loop, reports the close and frees it.
+ */
+// <----------------------------------------------------------------> //
+static void terchatRelease(TerchatLoop *loop, TerchatSession *session)
+{
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, session->sock, NULL);
+    pthread_mutex_lock(&loop->lock);
+    if (session->previous != NULL)
+    {
+        session->previous->next = session->next;
+    }
+    else
+    {
+        loop->sessions = session->next;
+    }
+    if (session->next != NULL)
+    {
+        session->next->previous = session->previous;
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    session->onFrame(session, NULL, -1, 1, session->context);
+    close(session->sock);
+    while (session->uploads != NULL)
+    {
+        TerchatUpload *upload = session->uploads;
+        session->uploads = upload->next;
+        fclose(upload->file);
+        free(upload);
+    }
+    free(session->output);
+    pthread_mutex_destroy(&session->lock);
+    free(session);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Stops an upload the server answered before its last chunk, i.e. refused.
+ *
+ * An empty last chunk tells the server the upload is over, so it frees what
+ * it kept for it. Called on the loop's thread with the session lock held.
+ */
+// <----------------------------------------------------------------> //
+static void terchatCancelUpload(TerchatSession *session, int requestId)
+{
+    TerchatUpload *previous = NULL;
+    TerchatUpload *upload = session->uploads;
+    while (upload != NULL && upload->requestId != requestId)
+    {
+        previous = upload;
+        upload = upload->next;
+    }
+    if (upload == NULL)
+    {
+        return; // finished already
+    }
+    if (upload->chunk.offset > 0)
+    {
+        upload->chunk.length = 0;
+        upload->chunk.last = 1;
+        memcpy(upload->frame.body, &upload->chunk, sizeof(BlobChunk));
+        upload->frame.requestId = 0;
+        terchatQueue(session, &upload->frame); // a failure shows up as a close
+    }
+    if (previous != NULL)
+    {
+        previous->next = upload->next;
+    }
+    else
+    {
+        session->uploads = upload->next;
+    }
+    if (session->lastUpload == upload)
+    {
+        session->lastUpload = previous;
+    }
+    fclose(upload->file);
+    free(upload);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Reads whatever is available and hands every complete frame to the session's callback.
+ *
+ * @return int 0 while the connection is open, -1 once it has closed.
+ */
+// <----------------------------------------------------------------> //
+static int terchatRead(TerchatSession *session)
+{
+    while (1)
+    {
+        ssize_t n = recv(session->sock, (char *)&session->frame + session->received, sizeof(Message) - session->received, MSG_DONTWAIT);
+        if (n > 0)
+        {
+            session->received += (size_t)n;
+            if (session->received == sizeof(Message))
+            {
+                session->received = 0;
+                int requestType;
+                pthread_mutex_lock(&session->lock);
+                int complete = terchatMatchReply(session, &session->frame, &requestType);
+                if (complete && requestType == 16)
+                {
+                    terchatCancelUpload(session, session->frame.requestId);
+                }
+                pthread_mutex_unlock(&session->lock);
+                session->onFrame(session, &session->frame, requestType, complete, session->context);
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 0;
+        }
+        pthread_mutex_lock(&session->lock);
+        if (n < 0 && session->error == 0)
+        {
+            session->error = errno;
+        }
+        pthread_mutex_unlock(&session->lock);
+        return -1;
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Reads the next chunk of an upload from its file; loop thread only, without the lock.
+ *
+ * @return int 0 on success, -1 with errno set if the file could not be read.
+ */
+// <----------------------------------------------------------------> //
+static int terchatReadChunk(TerchatUpload *upload)
+{
+    size_t used = upload->nameLength;
+    size_t wanted = BLOB_CHUNK_DATA_SIZE - used;
+    size_t length = fread(upload->frame.body + sizeof(BlobChunk) + used, 1, wanted, upload->file);
+    if (ferror(upload->file))
+    {
+        errno = EIO;
+        return -1;
+    }
+    upload->chunk.length = (unsigned short)(used + length);
+    upload->chunk.last = length < wanted;
+    memcpy(upload->frame.body, &upload->chunk, sizeof(BlobChunk));
+    upload->frame.requestId = upload->chunk.last || upload->chunk.offset == 0 ? upload->requestId : 0; // a refusal answers the first
+    upload->nameLength = 0;
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Refills the session's output with chunks of its uploads, up to the window.
+ *
+ * Runs on the loop's thread whenever the socket drains, so an upload holds
+ * at most TERCHAT_UPLOAD_WINDOW_FRAMES frames of memory however large its
+ * file, and the file is read without the session lock. A file that cannot
+ * be read closes the session with EIO: the server could not tell the
+ * upload apart from one still in progress.
+ *
+ * @return int 0 while the session stays open, -1 if the connection failed.
+ */
+// <----------------------------------------------------------------> //
+static int terchatPump(TerchatSession *session)
+{
+    pthread_mutex_lock(&session->lock);
+    while (session->uploads != NULL && !session->connecting && !session->closing && session->error == 0 &&
+           session->outputEnd - session->outputStart < TERCHAT_UPLOAD_WINDOW_FRAMES * sizeof(Message))
+    {
+        TerchatUpload *upload = session->uploads;
+        pthread_mutex_unlock(&session->lock);
+        int failed = terchatReadChunk(upload);
+        int error = errno;
+        pthread_mutex_lock(&session->lock);
+        if (failed)
+        {
+            session->error = error;
+            shutdown(session->sock, SHUT_RDWR);
+            break;
+        }
+        if (terchatQueue(session, &upload->frame) < 0)
+        {
+            break;
+        }
+        upload->chunk.offset += upload->chunk.length;
+        if (upload->chunk.last)
+        {
+            session->uploads = upload->next;
+            if (session->uploads == NULL)
+            {
+                session->lastUpload = NULL;
+            }
+            fclose(upload->file);
+            free(upload);
+        }
+    }
+    int open = session->error == 0;
+    pthread_mutex_unlock(&session->lock);
+    return open ? 0 : -1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Handles the epoll events of one session.
+ *
+ * @return int 0 while the session stays open, -1 once it has to be released.
+ */
+// <----------------------------------------------------------------> //
+static int terchatHandle(TerchatSession *session, unsigned events)
+{
+    pthread_mutex_lock(&session->lock);
+    int open = !session->closing;
+    if (open && session->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(session->sock, SOL_SOCKET, SO_ERROR, &error, &length);
+        session->connecting = 0;
+        session->error = error;
+        open = error == 0;
+    }
+    if (open && !session->connecting && (events & EPOLLOUT))
+    {
+        open = terchatFlush(session) == 0;
+    }
+    pthread_mutex_unlock(&session->lock);
+    if (open && (events & EPOLLOUT))
+    {
+        open = terchatPump(session) == 0;
+    }
+    if (open && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+    {
+        open = terchatRead(session) == 0;
+    }
+    return open ? 0 : -1;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Pings the server on every session that sent nothing for a heartbeat interval.
+ *
+ * Sessions that are busy anyway need no ping: any frame keeps them from
+ * being reaped as idle.
+ */
+// <----------------------------------------------------------------> //
+static void terchatTick(TerchatLoop *loop, long long now)
+{
+    Message heartbeat;
+    memset(&heartbeat, 0, sizeof(heartbeat));
+    heartbeat.type = 11;
+    heartbeat.to = -1;
+
+    pthread_mutex_lock(&loop->lock);
+    TerchatSession *session;
+    for (session = loop->sessions; session != NULL; session = session->next)
+    {
+        pthread_mutex_lock(&session->lock);
+        if (!session->connecting && now - session->lastSentAt >= HEARTBEAT_INTERVAL * 1000LL)
+        {
+            heartbeat.from = session->userId;
+            terchatQueue(session, &heartbeat); // a failure shows up as a close
+        }
+        pthread_mutex_unlock(&session->lock);
+    }
+    pthread_mutex_unlock(&loop->lock);
+    loop->nextTickAt = now + TERCHAT_TICK_MS;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Runs the loop until some events were handled or the timeout passed.
+ *
+ * Every frame callback runs inside this call, on the calling thread.
+ * Heartbeats are sent from here as well.
+ *
+ * @param loop The loop.
+ * @param timeoutMs How long to wait for events; -1 waits until there are some.
+ * @return int Number of events handled, or -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int terchatLoopRun(TerchatLoop *loop, int timeoutMs)
+{
+    struct epoll_event events[TERCHAT_MAX_EVENTS];
+    long long deadline = terchatNowMs() + timeoutMs;
+    int handled = 0;
+    while (1)
+    {
+        long long now = terchatNowMs();
+        if (now >= loop->nextTickAt)
+        {
+            terchatTick(loop, now);
+        }
+        long long wait = loop->nextTickAt - now;
+        if (timeoutMs >= 0 && deadline - now < wait)
+        {
+            wait = deadline > now ? deadline - now : 0;
+        }
+
+        int count = epoll_wait(loop->epollFd, events, TERCHAT_MAX_EVENTS, (int)wait);
+        if (count < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+        int i;
+        for (i = 0; i < count; i++)
+        {
+            TerchatSession *session = events[i].data.ptr;
+            if (terchatHandle(session, events[i].events) < 0)
+            {
+                terchatRelease(loop, session);
+            }
+        }
+        handled += count > 0 ? count : 0;
+        if (handled > 0 || (timeoutMs >= 0 && terchatNowMs() >= deadline))
+        {
+            return handled;
+        }
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Closes every remaining session, reporting each close, and frees the loop.
+ *
+ * Must be called on the thread that runs the loop.
+ */
+// <----------------------------------------------------------------> //
+void terchatLoopDestroy(TerchatLoop *loop)
+{
+    while (loop->sessions != NULL)
+    {
+        terchatRelease(loop, loop->sessions);
+    }
+    close(loop->epollFd);
+    pthread_mutex_destroy(&loop->lock);
+    free(loop);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sends a request and records it as pending.
+ *
+ * The request ID is assigned here; the server echoes it on every reply, so
+ * several requests can be in flight at once and their replies matched up
+ * in any order. The sender is always the session's user.
+ *
+ * @param session The session.
+ * @param msg The request; its requestId and from are filled in.
+ * @return int The request ID, or -1 with errno set on error.
+ */
+// <----------------------------------------------------------------> //
+int terchatRequest(TerchatSession *session, Message *msg)
+{
+    pthread_mutex_lock(&session->lock);
+    msg->from = session->userId;
+    terchatTrack(session, msg);
+    int result = terchatQueue(session, msg) < 0 ? -1 : msg->requestId;
+    pthread_mutex_unlock(&session->lock);
+    return result;
+}
+
+static int terchatSimpleRequest(TerchatSession *session, int type, int to, const char *body)
+{
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = type;
+    msg.to = to;
+    if (body != NULL)
+    {
+        strncpy(msg.body, body, sizeof(msg.body) - 1);
+    }
+    return terchatRequest(session, &msg);
+}
+
+// Logs in; answered with a confirmation, or with a registration request (type 2) for a new user
+int terchatLogin(TerchatSession *session)
+{
+    return terchatSimpleRequest(session, 0, -1, NULL);
+}
+
+int terchatRegister(TerchatSession *session, const char *username, const char *phoneNumber, const char *name, const char *surname)
+{
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 2;
+    snprintf(msg.body, sizeof(msg.body), "%s,%s,%s,%s", username, phoneNumber, name, surname);
+    return terchatRequest(session, &msg);
+}
+
+int terchatDisconnect(TerchatSession *session)
+{
+    return terchatSimpleRequest(session, -1, -1, NULL);
+}
+
+int terchatListContacts(TerchatSession *session)
+{
+    return terchatSimpleRequest(session, 4, -1, "List contacts request");
+}
+
+int terchatAddContact(TerchatSession *session, const User *user)
+{
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 5;
+    memcpy(msg.body, user, sizeof(User));
+    return terchatRequest(session, &msg);
+}
+
+int terchatDeleteContact(TerchatSession *session, int contactId)
+{
+    return terchatSimpleRequest(session, 6, contactId, NULL);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sends a message to another user.
+ *
+ * A message too long for one frame is streamed as a blob without a name.
+ *
+ * @return int The request ID of the (last) frame, or -1 with errno set on error.
+ */
+// <----------------------------------------------------------------> //
+int terchatSendMessage(TerchatSession *session, int recipientId, const char *text)
+{
+    size_t length = strlen(text);
+    if (length < MESSAGE_BODY_SIZE)
+    {
+        return terchatSimpleRequest(session, 7, recipientId, text);
+    }
+    // The upload outlives the call, so it reads from a copy of the text
+    FILE *file = fmemopen(NULL, length, "w+");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    if (fwrite(text, 1, length, file) != length)
+    {
+        fclose(file);
+        errno = EIO;
+        return -1;
+    }
+    rewind(file);
+    return terchatSendFile(session, recipientId, "", file);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Sends one message to several users in a single batch request.
+ *
+ * @param recipientCount In: number of recipientIds. Out: how many of them
+ *                       fit into the frame and were sent the message.
+ * @return int The request ID, or -1 with errno set on error.
+ */
+// <----------------------------------------------------------------> //
+int terchatSendBatch(TerchatSession *session, const int *recipientIds, int *recipientCount, const char *text)
+{
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = 10;
+    msg.to = 0; // Number of entries in the body
+    size_t textLength = strnlen(text, sizeof(msg.body) - sizeof(BatchEntry));
+    size_t offset = 0;
+    while (msg.to < *recipientCount && offset + sizeof(BatchEntry) + textLength <= sizeof(msg.body))
+    {
+        BatchEntry entry = {recipientIds[msg.to], (unsigned short)textLength};
+        memcpy(msg.body + offset, &entry, sizeof(entry));
+        memcpy(msg.body + offset + sizeof(entry), text, textLength);
+        offset += sizeof(entry) + textLength;
+        msg.to++;
+    }
+    *recipientCount = msg.to;
+    return terchatRequest(session, &msg);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Streams a blob to the server; the recipient gets a message that references it.
+ *
+ * The upload is only queued here. The loop's thread reads the file a few
+ * chunks at a time as the socket drains (see terchatPump()), after any
+ * upload queued earlier on the session. The first and the last chunk carry
+ * the request ID: the confirmation of the last tells how the whole upload
+ * went, unless the server refuses the first and the upload stops there.
+ *
+ * @param session The session.
+ * @param recipientId The ID of the recipient.
+ * @param name Name of the blob; empty for a long text message.
+ * @param file Where the bytes are read from; at most BLOB_MAX_SIZE of them.
+ *             The session owns it from now on, and closes it even on error.
+ * @return int The request ID of the last chunk, or -1 with errno set on error.
+ */
+// <----------------------------------------------------------------> //
+int terchatSendFile(TerchatSession *session, int recipientId, const char *name, FILE *file)
+{
+    TerchatUpload *upload = calloc(1, sizeof(TerchatUpload));
+    if (upload == NULL)
+    {
+        fclose(file);
+        return -1;
+    }
+    upload->file = file;
+    upload->frame.type = 16;
+    upload->frame.to = recipientId;
+    upload->nameLength = strnlen(name, BLOB_NAME_SIZE - 1);
+    memcpy(upload->frame.body + sizeof(BlobChunk), name, upload->nameLength);
+    upload->frame.body[sizeof(BlobChunk) + upload->nameLength++] = '\0'; // the first chunk starts with the name
+
+    pthread_mutex_lock(&session->lock);
+    if (session->closing || session->error != 0)
+    {
+        errno = session->error != 0 ? session->error : EPIPE;
+        pthread_mutex_unlock(&session->lock);
+        fclose(file);
+        free(upload);
+        return -1;
+    }
+    upload->frame.from = session->userId;
+    upload->chunk.uploadId = ++session->lastUploadId;
+    terchatTrack(session, &upload->frame);
+    upload->requestId = upload->frame.requestId;
+    if (session->lastUpload != NULL)
+    {
+        session->lastUpload->next = upload;
+    }
+    else
+    {
+        session->uploads = upload;
+    }
+    session->lastUpload = upload;
+    if (!session->connecting)
+    {
+        terchatWatch(session, 1); // the loop starts reading once the socket reports writable
+    }
+    int requestId = upload->requestId;
+    pthread_mutex_unlock(&session->lock);
+    return requestId;
+}
+
+int terchatCheckMessages(TerchatSession *session)
+{
+    return terchatSimpleRequest(session, 8, -1, NULL);
+}
+
+// Reads the history with one peer; the server marks it read. Answered with history frames and then a confirmation
+int terchatReadMessages(TerchatSession *session, int peerId)
+{
+    return terchatSimpleRequest(session, 9, peerId, NULL);
+}
+
+// maxResults 0 asks for the server's default
+int terchatSearchMessages(TerchatSession *session, const char *query, int maxResults)
+{
+    return terchatSimpleRequest(session, 12, maxResults, query);
+}
+
+int terchatFindUsers(TerchatSession *session, const char *query, int maxResults)
+{
+    return terchatSimpleRequest(session, 13, maxResults, query);
+}
+
+// Asks for the presence of the contacts; changes are pushed from then on
+int terchatSubscribePresence(TerchatSession *session)
+{
+    return terchatSimpleRequest(session, 14, 0, NULL);
+}
+
+int terchatSync(TerchatSession *session, long long sinceVersion)
+{
+    char version[32];
+    snprintf(version, sizeof(version), "%lld", sinceVersion);
+    return terchatSimpleRequest(session, 15, 0, version);
+}
+
+int terchatFetchBlob(TerchatSession *session, int peerId, long long blobId)
+{
+    char id[32];
+    snprintf(id, sizeof(id), "%lld", blobId);
+    return terchatSimpleRequest(session, 17, peerId, id);
+}
@@ -0,0 +1,156 @@
+#include <stddef.h>
+
+#include "timerwheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+static void timerListInsert(TimerEntry *head, TimerEntry *entry)
+{
+    entry->next = head->next;
+    entry->prev = head;
+    head->next->prev = entry;
+    head->next = entry;
+}
+
+static void timerListRemove(TimerEntry *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Initialises an empty wheel positioned at the given tick.
+ */
+// <----------------------------------------------------------------> //
+void timerWheelInit(TimerWheel *wheel, uint64_t now)
+{
+    int level, slot;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+        {
+            wheel->slots[level][slot].next = &wheel->slots[level][slot];
+            wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+        }
+    }
+    wheel->now = now;
+    wheel->count = 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Schedules (or reschedules) a timer in O(1).
+ *
+ * The level is picked from the distance to the deadline: level L holds
+ * timers less than 64^(L+1) ticks away, in the slot given by bits
+ * [6L, 6L+6) of the deadline. Timers further than the wheel's range are
+ * clamped to its end and simply fire late.
+ *
+ * @param wheel The wheel.
+ * @param entry The timer; may already be scheduled.
+ * @param expiresAt The deadline in ticks.
+ */
+// <----------------------------------------------------------------> //
+void timerWheelSchedule(TimerWheel *wheel, TimerEntry *entry, uint64_t expiresAt)
+{
+    if (entry->next != NULL)
+    {
+        timerListRemove(entry);
+        wheel->count--;
+    }
+
+    if (expiresAt <= wheel->now)
+    {
+        expiresAt = wheel->now + 1;
+    }
+    if (expiresAt - wheel->now >= TIMER_WHEEL_RANGE)
+    {
+        expiresAt = wheel->now + TIMER_WHEEL_RANGE - 1;
+    }
+    entry->expiresAt = expiresAt;
+
+    uint64_t delta = expiresAt - wheel->now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+    int slot = (int)((expiresAt >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    timerListInsert(&wheel->slots[level][slot], entry);
+    wheel->count++;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Removes a timer if it is scheduled.
+ */
+// <----------------------------------------------------------------> //
+void timerWheelCancel(TimerWheel *wheel, TimerEntry *entry)
+{
+    if (entry->next != NULL)
+    {
+        timerListRemove(entry);
+        wheel->count--;
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Moves every timer of a higher-level slot down to where it now belongs.
+ */
+// <----------------------------------------------------------------> //
+static void timerWheelCascade(TimerWheel *wheel, int level)
+{
+    int slot = (int)((wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    TimerEntry *head = &wheel->slots[level][slot];
+    while (head->next != head)
+    {
+        TimerEntry *entry = head->next;
+        timerWheelSchedule(wheel, entry, entry->expiresAt);
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Advances the wheel to a tick, firing every timer that expired on the way.
+ *
+ * The expire callback runs with the timer already unscheduled; it may
+ * schedule it again.
+ *
+ * @param wheel The wheel.
+ * @param now The current tick.
+ * @param expire Called once for every expired timer.
+ * @param context Passed through to the callback.
+ */
+// <----------------------------------------------------------------> //
+void timerWheelAdvance(TimerWheel *wheel, uint64_t now, TimerExpireFn expire, void *context)
+{
+    while (wheel->now < now)
+    {
+        wheel->now++;
+
+        // When a level wraps, the next slot of the level above is due for redistribution
+        int level = 1;
+        while (level < TIMER_WHEEL_LEVELS && (wheel->now & ((1ull << (TIMER_WHEEL_BITS * level)) - 1)) == 0)
+        {
+            level++;
+        }
+        while (--level >= 1)
+        {
+            timerWheelCascade(wheel, level);
+        }
+
+        TimerEntry *head = &wheel->slots[0][wheel->now & TIMER_WHEEL_MASK];
+        while (head->next != head)
+        {
+            TimerEntry *entry = head->next;
+            timerListRemove(entry);
+            wheel->count--;
+            expire(entry, context);
+        }
+    }
+}
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "log.h"
+#include "trace.h"
+
+#define TRACE_RING_CAPACITY 1024 // spans per thread, must be a power of two
+#define TRACE_FLUSH_INTERVAL_NS 100000000
+#define TRACE_BUFFER_SIZE (256 * 1024)
+
+typedef struct
+{
+    uint64_t traceId;
+    uint64_t startedAt;
+    uint64_t endedAt;
+    const char *name; // a string literal
+    int32_t type;
+    int32_t requestId;
+    int32_t user;
+} TraceSpan;
+
+// Single-producer (the owning thread) single-consumer (the flusher) ring
+typedef struct TraceRing
+{
+    TraceSpan spans[TRACE_RING_CAPACITY];
+    atomic_uint head; // next slot the producer writes
+    atomic_uint tail; // next slot the flusher reads
+    atomic_int orphaned; // set when the owning thread exits
+    int threadNumber;
+    struct TraceRing *next;
+} TraceRing;
+
+volatile int traceSampleEvery = 0;
+_Thread_local TraceContext traceContext;
+_Thread_local uint64_t traceReadAt;
+
+static _Thread_local int sampleCountdown;
+static _Thread_local TraceRing *localRing;
+static TraceRing *rings = NULL;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+static int nextThreadNumber = 0;
+static atomic_ullong nextTraceId;
+static atomic_long droppedSpans;
+
+static FILE *traceFile = NULL;
+static uint64_t startedAtNs;
+static int eventsWritten = 0;
+static pthread_t flusherThread;
+static atomic_int flusherRunning;
+
+static void orphanRing(void *ring)
+{
+    atomic_store_explicit(&((TraceRing *)ring)->orphaned, 1, memory_order_release);
+}
+
+static void createRingKey(void)
+{
+    pthread_key_create(&ringKey, orphanRing);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Returns the calling thread's ring, registering a new one on first use.
+ */
+// <----------------------------------------------------------------> //
+static TraceRing *traceRing(void)
+{
+    if (localRing != NULL)
+    {
+        return localRing;
+    }
+
+    TraceRing *ring = calloc(1, sizeof(TraceRing));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    pthread_once(&ringKeyOnce, createRingKey);
+    pthread_setspecific(ringKey, ring);
+
+    pthread_mutex_lock(&ringsLock);
+    ring->threadNumber = nextThreadNumber++;
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&ringsLock);
+
+    localRing = ring;
+    return ring;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Records one finished span of the current request into the calling thread's ring.
+ *
+ * When the ring is full the span is dropped and counted instead of blocking.
+ *
+ * @param name What the span measured; must outlive the process.
+ * @param startedAt From traceNow().
+ * @param endedAt From traceNow().
+ */
+// <----------------------------------------------------------------> //
+void traceRecord(const char *name, uint64_t startedAt, uint64_t endedAt)
+{
+    TraceRing *ring = traceRing();
+    if (ring == NULL)
+    {
+        return;
+    }
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= TRACE_RING_CAPACITY)
+    {
+        atomic_fetch_add_explicit(&droppedSpans, 1, memory_order_relaxed);
+        return;
+    }
+    TraceSpan *span = &ring->spans[head & (TRACE_RING_CAPACITY - 1)];
+    span->traceId = traceContext.id;
+    span->startedAt = startedAt;
+    span->endedAt = endedAt;
+    span->name = name;
+    span->type = traceContext.type;
+    span->requestId = traceContext.requestId;
+    span->user = traceContext.user;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Picks every traceSampleEvery-th request read by the calling thread for tracing.
+ *
+ * A picked request gets a trace ID that follows it to the shard that runs
+ * it, and its read is recorded as the "recv" span when the reader marked
+ * its start with traceReadStarted().
+ */
+// <----------------------------------------------------------------> //
+void traceSample(const Message *message)
+{
+    traceContext.id = 0;
+    if (++sampleCountdown < traceSampleEvery)
+    {
+        return;
+    }
+    sampleCountdown = 0;
+    traceContext.id = atomic_fetch_add_explicit(&nextTraceId, 1, memory_order_relaxed) + 1;
+    traceContext.type = message->type;
+    traceContext.requestId = message->requestId;
+    traceContext.user = message->from;
+    if (traceReadAt != 0)
+    {
+        traceRecord("recv", traceReadAt, traceNow());
+    }
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Adopts a handed-off request and records how long it waited in the queue.
+ */
+// <----------------------------------------------------------------> //
+void traceResumeSampled(const TraceContext *context)
+{
+    traceContext = *context;
+    traceRecord("queued", context->handedOffAt, traceNow());
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Writes one span as a trace event.
+ *
+ * Spans become complete ("X") events of the Trace Event Format, which
+ * chrome://tracing and Perfetto open directly. The trace ID is in the
+ * arguments, so the spans of one request can be found across threads.
+ */
+// <----------------------------------------------------------------> //
+static void traceWriteSpan(const TraceSpan *span, int threadNumber)
+{
+    uint64_t startedAt = span->startedAt > startedAtNs ? span->startedAt - startedAtNs : 0;
+    uint64_t duration = span->endedAt > span->startedAt ? span->endedAt - span->startedAt : 0;
+    fprintf(traceFile,
+            "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"trace\":%llu,\"type\":%d,\"request\":%d,\"user\":%d}}",
+            eventsWritten++ > 0 ? ",\n" : "", span->name, (double)startedAt / 1000.0, (double)duration / 1000.0, (int)getpid(), threadNumber,
+            (unsigned long long)span->traceId, span->type, span->requestId, span->user);
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Drains every ring once into the trace file.
+ */
+// <----------------------------------------------------------------> //
+static void traceDrain(void)
+{
+    pthread_mutex_lock(&ringsLock);
+    TraceRing **link = &rings;
+    while (*link != NULL)
+    {
+        TraceRing *ring = *link;
+        int orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while (tail != head)
+        {
+            traceWriteSpan(&ring->spans[tail & (TRACE_RING_CAPACITY - 1)], ring->threadNumber);
+            tail++;
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+
+        // The owner has exited and everything it wrote is out, so the ring can go
+        if (orphaned)
+        {
+            *link = ring->next;
+            free(ring);
+        }
+        else
+        {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&ringsLock);
+    fflush(traceFile);
+}
+
+static void *traceFlusherLoop(void *arg)
+{
+    (void)arg;
+    struct timespec interval = {0, TRACE_FLUSH_INTERVAL_NS};
+    while (atomic_load(&flusherRunning))
+    {
+        traceDrain();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Starts tracing sampled requests to a Trace Event Format file.
+ *
+ * @param path The trace file; truncated.
+ * @param sampleEvery Trace one request in this many; 1 traces all of them.
+ * @return int 0 on success, -1 on error.
+ */
+// <----------------------------------------------------------------> //
+int traceStart(const char *path, int sampleEvery)
+{
+    traceFile = fopen(path, "w");
+    if (traceFile == NULL)
+    {
+        LOG_ERROR("Error opening trace file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    setvbuf(traceFile, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    startedAtNs = traceNow();
+    fputs("[\n", traceFile); // the array form; viewers accept it without the closing bracket after a crash
+    atomic_store(&flusherRunning, 1);
+    if (pthread_create(&flusherThread, NULL, traceFlusherLoop, NULL) != 0)
+    {
+        LOG_ERROR("Trace flusher thread create error");
+        atomic_store(&flusherRunning, 0);
+        fclose(traceFile);
+        traceFile = NULL;
+        return -1;
+    }
+    traceSampleEvery = sampleEvery > 0 ? sampleEvery : 1;
+    LOG_INFO("Tracing one request in %d to %s", traceSampleEvery, path);
+    return 0;
+}
+
+// <----------------------------------------------------------------> //
+/**
+ * @brief Stops sampling, writes out the remaining spans and completes the file.
+ */
+// <----------------------------------------------------------------> //
+void traceShutdown(void)
+{
+    traceSampleEvery = 0;
+    if (atomic_exchange(&flusherRunning, 0))
+    {
+        pthread_join(flusherThread, NULL);
+    }
+    if (traceFile != NULL)
+    {
+        traceDrain();
+        fputs("\n]\n", traceFile);
+        fclose(traceFile);
+        traceFile = NULL;
+    }
+}
+
+long traceDroppedSpans(void)
+{
+    return atomic_load_explicit(&droppedSpans, memory_order_relaxed);
+}